@@ -33,18 +33,38 @@
 
 // accelerators/bvh.cpp*
 #include "accelerators/bvh.h"
+#include "shapes/triangle.h"
 #include "interaction.h"
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
 #include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
+STAT_MEMORY_COUNTER("Memory/BVH primitive references", primRefBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Trees loaded from cache", cacheHits);
+STAT_COUNTER("BVH/Trees written to cache", cacheWrites);
+STAT_COUNTER("BVH/Refits", nRefits);
+STAT_COUNTER("BVH/Tree rotations", nRotations);
+STAT_PERCENT("BVH/Occluder cache hits", occluderCacheHits, occluderCacheTests);
+STAT_RATIO("Accelerator/Nodes visited per ray", nodesVisited, nodeRays);
+STAT_RATIO("Accelerator/Primitive tests per ray", primitiveTests,
+           primitiveRays);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -100,40 +120,159 @@ struct LinearBVHNode {
     };
     uint16_t nPrimitives;  // 0 -> interior node
     uint8_t axis;          // interior node: xyz
-    uint8_t pad[1];        // ensure 32 byte total size
+    // Interior node: nonzero if shadow rays should visit the second child
+    // first; also ensures 32 byte total size
+    uint8_t occlusionOrder;
+};
+
+struct CompactBVHNode {
+    // CompactBVHNode Public Methods
+    bool IsLeaf() const { return flags & 0x80000000u; }
+    int Axis() const { return (flags >> 29) & 3; }
+    int FirstChild() const { return flags & 0x1fffffff; }
+
+    // CompactBVHNode Public Data
+    union {
+        // Interior node: both children's bounds, quantized to 8 bits per
+        // coordinate relative to this node's (decoded) bounds
+        uint8_t childBounds[2][6];
+        struct {
+            int32_t primitivesOffset, nPrimitives;
+        } leaf;
+    };
+    // Leaf flag in bit 31, split axis in bits 29-30, and the index of the
+    // first of the two adjacent children in the low 29 bits
+    uint32_t flags;
 };
+static_assert(sizeof(CompactBVHNode) == 16,
+              "CompactBVHNode should be 16 bytes");
 
 // BVHAccel Utility Functions
-inline uint32_t LeftShift3(uint32_t x) {
-    CHECK_LE(x, (1 << 10));
-    if (x == (1 << 10)) --x;
-#ifdef PBRT_HAVE_BINARY_CONSTANTS
-    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
-    // x = ---- --98 ---- ---- ---- ---- 7654 3210
-    x = (x | (x << 8)) & 0b00000011000000001111000000001111;
-    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
-    x = (x | (x << 4)) & 0b00000011000011000011000011000011;
-    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
-    x = (x | (x << 2)) & 0b00001001001001001001001001001001;
-    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
-#else
-    x = (x | (x << 16)) & 0x30000ff;
-    // x = ---- --98 ---- ---- ---- ---- 7654 3210
-    x = (x | (x << 8)) & 0x300f00f;
-    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
-    x = (x | (x << 4)) & 0x30c30c3;
-    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
-    x = (x | (x << 2)) & 0x9249249;
-    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
-#endif // PBRT_HAVE_BINARY_CONSTANTS
-    return x;
+static inline void ReportTraversal(int nVisited, int nTested) {
+    nodesVisited += nVisited;
+    ++nodeRays;
+    primitiveTests += nTested;
+    ++primitiveRays;
+}
+
+inline Float DequantizeCoordinate(uint8_t q, Float min, Float max) {
+    if (q == 0) return min;
+    if (q == 255) return max;
+    return min + q * ((max - min) * (1.f / 255.f));
+}
+
+inline Bounds3f DequantizeBounds(const uint8_t q[6], const Bounds3f &ref) {
+    Point3f pMin, pMax;
+    for (int axis = 0; axis < 3; ++axis) {
+        pMin[axis] = DequantizeCoordinate(q[axis], ref.pMin[axis],
+                                          ref.pMax[axis]);
+        pMax[axis] = DequantizeCoordinate(q[axis + 3], ref.pMin[axis],
+                                          ref.pMax[axis]);
+    }
+    return Bounds3f(pMin, pMax);
 }
 
-inline uint32_t EncodeMorton3(const Vector3f &v) {
-    CHECK_GE(v.x, 0);
-    CHECK_GE(v.y, 0);
-    CHECK_GE(v.z, 0);
-    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+static void QuantizeBounds(const Bounds3f &b, const Bounds3f &ref,
+                           uint8_t q[6]) {
+    for (int axis = 0; axis < 3; ++axis) {
+        // Round outward, then step until the decoded extent covers _b_ so
+        // that the quantized box is conservative under _DequantizeBounds()_
+        Float min = ref.pMin[axis], max = ref.pMax[axis];
+        Float scale = (max > min) ? 255 / (max - min) : 0;
+        int lo = Clamp((int)std::floor((b.pMin[axis] - min) * scale), 0, 255);
+        while (lo > 0 && DequantizeCoordinate(lo, min, max) > b.pMin[axis])
+            --lo;
+        int hi = Clamp((int)std::ceil((b.pMax[axis] - min) * scale), 0, 255);
+        while (hi < 255 && DequantizeCoordinate(hi, min, max) < b.pMax[axis])
+            ++hi;
+        q[axis] = lo;
+        q[axis + 3] = hi;
+    }
+}
+
+// BVH cache files hold a _BVHCacheHeader_, then the leaf ordering of the
+// primitives as 32-bit indices, then the flattened nodes, with both arrays
+// starting on a 64-byte boundary.
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version, floatSize, nodeSize, compact;
+    uint64_t hash, nOrdered, totalNodes;
+    Bounds3f rootBounds;
+};
+
+static const char BVHCacheMagic[8] = {'p', 'b', 'r', 't', 'B', 'V', 'H', 0};
+
+inline size_t BVHCacheOrderOffset() {
+    return (sizeof(BVHCacheHeader) + 63) & ~size_t(63);
+}
+
+inline size_t BVHCacheNodesOffset(size_t nOrdered) {
+    return (BVHCacheOrderOffset() + nOrdered * sizeof(int32_t) + 63) &
+           ~size_t(63);
+}
+
+// 64-bit FNV-1a hash, used to key BVH cache files
+inline uint64_t HashBytes(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Motion blur BVH nodes store bounds at up to _MaxTimeSegments_ + 1 times
+static PBRT_CONSTEXPR int MaxTimeSegments = 32;
+
+// Computes bounds of _prim_ at the _nSegments_ + 1 evenly spaced times from
+// _time0_ to _time1_ such that, within each time segment, linearly
+// interpolating between the segment's two bounds conservatively bounds the
+// primitive.
+static void PrimitiveMotionKeys(const Primitive &prim, Float time0, Float time1,
+                                int nSegments, Bounds3f *keys) {
+    Bounds3f overall = prim.MotionBounds(time0, time1);
+    Bounds3f start = prim.MotionBounds(time0, time0);
+    if (overall == start) {
+        // Handle primitive that doesn't move
+        for (int k = 0; k <= nSegments; ++k) keys[k] = overall;
+        return;
+    }
+    for (int k = 0; k <= nSegments; ++k) keys[k] = Bounds3f();
+    for (int k = 0; k < nSegments; ++k) {
+        // Start with the primitive's bounds at the segment's endpoints
+        Float ta = Lerp(Float(k) / nSegments, time0, time1);
+        Float tb = Lerp(Float(k + 1) / nSegments, time0, time1);
+        Bounds3f b[2] = {prim.MotionBounds(ta, ta), prim.MotionBounds(tb, tb)};
+
+        // Grow the interpolated bounds to contain conservative bounds over
+        // sub-intervals of the segment; since the interpolated bounds are
+        // linear in time, checking each sub-interval's endpoints suffices
+        PBRT_CONSTEXPR int nSubIntervals = 4;
+        Vector3f lowerShift(0, 0, 0), upperShift(0, 0, 0);
+        for (int i = 0; i < nSubIntervals; ++i) {
+            Float fa = Float(i) / nSubIntervals;
+            Float fb = Float(i + 1) / nSubIntervals;
+            Bounds3f sub =
+                prim.MotionBounds(Lerp(fa, ta, tb), Lerp(fb, ta, tb));
+            for (Float f : {fa, fb}) {
+                Point3f pMin = Lerp(f, b[0].pMin, b[1].pMin);
+                Point3f pMax = Lerp(f, b[0].pMax, b[1].pMax);
+                for (int axis = 0; axis < 3; ++axis) {
+                    lowerShift[axis] = std::max(lowerShift[axis],
+                                                pMin[axis] - sub.pMin[axis]);
+                    upperShift[axis] = std::max(upperShift[axis],
+                                                sub.pMax[axis] - pMax[axis]);
+                }
+            }
+        }
+        for (int e = 0; e < 2; ++e) {
+            b[e].pMin -= lowerShift;
+            b[e].pMax += upperShift;
+            // Adjacent segments share a key; lowering (raising) an endpoint
+            // of a lower (upper) bound keeps it conservative
+            keys[k + e] = Union(keys[k + e], b[e]);
+        }
+    }
 }
 
 static void RadixSort(std::vector<MortonPrimitive> *v) {
@@ -181,50 +320,397 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, bool compact,
+                   const std::string &cacheDir, int nTimeSegments,
+                   Float time0, Float time1, bool optimizeShadowRays)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
-      primitives(std::move(p)) {
+      primitives(std::move(p)),
+      compact(compact),
+      nTimeSegments(compact ? 0 : Clamp(nTimeSegments, 0, MaxTimeSegments)),
+      time0(time0),
+      time1(time1),
+      optimizeShadowRays(optimizeShadowRays) {
     ProfilePhase _(Prof::AccelConstruction);
+    if (compact && nTimeSegments > 0)
+        Warning("Motion blur BVH isn't supported with compact nodes. "
+                "Ignoring \"timesegments\".");
     if (primitives.empty()) return;
     // Build BVH from _primitives_
 
+    // Expand _PrimitiveArray_s into per-element _PrimitiveRef_s
+    useRefs = compact;
+    for (const auto &prim : primitives)
+        if (dynamic_cast<const PrimitiveArray *>(prim.get())) useRefs = true;
+    if (useRefs) {
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            const PrimitiveArray *array =
+                dynamic_cast<const PrimitiveArray *>(primitives[i].get());
+            if (array) {
+                uint32_t arrayIndex = arrays.size();
+                arrays.push_back(array);
+                for (int e = 0; e < array->NumElements(); ++e)
+                    primRefs.push_back({arrayIndex, uint32_t(e)});
+            } else
+                primRefs.push_back({PrimitiveRef::NoArray, uint32_t(i)});
+        }
+    }
+
     // Initialize _primitiveInfo_ array for primitives
-    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); ++i)
-        primitiveInfo[i] = {i, primitives[i]->WorldBound()};
+    std::vector<BVHPrimitiveInfo> primitiveInfo(useRefs ? primRefs.size()
+                                                        : primitives.size());
+    ParallelFor([&](int64_t i) {
+        primitiveInfo[i] = {size_t(i), primitiveBound(i)};
+    }, primitiveInfo.size(), 4096);
+
+    // Try to load the BVH from the cache before building it
+    std::string cacheFile;
+    uint64_t cacheHash = 0;
+    if (!cacheDir.empty()) {
+        // Hash the primitive bounds and build parameters; the tree is a
+        // function of nothing else
+        uint64_t hash = 0xcbf29ce484222325ull;
+        int params[4] = {this->maxPrimsInNode, int(splitMethod), int(compact),
+                         int(useRefs)};
+        hash = HashBytes(params, sizeof(params), hash);
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            hash = HashBytes(&pi.bounds, sizeof(pi.bounds), hash);
+        cacheHash = hash;
+        cacheFile = cacheDir + StringPrintf("/%016llx.bvh",
+                                            (unsigned long long)hash);
+        if (readCache(cacheFile, cacheHash, primitiveInfo.size())) {
+            ++cacheHits;
+            LOG(INFO) << "Loaded BVH for " << primitiveInfo.size()
+                      << " primitives from " << cacheFile;
+            if (this->nTimeSegments > 0) computeMotionBounds();
+            return;
+        }
+    }
 
     // Build BVH tree for primitives using _primitiveInfo_
     MemoryArena arena(1024 * 1024);
-    int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
+    std::vector<int> orderedPrims;
+    orderedPrims.reserve(primitiveInfo.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
         root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
     else
-        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
+        root = recursiveBuild(arena, primitiveInfo, 0, primitiveInfo.size(),
                               &totalNodes, orderedPrims);
-    primitives.swap(orderedPrims);
-    primitiveInfo.resize(0);
+
+    // Charge the memory used by the build while the tree is flattened
+    TrackedMemory buildMemory(
+        MemoryCategory::Acceleration,
+        arena.TotalAllocated() +
+            primitiveInfo.capacity() * sizeof(BVHPrimitiveInfo) +
+            orderedPrims.capacity() * sizeof(int));
+    reorderPrimitives(orderedPrims.data(), orderedPrims.size());
+    size_t nodeSize = compact ? sizeof(CompactBVHNode) : sizeof(LinearBVHNode);
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
                               "primitives (%.2f MB), arena allocated %.2f MB",
-                              totalNodes, (int)primitives.size(),
-                              float(totalNodes * sizeof(LinearBVHNode)) /
+                              totalNodes, (int)primitiveInfo.size(),
+                              float(totalNodes * nodeSize) /
                               (1024.f * 1024.f),
                               float(arena.TotalAllocated()) /
                               (1024.f * 1024.f));
+    primitiveInfo.resize(0);
 
     // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
+    size_t bytes = totalNodes * nodeSize + sizeof(*this) +
+                   primitives.size() * sizeof(primitives[0]) +
+                   arrays.size() * sizeof(arrays[0]);
+    treeBytes += bytes;
+    primRefBytes += primRefs.size() * sizeof(primRefs[0]);
+    trackedMemory.Add(bytes + primRefs.size() * sizeof(primRefs[0]));
+    if (compact) {
+        compactNodes = AllocAligned<CompactBVHNode>(totalNodes);
+        NumaFirstTouch(compactNodes, totalNodes * sizeof(CompactBVHNode));
+        rootBounds = root->bounds;
+        int nextFree = 1;
+        flattenCompactBVHTree(root, 0, rootBounds, &nextFree);
+        CHECK_EQ(totalNodes, nextFree);
+    } else {
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        NumaFirstTouch(nodes, totalNodes * sizeof(LinearBVHNode));
+        int offset = 0;
+        flattenBVHTree(root, &offset);
+        CHECK_EQ(totalNodes, offset);
+        computeOcclusionOrder();
+    }
+    if (!cacheFile.empty())
+        writeCache(cacheFile, cacheHash, orderedPrims);
+    if (this->nTimeSegments > 0) computeMotionBounds();
+}
+
+void BVHAccel::computeMotionBounds() {
+    int nKeys = nTimeSegments + 1;
+    if (motionBounds.empty()) {
+        treeBytes += size_t(totalNodes) * nKeys * sizeof(Bounds3f);
+        trackedMemory.Add(size_t(totalNodes) * nKeys * sizeof(Bounds3f));
+    }
+    motionBounds.assign(size_t(totalNodes) * nKeys, Bounds3f());
+    // Compute motion bounds of leaf nodes from their primitives
+    ParallelFor([&](int64_t i) {
+        const LinearBVHNode &node = nodes[i];
+        Bounds3f *nodeKeys = &motionBounds[i * nKeys];
+        for (int j = 0; j < node.nPrimitives; ++j) {
+            int index = node.primitivesOffset + j;
+            if (useRefs && primRefs[index].array != PrimitiveRef::NoArray) {
+                // _PrimitiveArray_ elements don't move
+                Bounds3f b = primitiveBound(index);
+                for (int k = 0; k < nKeys; ++k)
+                    nodeKeys[k] = Union(nodeKeys[k], b);
+                continue;
+            }
+            Bounds3f primKeys[MaxTimeSegments + 1];
+            const Primitive &prim =
+                *primitives[useRefs ? primRefs[index].index : index];
+            PrimitiveMotionKeys(prim, time0, time1, nTimeSegments, primKeys);
+            for (int k = 0; k < nKeys; ++k)
+                nodeKeys[k] = Union(nodeKeys[k], primKeys[k]);
+        }
+    }, totalNodes, 256);
+
+    // Propagate motion bounds up to interior nodes; since children are
+    // always after their parents, a reverse pass visits them first
+    for (int i = totalNodes - 1; i >= 0; --i) {
+        const LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) continue;
+        for (int k = 0; k < nKeys; ++k)
+            motionBounds[i * nKeys + k] =
+                Union(motionBounds[(i + 1) * nKeys + k],
+                      motionBounds[node.secondChildOffset * nKeys + k]);
+    }
+}
+
+Bounds3f BVHAccel::MotionBounds(Float t0, Float t1) const {
+    if (nTimeSegments == 0 || !nodes) return WorldBound();
+    // Bound root node's interpolated bounds at the interval's endpoints and
+    // any keys in between
+    int s0, s1;
+    Float f0, f1;
+    motionSegment(t0, &s0, &f0);
+    motionSegment(t1, &s1, &f1);
+    Bounds3f bounds =
+        Union(motionNodeBounds(0, s0, f0), motionNodeBounds(0, s1, f1));
+    for (int k = s0 + 1; k <= s1; ++k) bounds = Union(bounds, motionBounds[k]);
+    return bounds;
+}
+
+void BVHAccel::reorderPrimitives(const int *orderedPrims, size_t nOrdered) {
+    // Reorder primitives (or references) to match leaf order
+    if (useRefs) {
+        std::vector<PrimitiveRef> orderedRefs(nOrdered);
+        for (size_t i = 0; i < nOrdered; ++i)
+            orderedRefs[i] = primRefs[orderedPrims[i]];
+        primRefs.swap(orderedRefs);
+    } else {
+        std::vector<std::shared_ptr<Primitive>> reordered;
+        reordered.reserve(nOrdered);
+        for (size_t i = 0; i < nOrdered; ++i)
+            reordered.push_back(primitives[orderedPrims[i]]);
+        primitives.swap(reordered);
+    }
+}
+
+void BVHAccel::releaseCacheData() {
+    if (!cacheData) return;
+#ifdef PBRT_HAVE_MMAP
+    munmap(cacheData, cacheDataSize);
+#else
+    FreeAligned(cacheData);
+#endif
+    cacheData = nullptr;
+    cacheDataSize = 0;
+}
+
+// The offsets stored in a BVH node, in a form common to both node types
+struct BVHNodeLinks {
+    bool leaf;
+    int64_t primitivesOffset, nPrimitives;
+    int64_t children[2];
+    int axis;
+};
+
+static BVHNodeLinks NodeLinks(const LinearBVHNode &node, size_t index) {
+    BVHNodeLinks links;
+    links.leaf = node.nPrimitives > 0;
+    links.primitivesOffset = links.children[1] = node.primitivesOffset;
+    links.nPrimitives = node.nPrimitives;
+    links.children[0] = index + 1;
+    links.axis = node.axis;
+    return links;
+}
+
+static BVHNodeLinks NodeLinks(const CompactBVHNode &node, size_t index) {
+    BVHNodeLinks links;
+    links.leaf = node.IsLeaf();
+    links.primitivesOffset = node.leaf.primitivesOffset;
+    links.nPrimitives = node.leaf.nPrimitives;
+    links.children[0] = node.FirstChild();
+    links.children[1] = node.FirstChild() + 1;
+    links.axis = node.Axis();
+    return links;
+}
+
+// Cached nodes are used as they are, so check that their primitive and
+// child offsets are in range. Children are always stored after their
+// parents, which rules out cycles, and limiting the tree's depth keeps
+// traversal's stack of nodes to visit from overflowing.
+template <typename Node>
+static bool ValidCacheNodes(const Node *nodes, size_t totalNodes,
+                            size_t nPrimitives) {
+    if (totalNodes == 0 || totalNodes > (1 << 29)) return false;
+    std::vector<uint8_t> depth(totalNodes, 0);
+    for (size_t i = 0; i < totalNodes; ++i) {
+        BVHNodeLinks links = NodeLinks(nodes[i], i);
+        if (links.leaf) {
+            if (links.primitivesOffset < 0 || links.nPrimitives < 0 ||
+                links.primitivesOffset + links.nPrimitives >
+                    int64_t(nPrimitives))
+                return false;
+            continue;
+        }
+        if (links.axis > 2 || depth[i] + 1 >= 64) return false;
+        for (int64_t child : links.children) {
+            if (child <= int64_t(i) || child >= int64_t(totalNodes))
+                return false;
+            depth[child] = std::max<int>(depth[child], depth[i] + 1);
+        }
+    }
+    return true;
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t hash,
+                         size_t nOrdered) {
+    // Map the cache file into memory, if it exists
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t len = stat.st_size;
+    void *ptr = len > 0 ? mmap(0, len, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0)
+                        : MAP_FAILED;
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    size_t len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void *ptr = AllocAligned<uint8_t>(len);
+    bool readOk = fread(ptr, 1, len, f) == len;
+    fclose(f);
+    if (!readOk) {
+        FreeAligned(ptr);
+        return false;
+    }
+#endif
+    cacheData = ptr;
+    cacheDataSize = len;
+
+    // Validate the cache file against this BVH
+    size_t nodeSize = compact ? sizeof(CompactBVHNode) : sizeof(LinearBVHNode);
+    const BVHCacheHeader *header = (const BVHCacheHeader *)ptr;
+    bool valid = len >= sizeof(BVHCacheHeader) &&
+                 memcmp(header->magic, BVHCacheMagic, 8) == 0 &&
+                 header->version == 2 && header->floatSize == sizeof(Float) &&
+                 header->nodeSize == nodeSize &&
+                 header->compact == uint32_t(compact) && header->hash == hash &&
+                 header->nOrdered == nOrdered &&
+                 len >= BVHCacheNodesOffset(nOrdered) &&
+                 header->totalNodes ==
+                     (len - BVHCacheNodesOffset(nOrdered)) / nodeSize &&
+                 len == BVHCacheNodesOffset(nOrdered) +
+                            header->totalNodes * nodeSize;
+    const int32_t *orderedPrims =
+        (const int32_t *)((const char *)ptr + BVHCacheOrderOffset());
+    for (size_t i = 0; valid && i < nOrdered; ++i)
+        valid = orderedPrims[i] >= 0 && size_t(orderedPrims[i]) < nOrdered;
+    const void *cachedNodes = (const char *)ptr + BVHCacheNodesOffset(nOrdered);
+    if (valid)
+        valid = compact ? ValidCacheNodes((const CompactBVHNode *)cachedNodes,
+                                          header->totalNodes, nOrdered)
+                        : ValidCacheNodes((const LinearBVHNode *)cachedNodes,
+                                          header->totalNodes, nOrdered);
+    if (!valid) {
+        Warning("%s: invalid or stale BVH cache file. Rebuilding.",
+                filename.c_str());
+        releaseCacheData();
+        return false;
+    }
+
+    // Use the cached primitive ordering and nodes in place
+    reorderPrimitives(orderedPrims, nOrdered);
+    void *nodeData = (char *)ptr + BVHCacheNodesOffset(nOrdered);
+    totalNodes = header->totalNodes;
+    size_t bytes = header->totalNodes * nodeSize + sizeof(*this) +
+                   primitives.size() * sizeof(primitives[0]) +
+                   arrays.size() * sizeof(arrays[0]);
+    treeBytes += bytes;
+    primRefBytes += primRefs.size() * sizeof(primRefs[0]);
+    trackedMemory.Add(bytes + primRefs.size() * sizeof(primRefs[0]));
+    if (compact) {
+        compactNodes = (CompactBVHNode *)nodeData;
+        rootBounds = header->rootBounds;
+    } else
+        nodes = (LinearBVHNode *)nodeData;
+    return true;
+}
+
+void BVHAccel::writeCache(const std::string &filename, uint64_t hash,
+                          const std::vector<int> &orderedPrims) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BVHCacheMagic, 8);
+    header.version = 2;
+    header.floatSize = sizeof(Float);
+    header.nodeSize = compact ? sizeof(CompactBVHNode) : sizeof(LinearBVHNode);
+    header.compact = compact;
+    header.hash = hash;
+    header.nOrdered = orderedPrims.size();
+    header.totalNodes = totalNodes;
+    header.rootBounds = WorldBound();
+
+    // Write to a temporary file and rename it so that concurrent renders
+    // never see a partially-written cache file
+    std::string tmpFilename = filename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: unable to write BVH cache file: %s", tmpFilename.c_str(),
+                strerror(errno));
+        return;
+    }
+    std::vector<char> zeros(64, 0);
+    std::vector<int32_t> order(orderedPrims.begin(), orderedPrims.end());
+    size_t orderEnd = BVHCacheOrderOffset() + order.size() * sizeof(int32_t);
+    const void *nodeData = compact ? (const void *)compactNodes : nodes;
+    bool ok =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(&zeros[0], 1, BVHCacheOrderOffset() - sizeof(header), f) ==
+            BVHCacheOrderOffset() - sizeof(header) &&
+        (order.empty() ||
+         fwrite(&order[0], sizeof(int32_t), order.size(), f) == order.size()) &&
+        fwrite(&zeros[0], 1, BVHCacheNodesOffset(order.size()) - orderEnd,
+               f) == BVHCacheNodesOffset(order.size()) - orderEnd &&
+        fwrite(nodeData, header.nodeSize, totalNodes, f) == size_t(totalNodes);
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache file: %s", filename.c_str(),
+                strerror(errno));
+        remove(tmpFilename.c_str());
+        return;
+    }
+    ++cacheWrites;
 }
 
 Bounds3f BVHAccel::WorldBound() const {
+    if (compact) return rootBounds;
     return nodes ? nodes[0].bounds : Bounds3f();
 }
 
@@ -235,8 +721,7 @@ struct BucketInfo {
 
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
-    int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    int end, int *totalNodes, std::vector<int> &orderedPrims) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     (*totalNodes)++;
@@ -250,7 +735,7 @@ BVHBuildNode *BVHAccel::recursiveBuild(
         int firstPrimOffset = orderedPrims.size();
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims.push_back(primNum);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
         return node;
@@ -268,7 +753,7 @@ BVHBuildNode *BVHAccel::recursiveBuild(
             int firstPrimOffset = orderedPrims.size();
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims.push_back(primNum);
             }
             node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
             return node;
@@ -382,7 +867,7 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         int firstPrimOffset = orderedPrims.size();
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims.push_back(primNum);
                         }
                         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
                         return node;
@@ -403,8 +888,7 @@ BVHBuildNode *BVHAccel::recursiveBuild(
 
 BVHBuildNode *BVHAccel::HLBVHBuild(
     MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
+    int *totalNodes, std::vector<int> &orderedPrims) const {
     // Compute bounding box of all primitive centroids
     Bounds3f bounds;
     for (const BVHPrimitiveInfo &pi : primitiveInfo)
@@ -448,7 +932,7 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
 
     // Create LBVHs for treelets in parallel
     std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
-    orderedPrims.resize(primitives.size());
+    orderedPrims.resize(primitiveInfo.size());
     ParallelFor([&](int i) {
         // Generate _i_th LBVH treelet
         int nodesCreated = 0;
@@ -475,8 +959,8 @@ BVHBuildNode *BVHAccel::emitLBVH(
     BVHBuildNode *&buildNodes,
     const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-    std::atomic<int> *orderedPrimsOffset, int bitIndex) const {
+    std::vector<int> &orderedPrims, std::atomic<int> *orderedPrimsOffset,
+    int bitIndex) const {
     CHECK_GT(nPrimitives, 0);
     if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
         // Create and return leaf node of LBVH treelet
@@ -486,7 +970,7 @@ BVHBuildNode *BVHAccel::emitLBVH(
         int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
         for (int i = 0; i < nPrimitives; ++i) {
             int primitiveIndex = mortonPrims[i].primitiveIndex;
-            orderedPrims[firstPrimOffset + i] = primitives[primitiveIndex];
+            orderedPrims[firstPrimOffset + i] = primitiveIndex;
             bounds = Union(bounds, primitiveInfo[primitiveIndex].bounds);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
@@ -657,26 +1141,239 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+void BVHAccel::computeOcclusionOrder() {
+    // Shadow rays can stop at any intersection, so rather than visiting the
+    // nearer child first they visit the one with the greater chance of
+    // being hit per unit of intersection cost, estimated as its surface
+    // area divided by the number of primitives below it. Children are
+    // always after their parents, so a reverse pass sees them first.
+    std::vector<int> subtreePrims(totalNodes);
+    for (int i = totalNodes - 1; i >= 0; --i) {
+        LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) {
+            subtreePrims[i] = node.nPrimitives;
+            node.occlusionOrder = 0;
+            continue;
+        }
+        int c0 = i + 1, c1 = node.secondChildOffset;
+        subtreePrims[i] = subtreePrims[c0] + subtreePrims[c1];
+        Float score0 = nodes[c0].bounds.SurfaceArea() / subtreePrims[c0];
+        Float score1 = nodes[c1].bounds.SurfaceArea() / subtreePrims[c1];
+        node.occlusionOrder = score1 > score0;
+    }
+}
+
+void BVHAccel::flattenCompactBVHTree(BVHBuildNode *node, int nodeIndex,
+                                     const Bounds3f &bounds, int *nextFree) {
+    CompactBVHNode *compactNode = &compactNodes[nodeIndex];
+    if (node->nPrimitives > 0) {
+        CHECK(!node->children[0] && !node->children[1]);
+        compactNode->leaf.primitivesOffset = node->firstPrimOffset;
+        compactNode->leaf.nPrimitives = node->nPrimitives;
+        compactNode->flags = 0x80000000u;
+    } else {
+        // Create interior compact node with adjacent, quantized children
+        int firstChild = *nextFree;
+        *nextFree += 2;
+        CHECK_LT(firstChild, 1 << 29);
+        compactNode->flags = (uint32_t(node->splitAxis) << 29) | firstChild;
+        for (int c = 0; c < 2; ++c)
+            QuantizeBounds(node->children[c]->bounds, bounds,
+                           compactNode->childBounds[c]);
+        // Recurse using the decoded child bounds so that traversal, which
+        // only has those, reconstructs exactly the same boxes
+        for (int c = 0; c < 2; ++c)
+            flattenCompactBVHTree(
+                node->children[c], firstChild + c,
+                DequantizeBounds(compactNode->childBounds[c], bounds),
+                nextFree);
+    }
+}
+
+BVHAccel::~BVHAccel() {
+    if (cacheData)
+        // The nodes live in the cache file's memory
+        releaseCacheData();
+    else {
+        FreeAligned(nodes);
+        FreeAligned(compactNodes);
+    }
+}
+
+Bounds3f BVHAccel::primitiveBound(int index) const {
+    if (!useRefs) return primitives[index]->WorldBound();
+    const PrimitiveRef &ref = primRefs[index];
+    if (ref.array == PrimitiveRef::NoArray)
+        return primitives[ref.index]->WorldBound();
+    return arrays[ref.array]->ElementBound(ref.index);
+}
+
+// Applies the tree rotation at _node_ that most reduces the surface area of
+// its children, if any does.  See Kopta et al., "Fast, Effective BVH Updates
+// for Animated Scenes," I3D 2012.
+static bool RotateBVHNode(BVHBuildNode *node) {
+    Float bestDelta = 0;
+    int bestChild = -1, bestGrandchild = -1;
+    for (int c = 0; c < 2; ++c) {
+        // Consider swapping the other child with a child of _node->children[c]_
+        BVHBuildNode *child = node->children[c];
+        if (child->nPrimitives > 0) continue;
+        BVHBuildNode *other = node->children[1 - c];
+        Float area = child->bounds.SurfaceArea();
+        for (int g = 0; g < 2; ++g) {
+            Float delta = Union(other->bounds, child->children[1 - g]->bounds)
+                              .SurfaceArea() -
+                          area;
+            if (delta < bestDelta) {
+                bestDelta = delta;
+                bestChild = c;
+                bestGrandchild = g;
+            }
+        }
+    }
+    if (bestChild == -1) return false;
+
+    // Swap the other child with the selected grandchild
+    BVHBuildNode *child = node->children[bestChild];
+    std::swap(node->children[1 - bestChild], child->children[bestGrandchild]);
+    child->bounds =
+        Union(child->children[0]->bounds, child->children[1]->bounds);
+    // Choose split axes for the modified nodes from the child centroids
+    for (BVHBuildNode *n : {node, child}) {
+        Vector3f d = (n->children[1]->bounds.pMin + n->children[1]->bounds.pMax) -
+                     (n->children[0]->bounds.pMin + n->children[0]->bounds.pMax);
+        n->splitAxis = MaxDimension(Abs(d));
+    }
+    return true;
+}
+
+void BVHAccel::Refit(bool restoreQuality) {
+    ProfilePhase _(Prof::AccelConstruction);
+    if (!nodes && !compactNodes) return;
+    ++nRefits;
+    // Recover tree topology from the flattened nodes
+    std::vector<BVHBuildNode> buildNodes(totalNodes);
+    std::vector<std::vector<BVHBuildNode *>> levels;
+    std::vector<int> depth(totalNodes, 0);
+    for (int i = 0; i < totalNodes; ++i) {
+        // Children are always stored after their parents, so _depth[i]_ is
+        // known here
+        BVHBuildNode &node = buildNodes[i];
+        int children[2] = {-1, -1};
+        if (compact) {
+            const CompactBVHNode &cn = compactNodes[i];
+            if (cn.IsLeaf()) {
+                node.firstPrimOffset = cn.leaf.primitivesOffset;
+                node.nPrimitives = cn.leaf.nPrimitives;
+            } else {
+                node.splitAxis = cn.Axis();
+                children[0] = cn.FirstChild();
+                children[1] = cn.FirstChild() + 1;
+            }
+        } else {
+            const LinearBVHNode &ln = nodes[i];
+            if (ln.nPrimitives > 0) {
+                node.firstPrimOffset = ln.primitivesOffset;
+                node.nPrimitives = ln.nPrimitives;
+            } else {
+                node.splitAxis = ln.axis;
+                children[0] = i + 1;
+                children[1] = ln.secondChildOffset;
+            }
+        }
+        if (children[0] == -1)
+            node.children[0] = node.children[1] = nullptr;
+        else {
+            node.nPrimitives = 0;
+            for (int c = 0; c < 2; ++c) {
+                node.children[c] = &buildNodes[children[c]];
+                depth[children[c]] = depth[i] + 1;
+            }
+        }
+        if (depth[i] >= (int)levels.size()) levels.resize(depth[i] + 1);
+        levels[depth[i]].push_back(&node);
+    }
+
+    // Recompute bounds bottom-up, one level of the tree at a time
+    for (int d = levels.size() - 1; d >= 0; --d) {
+        const std::vector<BVHBuildNode *> &level = levels[d];
+        ParallelFor([&](int64_t i) {
+            BVHBuildNode *node = level[i];
+            if (node->nPrimitives > 0) {
+                node->bounds = Bounds3f();
+                for (int j = 0; j < node->nPrimitives; ++j)
+                    node->bounds = Union(
+                        node->bounds, primitiveBound(node->firstPrimOffset + j));
+            } else {
+                node->bounds = Union(node->children[0]->bounds,
+                                     node->children[1]->bounds);
+                // Nodes at the same level have disjoint subtrees, so they can
+                // be rotated concurrently
+                if (restoreQuality && RotateBVHNode(node)) ++nRotations;
+            }
+        }, level.size(), 64);
+    }
+
+    // Flatten the updated tree into new node storage
+    BVHBuildNode *root = &buildNodes[0];
+    if (cacheData)
+        releaseCacheData();
+    else {
+        FreeAligned(nodes);
+        FreeAligned(compactNodes);
+    }
+    nodes = nullptr;
+    compactNodes = nullptr;
+    if (compact) {
+        compactNodes = AllocAligned<CompactBVHNode>(totalNodes);
+        NumaFirstTouch(compactNodes, totalNodes * sizeof(CompactBVHNode));
+        rootBounds = root->bounds;
+        int nextFree = 1;
+        flattenCompactBVHTree(root, 0, rootBounds, &nextFree);
+        CHECK_EQ(totalNodes, nextFree);
+    } else {
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        NumaFirstTouch(nodes, totalNodes * sizeof(LinearBVHNode));
+        int offset = 0;
+        flattenBVHTree(root, &offset);
+        CHECK_EQ(totalNodes, offset);
+        computeOcclusionOrder();
+        if (nTimeSegments > 0) computeMotionBounds();
+    }
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (compact) return IntersectCompact(ray, isect);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    // Find time segment for motion blur BVH node bounds at the ray's time
+    int segment = 0;
+    Float frac = 0;
+    if (nTimeSegments > 0) motionSegment(ray.time, &segment, &frac);
     // Follow ray through BVH nodes to find primitive intersections
     int toVisitOffset = 0, currentNodeIndex = 0;
     int nodesToVisit[64];
+    int nVisited = 0, nTested = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        // Check ray against BVH node
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        ++nVisited;
+        // Check ray against BVH node; only motion blur nodes need their
+        // bounds interpolated, so static nodes are tested in place
+        bool hitNode =
+            nTimeSegments > 0
+                ? motionNodeBounds(currentNodeIndex, segment, frac)
+                      .IntersectP(ray, invDir, dirIsNeg)
+                : node->bounds.IntersectP(ray, invDir, dirIsNeg);
+        if (hitNode) {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
+                nTested += node->nPrimitives;
                 for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
+                    if (intersectPrimitive(node->primitivesOffset + i, ray,
+                                           isect))
                         hit = true;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
@@ -696,31 +1393,69 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    ReportTraversal(nVisited, nTested);
     return hit;
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    return FindOccluder(ray, nullptr);
+}
+
+bool BVHAccel::IntersectPCached(const Ray &ray, OccluderCache *cache) const {
+    if (!optimizeShadowRays || !cache) return FindOccluder(ray, nullptr);
+    // Test the occluder previously found for the cache's rays first
+    int nPrims = useRefs ? primRefs.size() : primitives.size();
+    if (cache->aggregate == this && cache->index >= 0 &&
+        cache->index < nPrims) {
+        ++occluderCacheTests;
+        if (intersectPPrimitive(cache->index, ray)) {
+            ++occluderCacheHits;
+            return true;
+        }
+    }
+    int occluder;
+    if (!FindOccluder(ray, &occluder)) return false;
+    cache->aggregate = this;
+    cache->index = occluder;
+    return true;
+}
+
+bool BVHAccel::FindOccluder(const Ray &ray, int *occluder) const {
+    if (compact) return IntersectPCompact(ray, occluder);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int segment = 0;
+    Float frac = 0;
+    if (nTimeSegments > 0) motionSegment(ray.time, &segment, &frac);
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
+    int nVisited = 0, nTested = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        ++nVisited;
+        bool hitNode =
+            nTimeSegments > 0
+                ? motionNodeBounds(currentNodeIndex, segment, frac)
+                      .IntersectP(ray, invDir, dirIsNeg)
+                : node->bounds.IntersectP(ray, invDir, dirIsNeg);
+        if (hitNode) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
                 for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
+                    ++nTested;
+                    if (intersectPPrimitive(node->primitivesOffset + i, ray)) {
+                        if (occluder) *occluder = node->primitivesOffset + i;
+                        ReportTraversal(nVisited, nTested);
                         return true;
                     }
                 }
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
-                if (dirIsNeg[node->axis]) {
+                if (optimizeShadowRays ? node->occlusionOrder
+                                       : dirIsNeg[node->axis]) {
                     /// second child first
                     nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
                     currentNodeIndex = node->secondChildOffset;
@@ -734,11 +1469,128 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    ReportTraversal(nVisited, nTested);
+    return false;
+}
+
+bool BVHAccel::IntersectCompact(const Ray &ray,
+                                SurfaceInteraction *isect) const {
+    if (!compactNodes) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    if (!rootBounds.IntersectP(ray, invDir, dirIsNeg)) return false;
+    // Follow ray through compact BVH nodes, decoding child bounds on the way
+    struct NodeToVisit {
+        int nodeIndex;
+        Bounds3f bounds;
+    };
+    NodeToVisit nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    Bounds3f currentBounds = rootBounds;
+    int nVisited = 1, nTested = 0;
+    while (true) {
+        const CompactBVHNode *node = &compactNodes[currentNodeIndex];
+        if (node->IsLeaf()) {
+            // Intersect ray with primitives in leaf compact BVH node
+            nTested += node->leaf.nPrimitives;
+            for (int i = 0; i < node->leaf.nPrimitives; ++i)
+                if (intersectPrimitive(node->leaf.primitivesOffset + i, ray,
+                                       isect))
+                    hit = true;
+        } else {
+            // Test ray against both children; visit the near one first
+            Bounds3f childBounds[2] = {
+                DequantizeBounds(node->childBounds[0], currentBounds),
+                DequantizeBounds(node->childBounds[1], currentBounds)};
+            bool childHit[2] = {
+                childBounds[0].IntersectP(ray, invDir, dirIsNeg),
+                childBounds[1].IntersectP(ray, invDir, dirIsNeg)};
+            nVisited += 2;
+            int nearChild = dirIsNeg[node->Axis()];
+            if (childHit[0] || childHit[1]) {
+                int c = childHit[nearChild] ? nearChild : 1 - nearChild;
+                if (childHit[0] && childHit[1])
+                    nodesToVisit[toVisitOffset++] = {
+                        node->FirstChild() + 1 - nearChild,
+                        childBounds[1 - nearChild]};
+                currentNodeIndex = node->FirstChild() + c;
+                currentBounds = childBounds[c];
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+        currentBounds = nodesToVisit[toVisitOffset].bounds;
+    }
+    ReportTraversal(nVisited, nTested);
+    return hit;
+}
+
+bool BVHAccel::IntersectPCompact(const Ray &ray, int *occluder) const {
+    if (!compactNodes) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    if (!rootBounds.IntersectP(ray, invDir, dirIsNeg)) return false;
+    struct NodeToVisit {
+        int nodeIndex;
+        Bounds3f bounds;
+    };
+    NodeToVisit nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    Bounds3f currentBounds = rootBounds;
+    int nVisited = 1, nTested = 0;
+    while (true) {
+        const CompactBVHNode *node = &compactNodes[currentNodeIndex];
+        if (node->IsLeaf()) {
+            for (int i = 0; i < node->leaf.nPrimitives; ++i) {
+                ++nTested;
+                if (intersectPPrimitive(node->leaf.primitivesOffset + i, ray)) {
+                    if (occluder) *occluder = node->leaf.primitivesOffset + i;
+                    ReportTraversal(nVisited, nTested);
+                    return true;
+                }
+            }
+        } else {
+            Bounds3f childBounds[2] = {
+                DequantizeBounds(node->childBounds[0], currentBounds),
+                DequantizeBounds(node->childBounds[1], currentBounds)};
+            bool childHit[2] = {
+                childBounds[0].IntersectP(ray, invDir, dirIsNeg),
+                childBounds[1].IntersectP(ray, invDir, dirIsNeg)};
+            nVisited += 2;
+            // Compact nodes have no room for a precomputed shadow ray
+            // order, so the larger child is visited first instead
+            int nearChild =
+                optimizeShadowRays ? (childBounds[1].SurfaceArea() >
+                                      childBounds[0].SurfaceArea())
+                                   : dirIsNeg[node->Axis()];
+            if (childHit[0] || childHit[1]) {
+                int c = childHit[nearChild] ? nearChild : 1 - nearChild;
+                if (childHit[0] && childHit[1])
+                    nodesToVisit[toVisitOffset++] = {
+                        node->FirstChild() + 1 - nearChild,
+                        childBounds[1 - nearChild]};
+                currentNodeIndex = node->FirstChild() + c;
+                currentBounds = childBounds[c];
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+        currentBounds = nodesToVisit[toVisitOffset].bounds;
+    }
+    ReportTraversal(nVisited, nTested);
     return false;
 }
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    Float time0, Float time1) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
     BVHAccel::SplitMethod splitMethod;
     if (splitMethodName == "sah")
@@ -756,7 +1608,14 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    bool compact = ps.FindOneBool("compact", false);
+    std::string cacheDir = ps.FindOneFilename("cachedir", "");
+    int nTimeSegments = ps.FindOneInt("timesegments", 0);
+    bool optimizeShadowRays = ps.FindOneBool("shadowrays", false);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, compact, cacheDir,
+                                      nTimeSegments, time0, time1,
+                                      optimizeShadowRays);
 }
 
 }  // namespace pbrt
@@ -50,6 +50,15 @@ struct BVHBuildNode;
 struct BVHPrimitiveInfo;
 struct MortonPrimitive;
 struct LinearBVHNode;
+struct CompactBVHNode;
+
+// PrimitiveRef Declarations
+struct PrimitiveRef {
+    // Element _index_ of _PrimitiveArray_ _array_, or the _index_th element
+    // of _BVHAccel::primitives_ if _array_ is _NoArray_
+    static const uint32_t NoArray = 0xffffffff;
+    uint32_t array, index;
+};
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
@@ -60,42 +69,128 @@ class BVHAccel : public Aggregate {
     // BVHAccel Public Methods
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH,
+             bool compact = false, const std::string &cacheDir = "",
+             int nTimeSegments = 0, Float time0 = 0, Float time1 = 1,
+             bool optimizeShadowRays = false);
     Bounds3f WorldBound() const;
+    Bounds3f MotionBounds(Float time0, Float time1) const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    bool IntersectPCached(const Ray &ray, OccluderCache *cache) const;
+
+    // Updates the node bounds after the primitives have moved, keeping the
+    // tree topology; if _restoreQuality_ is set, tree rotations are also
+    // applied to recover some of the quality lost to deformation.
+    void Refit(bool restoreQuality = true);
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int start, int end, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+        int start, int end, int *totalNodes, std::vector<int> &orderedPrims);
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
+        int *totalNodes, std::vector<int> &orderedPrims) const;
     BVHBuildNode *emitLBVH(
         BVHBuildNode *&buildNodes,
         const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-        std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+        std::vector<int> &orderedPrims, std::atomic<int> *orderedPrimsOffset,
+        int bitIndex) const;
     BVHBuildNode *buildUpperSAH(MemoryArena &arena,
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    void computeOcclusionOrder();
+    void flattenCompactBVHTree(BVHBuildNode *node, int nodeIndex,
+                               const Bounds3f &bounds, int *nextFree);
+    Bounds3f primitiveBound(int index) const;
+    bool intersectPrimitive(int index, const Ray &ray,
+                            SurfaceInteraction *isect) const {
+        if (!useRefs) return primitives[index]->Intersect(ray, isect);
+        const PrimitiveRef &ref = primRefs[index];
+        if (ref.array == PrimitiveRef::NoArray)
+            return primitives[ref.index]->Intersect(ray, isect);
+        return arrays[ref.array]->Intersect(ref.index, ray, isect);
+    }
+    bool intersectPPrimitive(int index, const Ray &ray) const {
+        if (!useRefs) return primitives[index]->IntersectP(ray);
+        const PrimitiveRef &ref = primRefs[index];
+        if (ref.array == PrimitiveRef::NoArray)
+            return primitives[ref.index]->IntersectP(ray);
+        return arrays[ref.array]->IntersectP(ref.index, ray);
+    }
+    void computeMotionBounds();
+    void motionSegment(Float time, int *segment, Float *frac) const {
+        Float u = (time1 > time0) ? Clamp((time - time0) / (time1 - time0),
+                                          0, 1) * nTimeSegments
+                                  : 0;
+        *segment = std::min(int(u), nTimeSegments - 1);
+        *frac = u - *segment;
+    }
+    Bounds3f motionNodeBounds(int nodeIndex, int segment, Float frac) const {
+        const Bounds3f &b0 = motionBounds[nodeIndex * (nTimeSegments + 1) +
+                                          segment];
+        const Bounds3f &b1 = (&b0)[1];
+        Bounds3f b;
+        b.pMin = Lerp(frac, b0.pMin, b1.pMin);
+        b.pMax = Lerp(frac, b0.pMax, b1.pMax);
+        return b;
+    }
+    void releaseCacheData();
+    void reorderPrimitives(const int *orderedPrims, size_t nOrdered);
+    bool readCache(const std::string &filename, uint64_t hash,
+                   size_t nOrdered);
+    void writeCache(const std::string &filename, uint64_t hash,
+                    const std::vector<int> &orderedPrims) const;
+    bool IntersectCompact(const Ray &ray, SurfaceInteraction *isect) const;
+    bool FindOccluder(const Ray &ray, int *occluder) const;
+    bool IntersectPCompact(const Ray &ray, int *occluder) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<std::shared_ptr<Primitive>> primitives;
     LinearBVHNode *nodes = nullptr;
+    int totalNodes = 0;
+
+    // If any of the primitives are _PrimitiveArray_s, or if compact nodes
+    // are used, leaves refer to _primRefs_ rather than _primitives_, so that
+    // array elements are stored in the tree individually
+    bool useRefs = false;
+    std::vector<const PrimitiveArray *> arrays;
+    std::vector<PrimitiveRef> primRefs;
+
+    // Compact BVH data: quantized nodes, with the root bounds stored
+    // separately at full precision
+    const bool compact;
+    CompactBVHNode *compactNodes = nullptr;
+    Bounds3f rootBounds;
+
+    // Motion blur BVH data: if _nTimeSegments_ is nonzero, each node has
+    // bounds at _nTimeSegments + 1_ evenly spaced times from _time0_ to
+    // _time1_, which are interpolated at the ray's time during traversal
+    const int nTimeSegments;
+    const Float time0, time1;
+    std::vector<Bounds3f> motionBounds;
+
+    // If _optimizeShadowRays_ is set, _IntersectP()_ visits children in
+    // the order given by _LinearBVHNode::occlusionOrder_ and
+    // _IntersectPCached()_ tests the cached occluder first
+    const bool optimizeShadowRays;
+
+    // When the nodes were loaded from the BVH cache, _cacheData_ is the
+    // mapping (or buffer) holding the file and the nodes point into it
+    void *cacheData = nullptr;
+    size_t cacheDataSize = 0;
+    TrackedMemory trackedMemory{MemoryCategory::Acceleration};
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps);
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps,
+    Float time0 = 0, Float time1 = 1);
 
 }  // namespace pbrt
 
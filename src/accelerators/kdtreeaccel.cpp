@@ -36,14 +36,21 @@
 #include "paramset.h"
 #include "interaction.h"
 #include "stats.h"
+#include "parallel.h"
 #include <algorithm>
 
 namespace pbrt {
 
+STAT_MEMORY_COUNTER("Memory/Kd-tree", treeBytes);
+STAT_RATIO("Accelerator/Nodes visited per ray", nodesVisited, nodeRays);
+STAT_RATIO("Accelerator/Primitive tests per ray", primitiveTests,
+           primitiveRays);
+
 // KdTreeAccel Local Declarations
 struct KdAccelNode {
     // KdAccelNode Methods
-    void InitLeaf(int *primNums, int np, std::vector<int> *primitiveIndices);
+    void InitLeaf(const int *primNums, int np,
+                  std::vector<int> *primitiveIndices);
     void InitInterior(int axis, int ac, Float s) {
         split = s;
         flags = axis;
@@ -75,11 +82,37 @@ struct BoundEdge {
     BoundEdge(Float t, int primNum, bool starting) : t(t), primNum(primNum) {
         type = starting ? EdgeType::Start : EdgeType::End;
     }
+    // Edges are ordered by position, with starting edges first at equal
+    // positions; the primitive number breaks any remaining ties so that the
+    // order is the same wherever a set of edges is sorted
+    bool operator<(const BoundEdge &e) const {
+        if (t != e.t) return t < e.t;
+        if (type != e.type) return (int)type < (int)e.type;
+        return primNum < e.primNum;
+    }
     Float t;
     int primNum;
     EdgeType type;
 };
 
+// A node that is yet to be built: its primitives and, for each axis, their
+// bounding box edges in sorted order
+struct KdBuildTask {
+    Bounds3f bounds;
+    std::vector<int> primNums;
+    std::vector<BoundEdge> edges[3];
+    int depth, badRefines;
+};
+
+// Node of the upper levels of the tree, built breadth-first; each
+// unsplit node refers to the _KdBuildTask_ that builds its subtree
+struct KdUpperNode {
+    int axis;
+    Float split;
+    int children[2];
+    int task = -1;
+};
+
 // KdTreeAccel Method Definitions
 KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
                          int isectCost, int traversalCost, Float emptyBonus,
@@ -96,31 +129,90 @@ KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
         maxDepth = std::round(8 + 1.3f * Log2Int(int64_t(primitives.size())));
 
     // Compute bounds for kd-tree construction
-    std::vector<Bounds3f> primBounds;
-    primBounds.reserve(primitives.size());
-    for (const std::shared_ptr<Primitive> &prim : primitives) {
-        Bounds3f b = prim->WorldBound();
-        bounds = Union(bounds, b);
-        primBounds.push_back(b);
+    primBounds.resize(primitives.size());
+    ParallelFor([&](int64_t i) { primBounds[i] = primitives[i]->WorldBound(); },
+                primitives.size(), 4096);
+    for (const Bounds3f &b : primBounds) bounds = Union(bounds, b);
+
+    // Initialize root _KdBuildTask_ with edges sorted once for each axis
+    std::vector<KdBuildTask> frontier(1);
+    KdBuildTask &root = frontier[0];
+    root.bounds = bounds;
+    root.depth = maxDepth;
+    root.badRefines = 0;
+    root.primNums.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) root.primNums[i] = i;
+    ParallelFor([&](int64_t axis) {
+        std::vector<BoundEdge> &edges = root.edges[axis];
+        edges.resize(2 * primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            edges[2 * i] = BoundEdge(primBounds[i].pMin[axis], i, true);
+            edges[2 * i + 1] = BoundEdge(primBounds[i].pMax[axis], i, false);
+        }
+        std::sort(edges.begin(), edges.end());
+    }, 3);
+
+    // Split the upper levels of the tree breadth-first, processing all of
+    // the nodes at each level in parallel, until there are enough subtrees
+    // to keep all threads busy
+    std::vector<KdUpperNode> upperNodes(1);
+    std::vector<int> frontierNodes(1, 0);
+    std::vector<KdBuildTask> tasks;
+    size_t nSubtrees =
+        primitives.size() < 4096 ? 1 : size_t(8 * MaxThreadIndex());
+    while (!frontier.empty()) {
+        std::vector<KdBuildTask> children(2 * frontier.size());
+        std::unique_ptr<bool[]> split(new bool[frontier.size()]);
+        bool expand = frontier.size() < nSubtrees;
+        if (expand)
+            ParallelFor([&](int64_t i) {
+                KdUpperNode &node = upperNodes[frontierNodes[i]];
+                split[i] = splitNode(&frontier[i], &node.axis, &node.split,
+                                     &children[2 * i], &children[2 * i + 1]);
+            }, frontier.size());
+        std::vector<KdBuildTask> nextFrontier;
+        std::vector<int> nextFrontierNodes;
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            int nodeIndex = frontierNodes[i];
+            if (expand && split[i]) {
+                for (int c = 0; c < 2; ++c) {
+                    upperNodes[nodeIndex].children[c] = upperNodes.size();
+                    nextFrontierNodes.push_back(upperNodes.size());
+                    upperNodes.push_back(KdUpperNode());
+                    nextFrontier.push_back(std::move(children[2 * i + c]));
+                }
+            } else {
+                upperNodes[nodeIndex].task = tasks.size();
+                tasks.push_back(std::move(frontier[i]));
+            }
+        }
+        frontier.swap(nextFrontier);
+        frontierNodes.swap(nextFrontierNodes);
     }
 
-    // Allocate working memory for kd-tree construction
-    std::unique_ptr<BoundEdge[]> edges[3];
-    for (int i = 0; i < 3; ++i)
-        edges[i].reset(new BoundEdge[2 * primitives.size()]);
-    std::unique_ptr<int[]> prims0(new int[primitives.size()]);
-    std::unique_ptr<int[]> prims1(new int[(maxDepth + 1) * primitives.size()]);
-
-    // Initialize _primNums_ for kd-tree construction
-    std::unique_ptr<int[]> primNums(new int[primitives.size()]);
-    for (size_t i = 0; i < primitives.size(); ++i) primNums[i] = i;
-
-    // Start recursive construction of kd-tree
-    buildTree(0, bounds, primBounds, primNums.get(), primitives.size(),
-              maxDepth, edges, prims0.get(), prims1.get());
+    // Build the subtrees in parallel, each into its own node array
+    std::vector<std::vector<KdAccelNode>> subtreeNodes(tasks.size());
+    std::vector<std::vector<int>> subtreeIndices(tasks.size());
+    ParallelFor([&](int64_t i) {
+        buildTree(&tasks[i], &subtreeNodes[i], &subtreeIndices[i]);
+    }, tasks.size());
+
+    // Assemble the final _nodes_ array, relocating the subtrees' nodes
+    nAllocedNodes = upperNodes.size();
+    for (const KdUpperNode &node : upperNodes)
+        if (node.task >= 0) nAllocedNodes += subtreeNodes[node.task].size() - 1;
+    nodes = AllocAligned<KdAccelNode>(nAllocedNodes);
+    emitUpperNode(upperNodes, 0, subtreeNodes, subtreeIndices);
+    CHECK_EQ(nextFreeNode, nAllocedNodes);
+    primBounds = std::vector<Bounds3f>();
+    size_t bytes = nAllocedNodes * sizeof(KdAccelNode) +
+                   primitiveIndices.size() * sizeof(int) +
+                   primitives.size() * sizeof(primitives[0]);
+    treeBytes += bytes;
+    trackedMemory.Add(bytes);
 }
 
-void KdAccelNode::InitLeaf(int *primNums, int np,
+void KdAccelNode::InitLeaf(const int *primNums, int np,
                            std::vector<int> *primitiveIndices) {
     flags = 3;
     nPrims |= (np << 2);
@@ -137,34 +229,22 @@ void KdAccelNode::InitLeaf(int *primNums, int np,
 
 KdTreeAccel::~KdTreeAccel() { FreeAligned(nodes); }
 
-void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
-                            const std::vector<Bounds3f> &allPrimBounds,
-                            int *primNums, int nPrimitives, int depth,
-                            const std::unique_ptr<BoundEdge[]> edges[3],
-                            int *prims0, int *prims1, int badRefines) {
-    CHECK_EQ(nodeNum, nextFreeNode);
-    // Get next free node from _nodes_ array
-    if (nextFreeNode == nAllocedNodes) {
-        int nNewAllocNodes = std::max(2 * nAllocedNodes, 512);
-        KdAccelNode *n = AllocAligned<KdAccelNode>(nNewAllocNodes);
-        if (nAllocedNodes > 0) {
-            memcpy(n, nodes, nAllocedNodes * sizeof(KdAccelNode));
-            FreeAligned(nodes);
-        }
-        nodes = n;
-        nAllocedNodes = nNewAllocNodes;
-    }
-    ++nextFreeNode;
-
-    // Initialize leaf node if termination criteria met
-    if (nPrimitives <= maxPrims || depth == 0) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
-        return;
-    }
+static inline void ReportTraversal(int nVisited, int nTested) {
+    nodesVisited += nVisited;
+    ++nodeRays;
+    primitiveTests += nTested;
+    ++primitiveRays;
+}
 
-    // Initialize interior node and continue recursion
+bool KdTreeAccel::splitNode(KdBuildTask *task, int *splitAxis,
+                            Float *splitPos, KdBuildTask *below,
+                            KdBuildTask *above) const {
+    // Create leaf if termination criteria met
+    int nPrimitives = task->primNums.size();
+    if (nPrimitives <= maxPrims || task->depth == 0) return false;
 
     // Choose split axis position for interior node
+    const Bounds3f &nodeBounds = task->bounds;
     int bestAxis = -1, bestOffset = -1;
     Float bestCost = Infinity;
     Float oldCost = isectCost * Float(nPrimitives);
@@ -174,92 +254,139 @@ void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
 
     // Choose which axis to split along
     int axis = nodeBounds.MaximumExtent();
-    int retries = 0;
-retrySplit:
-
-    // Initialize edges for _axis_
-    for (int i = 0; i < nPrimitives; ++i) {
-        int pn = primNums[i];
-        const Bounds3f &bounds = allPrimBounds[pn];
-        edges[axis][2 * i] = BoundEdge(bounds.pMin[axis], pn, true);
-        edges[axis][2 * i + 1] = BoundEdge(bounds.pMax[axis], pn, false);
-    }
-
-    // Sort _edges_ for _axis_
-    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives],
-              [](const BoundEdge &e0, const BoundEdge &e1) -> bool {
-                  if (e0.t == e1.t)
-                      return (int)e0.type < (int)e1.type;
-                  else
-                      return e0.t < e1.t;
-              });
-
-    // Compute cost of all splits for _axis_ to find best
-    int nBelow = 0, nAbove = nPrimitives;
-    for (int i = 0; i < 2 * nPrimitives; ++i) {
-        if (edges[axis][i].type == EdgeType::End) --nAbove;
-        Float edgeT = edges[axis][i].t;
-        if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis]) {
-            // Compute cost for split at _i_th edge
-
-            // Compute child surface areas for split at _edgeT_
-            int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
-            Float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] +
-                                 (edgeT - nodeBounds.pMin[axis]) *
-                                     (d[otherAxis0] + d[otherAxis1]));
-            Float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] +
-                                 (nodeBounds.pMax[axis] - edgeT) *
-                                     (d[otherAxis0] + d[otherAxis1]));
-            Float pBelow = belowSA * invTotalSA;
-            Float pAbove = aboveSA * invTotalSA;
-            Float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
-            Float cost =
-                traversalCost +
-                isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
-
-            // Update best split if this is lowest cost so far
-            if (cost < bestCost) {
-                bestCost = cost;
-                bestAxis = axis;
-                bestOffset = i;
+    for (int retries = 0; bestAxis == -1 && retries < 3; ++retries) {
+        // Compute cost of all splits for _axis_ to find best; the edges
+        // are already sorted
+        const std::vector<BoundEdge> &edges = task->edges[axis];
+        int nBelow = 0, nAbove = nPrimitives;
+        for (int i = 0; i < 2 * nPrimitives; ++i) {
+            if (edges[i].type == EdgeType::End) --nAbove;
+            Float edgeT = edges[i].t;
+            if (edgeT > nodeBounds.pMin[axis] &&
+                edgeT < nodeBounds.pMax[axis]) {
+                // Compute cost for split at _i_th edge
+
+                // Compute child surface areas for split at _edgeT_
+                int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+                Float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] +
+                                     (edgeT - nodeBounds.pMin[axis]) *
+                                         (d[otherAxis0] + d[otherAxis1]));
+                Float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] +
+                                     (nodeBounds.pMax[axis] - edgeT) *
+                                         (d[otherAxis0] + d[otherAxis1]));
+                Float pBelow = belowSA * invTotalSA;
+                Float pAbove = aboveSA * invTotalSA;
+                Float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
+                Float cost =
+                    traversalCost +
+                    isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
+
+                // Update best split if this is lowest cost so far
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
             }
+            if (edges[i].type == EdgeType::Start) ++nBelow;
         }
-        if (edges[axis][i].type == EdgeType::Start) ++nBelow;
+        CHECK(nBelow == nPrimitives && nAbove == 0);
+        axis = (axis + 1) % 3;
     }
-    CHECK(nBelow == nPrimitives && nAbove == 0);
 
     // Create leaf if no good splits were found
-    if (bestAxis == -1 && retries < 2) {
-        ++retries;
-        axis = (axis + 1) % 3;
-        goto retrySplit;
-    }
+    int badRefines = task->badRefines;
     if (bestCost > oldCost) ++badRefines;
     if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
-        badRefines == 3) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
-        return;
+        badRefines == 3)
+        return false;
+
+    // Classify primitives with respect to split; a primitive is below the
+    // split if its starting edge precedes the split edge and above it if
+    // its ending edge follows it
+    const BoundEdge split = task->edges[bestAxis][bestOffset];
+    auto isBelow = [&](int pn) {
+        return BoundEdge(primBounds[pn].pMin[bestAxis], pn, true) < split;
+    };
+    auto isAbove = [&](int pn) {
+        return split < BoundEdge(primBounds[pn].pMax[bestAxis], pn, false);
+    };
+    for (int pn : task->primNums) {
+        if (isBelow(pn)) below->primNums.push_back(pn);
+        if (isAbove(pn)) above->primNums.push_back(pn);
     }
 
-    // Classify primitives with respect to split
-    int n0 = 0, n1 = 0;
-    for (int i = 0; i < bestOffset; ++i)
-        if (edges[bestAxis][i].type == EdgeType::Start)
-            prims0[n0++] = edges[bestAxis][i].primNum;
-    for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
-        if (edges[bestAxis][i].type == EdgeType::End)
-            prims1[n1++] = edges[bestAxis][i].primNum;
+    // Partition sorted edges for children, which keeps them sorted
+    for (int a = 0; a < 3; ++a) {
+        below->edges[a].reserve(2 * below->primNums.size());
+        above->edges[a].reserve(2 * above->primNums.size());
+        for (const BoundEdge &e : task->edges[a]) {
+            if (isBelow(e.primNum)) below->edges[a].push_back(e);
+            if (isAbove(e.primNum)) above->edges[a].push_back(e);
+        }
+    }
+
+    // Initialize child tasks and free the split node's edges
+    *splitAxis = bestAxis;
+    *splitPos = split.t;
+    below->bounds = above->bounds = nodeBounds;
+    below->bounds.pMax[bestAxis] = above->bounds.pMin[bestAxis] = split.t;
+    below->depth = above->depth = task->depth - 1;
+    below->badRefines = above->badRefines = badRefines;
+    for (int a = 0; a < 3; ++a) task->edges[a] = std::vector<BoundEdge>();
+    return true;
+}
+
+void KdTreeAccel::buildTree(KdBuildTask *task,
+                            std::vector<KdAccelNode> *treeNodes,
+                            std::vector<int> *treeIndices) const {
+    int nodeNum = treeNodes->size();
+    treeNodes->push_back(KdAccelNode());
+    int axis;
+    Float split;
+    KdBuildTask below, above;
+    if (!splitNode(task, &axis, &split, &below, &above)) {
+        (*treeNodes)[nodeNum].InitLeaf(task->primNums.data(),
+                                       task->primNums.size(), treeIndices);
+        *task = KdBuildTask();
+        return;
+    }
+    task->primNums = std::vector<int>();
 
     // Recursively initialize children nodes
-    Float tSplit = edges[bestAxis][bestOffset].t;
-    Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
-    bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
-    buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
-    int aboveChild = nextFreeNode;
-    nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
-    buildTree(aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
+    buildTree(&below, treeNodes, treeIndices);
+    int aboveChild = treeNodes->size();
+    (*treeNodes)[nodeNum].InitInterior(axis, aboveChild, split);
+    buildTree(&above, treeNodes, treeIndices);
+}
+
+void KdTreeAccel::emitUpperNode(
+    const std::vector<KdUpperNode> &upperNodes, int index,
+    const std::vector<std::vector<KdAccelNode>> &subtreeNodes,
+    const std::vector<std::vector<int>> &subtreeIndices) {
+    const KdUpperNode &node = upperNodes[index];
+    if (node.task >= 0) {
+        // Copy subtree's nodes, offsetting child and primitive indices
+        int nodeOffset = nextFreeNode;
+        int indexOffset = primitiveIndices.size();
+        for (const KdAccelNode &n : subtreeNodes[node.task]) {
+            KdAccelNode &out = nodes[nextFreeNode++];
+            out = n;
+            if (!n.IsLeaf())
+                out.InitInterior(n.SplitAxis(), n.AboveChild() + nodeOffset,
+                                 n.SplitPos());
+            else if (n.nPrimitives() > 1)
+                out.primitiveIndicesOffset += indexOffset;
+        }
+        primitiveIndices.insert(primitiveIndices.end(),
+                                subtreeIndices[node.task].begin(),
+                                subtreeIndices[node.task].end());
+        return;
+    }
+    int nodeNum = nextFreeNode++;
+    emitUpperNode(upperNodes, node.children[0], subtreeNodes, subtreeIndices);
+    nodes[nodeNum].InitInterior(node.axis, nextFreeNode, node.split);
+    emitUpperNode(upperNodes, node.children[1], subtreeNodes, subtreeIndices);
 }
 
 bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
@@ -279,9 +406,11 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     // Traverse kd-tree nodes in order for ray
     bool hit = false;
     const KdAccelNode *node = &nodes[0];
+    int nVisited = 0, nTested = 0;
     while (node != nullptr) {
         // Bail out if we found a hit closer than the current node
         if (ray.tMax < tMin) break;
+        ++nVisited;
         if (!node->IsLeaf()) {
             // Process kd-tree interior node
 
@@ -319,6 +448,7 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
         } else {
             // Check for intersections inside leaf node
             int nPrimitives = node->nPrimitives();
+            nTested += nPrimitives;
             if (nPrimitives == 1) {
                 const std::shared_ptr<Primitive> &p =
                     primitives[node->onePrimitive];
@@ -344,6 +474,7 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
                 break;
         }
     }
+    ReportTraversal(nVisited, nTested);
     return hit;
 }
 
@@ -361,14 +492,18 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
     KdToDo todo[maxTodo];
     int todoPos = 0;
     const KdAccelNode *node = &nodes[0];
+    int nVisited = 0, nTested = 0;
     while (node != nullptr) {
+        ++nVisited;
         if (node->IsLeaf()) {
             // Check for shadow ray intersections inside leaf node
             int nPrimitives = node->nPrimitives();
             if (nPrimitives == 1) {
                 const std::shared_ptr<Primitive> &p =
                     primitives[node->onePrimitive];
+                ++nTested;
                 if (p->IntersectP(ray)) {
+                    ReportTraversal(nVisited, nTested);
                     return true;
                 }
             } else {
@@ -377,7 +512,9 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
                         primitiveIndices[node->primitiveIndicesOffset + i];
                     const std::shared_ptr<Primitive> &prim =
                         primitives[primitiveIndex];
+                    ++nTested;
                     if (prim->IntersectP(ray)) {
+                        ReportTraversal(nVisited, nTested);
                         return true;
                     }
                 }
@@ -427,6 +564,7 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
             }
         }
     }
+    ReportTraversal(nVisited, nTested);
     return false;
 }
 
@@ -47,6 +47,8 @@ namespace pbrt {
 // KdTreeAccel Declarations
 struct KdAccelNode;
 struct BoundEdge;
+struct KdBuildTask;
+struct KdUpperNode;
 class KdTreeAccel : public Aggregate {
   public:
     // KdTreeAccel Public Methods
@@ -60,20 +62,25 @@ class KdTreeAccel : public Aggregate {
 
   private:
     // KdTreeAccel Private Methods
-    void buildTree(int nodeNum, const Bounds3f &bounds,
-                   const std::vector<Bounds3f> &primBounds, int *primNums,
-                   int nprims, int depth,
-                   const std::unique_ptr<BoundEdge[]> edges[3], int *prims0,
-                   int *prims1, int badRefines = 0);
+    bool splitNode(KdBuildTask *task, int *splitAxis, Float *splitPos,
+                   KdBuildTask *below, KdBuildTask *above) const;
+    void buildTree(KdBuildTask *task, std::vector<KdAccelNode> *treeNodes,
+                   std::vector<int> *treeIndices) const;
+    void emitUpperNode(const std::vector<KdUpperNode> &upperNodes, int index,
+                       const std::vector<std::vector<KdAccelNode>> &subtreeNodes,
+                       const std::vector<std::vector<int>> &subtreeIndices);
 
     // KdTreeAccel Private Data
     const int isectCost, traversalCost, maxPrims;
     const Float emptyBonus;
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::vector<int> primitiveIndices;
+    // Primitive bounds, only used during construction
+    std::vector<Bounds3f> primBounds;
     KdAccelNode *nodes;
     int nAllocedNodes, nextFreeNode;
     Bounds3f bounds;
+    TrackedMemory trackedMemory{MemoryCategory::Acceleration};
 };
 
 struct KdToDo {
@@ -32,6 +32,7 @@
 
 // core/api.cpp*
 #include "api.h"
+#include "checkpoint.h"
 #include "film.h"
 #include "medium.h"
 #include "parallel.h"
@@ -59,6 +60,7 @@
 #include "integrators/path.h"
 #include "integrators/sppm.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefrontpath.h"
 #include "integrators/whitted.h"
 #include "lights/diffuse.h"
 #include "lights/distant.h"
@@ -188,6 +190,10 @@ struct RenderOptions {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
+    // Non-animated instances for the BVH are collected in _instanceArray_,
+    // with _instancePrototypes_ mapping instance names to its prototypes
+    std::shared_ptr<InstanceArrayPrimitive> instanceArray;
+    std::map<std::string, int> instancePrototypes;
     bool haveScatteringMedia = false;
 };
 
@@ -376,6 +382,7 @@ static TransformSet curTransform;
 static uint32_t activeTransformBits = AllTransformsBits;
 static std::map<std::string, TransformSet> namedCoordinateSystems;
 static std::unique_ptr<RenderOptions> renderOptions;
+static WorldEndCallback worldEndCallback;
 static GraphicsState graphicsState;
 static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
@@ -564,6 +571,20 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
     return shapes;
 }
 
+// Returns the mesh shared by _shapes_ if they are exactly the triangles of
+// one _TriangleMesh_, and _nullptr_ otherwise.
+static std::shared_ptr<TriangleMesh> SharedTriangleMesh(
+    const std::vector<std::shared_ptr<Shape>> &shapes) {
+    const Triangle *first = dynamic_cast<const Triangle *>(shapes[0].get());
+    if (!first || (int)shapes.size() != first->GetMesh()->nTriangles)
+        return nullptr;
+    for (const auto &s : shapes) {
+        const Triangle *tri = dynamic_cast<const Triangle *>(s.get());
+        if (!tri || tri->GetMesh() != first->GetMesh()) return nullptr;
+    }
+    return first->GetMesh();
+}
+
 STAT_COUNTER("Scene/Materials created", nMaterialsCreated);
 
 std::shared_ptr<Material> MakeMaterial(const std::string &name,
@@ -808,7 +829,9 @@ std::shared_ptr<Primitive> MakeAccelerator(
     const ParamSet &paramSet) {
     std::shared_ptr<Primitive> accel;
     if (name == "bvh")
-        accel = CreateBVHAccelerator(std::move(prims), paramSet);
+        accel = CreateBVHAccelerator(std::move(prims), paramSet,
+                                     renderOptions->transformStartTime,
+                                     renderOptions->transformEndTime);
     else if (name == "kdtree")
         accel = CreateKdTreeAccelerator(std::move(prims), paramSet);
     else
@@ -910,6 +933,7 @@ void pbrtInit(const Options &opt) {
     renderOptions.reset(new RenderOptions);
     graphicsState = GraphicsState();
     catIndentCount = 0;
+    ResetCheckpointSceneHash();
 
     // General \pbrt Initialization
     SampledSpectrum::Init();
@@ -1383,6 +1407,19 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
             graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        // Use a single _TriangleMeshPrimitive_ for a triangle mesh if the
+        // compact BVH will reference its triangles directly
+        std::shared_ptr<TriangleMesh> mesh;
+        if (renderOptions->AcceleratorName == "bvh" &&
+            renderOptions->AcceleratorParams.FindOneBool("compact", false) &&
+            graphicsState.areaLight == "")
+            mesh = SharedTriangleMesh(shapes);
+        if (mesh) {
+            prims.push_back(std::make_shared<TriangleMeshPrimitive>(
+                mesh, shapes[0]->reverseOrientation,
+                shapes[0]->transformSwapsHandedness, mtl, mi));
+            shapes.clear();
+        }
         prims.reserve(shapes.size());
         for (auto s : shapes) {
             // Possibly create area light for shape
@@ -1586,7 +1623,10 @@ void pbrtObjectInstance(const std::string &name) {
         renderOptions->instances[name];
     if (in.empty()) return;
     ++nObjectInstancesUsed;
-    if (in.size() > 1) {
+    // A _PrimitiveArray_, such as a compact triangle mesh, also needs an
+    // aggregate, since on its own it tests every element against each ray
+    if (in.size() > 1 ||
+        dynamic_cast<const PrimitiveArray *>(in[0].get()) != nullptr) {
         // Create aggregate for instance _Primitive_s
         std::shared_ptr<Primitive> accel(
             MakeAccelerator(renderOptions->AcceleratorName, std::move(in),
@@ -1603,6 +1643,26 @@ void pbrtObjectInstance(const std::string &name) {
     AnimatedTransform animatedInstanceToWorld(
         InstanceToWorld[0], renderOptions->transformStartTime,
         InstanceToWorld[1], renderOptions->transformEndTime);
+    if (*InstanceToWorld[0] == *InstanceToWorld[1] &&
+        renderOptions->AcceleratorName == "bvh") {
+        // Add instance to the scene's _InstanceArrayPrimitive_, which the
+        // top-level BVH expands into individual instances
+        if (!renderOptions->instanceArray) {
+            renderOptions->instanceArray =
+                std::make_shared<InstanceArrayPrimitive>();
+            renderOptions->primitives.push_back(renderOptions->instanceArray);
+        }
+        auto iter = renderOptions->instancePrototypes.find(name);
+        int prototype;
+        if (iter == renderOptions->instancePrototypes.end()) {
+            prototype = renderOptions->instanceArray->AddPrototype(in[0]);
+            renderOptions->instancePrototypes[name] = prototype;
+        } else
+            prototype = iter->second;
+        renderOptions->instanceArray->AddInstance(prototype,
+                                                  *InstanceToWorld[0]);
+        return;
+    }
     std::shared_ptr<Primitive> prim(
         std::make_shared<TransformedPrimitive>(in[0], animatedInstanceToWorld));
     renderOptions->primitives.push_back(prim);
@@ -1624,9 +1684,13 @@ void pbrtWorldEnd() {
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
+    } else if (worldEndCallback) {
+        std::shared_ptr<const Camera> camera(renderOptions->MakeCamera());
+        worldEndCallback(renderOptions->primitives, camera);
     } else {
         std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
+        RecordMemoryUsage("Scene constructed");
 
         // This is kind of ugly; we directly override the current profiler
         // state to switch from parsing/scene construction related stuff to
@@ -1638,6 +1702,7 @@ void pbrtWorldEnd() {
         ProfilerState = ProfToBits(Prof::IntegratorRender);
 
         if (scene && integrator) integrator->Render(*scene);
+        RecordMemoryUsage("Rendering finished");
 
         CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::IntegratorRender));
         ProfilerState = ProfToBits(Prof::SceneConstruction);
@@ -1658,8 +1723,10 @@ void pbrtWorldEnd() {
         if (!PbrtOptions.quiet) {
             PrintStats(stdout);
             ReportProfilerResults(stdout);
+            ReportMemoryUsage(stdout);
             ClearStats();
             ClearProfiler();
+            ClearMemoryUsage();
         }
     }
 
@@ -1669,6 +1736,10 @@ void pbrtWorldEnd() {
                                  namedCoordinateSystems.end());
 }
 
+void pbrtSetWorldEndCallback(WorldEndCallback callback) {
+    worldEndCallback = std::move(callback);
+}
+
 Scene *RenderOptions::MakeScene() {
     std::shared_ptr<Primitive> accelerator = MakeAccelerator(
         AcceleratorName, std::move(primitives), AcceleratorParams);
@@ -1693,6 +1764,8 @@ Integrator *RenderOptions::MakeIntegrator() const {
         Error("Unable to create sampler.");
         return nullptr;
     }
+    std::string samplerDesc = SamplerName + " " + SamplerParams.ToString();
+    AddToCheckpointSceneHash(samplerDesc.data(), samplerDesc.size());
 
     Integrator *integrator = nullptr;
     if (IntegratorName == "whitted")
@@ -1704,6 +1777,9 @@ Integrator *RenderOptions::MakeIntegrator() const {
         integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "volpath")
         integrator = CreateVolPathIntegrator(IntegratorParams, sampler, camera);
+    else if (IntegratorName == "wavefrontpath")
+        integrator =
+            CreateWavefrontPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "bdpt") {
         integrator = CreateBDPTIntegrator(IntegratorParams, sampler, camera);
     } else if (IntegratorName == "mlt") {
@@ -1717,6 +1793,24 @@ Integrator *RenderOptions::MakeIntegrator() const {
         return nullptr;
     }
 
+    // Configure adaptive sampling for integrators that support it
+    SamplerIntegrator *samplerIntegrator =
+        dynamic_cast<SamplerIntegrator *>(integrator);
+    if (samplerIntegrator) {
+        Float maxError = IntegratorParams.FindOneFloat("adaptivemaxerror", 0);
+        if (maxError > 0)
+            samplerIntegrator->SetAdaptiveSampling(
+                maxError,
+                IntegratorParams.FindOneInt("adaptiveminsamples", 16));
+    } else if (PbrtOptions.timeLimit > 0 || PbrtOptions.targetNoise > 0)
+        Warning("The \"%s\" integrator doesn't support progressive "
+                "rendering; ignoring --timelimit and --targetnoise.",
+                IntegratorName.c_str());
+    if (!samplerIntegrator && (PbrtOptions.coordinatorPort > 0 ||
+                               !PbrtOptions.coordinatorAddress.empty()))
+        Warning("The \"%s\" integrator doesn't support distributed "
+                "rendering; rendering locally.", IntegratorName.c_str());
+
     if (renderOptions->haveScatteringMedia && IntegratorName != "volpath" &&
         IntegratorName != "bdpt" && IntegratorName != "mlt") {
         Warning(
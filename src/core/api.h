@@ -40,6 +40,7 @@
 
 // core/api.h*
 #include "pbrt.h"
+#include <functional>
 
 namespace pbrt {
 
@@ -91,6 +92,14 @@ void pbrtWorldEnd();
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
 
+// If set, _callback_ is called by pbrtWorldEnd() with the scene's
+// primitives and camera in place of rendering the scene; this is for tools
+// like pbrt_accelbench that use the parsed scene directly.
+typedef std::function<void(std::vector<std::shared_ptr<Primitive>> &,
+                           std::shared_ptr<const Camera>)>
+    WorldEndCallback;
+void pbrtSetWorldEndCallback(WorldEndCallback callback);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_API_H
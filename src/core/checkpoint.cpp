@@ -0,0 +1,216 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/checkpoint.cpp*
+#include "checkpoint.h"
+#include "film.h"
+#include "stats.h"
+#include "tilescheduler.h"
+#include <stdio.h>
+
+namespace pbrt {
+
+STAT_COUNTER("Integrator/Checkpoints written", nCheckpoints);
+
+// Checkpoint Local Definitions
+// Checkpoint files start with _CheckpointMagic_ and a version number,
+// followed by the description and the sections, each stored as a 64-bit
+// size and the bytes themselves, in the machine's native byte order.
+static const char CheckpointMagic[8] = {'P', 'B', 'R', 'T',
+                                        'C', 'K', 'P', 'T'};
+static const uint32_t CheckpointVersion = 1;
+// FNV-1a hash of the scene files and sampler parameters
+static const uint64_t SceneHashSeed = 14695981039346656037ull;
+static uint64_t sceneHash = SceneHashSeed;
+
+static bool WriteBytes(FILE *f, const std::string &s) {
+    uint64_t size = s.size();
+    return fwrite(&size, sizeof(size), 1, f) == 1 &&
+           fwrite(s.data(), 1, size, f) == size;
+}
+
+static bool ReadBytes(FILE *f, std::vector<char> *bytes) {
+    uint64_t size;
+    if (fread(&size, sizeof(size), 1, f) != 1) return false;
+    // Don't trust a corrupt size enough to allocate a huge buffer for it
+    long start = ftell(f);
+    if (fseek(f, 0, SEEK_END) != 0) return false;
+    long end = ftell(f);
+    if (start < 0 || end < 0 || size > uint64_t(end - start) ||
+        fseek(f, start, SEEK_SET) != 0)
+        return false;
+    bytes->resize(size);
+    return fread(bytes->data(), 1, size, f) == size;
+}
+
+// Checkpoint Method Definitions
+bool Checkpoint::Write(const std::string &filename) const {
+    // Write the checkpoint to a temporary file and then rename it, so that
+    // an interrupted write never clobbers the previous checkpoint
+    std::string tempFilename = filename + ".tmp";
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Error("%s: unable to open checkpoint file for writing",
+              tempFilename.c_str());
+        return false;
+    }
+    uint32_t floatSize = sizeof(Float);
+    bool ok = fwrite(CheckpointMagic, sizeof(CheckpointMagic), 1, f) == 1 &&
+              fwrite(&CheckpointVersion, sizeof(uint32_t), 1, f) == 1 &&
+              fwrite(&floatSize, sizeof(uint32_t), 1, f) == 1 &&
+              WriteBytes(f, description);
+    uint64_t nSections = sections.size();
+    ok = ok && fwrite(&nSections, sizeof(nSections), 1, f) == 1;
+    for (const auto &section : sections) {
+        if (!ok) break;
+        ok = WriteBytes(f, section.first) &&
+             WriteBytes(f, std::string(section.second.begin(),
+                                       section.second.end()));
+    }
+    ok = ok && fflush(f) == 0;
+    ok = (fclose(f) == 0) && ok;
+#ifdef PBRT_IS_WINDOWS
+    if (ok) remove(filename.c_str());
+#endif
+    if (!ok || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Error("%s: unable to write checkpoint file", filename.c_str());
+        remove(tempFilename.c_str());
+        return false;
+    }
+    ++nCheckpoints;
+    return true;
+}
+
+std::unique_ptr<Checkpoint> Checkpoint::Read(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    char magic[sizeof(CheckpointMagic)];
+    uint32_t version, floatSize;
+    std::vector<char> description;
+    uint64_t nSections;
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (fread(magic, sizeof(magic), 1, f) == 1 &&
+        memcmp(magic, CheckpointMagic, sizeof(magic)) == 0 &&
+        fread(&version, sizeof(version), 1, f) == 1 &&
+        version == CheckpointVersion &&
+        fread(&floatSize, sizeof(floatSize), 1, f) == 1 &&
+        floatSize == sizeof(Float) && ReadBytes(f, &description) &&
+        fread(&nSections, sizeof(nSections), 1, f) == 1) {
+        checkpoint.reset(new Checkpoint(
+            std::string(description.begin(), description.end())));
+        for (uint64_t i = 0; i < nSections && checkpoint; ++i) {
+            std::vector<char> name, bytes;
+            if (ReadBytes(f, &name) && ReadBytes(f, &bytes))
+                checkpoint->sections[std::string(name.begin(), name.end())] =
+                    std::move(bytes);
+            else
+                checkpoint.reset();
+        }
+    }
+    fclose(f);
+    if (!checkpoint)
+        Error("%s: checkpoint file is corrupt or from a different build of "
+              "pbrt", filename.c_str());
+    return checkpoint;
+}
+
+// Checkpoint Function Definitions
+void AddToCheckpointSceneHash(const void *data, size_t size) {
+    if (!CheckpointTimer::CheckpointingEnabled()) return;
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+        sceneHash ^= bytes[i];
+        sceneHash *= 1099511628211ull;
+    }
+}
+
+void ResetCheckpointSceneHash() { sceneHash = SceneHashSeed; }
+
+std::string CheckpointDescription(const std::string &integrator,
+                                  const Film *film, int64_t samplesPerPixel) {
+    Bounds2i sampleBounds = film->GetSampleBounds();
+    return StringPrintf("%s %d %d %d %d %d %d %" PRId64 " %016" PRIx64,
+                        integrator.c_str(), film->fullResolution.x,
+                        film->fullResolution.y, sampleBounds.pMin.x,
+                        sampleBounds.pMin.y, sampleBounds.pMax.x,
+                        sampleBounds.pMax.y, samplesPerPixel, sceneHash);
+}
+
+std::unique_ptr<Checkpoint> ResumeCheckpoint(const std::string &description) {
+    // Read the checkpoint file if resuming was requested
+    if (!PbrtOptions.resume || PbrtOptions.checkpointFile.empty())
+        return nullptr;
+    const std::string &filename = PbrtOptions.checkpointFile;
+    std::unique_ptr<Checkpoint> checkpoint = Checkpoint::Read(filename);
+    if (!checkpoint) {
+        Warning("%s: no checkpoint to resume from; starting a new render.",
+                filename.c_str());
+        return nullptr;
+    }
+    if (checkpoint->Description() != description) {
+        Error("%s: checkpoint is for a different render (\"%s\", expected "
+              "\"%s\"); starting a new render.", filename.c_str(),
+              checkpoint->Description().c_str(), description.c_str());
+        return nullptr;
+    }
+    LOG(INFO) << "Resuming render from checkpoint " << filename;
+    return checkpoint;
+}
+
+void SaveCheckpoint(const Checkpoint &checkpoint) {
+    ProfilePhase _(Prof::WriteCheckpoint);
+    if (checkpoint.Write(PbrtOptions.checkpointFile))
+        LOG(INFO) << "Wrote checkpoint " << PbrtOptions.checkpointFile;
+}
+
+void InitTileCheckpoints(const std::string &description, Film *film,
+                         TileScheduler *scheduler) {
+    // Restore _film_ and the tiles done from a checkpoint, if resuming
+    std::unique_ptr<Checkpoint> resumed = ResumeCheckpoint(description);
+    if (resumed &&
+        (!film->LoadState(*resumed) || !scheduler->LoadState(*resumed))) {
+        Error("%s: checkpoint is incomplete; starting a new render.",
+              PbrtOptions.checkpointFile.c_str());
+        film->Clear();
+    }
+
+    // Save both of them periodically while _scheduler_ runs
+    if (CheckpointTimer::CheckpointingEnabled())
+        scheduler->EnableCheckpoints([=]() {
+            Checkpoint checkpoint(description);
+            film->SaveState(&checkpoint);
+            scheduler->SaveState(&checkpoint);
+            SaveCheckpoint(checkpoint);
+        });
+}
+
+}  // namespace pbrt
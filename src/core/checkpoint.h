@@ -0,0 +1,140 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_CHECKPOINT_H
+#define PBRT_CORE_CHECKPOINT_H
+
+// core/checkpoint.h*
+#include "pbrt.h"
+#include <chrono>
+#include <map>
+
+namespace pbrt {
+
+// Checkpoint Declarations
+// A _Checkpoint_ holds the state of an in-progress render as named
+// sections of raw bytes, so only trivially copyable types may be stored.
+// Its description identifies the render it belongs to; a checkpoint is
+// only resumed by a render with the same description.
+class Checkpoint {
+  public:
+    // Checkpoint Public Methods
+    Checkpoint(const std::string &description) : description(description) {}
+    template <typename T>
+    void Add(const std::string &name, const T *values, size_t count) {
+        const char *bytes = (const char *)values;
+        sections[name].assign(bytes, bytes + count * sizeof(T));
+    }
+    template <typename T>
+    void Add(const std::string &name, const std::vector<T> &values) {
+        Add(name, values.data(), values.size());
+    }
+    template <typename T>
+    void Add(const std::string &name, const T &value) {
+        Add(name, &value, 1);
+    }
+    template <typename T>
+    bool Get(const std::string &name, T *values, size_t count) const {
+        auto iter = sections.find(name);
+        if (iter == sections.end() || iter->second.size() != count * sizeof(T))
+            return false;
+        memcpy(values, iter->second.data(), iter->second.size());
+        return true;
+    }
+    template <typename T>
+    bool Get(const std::string &name, std::vector<T> *values) const {
+        auto iter = sections.find(name);
+        if (iter == sections.end() || iter->second.size() % sizeof(T) != 0)
+            return false;
+        values->resize(iter->second.size() / sizeof(T));
+        return Get(name, values->data(), values->size());
+    }
+    template <typename T>
+    bool Get(const std::string &name, T *value) const {
+        return Get(name, value, 1);
+    }
+    bool Has(const std::string &name) const {
+        return sections.find(name) != sections.end();
+    }
+    bool Write(const std::string &filename) const;
+    static std::unique_ptr<Checkpoint> Read(const std::string &filename);
+    const std::string &Description() const { return description; }
+
+  private:
+    // Checkpoint Private Data
+    std::string description;
+    std::map<std::string, std::vector<char>> sections;
+};
+
+// CheckpointTimer Declarations
+class CheckpointTimer {
+  public:
+    // CheckpointTimer Public Methods
+    CheckpointTimer() : lastCheckpoint(std::chrono::steady_clock::now()) {}
+    bool Due() const {
+        return CheckpointingEnabled() &&
+               std::chrono::duration<Float>(std::chrono::steady_clock::now() -
+                                            lastCheckpoint)
+                       .count() >= PbrtOptions.checkpointInterval;
+    }
+    void Reset() { lastCheckpoint = std::chrono::steady_clock::now(); }
+    static bool CheckpointingEnabled() {
+        return !PbrtOptions.checkpointFile.empty();
+    }
+
+  private:
+    // CheckpointTimer Private Data
+    std::chrono::steady_clock::time_point lastCheckpoint;
+};
+
+// Checkpoint Function Declarations
+// The parser adds the text of each scene file to the scene hash and the
+// API adds the sampler's parameters, so that a checkpoint isn't resumed
+// after the scene has changed; it's only updated if checkpointing is
+// enabled.
+void AddToCheckpointSceneHash(const void *data, size_t size);
+void ResetCheckpointSceneHash();
+std::string CheckpointDescription(const std::string &integrator,
+                                  const Film *film, int64_t samplesPerPixel);
+std::unique_ptr<Checkpoint> ResumeCheckpoint(const std::string &description);
+void SaveCheckpoint(const Checkpoint &checkpoint);
+void InitTileCheckpoints(const std::string &description, Film *film,
+                         TileScheduler *scheduler);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_CHECKPOINT_H
@@ -0,0 +1,458 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/distributed.cpp*
+#include "distributed.h"
+#include "film.h"
+#include "parallel.h"
+#include "progressreporter.h"
+#include "stats.h"
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifndef PBRT_IS_WINDOWS
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+STAT_COUNTER("Distributed/Work units rendered by workers", nRemoteUnits);
+STAT_COUNTER("Distributed/Work units handed out again", nReassignedUnits);
+STAT_COUNTER("Distributed/Work units rendered for coordinator",
+             nWorkerUnits);
+
+#ifndef PBRT_IS_WINDOWS
+// Distributed Rendering Local Definitions
+// Each message starts with a _MessageType_, followed by the message's
+// data. Data is sent in the machine's native layout, so all processes
+// must run the same build of pbrt on machines of the same architecture;
+// the hello message checks as much of this as it can.
+enum MessageType : uint32_t {
+    HelloMessageType = 0x44524250,
+    RequestMessageType,
+    WorkUnitMessageType,
+    NoMoreWorkMessageType,
+    ResultMessageType
+};
+
+struct HelloMessage {
+    uint32_t floatSize, spectrumSamples;
+    int32_t fullResolution[2], sampleBounds[4];
+    int64_t samplesPerPixel;
+};
+
+struct WorkUnitMessage {
+    int32_t index;
+    int32_t bounds[4];
+};
+
+#ifdef MSG_NOSIGNAL
+static const int SendFlags = MSG_NOSIGNAL;
+#else
+static const int SendFlags = 0;
+#endif
+
+static bool SendAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, SendFlags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool RecvAll(int fd, void *data, size_t size) {
+    char *p = (char *)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+template <typename T>
+static bool Send(int fd, const T &value) {
+    return SendAll(fd, &value, sizeof(T));
+}
+
+template <typename T>
+static bool Recv(int fd, T *value) {
+    return RecvAll(fd, value, sizeof(T));
+}
+
+static void ConfigureSocket(int fd) {
+    // Send small request messages right away, and don't raise _SIGPIPE_
+    // if the other process has gone away
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+static HelloMessage MakeHello(const Film *film, int64_t samplesPerPixel) {
+    HelloMessage hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.floatSize = sizeof(Float);
+    hello.spectrumSamples = Spectrum::nSamples;
+    hello.fullResolution[0] = film->fullResolution.x;
+    hello.fullResolution[1] = film->fullResolution.y;
+    Bounds2i sampleBounds = film->GetSampleBounds();
+    hello.sampleBounds[0] = sampleBounds.pMin.x;
+    hello.sampleBounds[1] = sampleBounds.pMin.y;
+    hello.sampleBounds[2] = sampleBounds.pMax.x;
+    hello.sampleBounds[3] = sampleBounds.pMax.y;
+    hello.samplesPerPixel = samplesPerPixel;
+    return hello;
+}
+
+static int OpenListenSocket(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(*port);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0 ||
+        getsockname(fd, (sockaddr *)&addr, &addrLen) < 0) {
+        close(fd);
+        return -1;
+    }
+    // Report the port that was bound, in case the system chose it
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int ConnectToCoordinator(const std::string &coordinator) {
+    // Split _coordinator_ into host and port
+    size_t colon = coordinator.rfind(':');
+    if (colon == std::string::npos) {
+        Error("Coordinator address \"%s\" should be of the form host:port.",
+              coordinator.c_str());
+        return -1;
+    }
+    std::string host = coordinator.substr(0, colon);
+    std::string port = coordinator.substr(colon + 1);
+
+    // Try to connect for a while, since the coordinator may still be
+    // parsing the scene
+    for (int attempt = 0; attempt < 240; ++attempt) {
+        addrinfo hints, *addrs;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+            Error("Unable to resolve coordinator host \"%s\".", host.c_str());
+            return -1;
+        }
+        for (addrinfo *a = addrs; a; a = a->ai_next) {
+            int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                freeaddrinfo(addrs);
+                ConfigureSocket(fd);
+                return fd;
+            }
+            close(fd);
+        }
+        freeaddrinfo(addrs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+    return -1;
+}
+#endif  // !PBRT_IS_WINDOWS
+
+// Distributed Rendering Definitions
+void RenderCoordinator(int port, const std::vector<Bounds2i> &workUnits,
+                       Film *film, int64_t samplesPerPixel,
+                       const WorkUnitRenderer &render,
+                       const std::function<void(int)> &listening) {
+#ifdef PBRT_IS_WINDOWS
+    Error("Distributed rendering isn't supported on Windows; rendering "
+          "locally.");
+#else
+    // Listen for worker connections
+    int listenFd = OpenListenSocket(&port);
+    if (listenFd < 0)
+        Error("Unable to listen for workers on port %d; rendering locally.",
+              port);
+    else {
+        LOG(INFO) << "Listening for workers on port " << port;
+        if (!PbrtOptions.quiet)
+            printf("Listening for workers on port %d.\n", port);
+        if (listening) listening(port);
+    }
+#endif  // PBRT_IS_WINDOWS
+
+    // Initialize state shared by local threads and worker connections
+    int nUnits = workUnits.size(), nDone = 0;
+    std::mutex mutex;
+    std::condition_variable unitsChanged;
+    std::vector<int> pending(nUnits);
+    for (int i = 0; i < nUnits; ++i) pending[i] = nUnits - 1 - i;
+    ProgressReporter reporter(nUnits, "Rendering");
+    auto takeUnit = [&](int *index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.empty()) return false;
+        *index = pending.back();
+        pending.pop_back();
+        return true;
+    };
+    auto finishUnit = [&](std::unique_ptr<FilmTile> tile) {
+        film->MergeFilmTile(std::move(tile));
+        reporter.Update();
+        std::lock_guard<std::mutex> lock(mutex);
+        ++nDone;
+        unitsChanged.notify_all();
+    };
+
+#ifndef PBRT_IS_WINDOWS
+    // Serve each worker connection on its own thread
+    HelloMessage hello = MakeHello(film, samplesPerPixel);
+    std::atomic<bool> finished(false);
+    std::mutex connectionsMutex;
+    std::vector<int> connectionFds;
+    std::vector<std::thread> connections;
+    auto serve = [&](int fd) {
+        // Check that the worker is rendering the same scene
+        uint32_t type;
+        HelloMessage workerHello;
+        if (!Recv(fd, &type) || type != HelloMessageType ||
+            !Recv(fd, &workerHello))
+            return;
+        bool accepted = memcmp(&hello, &workerHello, sizeof(hello)) == 0;
+        if (!Send(fd, uint32_t(accepted)) || !accepted) {
+            Warning("Rejected a worker that is rendering a different scene.");
+            return;
+        }
+
+        // Hand out work units and merge results until the worker is done
+        std::vector<int> assigned;
+        while (Recv(fd, &type)) {
+            if (type == RequestMessageType) {
+                int index;
+                if (!takeUnit(&index)) {
+                    if (!Send(fd, NoMoreWorkMessageType)) break;
+                    continue;
+                }
+                assigned.push_back(index);
+                const Bounds2i &b = workUnits[index];
+                WorkUnitMessage unit = {
+                    index, {b.pMin.x, b.pMin.y, b.pMax.x, b.pMax.y}};
+                if (!Send(fd, WorkUnitMessageType) || !Send(fd, unit)) break;
+            } else if (type == ResultMessageType) {
+                // Receive film tile values for a work unit the worker has
+                WorkUnitMessage unit;
+                uint64_t nValues;
+                if (!Recv(fd, &unit) || !Recv(fd, &nValues)) break;
+                auto iter =
+                    std::find(assigned.begin(), assigned.end(), unit.index);
+                if (iter == assigned.end()) break;
+                std::unique_ptr<FilmTile> tile =
+                    film->GetFilmTile(workUnits[unit.index]);
+                Bounds2i pixelBounds = tile->GetPixelBounds();
+                if (nValues != uint64_t(pixelBounds.Area()) *
+                                   (Spectrum::nSamples + 1))
+                    break;
+                std::vector<Float> values(nValues);
+                if (!RecvAll(fd, values.data(), nValues * sizeof(Float)))
+                    break;
+                const Float *v = values.data();
+                for (Point2i p : pixelBounds) {
+                    FilmTilePixel &pixel = tile->GetPixel(p);
+                    for (int c = 0; c < Spectrum::nSamples; ++c)
+                        pixel.contribSum[c] = *v++;
+                    pixel.filterWeightSum = *v++;
+                }
+                assigned.erase(iter);
+                ++nRemoteUnits;
+                finishUnit(std::move(tile));
+            } else
+                break;
+        }
+
+        // Hand out again the units that the worker didn't finish
+        if (!assigned.empty() && !finished) {
+            Warning("Lost connection to a worker; reassigning %d work units.",
+                    int(assigned.size()));
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.insert(pending.end(), assigned.begin(), assigned.end());
+            nReassignedUnits += assigned.size();
+            unitsChanged.notify_all();
+        }
+    };
+    std::thread acceptThread([&]() {
+        // Accept worker connections until rendering is finished
+        if (listenFd < 0) return;
+        while (!finished) {
+            pollfd pfd = {listenFd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) continue;
+            ConfigureSocket(fd);
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            connectionFds.push_back(fd);
+            connections.push_back(std::thread([&, fd]() {
+                serve(fd);
+                ReportThreadStats();
+            }));
+        }
+    });
+#endif  // !PBRT_IS_WINDOWS
+
+    // Render work units locally until none are left to hand out
+    ParallelFor([&](int64_t) {
+        int index;
+        while (takeUnit(&index)) finishUnit(render(workUnits[index]));
+    }, MaxThreadIndex());
+
+    // Wait for workers to finish, rendering units that are handed back
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (nDone < nUnits) {
+            if (pending.empty()) {
+                unitsChanged.wait(lock);
+                continue;
+            }
+            int index = pending.back();
+            pending.pop_back();
+            lock.unlock();
+            finishUnit(render(workUnits[index]));
+            lock.lock();
+        }
+    }
+    reporter.Done();
+
+#ifndef PBRT_IS_WINDOWS
+    // Close worker connections and stop listening
+    finished = true;
+    acceptThread.join();
+    for (int fd : connectionFds) shutdown(fd, SHUT_RDWR);
+    for (std::thread &t : connections) t.join();
+    for (int fd : connectionFds) close(fd);
+    if (listenFd >= 0) close(listenFd);
+#endif
+}
+
+void RenderWorker(const std::string &coordinator, Film *film,
+                  int64_t samplesPerPixel, const WorkUnitRenderer &render) {
+#ifdef PBRT_IS_WINDOWS
+    Error("Distributed rendering isn't supported on Windows.");
+#else
+    // Connect to the coordinator and check that it accepts this worker
+    int fd = ConnectToCoordinator(coordinator);
+    if (fd < 0) {
+        Error("Unable to connect to coordinator \"%s\".",
+              coordinator.c_str());
+        return;
+    }
+    uint32_t accepted = 0;
+    if (!Send(fd, HelloMessageType) ||
+        !Send(fd, MakeHello(film, samplesPerPixel)) ||
+        !Recv(fd, &accepted) || !accepted) {
+        Error("Coordinator \"%s\" didn't accept this worker; make sure that "
+              "both are rendering the same scene.", coordinator.c_str());
+        close(fd);
+        return;
+    }
+    LOG(INFO) << "Connected to coordinator " << coordinator;
+
+    // Request, render, and return work units on all threads, taking turns
+    // using the connection
+    std::mutex connectionMutex;
+    bool connected = true;
+    ParallelFor([&](int64_t) {
+        while (true) {
+            // Get the next work unit from the coordinator
+            WorkUnitMessage unit;
+            {
+                std::lock_guard<std::mutex> lock(connectionMutex);
+                uint32_t type;
+                if (!connected) return;
+                if (!Send(fd, RequestMessageType) || !Recv(fd, &type)) {
+                    connected = false;
+                    return;
+                }
+                // Once the coordinator runs out of work units, this thread
+                // is done, but others may still be rendering theirs
+                if (type == NoMoreWorkMessageType) return;
+                if (type != WorkUnitMessageType || !Recv(fd, &unit)) {
+                    connected = false;
+                    return;
+                }
+            }
+
+            // Render the work unit and send its film tile's values
+            Bounds2i bounds(Point2i(unit.bounds[0], unit.bounds[1]),
+                            Point2i(unit.bounds[2], unit.bounds[3]));
+            std::unique_ptr<FilmTile> tile = render(bounds);
+            std::vector<Float> values;
+            for (Point2i p : tile->GetPixelBounds()) {
+                const FilmTilePixel &pixel = tile->GetPixel(p);
+                for (int c = 0; c < Spectrum::nSamples; ++c)
+                    values.push_back(pixel.contribSum[c]);
+                values.push_back(pixel.filterWeightSum);
+            }
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            if (!connected) return;
+            if (!Send(fd, ResultMessageType) || !Send(fd, unit) ||
+                !Send(fd, uint64_t(values.size())) ||
+                !SendAll(fd, values.data(), values.size() * sizeof(Float))) {
+                connected = false;
+                return;
+            }
+            ++nWorkerUnits;
+        }
+    }, MaxThreadIndex());
+    close(fd);
+    LOG(INFO) << "Finished rendering for coordinator " << coordinator;
+#endif  // PBRT_IS_WINDOWS
+}
+
+}  // namespace pbrt
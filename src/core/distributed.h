@@ -0,0 +1,68 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_DISTRIBUTED_H
+#define PBRT_CORE_DISTRIBUTED_H
+
+// core/distributed.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include <functional>
+
+namespace pbrt {
+
+// Distributed Rendering Declarations
+// A coordinator pbrt process hands image work units over TCP to worker
+// pbrt processes that render the same scene, possibly on other hosts, and
+// merges the film tiles that they send back into its _Film_. Work units
+// are handed out on request, so faster workers get more of them, and the
+// units of a worker that disconnects are handed out again. The
+// coordinator's own threads render work units as well. A coordinator
+// _port_ of zero listens on a free port chosen by the system; _listening_,
+// if given, is called with the port once workers can connect.
+typedef std::function<std::unique_ptr<FilmTile>(const Bounds2i &)>
+    WorkUnitRenderer;
+void RenderCoordinator(int port, const std::vector<Bounds2i> &workUnits,
+                       Film *film, int64_t samplesPerPixel,
+                       const WorkUnitRenderer &render,
+                       const std::function<void(int)> &listening = nullptr);
+void RenderWorker(const std::string &coordinator, Film *film,
+                  int64_t samplesPerPixel, const WorkUnitRenderer &render);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_DISTRIBUTED_H
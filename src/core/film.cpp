@@ -34,6 +34,7 @@
 // core/film.cpp*
 #include "film.h"
 #include "paramset.h"
+#include "checkpoint.h"
 #include "imageio.h"
 #include "stats.h"
 
@@ -41,6 +42,9 @@ namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Film pixels", filmPixelMemory);
 
+// Film Local Definitions
+static const int MaxSplatBuffers = 8;
+
 // Film Method Definitions
 Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
            std::unique_ptr<Filter> filt, Float diagonal,
@@ -64,6 +68,9 @@ Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
     // Allocate film image storage
     pixels = std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]);
     filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    trackedMemory.Add(croppedPixelBounds.Area() * sizeof(Pixel));
+    rowMutexes.reset(new std::mutex[std::max(
+        0, croppedPixelBounds.pMax.y - croppedPixelBounds.pMin.y)]);
 
     // Precompute filter weight table
     int offset = 0;
@@ -92,7 +99,8 @@ Bounds2f Film::GetPhysicalExtent() const {
     return Bounds2f(Point2f(-x / 2, -y / 2), Point2f(x / 2, y / 2));
 }
 
-std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
+std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds,
+                                            bool trackVariance) {
     // Bound image pixels that samples in _sampleBounds_ contribute to
     Vector2f halfPixel = Vector2f(0.5f, 0.5f);
     Bounds2f floatBounds = (Bounds2f)sampleBounds;
@@ -102,30 +110,42 @@ std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
     Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
     return std::unique_ptr<FilmTile>(new FilmTile(
         tilePixelBounds, filter->radius, filterTable, filterTableWidth,
-        maxSampleLuminance));
+        maxSampleLuminance, trackVariance));
 }
 
 void Film::Clear() {
     for (Point2i p : croppedPixelBounds) {
         Pixel &pixel = GetPixel(p);
-        for (int c = 0; c < 3; ++c)
-            pixel.splatXYZ[c] = pixel.xyz[c] = 0;
+        for (int c = 0; c < 3; ++c) pixel.xyz[c] = 0;
         pixel.filterWeightSum = 0;
     }
+    for (VarianceEstimator &v : variance) v = VarianceEstimator();
+    if (splatXYZ)
+        for (int i = 0; i < 3 * nSplatBuffers * croppedPixelBounds.Area(); ++i)
+            splatXYZ[i] = 0;
 }
 
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
     VLOG(1) << "Merging film tile " << tile->pixelBounds;
-    std::lock_guard<std::mutex> lock(mutex);
-    for (Point2i pixel : tile->GetPixelBounds()) {
-        // Merge _pixel_ into _Film::pixels_
-        const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
-        Pixel &mergePixel = GetPixel(pixel);
-        Float xyz[3];
-        tilePixel.contribSum.ToXYZ(xyz);
-        for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
-        mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+    Bounds2i tileBounds = tile->GetPixelBounds();
+    if (!tile->variance.empty()) AllocateVariance();
+    for (int y = tileBounds.pMin.y; y < tileBounds.pMax.y; ++y) {
+        std::lock_guard<std::mutex> lock(
+            rowMutexes[y - croppedPixelBounds.pMin.y]);
+        for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x) {
+            // Merge _pixel_ into _Film::pixels_
+            Point2i pixel(x, y);
+            const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
+            Pixel &mergePixel = GetPixel(pixel);
+            Float xyz[3];
+            tilePixel.contribSum.ToXYZ(xyz);
+            for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
+            mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+            if (!tile->variance.empty())
+                variance[PixelOffset(pixel)].Merge(
+                    tile->variance[tile->PixelOffset(pixel)]);
+        }
     }
 }
 
@@ -135,8 +155,9 @@ void Film::SetImage(const Spectrum *img) const {
         Pixel &p = pixels[i];
         img[i].ToXYZ(p.xyz);
         p.filterWeightSum = 1;
-        p.splatXYZ[0] = p.splatXYZ[1] = p.splatXYZ[2] = 0;
     }
+    if (splatXYZ)
+        for (int i = 0; i < 3 * nSplatBuffers * nPixels; ++i) splatXYZ[i] = 0;
 }
 
 void Film::AddSplat(const Point2f &p, Spectrum v) {
@@ -162,8 +183,95 @@ void Film::AddSplat(const Point2f &p, Spectrum v) {
         v *= maxSampleLuminance / v.y();
     Float xyz[3];
     v.ToXYZ(xyz);
-    Pixel &pixel = GetPixel(pi);
-    for (int i = 0; i < 3; ++i) pixel.splatXYZ[i].Add(xyz[i]);
+
+    // Allocate splat buffers the first time any thread splats
+    int nPixels = croppedPixelBounds.Area();
+    AllocateSplatBuffers();
+    CHECK_GE(ThreadIndex, 0);
+    int buffer = ThreadIndex % nSplatBuffers;
+    AtomicFloat *splat = &splatXYZ[3 * (buffer * nPixels + PixelOffset(pi))];
+    for (int i = 0; i < 3; ++i) splat[i].Add(xyz[i]);
+}
+
+void Film::AllocateSplatBuffers() {
+    std::call_once(splatBuffersAllocated, [&]() {
+        // Use a buffer per thread, up to a limit on their total memory
+        const int64_t maxSplatMemory = int64_t(256) << 20;
+        int nPixels = croppedPixelBounds.Area();
+        int64_t bufferBytes = 3 * sizeof(AtomicFloat) * int64_t(nPixels);
+        nSplatBuffers = std::min(MaxThreadIndex(), MaxSplatBuffers);
+        while (nSplatBuffers > 1 &&
+               nSplatBuffers * bufferBytes > maxSplatMemory)
+            --nSplatBuffers;
+        splatXYZ.reset(new AtomicFloat[3 * nSplatBuffers * nPixels]);
+        filmPixelMemory += nSplatBuffers * bufferBytes;
+        trackedMemory.Add(nSplatBuffers * bufferBytes);
+    });
+}
+
+void Film::AllocateVariance() {
+    std::call_once(varianceAllocated, [&]() {
+        variance.resize(croppedPixelBounds.Area());
+        filmPixelMemory += variance.size() * sizeof(VarianceEstimator);
+        trackedMemory.Add(variance.size() * sizeof(VarianceEstimator));
+    });
+}
+
+void Film::GetSplatXYZ(int offset, Float xyz[3]) const {
+    // Sum pixel _offset_'s splatted values over all splat buffers
+    xyz[0] = xyz[1] = xyz[2] = 0;
+    int nPixels = croppedPixelBounds.Area();
+    for (int buffer = 0; buffer < nSplatBuffers; ++buffer)
+        for (int i = 0; i < 3; ++i)
+            xyz[i] += splatXYZ[3 * (buffer * nPixels + offset) + i];
+}
+
+void Film::SaveState(Checkpoint *checkpoint) const {
+    // Save pixel sums, splatted values summed over the splat buffers, and
+    // sample statistics, whichever have been allocated
+    int nPixels = croppedPixelBounds.Area();
+    checkpoint->Add("film/pixels", pixels.get(), nPixels);
+    if (splatXYZ) {
+        std::vector<Float> splats(3 * nPixels);
+        for (int i = 0; i < nPixels; ++i) GetSplatXYZ(i, &splats[3 * i]);
+        checkpoint->Add("film/splats", splats);
+    }
+    if (!variance.empty()) checkpoint->Add("film/variance", variance);
+}
+
+bool Film::LoadState(const Checkpoint &checkpoint) {
+    int nPixels = croppedPixelBounds.Area();
+    std::vector<Float> splats;
+    if (!checkpoint.Get("film/pixels", pixels.get(), nPixels) ||
+        (checkpoint.Has("film/splats") &&
+         (!checkpoint.Get("film/splats", &splats) ||
+          splats.size() != 3 * size_t(nPixels))))
+        return false;
+    if (!splats.empty()) {
+        // Restore splatted values into the first splat buffer
+        AllocateSplatBuffers();
+        for (int i = 0; i < 3 * nSplatBuffers * nPixels; ++i)
+            splatXYZ[i] = i < 3 * nPixels ? splats[i] : 0;
+    }
+    if (checkpoint.Has("film/variance")) {
+        AllocateVariance();
+        if (!checkpoint.Get("film/variance", variance.data(), variance.size()))
+            return false;
+    }
+    return true;
+}
+
+Float Film::RelativeError() const {
+    // Average the relative errors of pixels that have been sampled
+    if (variance.empty()) return Infinity;
+    Float errorSum = 0;
+    int nSampled = 0;
+    for (const VarianceEstimator &v : variance) {
+        if (v.Count() == 0) continue;
+        errorSum += v.RelativeError();
+        ++nSampled;
+    }
+    return nSampled > 0 ? errorSum / nSampled : Infinity;
 }
 
 void Film::WriteImage(Float splatScale) {
@@ -190,8 +298,8 @@ void Film::WriteImage(Float splatScale) {
 
         // Add splat value at pixel
         Float splatRGB[3];
-        Float splatXYZ[3] = {pixel.splatXYZ[0], pixel.splatXYZ[1],
-                             pixel.splatXYZ[2]};
+        Float splatXYZ[3];
+        GetSplatXYZ(offset, splatXYZ);
         XYZToRGB(splatXYZ, splatRGB);
         rgb[3 * offset] += splatScale * splatRGB[0];
         rgb[3 * offset + 1] += splatScale * splatRGB[1];
@@ -45,6 +45,7 @@
 #include "filter.h"
 #include "stats.h"
 #include "parallel.h"
+#include "memory.h"
 
 namespace pbrt {
 
@@ -54,6 +55,44 @@ struct FilmTilePixel {
     Float filterWeightSum = 0.f;
 };
 
+// VarianceEstimator Declarations
+// Tracks the mean and variance of a series of values using Welford's
+// algorithm, which stays accurate over long series.
+class VarianceEstimator {
+  public:
+    // VarianceEstimator Public Methods
+    void Add(Float x) {
+        ++n;
+        Float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+    void Merge(const VarianceEstimator &v) {
+        // Combine the two series' statistics with Chan et al.'s formulas
+        if (v.n == 0) return;
+        int64_t nSum = n + v.n;
+        Float delta = v.mean - mean;
+        mean += delta * v.n / nSum;
+        m2 += v.m2 + delta * delta * n * v.n / nSum;
+        n = nSum;
+    }
+    int64_t Count() const { return n; }
+    Float Mean() const { return mean; }
+    Float Variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+    // Returns the standard error of the mean relative to the mean; means
+    // below _minMean_ are held to an absolute bound instead, so that
+    // nearly black pixels aren't considered arbitrarily noisy
+    Float RelativeError(Float minMean = 1e-3f) const {
+        if (n < 2) return Infinity;
+        return std::sqrt(Variance() / n) / std::max(mean, minMean);
+    }
+
+  private:
+    // VarianceEstimator Private Data
+    int64_t n = 0;
+    Float mean = 0, m2 = 0;
+};
+
 // Film Declarations
 class Film {
   public:
@@ -64,10 +103,14 @@ class Film {
          Float maxSampleLuminance = Infinity);
     Bounds2i GetSampleBounds() const;
     Bounds2f GetPhysicalExtent() const;
-    std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i &sampleBounds);
+    std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i &sampleBounds,
+                                          bool trackVariance = false);
     void MergeFilmTile(std::unique_ptr<FilmTile> tile);
     void SetImage(const Spectrum *img) const;
     void AddSplat(const Point2f &p, Spectrum v);
+    Float RelativeError() const;
+    void SaveState(Checkpoint *checkpoint) const;
+    bool LoadState(const Checkpoint &checkpoint);
     void WriteImage(Float splatScale = 1);
     void Clear();
 
@@ -84,24 +127,39 @@ class Film {
         Pixel() { xyz[0] = xyz[1] = xyz[2] = filterWeightSum = 0; }
         Float xyz[3];
         Float filterWeightSum;
-        AtomicFloat splatXYZ[3];
-        Float pad;
     };
     std::unique_ptr<Pixel[]> pixels;
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
-    std::mutex mutex;
+    // Film tiles are merged a row at a time, holding only that row's
+    // mutex, so threads merging different parts of the image don't wait
+    // for each other.
+    std::unique_ptr<std::mutex[]> rowMutexes;
+    // Splatted XYZ values are accumulated in _nSplatBuffers_ separate
+    // buffers, chosen by thread index, so that threads splatting to the
+    // same pixels rarely contend for the same cache lines; the buffers
+    // are allocated at the first splat and summed in _WriteImage()_.
+    std::once_flag splatBuffersAllocated;
+    int nSplatBuffers = 0;
+    std::unique_ptr<AtomicFloat[]> splatXYZ;
+    // Per-pixel sample statistics from film tiles that track variance
+    std::once_flag varianceAllocated;
+    std::vector<VarianceEstimator> variance;
+    TrackedMemory trackedMemory{MemoryCategory::Film};
     const Float scale;
     const Float maxSampleLuminance;
 
     // Film Private Methods
-    Pixel &GetPixel(const Point2i &p) {
+    int PixelOffset(const Point2i &p) const {
         CHECK(InsideExclusive(p, croppedPixelBounds));
         int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
-        int offset = (p.x - croppedPixelBounds.pMin.x) +
-                     (p.y - croppedPixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return (p.x - croppedPixelBounds.pMin.x) +
+               (p.y - croppedPixelBounds.pMin.y) * width;
     }
+    Pixel &GetPixel(const Point2i &p) { return pixels[PixelOffset(p)]; }
+    void AllocateSplatBuffers();
+    void AllocateVariance();
+    void GetSplatXYZ(int offset, Float xyz[3]) const;
 };
 
 class FilmTile {
@@ -109,7 +167,7 @@ class FilmTile {
     // FilmTile Public Methods
     FilmTile(const Bounds2i &pixelBounds, const Vector2f &filterRadius,
              const Float *filterTable, int filterTableSize,
-             Float maxSampleLuminance)
+             Float maxSampleLuminance, bool trackVariance = false)
         : pixelBounds(pixelBounds),
           filterRadius(filterRadius),
           invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
@@ -117,12 +175,20 @@ class FilmTile {
           filterTableSize(filterTableSize),
           maxSampleLuminance(maxSampleLuminance) {
         pixels = std::vector<FilmTilePixel>(std::max(0, pixelBounds.Area()));
+        if (trackVariance)
+            variance.resize(std::max(0, pixelBounds.Area()));
     }
     void AddSample(const Point2f &pFilm, Spectrum L,
                    Float sampleWeight = 1.) {
         ProfilePhase _(Prof::AddFilmSample);
         if (L.y() > maxSampleLuminance)
             L *= maxSampleLuminance / L.y();
+        if (!variance.empty()) {
+            // Update luminance statistics of the pixel that was sampled
+            Point2i pi = (Point2i)Floor(pFilm);
+            if (InsideExclusive(pi, pixelBounds))
+                variance[PixelOffset(pi)].Add(L.y());
+        }
         // Compute sample's raster bounds
         Point2f pFilmDiscrete = pFilm - Vector2f(0.5f, 0.5f);
         Point2i p0 = (Point2i)Ceil(pFilmDiscrete - filterRadius);
@@ -160,18 +226,17 @@ class FilmTile {
         }
     }
     FilmTilePixel &GetPixel(const Point2i &p) {
-        CHECK(InsideExclusive(p, pixelBounds));
-        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return pixels[PixelOffset(p)];
     }
     const FilmTilePixel &GetPixel(const Point2i &p) const {
-        CHECK(InsideExclusive(p, pixelBounds));
-        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return pixels[PixelOffset(p)];
+    }
+    // Returns the statistics of the samples taken in pixel _p_, or
+    // _nullptr_ if the tile doesn't track variance or _p_ is outside it
+    const VarianceEstimator *GetVariance(const Point2i &p) const {
+        if (variance.empty() || !InsideExclusive(p, pixelBounds))
+            return nullptr;
+        return &variance[PixelOffset(p)];
     }
     Bounds2i GetPixelBounds() const { return pixelBounds; }
 
@@ -182,8 +247,16 @@ class FilmTile {
     const Float *filterTable;
     const int filterTableSize;
     std::vector<FilmTilePixel> pixels;
+    std::vector<VarianceEstimator> variance;
     const Float maxSampleLuminance;
     friend class Film;
+
+    // FilmTile Private Methods
+    int PixelOffset(const Point2i &p) const {
+        CHECK(InsideExclusive(p, pixelBounds));
+        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
+        return (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
+    }
 };
 
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter);
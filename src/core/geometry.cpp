@@ -36,4 +36,27 @@
 
 namespace pbrt {
 
+// DirectionCone Method Definitions
+DirectionCone Union(const DirectionCone &a, const DirectionCone &b) {
+    // Handle the cases where one cone is empty or contains the other
+    if (a.IsEmpty()) return b;
+    if (b.IsEmpty()) return a;
+    Float thetaA = std::acos(Clamp(a.cosTheta, -1, 1));
+    Float thetaB = std::acos(Clamp(b.cosTheta, -1, 1));
+    Float thetaD = std::acos(Clamp(Dot(a.w, b.w), -1, 1));
+    if (std::min(thetaD + thetaB, Pi) <= thetaA) return a;
+    if (std::min(thetaD + thetaA, Pi) <= thetaB) return b;
+
+    // Find the axis and spread of the cone that bounds both
+    Float thetaO = (thetaA + thetaD + thetaB) / 2;
+    if (thetaO >= Pi) return DirectionCone::EntireSphere();
+    Vector3f wr = Cross(a.w, b.w);
+    if (wr.LengthSquared() == 0) return DirectionCone::EntireSphere();
+    // Rotate _a.w_ toward _b.w_ about _wr_, which is perpendicular to it
+    Float thetaR = thetaO - thetaA;
+    Vector3f w = std::cos(thetaR) * a.w +
+                 std::sin(thetaR) * Cross(Normalize(wr), a.w);
+    return DirectionCone(w, std::cos(thetaO));
+}
+
 }  // namespace pbrt
@@ -984,6 +984,28 @@ template <typename T>
 inline Vector3<T> Normalize(const Vector3<T> &v) {
     return v / v.Length();
 }
+
+// DirectionCone Declarations
+// The set of directions within an angle of the axis _w_ whose cosine is
+// _cosTheta_; a _cosTheta_ of -1 is the entire sphere of directions.
+struct DirectionCone {
+    // DirectionCone Public Methods
+    DirectionCone() = default;
+    DirectionCone(const Vector3f &w, Float cosTheta)
+        : w(Normalize(w)), cosTheta(cosTheta) {}
+    explicit DirectionCone(const Vector3f &w) : DirectionCone(w, 1) {}
+    static DirectionCone EntireSphere() {
+        return DirectionCone(Vector3f(0, 0, 1), -1);
+    }
+    bool IsEmpty() const { return cosTheta == Infinity; }
+
+    // DirectionCone Public Data
+    Vector3f w;
+    Float cosTheta = Infinity;
+};
+
+DirectionCone Union(const DirectionCone &a, const DirectionCone &b);
+
 template <typename T>
 T MinComponent(const Vector3<T> &v) {
     return std::min(v.x, std::min(v.y, v.z));
@@ -1474,6 +1496,39 @@ inline Float SphericalPhi(const Vector3f &v) {
     return (p < 0) ? (p + 2 * Pi) : p;
 }
 
+// Morton Code Utility Functions
+inline uint32_t LeftShift3(uint32_t x) {
+    CHECK_LE(x, (1 << 10));
+    if (x == (1 << 10)) --x;
+#ifdef PBRT_HAVE_BINARY_CONSTANTS
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    // x = ---- --98 ---- ---- ---- ---- 7654 3210
+    x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
+    x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
+    x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+#else
+    x = (x | (x << 16)) & 0x30000ff;
+    // x = ---- --98 ---- ---- ---- ---- 7654 3210
+    x = (x | (x << 8)) & 0x300f00f;
+    // x = ---- --98 ---- ---- 7654 ---- ---- 3210
+    x = (x | (x << 4)) & 0x30c30c3;
+    // x = ---- --98 ---- 76-- --54 ---- 32-- --10
+    x = (x | (x << 2)) & 0x9249249;
+    // x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+#endif // PBRT_HAVE_BINARY_CONSTANTS
+    return x;
+}
+
+inline uint32_t EncodeMorton3(const Vector3f &v) {
+    CHECK_GE(v.x, 0);
+    CHECK_GE(v.y, 0);
+    CHECK_GE(v.z, 0);
+    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+}
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_GEOMETRY_H
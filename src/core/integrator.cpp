@@ -40,12 +40,23 @@
 #include "sampler.h"
 #include "integrator.h"
 #include "progressreporter.h"
+#include "tilescheduler.h"
+#include "distributed.h"
+#include "checkpoint.h"
 #include "camera.h"
 #include "stats.h"
+#include "lightdistrib.h"
 
 namespace pbrt {
 
 STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_RATIO("Integrator/Adaptive samples per pixel", nAdaptiveSamples,
+           nAdaptivePixels);
+
+// Progressive rendering doubles the number of samples per pixel in each
+// pass up to this many, so that the image is still checked and written
+// regularly
+static const int64_t MaxPassSamples = 16;
 
 // Integrator Method Definitions
 Integrator::~Integrator() {}
@@ -84,7 +95,8 @@ Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
 
 Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                                MemoryArena &arena, Sampler &sampler,
-                               bool handleMedia, const Distribution1D *lightDistrib) {
+                               bool handleMedia,
+                               const LightDistribution *lightDistrib) {
     ProfilePhase p(Prof::DirectLighting);
     // Randomly choose a single light to sample, _light_
     int nLights = int(scene.lights.size());
@@ -92,8 +104,8 @@ Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
     int lightNum;
     Float lightPdf;
     if (lightDistrib) {
-        lightNum = lightDistrib->SampleDiscrete(sampler.Get1D(), &lightPdf);
-        if (lightPdf == 0) return Spectrum(0.f);
+        lightNum = lightDistrib->Sample(it.p, it.n, sampler.Get1D(), &lightPdf);
+        if (lightNum == -1) return Spectrum(0.f);
     } else {
         lightNum = std::min((int)(sampler.Get1D() * nLights), nLights - 1);
         lightPdf = Float(1) / nLights;
@@ -143,7 +155,7 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
                 Li *= visibility.Tr(scene, sampler);
                 VLOG(2) << "  after Tr, Li: " << Li;
             } else {
-              if (!visibility.Unoccluded(scene)) {
+              if (!visibility.Unoccluded(scene, light)) {
                 VLOG(2) << "  shadow ray blocked";
                 Li = Spectrum(0.f);
               } else
@@ -229,113 +241,298 @@ void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
     // Render image tiles in parallel
 
-    // Compute number of tiles, _nTiles_, to use for parallel rendering
-    Bounds2i sampleBounds = camera->film->GetSampleBounds();
-    Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-                   (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-    {
-        ParallelFor2D([&](Point2i tile) {
-            // Render section of image corresponding to _tile_
+    // Create _TileScheduler_ to hand out image tiles to threads
+    TileScheduler scheduler(camera->film->GetSampleBounds());
+    auto renderWork = [&](const Bounds2i &workBounds) {
+        // Render section of image corresponding to _workBounds_
 
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
+        // Get this thread's _MemoryArena_ for the work unit
+        ThreadArena arena;
 
+        // Get _FilmTile_ for work unit
+        std::unique_ptr<FilmTile> filmTile =
+            camera->film->GetFilmTile(workBounds, adaptiveMaxError > 0);
+        LOG(INFO) << "Starting image work unit " << workBounds;
+        for (Point2i tile : scheduler.Tiles(workBounds)) {
             // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
+            int seed = scheduler.TileIndex(tile);
             std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
 
-            // Compute sample bounds for tile
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
-            LOG(INFO) << "Starting image tile " << tileBounds;
+            // Render samples for the tile's pixels
+            RenderTile(scene, scheduler.TileBounds(tile), *tileSampler,
+                       *arena, filmTile.get());
+        }
+        LOG(INFO) << "Finished image work unit " << workBounds;
+        return filmTile;
+    };
+    bool distributed = PbrtOptions.coordinatorPort > 0 ||
+                       !PbrtOptions.coordinatorAddress.empty();
+    if (distributed &&
+        (PbrtOptions.timeLimit > 0 || PbrtOptions.targetNoise > 0))
+        Warning("Progressive rendering options are ignored when rendering "
+                "in distributed mode.");
+    if (distributed && CheckpointTimer::CheckpointingEnabled())
+        Warning("Checkpoints aren't supported when rendering in distributed "
+                "mode.");
+    if (!PbrtOptions.coordinatorAddress.empty()) {
+        // Render work units for a coordinator, which writes the image
+        RenderWorker(PbrtOptions.coordinatorAddress, camera->film,
+                     sampler->samplesPerPixel, renderWork);
+        return;
+    } else if (PbrtOptions.coordinatorPort > 0)
+        RenderCoordinator(PbrtOptions.coordinatorPort, scheduler.WorkUnits(),
+                          camera->film, sampler->samplesPerPixel, renderWork);
+    else if (PbrtOptions.timeLimit > 0 || PbrtOptions.targetNoise > 0)
+        RenderProgressive(scene, scheduler);
+    else {
+        InitTileCheckpoints(CheckpointDescription("sampler", camera->film,
+                                                  sampler->samplesPerPixel),
+                            camera->film, &scheduler);
+        ProgressReporter reporter(scheduler.TileCount(), "Rendering");
+        reporter.Update(scheduler.CompletedTileCount());
+        scheduler.ForEach([&](const Bounds2i &workBounds) {
+            // Merge image tile into _Film_
+            camera->film->MergeFilmTile(renderWork(workBounds));
+            reporter.Update(scheduler.Tiles(workBounds).Area());
+        });
+        reporter.Done();
+    }
+    LOG(INFO) << "Rendering finished";
+
+    // Save final image after rendering
+    camera->film->WriteImage();
+}
 
-            // Get _FilmTile_ for tile
+void SamplerIntegrator::RenderProgressive(const Scene &scene,
+                                          TileScheduler &scheduler) {
+    if (adaptiveMaxError > 0)
+        Warning("\"adaptivemaxerror\" is ignored when rendering "
+                "progressively.");
+    // Render passes over the image with growing numbers of samples per
+    // pixel until the sampler's sample count, the time limit, or the
+    // noise target is reached
+    Film *film = camera->film;
+    bool trackVariance = PbrtOptions.targetNoise > 0;
+    int64_t spp = sampler->samplesPerPixel;
+    int64_t firstSample = 0, passSamples = 1;
+    std::chrono::steady_clock::time_point startTime =
+        std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point lastWrite = startTime;
+    auto secondsSince = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<Float>(std::chrono::steady_clock::now() -
+                                            t).count();
+    };
+    auto outOfTime = [&]() {
+        return PbrtOptions.timeLimit > 0 &&
+               secondsSince(startTime) >= PbrtOptions.timeLimit;
+    };
+
+    // Resume from the last pass saved in a checkpoint, if requested
+    std::string description =
+        CheckpointDescription("progressive", film, spp);
+    std::unique_ptr<Checkpoint> resumed = ResumeCheckpoint(description);
+    if (resumed && (!resumed->Get("progressive/firstSample", &firstSample) ||
+                    !resumed->Get("progressive/passSamples", &passSamples) ||
+                    !film->LoadState(*resumed))) {
+        Error("%s: checkpoint is incomplete; starting a new render.",
+              PbrtOptions.checkpointFile.c_str());
+        film->Clear();
+        firstSample = 0;
+        passSamples = 1;
+    }
+    CheckpointTimer checkpointTimer;
+    ProgressReporter reporter(spp, "Rendering");
+    reporter.Update(firstSample);
+    while (firstSample < spp) {
+        passSamples = std::min(passSamples, spp - firstSample);
+        scheduler.ForEach([&](const Bounds2i &workBounds) {
+            // Skip the rest of the pass once time is up
+            if (outOfTime()) return;
+            ThreadArena arena;
             std::unique_ptr<FilmTile> filmTile =
-                camera->film->GetFilmTile(tileBounds);
-
-            // Loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds) {
-                {
-                    ProfilePhase pp(Prof::StartPixel);
-                    tileSampler->StartPixel(pixel);
+                film->GetFilmTile(workBounds, trackVariance);
+            for (Point2i tile : scheduler.Tiles(workBounds)) {
+                // Get sampler instance for tile. Samplers with deterministic
+                // sequences continue where the previous pass left off
+                // after _SetSampleNumber()_; the seed also depends on the
+                // pass's first sample, so that samplers that draw values
+                // from an _RNG_ don't repeat the previous passes' values.
+                int64_t seed = firstSample * scheduler.TileCount() +
+                               scheduler.TileIndex(tile);
+                std::unique_ptr<Sampler> tileSampler =
+                    sampler->Clone(int(seed));
+                for (Point2i pixel : scheduler.TileBounds(tile)) {
+                    {
+                        ProfilePhase pp(Prof::StartPixel);
+                        tileSampler->StartPixel(pixel);
+                    }
+                    if (!InsideExclusive(pixel, pixelBounds)) continue;
+                    tileSampler->SetSampleNumber(firstSample);
+                    for (int64_t i = 0; i < passSamples; ++i) {
+                        RenderSample(scene, pixel, *tileSampler, *arena,
+                                     filmTile.get());
+                        tileSampler->StartNextSample();
+                    }
                 }
+            }
+            film->MergeFilmTile(std::move(filmTile));
+        });
+        firstSample += passSamples;
+        reporter.Update(passSamples);
+
+        // Stop rendering or write the image so far, as requested
+        if (outOfTime()) break;
+        if (trackVariance && film->RelativeError() <= PbrtOptions.targetNoise)
+            break;
+        if (PbrtOptions.writeInterval > 0 &&
+            secondsSince(lastWrite) >= PbrtOptions.writeInterval) {
+            film->WriteImage();
+            lastWrite = std::chrono::steady_clock::now();
+        }
+        passSamples = std::min(2 * passSamples, MaxPassSamples);
+
+        // Save a checkpoint of the completed passes, if one is due
+        if (checkpointTimer.Due()) {
+            Checkpoint checkpoint(description);
+            checkpoint.Add("progressive/firstSample", firstSample);
+            checkpoint.Add("progressive/passSamples", passSamples);
+            film->SaveState(&checkpoint);
+            SaveCheckpoint(checkpoint);
+            checkpointTimer.Reset();
+        }
+    }
+    reporter.Done();
+    LOG(INFO) << "Progressive rendering took up to " << firstSample <<
+        " samples per pixel in " << secondsSince(startTime) << " seconds";
+}
 
-                // Do this check after the StartPixel() call; this keeps
-                // the usage of RNG values from (most) Samplers that use
-                // RNGs consistent, which improves reproducability /
-                // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
-
-                do {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
-
-                    // Issue warning if unexpected radiance value returned
-                    if (L.HasNaNs()) {
-                        LOG(ERROR) << StringPrintf(
-                            "Not-a-number radiance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (L.y() < -1e-5) {
-                        LOG(ERROR) << StringPrintf(
-                            "Negative luminance value, %f, returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            L.y(), pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (std::isinf(L.y())) {
-                          LOG(ERROR) << StringPrintf(
-                            "Infinite luminance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    }
-                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                        ray << " -> L = " << L;
+void SamplerIntegrator::RenderTile(const Scene &scene,
+                                   const Bounds2i &tileBounds,
+                                   Sampler &tileSampler, MemoryArena &arena,
+                                   FilmTile *filmTile) {
+    if (adaptiveMaxError > 0) {
+        RenderTileAdaptive(scene, tileBounds, tileSampler, arena, filmTile);
+        return;
+    }
+    // Loop over pixels in tile to render them
+    for (Point2i pixel : tileBounds) {
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            tileSampler.StartPixel(pixel);
+        }
+
+        // Do this check after the StartPixel() call; this keeps
+        // the usage of RNG values from (most) Samplers that use
+        // RNGs consistent, which improves reproducability /
+        // debugging.
+        if (!InsideExclusive(pixel, pixelBounds))
+            continue;
 
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+        do {
+            RenderSample(scene, pixel, tileSampler, arena, filmTile);
+        } while (tileSampler.StartNextSample());
+    }
+}
 
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
+void SamplerIntegrator::RenderTileAdaptive(const Scene &scene,
+                                           const Bounds2i &tileBounds,
+                                           Sampler &tileSampler,
+                                           MemoryArena &arena,
+                                           FilmTile *filmTile) {
+    // Take _adaptiveMinSamples_ samples in each pixel, then keep doubling
+    // the sample counts of pixels whose relative error is still too high,
+    // up to the sampler's sample count. Each pixel's rounds continue the
+    // one sample sequence that _StartPixel()_ prepares for the sampler's
+    // full sample count, so that samplers that stratify a pixel's samples
+    // still do so across rounds.
+    int64_t spp = tileSampler.samplesPerPixel;
+    for (Point2i pixel : tileBounds) {
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            tileSampler.StartPixel(pixel);
+        }
+        if (!InsideExclusive(pixel, pixelBounds)) continue;
+
+        int64_t n = 0;
+        while (n < spp) {
+            if (n > 0) {
+                // Stop sampling _pixel_ if its relative error is low enough;
+                // pixels outside the film's crop window only take the
+                // minimum number of samples
+                const VarianceEstimator *v = filmTile->GetVariance(pixel);
+                if (!v || v->RelativeError() <= adaptiveMaxError) break;
             }
-            LOG(INFO) << "Finished image tile " << tileBounds;
 
-            // Merge image tile into _Film_
-            camera->film->MergeFilmTile(std::move(filmTile));
-            reporter.Update();
-        }, nTiles);
-        reporter.Done();
+            // Take the next round of samples in _pixel_
+            int64_t count =
+                std::min(n == 0 ? (int64_t)adaptiveMinSamples : n, spp - n);
+            for (int64_t i = 0; i < count; ++i) {
+                RenderSample(scene, pixel, tileSampler, arena, filmTile);
+                tileSampler.StartNextSample();
+            }
+            n += count;
+            nAdaptiveSamples += count;
+        }
+        ++nAdaptivePixels;
     }
-    LOG(INFO) << "Rendering finished";
+}
 
-    // Save final image after rendering
-    camera->film->WriteImage();
+void SamplerIntegrator::RenderSample(const Scene &scene, const Point2i &pixel,
+                                     Sampler &tileSampler, MemoryArena &arena,
+                                     FilmTile *filmTile) {
+    // Initialize _CameraSample_ for current sample
+    CameraSample cameraSample = tileSampler.GetCameraSample(pixel);
+
+    // Generate camera ray for current sample
+    RayDifferential ray;
+    Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+    ray.ScaleDifferentials(1 / std::sqrt((Float)tileSampler.samplesPerPixel));
+    ++nCameraRays;
+
+    // Evaluate radiance along camera ray
+    Spectrum L(0.f);
+    if (rayWeight > 0) L = Li(ray, scene, tileSampler, arena);
+    L = CheckRadiance(L, pixel, tileSampler.CurrentSampleNumber());
+    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " << ray
+            << " -> L = " << L;
+
+    // Add camera ray's contribution to image
+    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+    // Free _MemoryArena_ memory from computing image sample value
+    arena.Reset();
+}
+
+void SamplerIntegrator::SetAdaptiveSampling(Float maxError, int minSamples) {
+    adaptiveMaxError = maxError;
+    // At least two samples are needed to estimate a pixel's variance
+    adaptiveMinSamples = std::max(2, minSamples);
+}
+
+Spectrum SamplerIntegrator::CheckRadiance(const Spectrum &L,
+                                          const Point2i &pixel,
+                                          int64_t sampleNum) const {
+    // Issue warning if unexpected radiance value returned
+    if (L.HasNaNs()) {
+        LOG(ERROR) << StringPrintf(
+            "Not-a-number radiance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampleNum);
+        return Spectrum(0.f);
+    } else if (L.y() < -1e-5) {
+        LOG(ERROR) << StringPrintf(
+            "Negative luminance value, %f, returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            L.y(), pixel.x, pixel.y, (int)sampleNum);
+        return Spectrum(0.f);
+    } else if (std::isinf(L.y())) {
+          LOG(ERROR) << StringPrintf(
+            "Infinite luminance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampleNum);
+        return Spectrum(0.f);
+    }
+    return L;
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(
@@ -64,7 +64,7 @@ Spectrum UniformSampleAllLights(const Interaction &it, const Scene &scene,
 Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                                MemoryArena &arena, Sampler &sampler,
                                bool handleMedia = false,
-                               const Distribution1D *lightDistrib = nullptr);
+                               const LightDistribution *lightDistrib = nullptr);
 Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
                         const Light &light, const Point2f &uLight,
                         const Scene &scene, Sampler &sampler,
@@ -80,9 +80,10 @@ class SamplerIntegrator : public Integrator {
     SamplerIntegrator(std::shared_ptr<const Camera> camera,
                       std::shared_ptr<Sampler> sampler,
                       const Bounds2i &pixelBounds)
-        : camera(camera), sampler(sampler), pixelBounds(pixelBounds) {}
+        : camera(camera), pixelBounds(pixelBounds), sampler(sampler) {}
     virtual void Preprocess(const Scene &scene, Sampler &sampler) {}
     void Render(const Scene &scene);
+    void SetAdaptiveSampling(Float maxError, int minSamples);
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
@@ -96,13 +97,31 @@ class SamplerIntegrator : public Integrator {
                               MemoryArena &arena, int depth) const;
 
   protected:
+    // SamplerIntegrator Protected Methods
+    virtual void RenderTile(const Scene &scene, const Bounds2i &tileBounds,
+                            Sampler &tileSampler, MemoryArena &arena,
+                            FilmTile *filmTile);
+    void RenderProgressive(const Scene &scene, TileScheduler &scheduler);
+    void RenderTileAdaptive(const Scene &scene, const Bounds2i &tileBounds,
+                            Sampler &tileSampler, MemoryArena &arena,
+                            FilmTile *filmTile);
+    void RenderSample(const Scene &scene, const Point2i &pixel,
+                      Sampler &tileSampler, MemoryArena &arena,
+                      FilmTile *filmTile);
+    Spectrum CheckRadiance(const Spectrum &L, const Point2i &pixel,
+                           int64_t sampleNum) const;
+
     // SamplerIntegrator Protected Data
     std::shared_ptr<const Camera> camera;
+    const Bounds2i pixelBounds;
+    // With adaptive sampling, pixels stop taking samples once the
+    // estimated relative error of their value is below _adaptiveMaxError_
+    Float adaptiveMaxError = 0;
+    int adaptiveMinSamples = 16;
 
   private:
     // SamplerIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
-    const Bounds2i pixelBounds;
 };
 
 }  // namespace pbrt
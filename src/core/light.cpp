@@ -56,10 +56,87 @@ Light::Light(int flags, const Transform &LightToWorld,
 
 Light::~Light() {}
 
+// LightBounds Method Definitions
+Float LightBounds::Importance(const Point3f &p, const Normal3f &n) const {
+    // Compute the clamped squared distance to the center of the bounds
+    Point3f pc = (bounds.pMin + bounds.pMax) / 2;
+    Float d2 = DistanceSquared(p, pc);
+    d2 = std::max(d2, bounds.Diagonal().Length() / 2);
+
+    // Points within the bounds' bounding sphere may be lit from anywhere
+    Point3f center;
+    Float radius;
+    bounds.BoundingSphere(&center, &radius);
+    Float dc2 = DistanceSquared(p, center);
+    if (dc2 < radius * radius) return phi / d2;
+    Float sinThetaB2 = radius * radius / dc2;
+    Float cosThetaB = std::sqrt(std::max((Float)0, 1 - sinThetaB2));
+    Float sinThetaB = std::sqrt(sinThetaB2);
+
+    // Cosine and sine of the difference of two angles, clamped to zero
+    auto cosSubClamped = [](Float sinA, Float cosA, Float sinB, Float cosB) {
+        return cosA > cosB ? (Float)1 : cosA * cosB + sinA * sinB;
+    };
+    auto sinSubClamped = [](Float sinA, Float cosA, Float sinB, Float cosB) {
+        return cosA > cosB ? (Float)0 : sinA * cosB - cosA * sinB;
+    };
+
+    // Find the smallest angle _thetaP_ between an emission direction and
+    // the direction from the lights to _p_; there's no light beyond
+    // _thetaE_
+    Vector3f wi = Normalize(p - pc);
+    Float cosThetaW = Dot(w, wi);
+    if (twoSided) cosThetaW = std::abs(cosThetaW);
+    Float sinThetaW = std::sqrt(std::max((Float)0, 1 - cosThetaW * cosThetaW));
+    Float sinThetaO = std::sqrt(std::max((Float)0, 1 - cosThetaO * cosThetaO));
+    Float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    Float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    Float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP < cosThetaE) return 0;
+    Float importance = phi * cosThetaP / d2;
+
+    // Account for the smallest possible angle of incidence at surfaces
+    if (n != Normal3f(0, 0, 0)) {
+        Float cosThetaI = AbsDot(wi, n);
+        Float sinThetaI =
+            std::sqrt(std::max((Float)0, 1 - cosThetaI * cosThetaI));
+        importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+    return std::max(importance, (Float)0);
+}
+
+LightBounds Union(const LightBounds &a, const LightBounds &b) {
+    if (a.phi == 0) return b;
+    if (b.phi == 0) return a;
+    DirectionCone cone = Union(DirectionCone(a.w, a.cosThetaO),
+                               DirectionCone(b.w, b.cosThetaO));
+    return LightBounds(Union(a.bounds, b.bounds), a.phi + b.phi, cone,
+                       std::min(a.cosThetaE, b.cosThetaE),
+                       a.twoSided || b.twoSided);
+}
+
 bool VisibilityTester::Unoccluded(const Scene &scene) const {
     return !scene.IntersectP(p0.SpawnRayTo(p1));
 }
 
+bool VisibilityTester::Unoccluded(const Scene &scene,
+                                  const Light &light) const {
+    // Find this thread's occluder cache for _light_; lights that map to the
+    // same entry just replace each other's cached occluder
+    struct LightOccluder {
+        const Light *light = nullptr;
+        OccluderCache cache;
+    };
+    static thread_local LightOccluder lightOccluders[64];
+    uint64_t hash = uint64_t(uintptr_t(&light)) * 0x9e3779b97f4a7c15ull;
+    LightOccluder &entry = lightOccluders[hash >> 58];
+    if (entry.light != &light) {
+        entry.light = &light;
+        entry.cache = OccluderCache();
+    }
+    return !scene.IntersectP(p0.SpawnRayTo(p1), &entry.cache);
+}
+
 Spectrum VisibilityTester::Tr(const Scene &scene, Sampler &sampler) const {
     Ray ray(p0.SpawnRayTo(p1));
     Spectrum Tr(1.f);
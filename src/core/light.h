@@ -58,6 +58,36 @@ inline bool IsDeltaLight(int flags) {
            flags & (int)LightFlags::DeltaDirection;
 }
 
+// LightBounds Declarations
+// LightBounds bounds the emission of one or more lights: their positions,
+// total power _phi_, and the directions they emit in, which are within
+// _thetaE_ of some direction in the cone of axis _w_ and spread _thetaO_
+// (stored as cosines). _twoSided_ lights emit around both _w_ and _-w_.
+struct LightBounds {
+    // LightBounds Public Methods
+    LightBounds() = default;
+    LightBounds(const Bounds3f &bounds, Float phi, const DirectionCone &cone,
+                Float cosThetaE, bool twoSided)
+        : bounds(bounds),
+          phi(phi),
+          w(cone.w),
+          cosThetaO(cone.cosTheta),
+          cosThetaE(cosThetaE),
+          twoSided(twoSided) {}
+    // Returns an estimate of how much the lights could illuminate the
+    // point _p_ on a surface with normal _n_, or in a medium if _n_ is zero.
+    Float Importance(const Point3f &p, const Normal3f &n) const;
+
+    // LightBounds Public Data
+    Bounds3f bounds;
+    Float phi = 0;
+    Vector3f w;
+    Float cosThetaO = 1, cosThetaE = 1;
+    bool twoSided = false;
+};
+
+LightBounds Union(const LightBounds &a, const LightBounds &b);
+
 // Light Declarations
 class Light {
   public:
@@ -77,6 +107,10 @@ class Light {
                                Float *pdfDir) const = 0;
     virtual void Pdf_Le(const Ray &ray, const Normal3f &nLight, Float *pdfPos,
                         Float *pdfDir) const = 0;
+    // Initializes _*bounds_ and returns true for lights at a finite
+    // distance, which the light BVH can bound; distant and infinite lights
+    // return false.
+    virtual bool Bounds(LightBounds *bounds) const { return false; }
 
     // Light Public Data
     const int flags;
@@ -97,6 +131,9 @@ class VisibilityTester {
     const Interaction &P0() const { return p0; }
     const Interaction &P1() const { return p1; }
     bool Unoccluded(const Scene &scene) const;
+    // Shadow test for a ray to _light_ that first tries the occluder most
+    // recently found by this thread for the same light.
+    bool Unoccluded(const Scene &scene, const Light &light) const;
     Spectrum Tr(const Scene &scene, Sampler &sampler) const;
 
   private:
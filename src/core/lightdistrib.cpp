@@ -39,12 +39,39 @@
 #include "scene.h"
 #include "stats.h"
 #include "integrator.h"
+#include <limits>
 #include <numeric>
 
 namespace pbrt {
 
 LightDistribution::~LightDistribution() {}
 
+int LightDistribution::Sample(const Point3f &p, const Normal3f &n, Float u,
+                              Float *pmf) const {
+    const Distribution1D *distrib = Lookup(p);
+    if (!distrib || distrib->Count() == 0) {
+        *pmf = 0;
+        return -1;
+    }
+    int lightIndex = distrib->SampleDiscrete(u, pmf);
+    return *pmf > 0 ? lightIndex : -1;
+}
+
+Float LightDistribution::Pmf(const Point3f &p, const Normal3f &n,
+                             int lightIndex) const {
+    const Distribution1D *distrib = Lookup(p);
+    return distrib ? distrib->DiscretePDF(lightIndex) : 0;
+}
+
+// Memory available for cached SpatialLightDistribution voxel
+// distributions; an eighth of the --memorybudget, if one was given.
+static size_t SpatialCacheBytes() {
+    size_t bytes = 64 * 1024 * 1024;
+    if (PbrtOptions.memoryBudget > 0)
+        bytes = std::min<size_t>(bytes, PbrtOptions.memoryBudget / 8);
+    return bytes;
+}
+
 std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
     const std::string &name, const Scene &scene) {
     if (name == "uniform" || scene.lights.size() == 1)
@@ -55,19 +82,23 @@ std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
             new PowerLightDistribution(scene)};
     else if (name == "spatial")
         return std::unique_ptr<LightDistribution>{
-            new SpatialLightDistribution(scene)};
+            new SpatialLightDistribution(scene, 64, SpatialCacheBytes())};
+    else if (name == "bvh")
+        return std::unique_ptr<LightDistribution>{
+            new LightBVHLightDistribution(scene)};
     else {
         Error(
             "Light sample distribution type \"%s\" unknown. Using \"spatial\".",
             name.c_str());
         return std::unique_ptr<LightDistribution>{
-            new SpatialLightDistribution(scene)};
+            new SpatialLightDistribution(scene, 64, SpatialCacheBytes())};
     }
 }
 
 UniformLightDistribution::UniformLightDistribution(const Scene &scene) {
     std::vector<Float> prob(scene.lights.size(), Float(1));
     distrib.reset(new Distribution1D(&prob[0], int(prob.size())));
+    trackedMemory.Add(distrib->BytesUsed());
 }
 
 const Distribution1D *UniformLightDistribution::Lookup(const Point3f &p) const {
@@ -75,7 +106,9 @@ const Distribution1D *UniformLightDistribution::Lookup(const Point3f &p) const {
 }
 
 PowerLightDistribution::PowerLightDistribution(const Scene &scene)
-    : distrib(ComputeLightPowerDistribution(scene)) {}
+    : distrib(ComputeLightPowerDistribution(scene)) {
+    if (distrib) trackedMemory.Add(distrib->BytesUsed());
+}
 
 const Distribution1D *PowerLightDistribution::Lookup(const Point3f &p) const {
     return distrib.get();
@@ -85,218 +118,653 @@ const Distribution1D *PowerLightDistribution::Lookup(const Point3f &p) const {
 // SpatialLightDistribution
 
 STAT_COUNTER("SpatialLightDistribution/Distributions created", nCreated);
+STAT_COUNTER("SpatialLightDistribution/Distributions evicted", nEvicted);
+STAT_COUNTER("SpatialLightDistribution/Distributions not cached", nUncached);
 STAT_RATIO("SpatialLightDistribution/Lookups per distribution", nLookups, nDistributions);
+STAT_PERCENT("SpatialLightDistribution/Lookups using a coarser distribution",
+             nCoarserLookups, nLevelLookups);
 STAT_INT_DISTRIBUTION("SpatialLightDistribution/Hash probes per lookup", nProbesPerLookup);
+STAT_INT_DISTRIBUTION("SpatialLightDistribution/Voxel level per lookup", nLevelPerLookup);
+
+// Each voxel's distribution is estimated from _nVoxelSamples_ points; threads
+// that find a voxel's distribution under construction claim batches of
+// _voxelSampleBatch_ points and help compute it.
+static PBRT_CONSTEXPR int nVoxelSamples = 128;
+static PBRT_CONSTEXPR int voxelSampleBatch = 16;
+// Voxels are refined after this many lookups.
+static PBRT_CONSTEXPR int refineLookups = 1024;
+// Number of consecutive hash table entries that a voxel may occupy.
+static PBRT_CONSTEXPR int hashProbeWindow = 16;
+
+struct SpatialLightDistribution::VoxelDistribution {
+    VoxelDistribution(uint64_t key, const Bounds3f &bounds, int nLights)
+        : key(key), bounds(bounds), contrib(new AtomicFloat[nLights]) {}
+    ~VoxelDistribution() { delete distrib.load(); }
+    size_t BytesUsed(size_t nLights) const {
+        size_t bytes = sizeof(*this);
+        if (contrib) bytes += nLights * sizeof(AtomicFloat);
+        Distribution1D *d = distrib.load();
+        if (d) bytes += d->BytesUsed();
+        return bytes;
+    }
 
-// Voxel coordinates are packed into a uint64_t for hash table lookups;
-// 10 bits are allocated to each coordinate.  invalidPackedPos is an impossible
-// packed coordinate value, which we use to represent
-static const uint64_t invalidPackedPos = 0xffffffffffffffff;
+    // VoxelDistribution Public Data
+    const uint64_t key;
+    const Bounds3f bounds;
+    std::atomic<int> nextSample{0}, samplesDone{0};
+    std::unique_ptr<AtomicFloat[]> contrib;
+    std::atomic<Distribution1D *> distrib{nullptr};
+    std::atomic<int> nLookups{0};
+    std::atomic<bool> refined{false};
+    // Memory used by the voxel once its distribution has been published;
+    // set before _distrib_ is stored
+    int64_t bytes = 0;
+};
+
+// Each thread's epochs for the spatial light distributions it has looked
+// up, keyed by their ids. A thread's epochs are cleared when it exits so
+// that it no longer holds back reclamation.
+struct ThreadEpochs {
+    ~ThreadEpochs() {
+        for (auto &e : epochs) e.second->store(0);
+    }
+    std::vector<std::pair<uint64_t, std::shared_ptr<std::atomic<uint64_t>>>>
+        epochs;
+};
+static thread_local ThreadEpochs threadLocalEpochs;
+static std::atomic<uint64_t> nextDistributionId{1};
 
 SpatialLightDistribution::SpatialLightDistribution(const Scene &scene,
-                                                   int maxVoxels)
-    : scene(scene) {
-    // Compute the number of voxels so that the widest scene bounding box
-    // dimension has maxVoxels voxels and the other dimensions have a number
+                                                   int maxVoxels,
+                                                   size_t maxBytes)
+    : scene(scene),
+      fallbackDistrib(ComputeLightPowerDistribution(scene)),
+      id(nextDistributionId++) {
+    // Compute the number of voxels at each level so that the widest scene
+    // bounding box dimension has maxVoxels voxels at the finest level, half
+    // as many at each coarser level, and the other dimensions have a number
     // of voxels so that voxels are roughly cube shaped.
     Bounds3f b = scene.WorldBound();
     Vector3f diag = b.Diagonal();
     Float bmax = diag[b.MaximumExtent()];
-    for (int i = 0; i < 3; ++i) {
-        nVoxels[i] = std::max(1, int(std::round(diag[i] / bmax * maxVoxels)));
-        // In the Lookup() method, we require that 20 or fewer bits be
-        // sufficient to represent each coordinate value. It's fairly hard
-        // to imagine that this would ever be a problem.
-        CHECK_LT(nVoxels[i], 1 << 20);
+    nLevels = 1 + (maxVoxels >= 8 ? Log2Int(maxVoxels / 4) : 0);
+    // The level is stored in 4 bits of the voxel keys.
+    CHECK_LT(nLevels, 16);
+    int64_t totalVoxels = 0;
+    for (int level = 0; level < nLevels; ++level) {
+        int res = std::max(1, maxVoxels >> (nLevels - 1 - level));
+        Point3i nv;
+        for (int i = 0; i < 3; ++i) {
+            nv[i] = std::max(1, int(std::round(diag[i] / bmax * res)));
+            // In the Lookup() method, we require that 20 or fewer bits be
+            // sufficient to represent each coordinate value. It's fairly
+            // hard to imagine that this would ever be a problem.
+            CHECK_LT(nv[i], 1 << 20);
+        }
+        nVoxels.push_back(nv);
+        totalVoxels += int64_t(nv[0]) * nv[1] * nv[2];
     }
 
-    hashTableSize = 4 * nVoxels[0] * nVoxels[1] * nVoxels[2];
+    // Size the hash table so that it holds no more distributions than fit
+    // in _maxBytes_, and no more than twice the total number of voxels.
+    size_t nLights = scene.lights.size();
+    size_t voxelBytes = sizeof(VoxelDistribution) + sizeof(Distribution1D) +
+                        (2 * nLights + 1) * sizeof(Float) + sizeof(HashEntry);
+    int64_t maxEntries = std::max<int64_t>(hashProbeWindow, maxBytes / voxelBytes);
+    hashTableSize = std::min(RoundUpPow2(2 * totalVoxels),
+                             int64_t(1) << Log2Int(maxEntries));
+    hashTableSize = std::max<size_t>(hashTableSize, hashProbeWindow);
+    trackedMemory.Add(hashTableSize * sizeof(HashEntry));
     hashTable.reset(new HashEntry[hashTableSize]);
-    for (int i = 0; i < hashTableSize; ++i) {
-        hashTable[i].packedPos.store(invalidPackedPos);
-        hashTable[i].distribution.store(nullptr);
+    for (size_t i = 0; i < hashTableSize; ++i) {
+        hashTable[i].voxel.store(nullptr);
+        hashTable[i].lastUsed.store(0);
     }
 
+    // Evicted voxels that haven't been freed yet may use whatever the hash
+    // table's voxels leave of _maxBytes_, but at least a quarter of it.
+    int64_t tableBytes = hashTableSize * voxelBytes;
+    maxRetiredBytes =
+        std::max<int64_t>(int64_t(maxBytes) - tableBytes, maxBytes / 4);
+
     LOG(INFO) << "SpatialLightDistribution: scene bounds " << b <<
-        ", voxel res (" << nVoxels[0] << ", " << nVoxels[1] << ", " <<
-        nVoxels[2] << ")";
+        ", finest voxel res (" << nVoxels.back()[0] << ", " <<
+        nVoxels.back()[1] << ", " << nVoxels.back()[2] << "), " << nLevels <<
+        " levels, " << hashTableSize << " hash table entries";
 }
 
 SpatialLightDistribution::~SpatialLightDistribution() {
-    // Gather statistics about how well the computed distributions are across
-    // the buckets.
     for (size_t i = 0; i < hashTableSize; ++i) {
-        HashEntry &entry = hashTable[i];
-        if (entry.distribution.load())
-            delete entry.distribution.load();
+        VoxelDistribution *voxel = hashTable[i].voxel.load();
+        if (voxel) {
+            trackedMemory.Add(-int64_t(voxel->BytesUsed(scene.lights.size())));
+            delete voxel;
+        }
     }
+    Reclaim(true);
+}
+
+std::atomic<uint64_t> &SpatialLightDistribution::ThreadEpoch() const {
+    for (const auto &e : threadLocalEpochs.epochs)
+        if (e.first == id) return *e.second;
+
+    // This is the thread's first lookup; register an epoch for it.
+    std::shared_ptr<std::atomic<uint64_t>> threadEpoch =
+        std::make_shared<std::atomic<uint64_t>>(0);
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    threadEpoch->store(epoch.load());
+    threadEpochs.push_back(threadEpoch);
+    threadLocalEpochs.epochs.push_back(std::make_pair(id, threadEpoch));
+    return *threadEpoch;
 }
 
 const Distribution1D *SpatialLightDistribution::Lookup(const Point3f &p) const {
     ProfilePhase _(Prof::LightDistribLookup);
     ++nLookups;
 
+    // Announce that this thread is done with the distributions returned by
+    // its earlier lookups, and advance the clock used for LRU eviction
+    ThreadEpoch().store(epoch.load());
+    static PBRT_THREAD_LOCAL uint32_t nThreadLookups = 0;
+    if ((++nThreadLookups & 1023) == 0)
+        clock.fetch_add(1, std::memory_order_relaxed);
+
+    // Descend the voxel levels until reaching a voxel that hasn't been
+    // refined, starting from the power distribution in case no voxel
+    // distribution is available yet
+    const Distribution1D *distrib = fallbackDistrib.get();
+    int level;
+    for (level = 0; level < nLevels; ++level) {
+        ++nLevelLookups;
+        VoxelDistribution *voxel = FindOrCreateVoxel(level, p);
+        if (!voxel) {
+            ++nCoarserLookups;
+            break;
+        }
+        Distribution1D *voxelDistrib =
+            voxel->distrib.load(std::memory_order_acquire);
+        if (!voxelDistrib) {
+            // Help compute the voxel's distribution. If other threads are
+            // still working on their share of it, use the coarser
+            // distribution for now rather than waiting for them.
+            ComputeSamples(voxel);
+            voxelDistrib = voxel->distrib.load(std::memory_order_acquire);
+            if (!voxelDistrib) {
+                ++nCoarserLookups;
+                break;
+            }
+        }
+        distrib = voxelDistrib;
+
+        // Refine voxels that are looked up frequently
+        if (level + 1 == nLevels) break;
+        if (!voxel->refined.load(std::memory_order_relaxed)) {
+            if (voxel->nLookups.fetch_add(1, std::memory_order_relaxed) <
+                refineLookups)
+                break;
+            voxel->refined.store(true, std::memory_order_relaxed);
+        }
+    }
+    ReportValue(nLevelPerLookup, level);
+    return distrib;
+}
+
+SpatialLightDistribution::VoxelDistribution *
+SpatialLightDistribution::FindOrCreateVoxel(int level, const Point3f &p) const {
     // First, compute integer voxel coordinates for the given point |p|
-    // with respect to the overall voxel grid.
+    // with respect to the voxel grid at |level|.
+    const Point3i &nv = nVoxels[level];
     Vector3f offset = scene.WorldBound().Offset(p);  // offset in [0,1].
     Point3i pi;
     for (int i = 0; i < 3; ++i)
         // The clamp should almost never be necessary, but is there to be
         // robust to computed intersection points being slightly outside
         // the scene bounds due to floating-point roundoff error.
-        pi[i] = Clamp(int(offset[i] * nVoxels[i]), 0, nVoxels[i] - 1);
-
-    // Pack the 3D integer voxel coordinates into a single 64-bit value.
-    uint64_t packedPos = (uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2];
-    CHECK_NE(packedPos, invalidPackedPos);
-
-    // Compute a hash value from the packed voxel coordinates.  We could
-    // just take packedPos mod the hash table size, but since packedPos
-    // isn't necessarily well distributed on its own, it's worthwhile to do
-    // a little work to make sure that its bits values are individually
-    // fairly random. For details of and motivation for the following, see:
+        pi[i] = Clamp(int(offset[i] * nv[i]), 0, nv[i] - 1);
+
+    // Pack the level and the 3D integer voxel coordinates into a single
+    // 64-bit key.
+    uint64_t key = (uint64_t(level) << 60) | (uint64_t(pi[0]) << 40) |
+                   (uint64_t(pi[1]) << 20) | pi[2];
+
+    // Compute a hash value from the key.  We could just take the key mod
+    // the hash table size, but since it isn't necessarily well distributed
+    // on its own, it's worthwhile to do a little work to make sure that its
+    // bits values are individually fairly random. For details of and
+    // motivation for the following, see:
     // http://zimbry.blogspot.ch/2011/09/better-bit-mixing-improving-on.html
-    uint64_t hash = packedPos;
+    uint64_t hash = key;
     hash ^= (hash >> 31);
     hash *= 0x7fb5d329728ea185;
     hash ^= (hash >> 27);
     hash *= 0x81dadef4bc2dd44d;
     hash ^= (hash >> 33);
-    hash %= hashTableSize;
-    CHECK_GE(hash, 0);
-
-    // Now, see if the hash table already has an entry for the voxel. We'll
-    // use quadratic probing when the hash table entry is already used for
-    // another value; step stores the square root of the probe step.
-    int step = 1;
-    int nProbes = 0;
+
+    // A voxel may be stored in any of the _hashProbeWindow_ entries
+    // following its hash value. Entries are never emptied once used, only
+    // replaced, so an empty entry ends the search.
+    uint32_t now = clock.load(std::memory_order_relaxed);
+    VoxelDistribution *newVoxel = nullptr;
     while (true) {
-        ++nProbes;
-        HashEntry &entry = hashTable[hash];
-        // Does the hash table entry at offset |hash| match the current point?
-        uint64_t entryPackedPos = entry.packedPos.load(std::memory_order_acquire);
-        if (entryPackedPos == packedPos) {
-            // Yes! Most of the time, there should already by a light
-            // sampling distribution available.
-            Distribution1D *dist = entry.distribution.load(std::memory_order_acquire);
-            if (dist == nullptr) {
-                // Rarely, another thread will have already done a lookup
-                // at this point, found that there isn't a sampling
-                // distribution, and will already be computing the
-                // distribution for the point.  In this case, we spin until
-                // the sampling distribution is ready.  We assume that this
-                // is a rare case, so don't do anything more sophisticated
-                // than spinning.
-                ProfilePhase _(Prof::LightDistribSpinWait);
-                while ((dist = entry.distribution.load(std::memory_order_acquire)) ==
-                       nullptr)
-                    // spin :-(. If we were fancy, we'd have any threads
-                    // that hit this instead help out with computing the
-                    // distribution for the voxel...
-                    ;
+        HashEntry *victim = nullptr;
+        VoxelDistribution *victimVoxel = nullptr;
+        uint32_t victimAge = 0;
+        for (int i = 0; i < hashProbeWindow; ++i) {
+            HashEntry &entry = hashTable[(hash + i) & (hashTableSize - 1)];
+            // (This load and the store to _threadEpochs_ in Lookup() must
+            // not be reordered, so both are sequentially consistent.)
+            VoxelDistribution *voxel = entry.voxel.load();
+            if (!voxel) {
+                victim = &entry;
+                victimVoxel = nullptr;
+                break;
             }
-            // We have a valid sampling distribution.
-            ReportValue(nProbesPerLookup, nProbes);
-            return dist;
-        } else if (entryPackedPos != invalidPackedPos) {
-            // The hash table entry we're checking has already been
-            // allocated for another voxel. Advance to the next entry with
-            // quadratic probing.
-            hash += step * step;
-            if (hash >= hashTableSize)
-                hash %= hashTableSize;
-            ++step;
-        } else {
-            // We have found an invalid entry. (Though this may have
-            // changed since the load into entryPackedPos above.)  Use an
-            // atomic compare/exchange to try to claim this entry for the
-            // current position.
-            uint64_t invalid = invalidPackedPos;
-            if (entry.packedPos.compare_exchange_weak(invalid, packedPos)) {
-                // Success; we've claimed this position for this voxel's
-                // distribution. Now compute the sampling distribution and
-                // add it to the hash table. As long as packedPos has been
-                // set but the entry's distribution pointer is nullptr, any
-                // other threads looking up the distribution for this voxel
-                // will spin wait until the distribution pointer is
-                // written.
-                Distribution1D *dist = ComputeDistribution(pi);
-                entry.distribution.store(dist, std::memory_order_release);
-                ReportValue(nProbesPerLookup, nProbes);
-                return dist;
+            uint32_t lastUsed = entry.lastUsed.load(std::memory_order_relaxed);
+            if (voxel->key == key) {
+                // Found it; this is by far the most common case.
+                if (lastUsed != now)
+                    entry.lastUsed.store(now, std::memory_order_relaxed);
+                ReportValue(nProbesPerLookup, i + 1);
+                if (newVoxel) {
+                    trackedMemory.Add(
+                        -int64_t(newVoxel->BytesUsed(scene.lights.size())));
+                    delete newVoxel;
+                }
+                return voxel;
+            }
+            // Otherwise remember the least recently used entry. Voxels whose
+            // distribution is still being computed aren't evicted, since
+            // the threads computing it are using them.
+            if (!voxel->distrib.load(std::memory_order_acquire)) continue;
+            if (!victim || now - lastUsed > victimAge) {
+                victim = &entry;
+                victimVoxel = voxel;
+                victimAge = now - lastUsed;
+            }
+        }
+
+        // Don't cache the voxel if no entry can be evicted for it, or if
+        // evicting one would exceed the memory bound because too many
+        // evicted voxels are still in use.
+        if (!victim ||
+            (victimVoxel && !newVoxel &&
+             retiredBytes.load(std::memory_order_relaxed) > maxRetiredBytes &&
+             !Reclaim(false))) {
+            if (newVoxel) {
+                trackedMemory.Add(
+                    -int64_t(newVoxel->BytesUsed(scene.lights.size())));
+                delete newVoxel;
+            }
+            ++nUncached;
+            return nullptr;
+        }
+
+        // The voxel isn't in the table; use an atomic compare/exchange to
+        // try to claim the empty or least recently used entry for it.
+        if (!newVoxel) {
+            Point3f p0(Float(pi[0]) / Float(nv[0]), Float(pi[1]) / Float(nv[1]),
+                       Float(pi[2]) / Float(nv[2]));
+            Point3f p1(Float(pi[0] + 1) / Float(nv[0]),
+                       Float(pi[1] + 1) / Float(nv[1]),
+                       Float(pi[2] + 1) / Float(nv[2]));
+            Bounds3f voxelBounds(scene.WorldBound().Lerp(p0),
+                                 scene.WorldBound().Lerp(p1));
+            newVoxel = new VoxelDistribution(key, voxelBounds,
+                                             int(scene.lights.size()));
+            trackedMemory.Add(newVoxel->BytesUsed(scene.lights.size()));
+        }
+        if (victim->voxel.compare_exchange_strong(victimVoxel, newVoxel)) {
+            victim->lastUsed.store(now, std::memory_order_relaxed);
+            ++nCreated;
+            ReportValue(nProbesPerLookup, hashProbeWindow);
+            if (victimVoxel) {
+                ++nEvicted;
+                Retire(victimVoxel);
             }
+            return newVoxel;
         }
+        // Another thread changed the entry; look again.
     }
 }
 
-Distribution1D *
-SpatialLightDistribution::ComputeDistribution(Point3i pi) const {
+void SpatialLightDistribution::ComputeSamples(VoxelDistribution *voxel) const {
     ProfilePhase _(Prof::LightDistribCreation);
-    ++nCreated;
-    ++nDistributions;
-
-    // Compute the world-space bounding box of the voxel corresponding to
-    // |pi|.
-    Point3f p0(Float(pi[0]) / Float(nVoxels[0]),
-               Float(pi[1]) / Float(nVoxels[1]),
-               Float(pi[2]) / Float(nVoxels[2]));
-    Point3f p1(Float(pi[0] + 1) / Float(nVoxels[0]),
-               Float(pi[1] + 1) / Float(nVoxels[1]),
-               Float(pi[2] + 1) / Float(nVoxels[2]));
-    Bounds3f voxelBounds(scene.WorldBound().Lerp(p0),
-                         scene.WorldBound().Lerp(p1));
-
     // Compute the sampling distribution. Sample a number of points inside
-    // voxelBounds using a 3D Halton sequence; at each one, sample each
-    // light source and compute a weight based on Li/pdf for the light's
-    // sample (ignoring visibility between the point in the voxel and the
-    // point on the light source) as an approximation to how much the light
-    // is likely to contribute to illumination in the voxel.
-    int nSamples = 128;
+    // the voxel's bounds using a 3D Halton sequence; at each one, sample
+    // each light source and compute a weight based on Li/pdf for the
+    // light's sample (ignoring visibility between the point in the voxel
+    // and the point on the light source) as an approximation to how much
+    // the light is likely to contribute to illumination in the voxel.
+    // Threads claim batches of points until all have been taken.
     std::vector<Float> lightContrib(scene.lights.size(), Float(0));
-    for (int i = 0; i < nSamples; ++i) {
-        Point3f po = voxelBounds.Lerp(Point3f(
-            RadicalInverse(0, i), RadicalInverse(1, i), RadicalInverse(2, i)));
-        Interaction intr(po, Normal3f(), Vector3f(), Vector3f(1, 0, 0),
-                         0 /* time */, MediumInterface());
-
-        // Use the next two Halton dimensions to sample a point on the
-        // light source.
-        Point2f u(RadicalInverse(3, i), RadicalInverse(4, i));
-        for (size_t j = 0; j < scene.lights.size(); ++j) {
-            Float pdf;
-            Vector3f wi;
-            VisibilityTester vis;
-            Spectrum Li = scene.lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
-            if (pdf > 0) {
-                // TODO: look at tracing shadow rays / computing beam
-                // transmittance.  Probably shouldn't give those full weight
-                // but instead e.g. have an occluded shadow ray scale down
-                // the contribution by 10 or something.
-                lightContrib[j] += Li.y() / pdf;
+    while (true) {
+        int start = voxel->nextSample.fetch_add(voxelSampleBatch);
+        if (start >= nVoxelSamples) return;
+        int end = std::min(start + voxelSampleBatch, nVoxelSamples);
+        std::fill(lightContrib.begin(), lightContrib.end(), Float(0));
+        for (int i = start; i < end; ++i) {
+            Point3f po = voxel->bounds.Lerp(Point3f(
+                RadicalInverse(0, i), RadicalInverse(1, i), RadicalInverse(2, i)));
+            Interaction intr(po, Normal3f(), Vector3f(), Vector3f(1, 0, 0),
+                             0 /* time */, MediumInterface());
+
+            // Use the next two Halton dimensions to sample a point on the
+            // light source.
+            Point2f u(RadicalInverse(3, i), RadicalInverse(4, i));
+            for (size_t j = 0; j < scene.lights.size(); ++j) {
+                Float pdf;
+                Vector3f wi;
+                VisibilityTester vis;
+                Spectrum Li = scene.lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
+                if (pdf > 0) {
+                    // TODO: look at tracing shadow rays / computing beam
+                    // transmittance.  Probably shouldn't give those full weight
+                    // but instead e.g. have an occluded shadow ray scale down
+                    // the contribution by 10 or something.
+                    lightContrib[j] += Li.y() / pdf;
+                }
             }
         }
+        for (size_t j = 0; j < lightContrib.size(); ++j)
+            if (lightContrib[j] > 0) voxel->contrib[j].Add(lightContrib[j]);
+        int nDone = end - start;
+        if (voxel->samplesDone.fetch_add(nDone) + nDone < nVoxelSamples)
+            continue;
+
+        // This thread finished the last batch of points, so it creates the
+        // distribution.
+        ++nDistributions;
+        for (size_t j = 0; j < lightContrib.size(); ++j)
+            lightContrib[j] = voxel->contrib[j];
+
+        // We don't want to leave any lights with a zero probability; it's
+        // possible that a light contributes to points in the voxel even though
+        // we didn't find such a point when sampling above.  Therefore, compute
+        // a minimum (small) weight and ensure that all lights are given at
+        // least the corresponding probability.
+        Float sumContrib =
+            std::accumulate(lightContrib.begin(), lightContrib.end(), Float(0));
+        Float avgContrib = sumContrib / (nVoxelSamples * lightContrib.size());
+        Float minContrib = (avgContrib > 0) ? .001 * avgContrib : 1;
+        for (size_t i = 0; i < lightContrib.size(); ++i) {
+            VLOG(2) << "Voxel key = " << voxel->key << ", light " << i
+                    << " contrib = " << lightContrib[i];
+            lightContrib[i] = std::max(lightContrib[i], minContrib);
+        }
+        LOG(INFO) << "Initialized light distribution in voxel " <<
+            voxel->bounds << ", avgContrib = " << avgContrib;
+
+        // Compute a sampling distribution from the accumulated contributions.
+        Distribution1D *distrib =
+            new Distribution1D(&lightContrib[0], int(lightContrib.size()));
+        trackedMemory.Add(distrib->BytesUsed() -
+                          int64_t(lightContrib.size() * sizeof(AtomicFloat)));
+        voxel->contrib.reset();
+        voxel->bytes = sizeof(VoxelDistribution) + distrib->BytesUsed();
+        voxel->distrib.store(distrib, std::memory_order_release);
+        return;
     }
+}
 
-    // We don't want to leave any lights with a zero probability; it's
-    // possible that a light contributes to points in the voxel even though
-    // we didn't find such a point when sampling above.  Therefore, compute
-    // a minimum (small) weight and ensure that all lights are given at
-    // least the corresponding probability.
-    Float sumContrib =
-        std::accumulate(lightContrib.begin(), lightContrib.end(), Float(0));
-    Float avgContrib = sumContrib / (nSamples * lightContrib.size());
-    Float minContrib = (avgContrib > 0) ? .001 * avgContrib : 1;
-    for (size_t i = 0; i < lightContrib.size(); ++i) {
-        VLOG(2) << "Voxel pi = " << pi << ", light " << i << " contrib = "
-                << lightContrib[i];
-        lightContrib[i] = std::max(lightContrib[i], minContrib);
+void SpatialLightDistribution::Retire(VoxelDistribution *voxel) const {
+    // Other threads may still be using the evicted voxel; record the epoch
+    // of its eviction so that it's freed only after they've moved on.
+    size_t nRetired;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        retiredVoxels.push_back({epoch.fetch_add(1), voxel, voxel->bytes});
+        retiredBytes += voxel->bytes;
+        nRetired = retiredVoxels.size();
+    }
+    if (nRetired >= 64) Reclaim(false);
+}
+
+bool SpatialLightDistribution::Reclaim(bool force) const {
+    std::lock_guard<std::mutex> lock(retiredMutex);
+    // A voxel retired at epoch _e_ may still be in use by any thread whose
+    // most recent lookup started at or before _e_.
+    uint64_t minEpoch = std::numeric_limits<uint64_t>::max();
+    if (!force)
+        for (const auto &threadEpoch : threadEpochs) {
+            uint64_t e = threadEpoch->load();
+            if (e != 0) minEpoch = std::min(minEpoch, e);
+        }
+    size_t nKept = 0;
+    for (const auto &r : retiredVoxels) {
+        if (r.epoch < minEpoch) {
+            trackedMemory.Add(-r.bytes);
+            retiredBytes -= r.bytes;
+            delete r.voxel;
+        } else
+            retiredVoxels[nKept++] = r;
+    }
+    retiredVoxels.resize(nKept);
+    // Report whether the remaining voxels fit in the memory bound.
+    return retiredBytes.load() <= maxRetiredBytes;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// LightBVHLightDistribution
+
+STAT_MEMORY_COUNTER("Memory/Light BVH", lightBVHBytes);
+STAT_COUNTER("LightBVHLightDistribution/Nodes", nLightBVHNodes);
+STAT_INT_DISTRIBUTION("LightBVHLightDistribution/Sampling depth",
+                      lightBVHSampleDepth);
+
+// Estimate of the cost of a light BVH node with bounds _b_ spanning
+// _bounds_ when split along _dim_: the power weighted by the solid angle
+// of the emission cone and the surface area of the bounds, with a penalty
+// for thin boxes split along their short axes.
+static Float LightBVHCost(const LightBounds &b, const Bounds3f &bounds,
+                          int dim) {
+    Float thetaO = std::acos(Clamp(b.cosThetaO, -1, 1));
+    Float thetaE = std::acos(Clamp(b.cosThetaE, -1, 1));
+    Float thetaW = std::min(thetaO + thetaE, Pi);
+    Float sinThetaO =
+        std::sqrt(std::max((Float)0, 1 - b.cosThetaO * b.cosThetaO));
+    Float Momega = 2 * Pi * (1 - b.cosThetaO) +
+                   Pi / 2 * (2 * thetaW * sinThetaO -
+                             std::cos(thetaO - 2 * thetaW) -
+                             2 * thetaO * sinThetaO + b.cosThetaO);
+    Vector3f d = bounds.Diagonal();
+    Float Kr = std::max(d.x, std::max(d.y, d.z)) / d[dim];
+    return b.phi * Momega * Kr * b.bounds.SurfaceArea();
+}
+
+LightBVHLightDistribution::LightBVHLightDistribution(const Scene &scene)
+    : lightToLeaf(scene.lights.size(), -1) {
+    // Separate the lights that can be bounded from infinite lights
+    std::vector<std::pair<int, LightBounds>> bvhLights;
+    for (size_t i = 0; i < scene.lights.size(); ++i) {
+        LightBounds lb;
+        if (scene.lights[i]->Bounds(&lb))
+            bvhLights.push_back(std::make_pair(int(i), lb));
+        else
+            infiniteLights.push_back(int(i));
     }
-    LOG(INFO) << "Initialized light distribution in voxel pi= " <<  pi <<
-        ", avgContrib = " << avgContrib;
 
-    // Compute a sampling distribution from the accumulated contributions.
-    return new Distribution1D(&lightContrib[0], int(lightContrib.size()));
+    if (!bvhLights.empty()) {
+        nodes.reserve(2 * bvhLights.size() - 1);
+        BuildBVH(bvhLights, 0, int(bvhLights.size()), -1);
+    }
+    pInfinite = Float(infiniteLights.size()) /
+                Float(infiniteLights.size() + (nodes.empty() ? 0 : 1));
+
+    size_t bytes = nodes.capacity() * sizeof(LightBVHNode) +
+                   (infiniteLights.capacity() + lightToLeaf.capacity()) *
+                       sizeof(int);
+    lightBVHBytes += bytes;
+    nLightBVHNodes += nodes.size();
+    trackedMemory.Add(bytes);
+}
+
+int LightBVHLightDistribution::BuildBVH(
+    std::vector<std::pair<int, LightBounds>> &bvhLights, int start, int end,
+    int parentIndex) {
+    CHECK_LT(start, end);
+    int nodeIndex = int(nodes.size());
+    nodes.push_back(LightBVHNode());
+    nodes[nodeIndex].parentIndex = parentIndex;
+
+    // Create a leaf node for a single light
+    if (end - start == 1) {
+        LightBVHNode &node = nodes[nodeIndex];
+        node.bounds = bvhLights[start].second;
+        node.childOrLightIndex = bvhLights[start].first;
+        node.isLeaf = true;
+        lightToLeaf[bvhLights[start].first] = nodeIndex;
+        return nodeIndex;
+    }
+
+    // Compute the bounds of the lights and of their centroids
+    Bounds3f bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        const Bounds3f &b = bvhLights[i].second.bounds;
+        bounds = Union(bounds, b);
+        centroidBounds = Union(centroidBounds, (b.pMin + b.pMax) / 2);
+    }
+
+    // Find the lowest-cost split using the bucketed SAH-like heuristic
+    PBRT_CONSTEXPR int nBuckets = 12;
+    Float minCost = Infinity;
+    int minCostSplitBucket = -1, minCostSplitDim = -1;
+    for (int dim = 0; dim < 3; ++dim) {
+        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) continue;
+        LightBounds bucketBounds[nBuckets];
+        for (int i = start; i < end; ++i) {
+            const LightBounds &lb = bvhLights[i].second;
+            Point3f pc = (lb.bounds.pMin + lb.bounds.pMax) / 2;
+            int b = nBuckets * centroidBounds.Offset(pc)[dim];
+            if (b == nBuckets) b = nBuckets - 1;
+            bucketBounds[b] = Union(bucketBounds[b], lb);
+        }
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            LightBounds below, above;
+            for (int j = 0; j <= i; ++j)
+                below = Union(below, bucketBounds[j]);
+            for (int j = i + 1; j < nBuckets; ++j)
+                above = Union(above, bucketBounds[j]);
+            Float cost = LightBVHCost(below, bounds, dim) +
+                         LightBVHCost(above, bounds, dim);
+            if (cost > 0 && cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+                minCostSplitDim = dim;
+            }
+        }
+    }
+
+    // Partition the lights at the chosen split, or at the median along
+    // the widest axis if no split had a meaningful cost (e.g. for point
+    // lights, whose bounds have no area)
+    int mid = -1;
+    if (minCostSplitDim != -1) {
+        auto pmid = std::partition(
+            &bvhLights[start], &bvhLights[end - 1] + 1,
+            [=](const std::pair<int, LightBounds> &l) {
+                const Bounds3f &b = l.second.bounds;
+                Point3f pc = (b.pMin + b.pMax) / 2;
+                int bucket =
+                    nBuckets * centroidBounds.Offset(pc)[minCostSplitDim];
+                if (bucket == nBuckets) bucket = nBuckets - 1;
+                return bucket <= minCostSplitBucket;
+            });
+        mid = int(pmid - &bvhLights[0]);
+    }
+    if (mid == -1 || mid == start || mid == end) {
+        int dim = centroidBounds.MaximumExtent();
+        mid = (start + end) / 2;
+        std::nth_element(&bvhLights[start], &bvhLights[mid],
+                         &bvhLights[end - 1] + 1,
+                         [dim](const std::pair<int, LightBounds> &a,
+                               const std::pair<int, LightBounds> &b) {
+                             return a.second.bounds.pMin[dim] +
+                                        a.second.bounds.pMax[dim] <
+                                    b.second.bounds.pMin[dim] +
+                                        b.second.bounds.pMax[dim];
+                         });
+    }
+
+    // Build the children; the first one immediately follows this node
+    int child0 = BuildBVH(bvhLights, start, mid, nodeIndex);
+    int child1 = BuildBVH(bvhLights, mid, end, nodeIndex);
+    LightBVHNode &node = nodes[nodeIndex];
+    node.bounds = Union(nodes[child0].bounds, nodes[child1].bounds);
+    node.childOrLightIndex = child1;
+    node.isLeaf = false;
+    return nodeIndex;
+}
+
+Float LightBVHLightDistribution::ChildProbability(const LightBVHNode &node,
+                                                  const Point3f &p,
+                                                  const Normal3f &n) const {
+    // Returns the probability of descending to the first child of _node_,
+    // or -1 if neither child can contribute at _p_
+    Float importance0 = nodes[&node - &nodes[0] + 1].bounds.Importance(p, n);
+    Float importance1 = nodes[node.childOrLightIndex].bounds.Importance(p, n);
+    if (importance0 == 0 && importance1 == 0) return -1;
+    return importance0 / (importance0 + importance1);
+}
+
+int LightBVHLightDistribution::Sample(const Point3f &p, const Normal3f &n,
+                                      Float u, Float *pmf) const {
+    ProfilePhase _(Prof::LightDistribLookup);
+    // Choose between the infinite lights and the BVH
+    if (u < pInfinite) {
+        int index = std::min(int(u / pInfinite * infiniteLights.size()),
+                             int(infiniteLights.size()) - 1);
+        *pmf = pInfinite / infiniteLights.size();
+        return infiniteLights[index];
+    }
+    *pmf = 0;
+    if (nodes.empty()) return -1;
+    u = std::min((u - pInfinite) / (1 - pInfinite), OneMinusEpsilon);
+
+    // Traverse the BVH, choosing children by their importance at _p_
+    int nodeIndex = 0, depth = 0;
+    Float nodePmf = 1 - pInfinite;
+    while (!nodes[nodeIndex].isLeaf) {
+        const LightBVHNode &node = nodes[nodeIndex];
+        Float p0 = ChildProbability(node, p, n);
+        if (p0 < 0) return -1;
+        if (u < p0) {
+            nodeIndex = nodeIndex + 1;
+            u = std::min(u / p0, OneMinusEpsilon);
+            nodePmf *= p0;
+        } else {
+            nodeIndex = node.childOrLightIndex;
+            u = std::min((u - p0) / (1 - p0), OneMinusEpsilon);
+            nodePmf *= 1 - p0;
+        }
+        ++depth;
+    }
+    ReportValue(lightBVHSampleDepth, depth);
+
+    // A lone light still has to be able to reach _p_
+    if (nodeIndex == 0 && nodes[0].bounds.Importance(p, n) == 0) return -1;
+    *pmf = nodePmf;
+    return nodes[nodeIndex].childOrLightIndex;
+}
+
+Float LightBVHLightDistribution::Pmf(const Point3f &p, const Normal3f &n,
+                                     int lightIndex) const {
+    ProfilePhase _(Prof::LightDistribLookup);
+    int leaf = lightToLeaf[lightIndex];
+    if (leaf == -1)
+        return infiniteLights.empty() ? 0 : pInfinite / infiniteLights.size();
+    if (leaf == 0 && nodes[0].bounds.Importance(p, n) == 0) return 0;
+
+    // Walk from the light's leaf up to the root, accumulating the
+    // probabilities of the choices that _Sample()_ would have made
+    Float pmf = 1 - pInfinite;
+    for (int nodeIndex = leaf; nodeIndex != 0;
+         nodeIndex = nodes[nodeIndex].parentIndex) {
+        int parentIndex = nodes[nodeIndex].parentIndex;
+        Float p0 = ChildProbability(nodes[parentIndex], p, n);
+        if (p0 < 0) return 0;
+        pmf *= (nodeIndex == parentIndex + 1) ? p0 : 1 - p0;
+    }
+    return pmf;
 }
 
 }  // namespace pbrt
@@ -35,7 +35,9 @@
 
 #include "pbrt.h"
 #include "geometry.h"
+#include "light.h"
 #include "sampling.h"
+#include "memory.h"
 #include <atomic>
 #include <functional>
 #include <mutex>
@@ -53,7 +55,22 @@ class LightDistribution {
 
     // Given a point |p| in space, this method returns a (hopefully
     // effective) sampling distribution for light sources at that point.
+    // Distributions that can't be expressed as a single Distribution1D
+    // per point (e.g. the light BVH) return nullptr; callers that can
+    // should use Sample() and Pmf() instead.
     virtual const Distribution1D *Lookup(const Point3f &p) const = 0;
+
+    // Choose a light for shading point |p| with surface normal |n| (which
+    // may be zero, e.g. for points in participating media). Returns the
+    // light's index in Scene::lights and its probability in |*pmf|, or -1
+    // if no light can contribute at |p|.
+    virtual int Sample(const Point3f &p, const Normal3f &n, Float u,
+                       Float *pmf) const;
+
+    // Returns the probability that Sample() chooses light |lightIndex| at
+    // the given shading point.
+    virtual Float Pmf(const Point3f &p, const Normal3f &n,
+                      int lightIndex) const;
 };
 
 std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
@@ -73,6 +90,7 @@ class UniformLightDistribution : public LightDistribution {
 
   private:
     std::unique_ptr<Distribution1D> distrib;
+    TrackedMemory trackedMemory{MemoryCategory::Lights};
 };
 
 // PowerLightDistribution returns a distribution with sampling probability
@@ -91,37 +109,121 @@ class PowerLightDistribution : public LightDistribution {
 
   private:
     std::unique_ptr<Distribution1D> distrib;
+    TrackedMemory trackedMemory{MemoryCategory::Lights};
 };
 
 // A spatially-varying light distribution that adjusts the probability of
 // sampling a light source based on an estimate of its contribution to a
-// region of space.  A fixed voxel grid is imposed over the scene bounds
-// and a sampling distribution is computed as needed for each voxel.
+// region of space.  A hierarchy of voxel grids is imposed over the scene
+// bounds, starting from a coarse grid; voxels that are looked up often
+// are refined, up to |maxVoxels| voxels along the widest axis. Sampling
+// distributions are computed as needed for each voxel and kept in a
+// lock-free cache that holds at most |maxBytes| of distributions, evicting
+// the least recently used ones when it fills up.
+//
+// A distribution returned by Lookup() remains valid until the calling
+// thread's next call to Lookup(); a later lookup at the same point may
+// return a different (e.g. finer) distribution.
 class SpatialLightDistribution : public LightDistribution {
   public:
-    SpatialLightDistribution(const Scene &scene, int maxVoxels = 64);
+    SpatialLightDistribution(const Scene &scene, int maxVoxels = 64,
+                             size_t maxBytes = 64 * 1024 * 1024);
     ~SpatialLightDistribution();
     const Distribution1D *Lookup(const Point3f &p) const;
 
   private:
-    // Compute the sampling distribution for the voxel with integer
-    // coordiantes given by "pi".
-    Distribution1D *ComputeDistribution(Point3i pi) const;
-
-    const Scene &scene;
-    int nVoxels[3];
-
-    // The hash table is a fixed number of HashEntry structs (where we
-    // allocate more than enough entries in the SpatialLightDistribution
-    // constructor). During rendering, the table is allocated without
-    // locks, using atomic operations. (See the Lookup() method
-    // implementation for details.)
+    // SpatialLightDistribution Private Declarations
+    struct VoxelDistribution;
+
+    // The hash table is a fixed number of HashEntry structs, sized for
+    // the maximum number of distributions the memory bound allows.
+    // Entries are claimed and replaced without locks using atomic
+    // compare/exchange operations on the _voxel_ pointer; the voxel
+    // stores its own key so that the pointer alone identifies it.
     struct HashEntry {
-        std::atomic<uint64_t> packedPos;
-        std::atomic<Distribution1D *> distribution;
+        std::atomic<VoxelDistribution *> voxel;
+        std::atomic<uint32_t> lastUsed;
     };
+
+    // SpatialLightDistribution Private Methods
+    VoxelDistribution *FindOrCreateVoxel(int level, const Point3f &p) const;
+    void ComputeSamples(VoxelDistribution *voxel) const;
+    std::atomic<uint64_t> &ThreadEpoch() const;
+    void Retire(VoxelDistribution *voxel) const;
+    bool Reclaim(bool force) const;
+
+    // SpatialLightDistribution Private Data
+    const Scene &scene;
+    int nLevels;
+    std::vector<Point3i> nVoxels;  // per level
+    std::unique_ptr<Distribution1D> fallbackDistrib;
     mutable std::unique_ptr<HashEntry[]> hashTable;
     size_t hashTableSize;
+    mutable std::atomic<uint32_t> clock{0};
+
+    // Evicted voxels are retired and freed once every thread that uses the
+    // distribution has looked up a distribution since they were evicted (a
+    // simple form of quiescent-state based reclamation). Each thread
+    // registers its own epoch on its first lookup, so threads outside the
+    // thread pool are tracked as well. Retired voxels count against the
+    // memory bound: while more than _maxRetiredBytes_ of them can't be
+    // freed yet, new voxels aren't cached and lookups use coarser ones.
+    const uint64_t id;
+    mutable std::atomic<uint64_t> epoch{1};
+    mutable std::mutex retiredMutex;
+    mutable std::vector<std::shared_ptr<std::atomic<uint64_t>>> threadEpochs;
+    struct RetiredVoxel {
+        uint64_t epoch;
+        VoxelDistribution *voxel;
+        int64_t bytes;
+    };
+    mutable std::vector<RetiredVoxel> retiredVoxels;
+    mutable std::atomic<int64_t> retiredBytes{0};
+    int64_t maxRetiredBytes;
+    mutable TrackedMemory trackedMemory{MemoryCategory::Lights};
+};
+
+// LightBVHLightDistribution organizes the lights in a bounding volume
+// hierarchy where each node stores the spatial bounds, total power, and
+// a cone bounding the emission directions of the lights below it (Conty
+// Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive
+// Tree Splitting", 2018). Lights are chosen by descending the tree and
+// picking each child with probability proportional to an estimate of its
+// importance at the shading point, which makes both Sample() and Pmf()
+// O(log n) in the number of lights, with O(n) memory overall. Infinite
+// and distant lights, which can't be bounded, are sampled uniformly
+// alongside the tree.
+class LightBVHLightDistribution : public LightDistribution {
+  public:
+    LightBVHLightDistribution(const Scene &scene);
+    const Distribution1D *Lookup(const Point3f &p) const { return nullptr; }
+    int Sample(const Point3f &p, const Normal3f &n, Float u,
+               Float *pmf) const;
+    Float Pmf(const Point3f &p, const Normal3f &n, int lightIndex) const;
+
+  private:
+    // LightBVHLightDistribution Private Data
+    struct LightBVHNode {
+        LightBounds bounds;
+        // Index of the second child for interior nodes (the first child
+        // immediately follows its parent) or of the light for leaves.
+        int childOrLightIndex;
+        int parentIndex;
+        bool isLeaf;
+    };
+
+    // LightBVHLightDistribution Private Methods
+    int BuildBVH(std::vector<std::pair<int, LightBounds>> &bvhLights,
+                 int start, int end, int parentIndex);
+    Float ChildProbability(const LightBVHNode &node, const Point3f &p,
+                           const Normal3f &n) const;
+
+    std::vector<int> infiniteLights;
+    std::vector<LightBVHNode> nodes;
+    // Leaf node for each light in Scene::lights, or -1 for infinite lights.
+    std::vector<int> lightToLeaf;
+    Float pInfinite;
+    TrackedMemory trackedMemory{MemoryCategory::Lights};
 };
 
 }  // namespace pbrt
@@ -37,12 +37,24 @@
 #include "texture.h"
 #include "spectrum.h"
 #include "reflection.h"
+#include "stats.h"
 
 namespace pbrt {
 
+STAT_INT_DISTRIBUTION("Integrator/Hits per material shading batch",
+                      hitsPerShadingBatch);
+
 // Material Method Definitions
 Material::~Material() {}
 
+void Material::ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si,
+                                               int n, MemoryArena &arena,
+                                               TransportMode mode,
+                                               bool allowMultipleLobes) const {
+    for (int i = 0; i < n; ++i)
+        ComputeScatteringFunctions(si[i], arena, mode, allowMultipleLobes);
+}
+
 void Material::Bump(const std::shared_ptr<Texture<Float>> &d,
                     SurfaceInteraction *si) {
     // Compute offset positions and evaluate displacement texture
@@ -82,4 +94,41 @@ void Material::Bump(const std::shared_ptr<Texture<Float>> &d,
                            false);
 }
 
+// ShadingQueue Method Definitions
+void ShadingQueue::Add(SurfaceInteraction *si, const RayDifferential &ray) {
+    si->ComputeDifferentials(ray);
+    hits.push_back(QueuedHit{si->primitive->GetMaterial(),
+                             std::type_index(typeid(*si->primitive)), si});
+}
+
+void ShadingQueue::Shade(MemoryArena &arena, TransportMode mode,
+                         bool allowMultipleLobes) {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    // Bucket the queued hits by material and primitive type, keeping each
+    // bucket in the order the hits were added so that arena use doesn't
+    // depend on the sort
+    std::stable_sort(hits.begin(), hits.end(),
+                     [](const QueuedHit &a, const QueuedHit &b) {
+                         if (a.material != b.material)
+                             return a.material < b.material;
+                         return a.primitiveType < b.primitiveType;
+                     });
+
+    // Shade each bucket with a single call to its first hit's primitive
+    for (size_t start = 0; start < hits.size();) {
+        size_t end = start;
+        batch.clear();
+        while (end < hits.size() &&
+               hits[end].material == hits[start].material &&
+               hits[end].primitiveType == hits[start].primitiveType)
+            batch.push_back(hits[end++].si);
+        batch[0]->primitive->ComputeScatteringFunctionsBatch(
+            batch.data(), int(batch.size()), arena, mode, allowMultipleLobes);
+        if (hits[start].material)
+            ReportValue(hitsPerShadingBatch, batch.size());
+        start = end;
+    }
+    hits.clear();
+}
+
 }  // namespace pbrt
@@ -41,6 +41,7 @@
 // core/material.h*
 #include "pbrt.h"
 #include "memory.h"
+#include <typeindex>
 
 namespace pbrt {
 
@@ -55,11 +56,42 @@ class Material {
                                             MemoryArena &arena,
                                             TransportMode mode,
                                             bool allowMultipleLobes) const = 0;
+    // Computes the scattering functions of _n_ hits that all use this
+    // material; materials override this to evaluate their textures for
+    // the whole batch before allocating the BSDFs
+    virtual void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si,
+                                                 int n, MemoryArena &arena,
+                                                 TransportMode mode,
+                                                 bool allowMultipleLobes) const;
     virtual ~Material();
     static void Bump(const std::shared_ptr<Texture<Float>> &d,
                      SurfaceInteraction *si);
 };
 
+// ShadingQueue Declarations
+// Defers computing the scattering functions of surface hits so that all
+// hits on the same kind of primitive with the same material are shaded
+// together, rather than interleaving unrelated materials' code and
+// textures.
+class ShadingQueue {
+  public:
+    // ShadingQueue Public Methods
+    void Add(SurfaceInteraction *si, const RayDifferential &ray);
+    void Shade(MemoryArena &arena, TransportMode mode = TransportMode::Radiance,
+               bool allowMultipleLobes = false);
+    size_t Size() const { return hits.size(); }
+
+  private:
+    // ShadingQueue Private Data
+    struct QueuedHit {
+        const Material *material;
+        std::type_index primitiveType;
+        SurfaceInteraction *si;
+    };
+    std::vector<QueuedHit> hits;
+    std::vector<SurfaceInteraction *> batch;
+};
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_MATERIAL_H
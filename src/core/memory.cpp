@@ -33,9 +33,54 @@
 
 // core/memory.cpp*
 #include "memory.h"
+#include "parallel.h"
+#include "stats.h"
+#include "stringprint.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#if defined(PBRT_HAVE_POSIX_MEMALIGN) && !defined(PBRT_IS_WINDOWS)
+#include <sys/mman.h>
+#endif
 
 namespace pbrt {
 
+STAT_COUNTER("Memory/Arena blocks allocated", nArenaBlocks);
+STAT_MEMORY_COUNTER("Memory/Thread arenas", threadArenaBytes);
+STAT_INT_DISTRIBUTION("Memory/Thread arena peak bytes per work unit",
+                      threadArenaBytesUsed);
+
+// Memory Local Definitions
+// Blocks of at least this size are aligned to it so that they can be
+// backed by transparent huge pages.
+static const size_t HugePageSize = 2 << 20;
+
+// Thread arenas use huge-page-sized blocks.
+static const size_t ThreadArenaBlockSize = HugePageSize;
+
+// Each thread's pool of arenas; there is usually just one, but code that
+// uses a _ThreadArena_ while another is live on the same thread gets a
+// different arena.
+static thread_local std::vector<std::unique_ptr<MemoryArena>> arenaPool;
+static PBRT_THREAD_LOCAL int nArenasInUse;
+
+// Live and peak bytes charged to each _MemoryCategory_ and in total
+static std::atomic<int64_t> memoryInUse[NumMemoryCategories],
+    memoryPeak[NumMemoryCategories];
+static std::atomic<int64_t> totalMemoryInUse, totalMemoryPeak;
+
+// Snapshots of the usage of each category, for the timeline in the report
+struct MemoryUsageRecord {
+    std::string event;
+    double seconds;
+    int64_t inUse[NumMemoryCategories], total, totalPeak;
+};
+static std::mutex memoryUsageMutex;
+static std::vector<MemoryUsageRecord> memoryUsageTimeline;
+static std::chrono::steady_clock::time_point memoryUsageStartTime =
+    std::chrono::steady_clock::now();
+
 // Memory Allocation Functions
 void *AllocAligned(size_t size) {
 #if defined(PBRT_HAVE__ALIGNED_MALLOC)
@@ -58,4 +103,197 @@ void FreeAligned(void *ptr) {
 #endif
 }
 
+uint8_t *AllocArenaBlock(size_t size) {
+    ++nArenaBlocks;
+#if defined(PBRT_HAVE_POSIX_MEMALIGN) && defined(MADV_HUGEPAGE)
+    if (size >= HugePageSize) {
+        void *ptr;
+        if (posix_memalign(&ptr, HugePageSize, size) == 0) {
+            madvise(ptr, size, MADV_HUGEPAGE);
+            return (uint8_t *)ptr;
+        }
+    }
+#endif
+    return AllocAligned<uint8_t>(size);
+}
+
+// Operating systems generally place memory pages on the NUMA node of the
+// thread that first writes to them; in NUMA mode, this writes to the pages
+// of a new allocation from all threads so that large read-mostly data is
+// spread over the nodes instead of all being on the allocating thread's.
+void NumaFirstTouch(void *ptr, size_t size) {
+    if (!PbrtOptions.numa || NumaNodeCount() < 2 || size < (1 << 20)) return;
+    const uintptr_t pageSize = 4096;
+    // Touch every page that overlaps the range, including partial pages at
+    // either end, writing only to bytes that are inside it
+    uintptr_t start = (uintptr_t)ptr, end = start + size;
+    uintptr_t firstPage = start & ~(pageSize - 1);
+    uintptr_t endPage = (end + pageSize - 1) & ~(pageSize - 1);
+    ParallelFor([&](int64_t page) {
+        uintptr_t p = std::max(start, firstPage + page * pageSize);
+        *(char *)p = 0;
+    }, (endPage - firstPage) / pageSize, 64);
+}
+
+// ThreadArena Method Definitions
+ThreadArena::ThreadArena() {
+    if (nArenasInUse == int(arenaPool.size()))
+        arenaPool.push_back(
+            std::unique_ptr<MemoryArena>(new MemoryArena(ThreadArenaBlockSize)));
+    arena = arenaPool[nArenasInUse++].get();
+    allocatedBefore = arena->TotalAllocated();
+}
+
+ThreadArena::~ThreadArena() {
+    // Record the arena's high-water mark and any memory it had to add
+    ReportValue(threadArenaBytesUsed, arena->MaxBytesUsed());
+    threadArenaBytes += arena->TotalAllocated() - allocatedBefore;
+    arena->Reset();
+    arena->ClearMaxBytesUsed();
+    CHECK_EQ(arena, arenaPool[nArenasInUse - 1].get());
+    --nArenasInUse;
+}
+
+// Memory Accounting Definitions
+static void UpdatePeak(std::atomic<int64_t> &peak, int64_t value) {
+    int64_t current = peak;
+    while (value > current && !peak.compare_exchange_weak(current, value))
+        ;
+}
+
+static std::string FormatBytes(int64_t bytes) {
+    double b = std::abs(double(bytes));
+    if (b < 1024. * 1024.) return StringPrintf("%.2f kB", bytes / 1024.);
+    if (b < 1024. * 1024. * 1024.)
+        return StringPrintf("%.2f MiB", bytes / (1024. * 1024.));
+    return StringPrintf("%.2f GiB", bytes / (1024. * 1024. * 1024.));
+}
+
+const char *MemoryCategoryName(MemoryCategory category) {
+    switch (category) {
+    case MemoryCategory::Meshes:
+        return "Meshes";
+    case MemoryCategory::Acceleration:
+        return "Acceleration structures";
+    case MemoryCategory::Textures:
+        return "Textures and MIP maps";
+    case MemoryCategory::Ptex:
+        return "Ptex cache";
+    case MemoryCategory::Lights:
+        return "Light distributions";
+    case MemoryCategory::Film:
+        return "Film";
+    case MemoryCategory::PathGuiding:
+        return "Path guiding trees";
+    case MemoryCategory::SPPM:
+        return "SPPM pixels and grid";
+    case MemoryCategory::MLT:
+        return "MLT chains";
+    }
+    LOG(FATAL) << "Unhandled memory category";
+    return nullptr;
+}
+
+static void MemoryBudgetExceeded(MemoryCategory category, int64_t bytes,
+                                 int64_t total) {
+    // Only report once, even if several threads go over the budget at once
+    std::lock_guard<std::mutex> lock(memoryUsageMutex);
+    Error("Tracked memory use of %s exceeds the --memorybudget of %s after "
+          "allocating %s for \"%s\". Exiting.",
+          FormatBytes(total).c_str(),
+          FormatBytes(PbrtOptions.memoryBudget).c_str(),
+          FormatBytes(bytes).c_str(), MemoryCategoryName(category));
+    for (int c = 0; c < NumMemoryCategories; ++c)
+        fprintf(stderr, "  %-30s %12s in use, %12s peak\n",
+                MemoryCategoryName(MemoryCategory(c)),
+                FormatBytes(memoryInUse[c]).c_str(),
+                FormatBytes(memoryPeak[c]).c_str());
+    // Other threads are still running and using static objects, so exit
+    // without running static destructors or atexit handlers
+    fflush(stdout);
+    fflush(stderr);
+    std::_Exit(1);
+}
+
+void TrackMemory(MemoryCategory category, int64_t bytes) {
+    int c = int(category);
+    UpdatePeak(memoryPeak[c], memoryInUse[c] += bytes);
+    int64_t total = totalMemoryInUse += bytes;
+    UpdatePeak(totalMemoryPeak, total);
+    if (bytes > 0 && PbrtOptions.memoryBudget > 0 &&
+        total > PbrtOptions.memoryBudget)
+        MemoryBudgetExceeded(category, bytes, total);
+}
+
+int64_t TrackedMemoryInUse(MemoryCategory category) {
+    return memoryInUse[int(category)];
+}
+
+int64_t TrackedMemoryPeak(MemoryCategory category) {
+    return memoryPeak[int(category)];
+}
+
+int64_t TrackedMemoryInUse() { return totalMemoryInUse; }
+
+int64_t TrackedMemoryPeak() { return totalMemoryPeak; }
+
+void RecordMemoryUsage(const std::string &event) {
+    MemoryUsageRecord record;
+    record.event = event;
+    record.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() -
+                         memoryUsageStartTime).count();
+    for (int c = 0; c < NumMemoryCategories; ++c)
+        record.inUse[c] = memoryInUse[c];
+    record.total = totalMemoryInUse;
+    record.totalPeak = totalMemoryPeak;
+    std::lock_guard<std::mutex> lock(memoryUsageMutex);
+    memoryUsageTimeline.push_back(record);
+}
+
+void ReportMemoryUsage(FILE *dest) {
+    std::lock_guard<std::mutex> lock(memoryUsageMutex);
+    if (totalMemoryPeak == 0) return;
+    fprintf(dest, "Memory usage:%42s%15s\n", "In use", "Peak");
+    for (int c = 0; c < NumMemoryCategories; ++c) {
+        if (memoryPeak[c] == 0) continue;
+        fprintf(dest, "  %-38s %14s %14s\n",
+                MemoryCategoryName(MemoryCategory(c)),
+                FormatBytes(memoryInUse[c]).c_str(),
+                FormatBytes(memoryPeak[c]).c_str());
+    }
+    fprintf(dest, "  %-38s %14s %14s\n", "Total",
+            FormatBytes(totalMemoryInUse).c_str(),
+            FormatBytes(totalMemoryPeak).c_str());
+    if (PbrtOptions.memoryBudget > 0)
+        fprintf(dest, "  %-38s %14s %14s\n", "Budget", "",
+                FormatBytes(PbrtOptions.memoryBudget).c_str());
+
+    // Print the usage of the largest categories at each recorded event
+    if (memoryUsageTimeline.empty()) return;
+    fprintf(dest, "Memory usage over time:\n");
+    for (const MemoryUsageRecord &record : memoryUsageTimeline) {
+        fprintf(dest, "  %9.2fs  %-28s %12s in use, %12s peak\n",
+                record.seconds, record.event.c_str(),
+                FormatBytes(record.total).c_str(),
+                FormatBytes(record.totalPeak).c_str());
+        for (int c = 0; c < NumMemoryCategories; ++c)
+            if (record.inUse[c] > 0 && record.inUse[c] >= record.total / 20)
+                fprintf(dest, "  %11s    %-38s %12s\n", "",
+                        MemoryCategoryName(MemoryCategory(c)),
+                        FormatBytes(record.inUse[c]).c_str());
+    }
+}
+
+void ClearMemoryUsage() {
+    // Live usage stays as it is, since the memory it counts is still
+    // allocated; peaks restart from it
+    std::lock_guard<std::mutex> lock(memoryUsageMutex);
+    for (int c = 0; c < NumMemoryCategories; ++c)
+        memoryPeak[c] = int64_t(memoryInUse[c]);
+    totalMemoryPeak = int64_t(totalMemoryInUse);
+    memoryUsageTimeline.clear();
+    memoryUsageStartTime = std::chrono::steady_clock::now();
+}
+
 }  // namespace pbrt
@@ -40,7 +40,7 @@
 
 // core/memory.h*
 #include "pbrt.h"
-#include <list>
+#include <atomic>
 #include <cstddef>
 
 namespace pbrt {
@@ -54,6 +54,8 @@ T *AllocAligned(size_t count) {
 }
 
 void FreeAligned(void *);
+void NumaFirstTouch(void *ptr, size_t size);
+uint8_t *AllocArenaBlock(size_t size);
 class
 #ifdef PBRT_HAVE_ALIGNAS
 alignas(PBRT_L1_CACHE_LINE_SIZE)
@@ -63,9 +65,7 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     // MemoryArena Public Methods
     MemoryArena(size_t blockSize = 262144) : blockSize(blockSize) {}
     ~MemoryArena() {
-        FreeAligned(currentBlock);
-        for (auto &block : usedBlocks) FreeAligned(block.second);
-        for (auto &block : availableBlocks) FreeAligned(block.second);
+        for (auto &block : blocks) FreeAligned(block.second);
     }
     void *Alloc(size_t nBytes) {
         // Round up _nBytes_ to minimum machine alignment
@@ -82,30 +82,20 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
 #endif
         nBytes = (nBytes + align - 1) & ~(align - 1);
         if (currentBlockPos + nBytes > currentAllocSize) {
-            // Add current block to _usedBlocks_ list
-            if (currentBlock) {
-                usedBlocks.push_back(
-                    std::make_pair(currentAllocSize, currentBlock));
-                currentBlock = nullptr;
-                currentAllocSize = 0;
-            }
-
             // Get new block of memory for _MemoryArena_
 
-            // Try to get memory block from _availableBlocks_
-            for (auto iter = availableBlocks.begin();
-                 iter != availableBlocks.end(); ++iter) {
-                if (iter->first >= nBytes) {
-                    currentAllocSize = iter->first;
-                    currentBlock = iter->second;
-                    availableBlocks.erase(iter);
-                    break;
-                }
-            }
-            if (!currentBlock) {
-                currentAllocSize = std::max(nBytes, blockSize);
-                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
+            // Try to get memory block from the blocks that aren't in use,
+            // allocating a new one if none is large enough
+            size_t i = nUsedBlocks;
+            while (i < blocks.size() && blocks[i].first < nBytes) ++i;
+            if (i == blocks.size()) {
+                size_t size = std::max(nBytes, blockSize);
+                blocks.push_back(std::make_pair(size, AllocArenaBlock(size)));
             }
+            std::swap(blocks[nUsedBlocks], blocks[i]);
+            currentAllocSize = blocks[nUsedBlocks].first;
+            currentBlock = blocks[nUsedBlocks].second;
+            ++nUsedBlocks;
             currentBlockPos = 0;
         }
         void *ret = currentBlock + currentBlockPos;
@@ -120,15 +110,23 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
         return ret;
     }
     void Reset() {
-        currentBlockPos = 0;
-        availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+        maxBytesUsed = MaxBytesUsed();
+        currentBlockPos = currentAllocSize = nUsedBlocks = 0;
+        currentBlock = nullptr;
     }
     size_t TotalAllocated() const {
-        size_t total = currentAllocSize;
-        for (const auto &alloc : usedBlocks) total += alloc.first;
-        for (const auto &alloc : availableBlocks) total += alloc.first;
+        size_t total = 0;
+        for (const auto &block : blocks) total += block.first;
         return total;
     }
+    size_t BytesUsed() const {
+        if (nUsedBlocks == 0) return 0;
+        size_t used = currentBlockPos;
+        for (size_t i = 0; i + 1 < nUsedBlocks; ++i) used += blocks[i].first;
+        return used;
+    }
+    size_t MaxBytesUsed() const { return std::max(maxBytesUsed, BytesUsed()); }
+    void ClearMaxBytesUsed() { maxBytesUsed = 0; }
 
   private:
     MemoryArena(const MemoryArena &) = delete;
@@ -137,7 +135,127 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     const size_t blockSize;
     size_t currentBlockPos = 0, currentAllocSize = 0;
     uint8_t *currentBlock = nullptr;
-    std::list<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks;
+    // Blocks are kept in a vector rather than lists of used and available
+    // blocks so that reusing them after _Reset()_ never allocates; the
+    // first _nUsedBlocks_ are in use, and the last of those is current.
+    std::vector<std::pair<size_t, uint8_t *>> blocks;
+    size_t nUsedBlocks = 0, maxBytesUsed = 0;
+};
+
+// ThreadArena Declarations
+// A _ThreadArena_ borrows a _MemoryArena_ from a pool kept by the calling
+// thread and resets and returns it when destroyed. The pool's arenas keep
+// their memory, so work units rendered later by the same thread, in this
+// frame or the next, don't allocate any; their blocks are large enough to
+// be backed by huge pages where the system supports it.
+class ThreadArena {
+  public:
+    // ThreadArena Public Methods
+    ThreadArena();
+    ~ThreadArena();
+    MemoryArena &operator*() { return *arena; }
+    MemoryArena *operator->() { return arena; }
+
+  private:
+    ThreadArena(const ThreadArena &) = delete;
+    ThreadArena &operator=(const ThreadArena &) = delete;
+    // ThreadArena Private Data
+    MemoryArena *arena;
+    size_t allocatedBefore;
+};
+
+// Memory Accounting Declarations
+// Categories that the large, long-lived allocations made while rendering
+// are charged to; see _TrackMemory()_.
+enum class MemoryCategory {
+    Meshes,
+    Acceleration,
+    Textures,
+    Ptex,
+    Lights,
+    Film,
+    PathGuiding,
+    SPPM,
+    MLT
+};
+static PBRT_CONSTEXPR int NumMemoryCategories = int(MemoryCategory::MLT) + 1;
+const char *MemoryCategoryName(MemoryCategory category);
+
+// Charges _bytes_ (which is negative when memory is freed) to _category_,
+// updating its live and peak usage. If the total live usage of all
+// categories exceeds the --memorybudget option, pbrt reports where the
+// memory went and exits.
+void TrackMemory(MemoryCategory category, int64_t bytes);
+int64_t TrackedMemoryInUse(MemoryCategory category);
+int64_t TrackedMemoryPeak(MemoryCategory category);
+int64_t TrackedMemoryInUse();
+int64_t TrackedMemoryPeak();
+// Adds the current usage of each category to the timeline printed by
+// _ReportMemoryUsage()_, labeled with _event_.
+void RecordMemoryUsage(const std::string &event);
+void ReportMemoryUsage(FILE *dest);
+void ClearMemoryUsage();
+
+// TrackedMemory holds the number of bytes that an object has charged to
+// a category and gives them back when it is destroyed; classes that own
+// large allocations keep one as a member and _Add()_ to it, possibly from
+// multiple threads, as they allocate.
+class TrackedMemory {
+  public:
+    // TrackedMemory Public Methods
+    explicit TrackedMemory(MemoryCategory category, int64_t bytes = 0)
+        : category(category) {
+        Add(bytes);
+    }
+    TrackedMemory(TrackedMemory &&tm)
+        : category(tm.category), bytes(tm.bytes.exchange(0)) {}
+    ~TrackedMemory() { Add(-bytes); }
+    void Add(int64_t b) {
+        if (b == 0) return;
+        bytes += b;
+        TrackMemory(category, b);
+    }
+    void Set(int64_t b) { Add(b - bytes); }
+    int64_t Bytes() const { return bytes; }
+
+  private:
+    TrackedMemory(const TrackedMemory &) = delete;
+    TrackedMemory &operator=(const TrackedMemory &) = delete;
+    // TrackedMemory Private Data
+    const MemoryCategory category;
+    std::atomic<int64_t> bytes{0};
+};
+
+// TrackedAllocator is a standard library allocator that charges the
+// memory of a container to a category.
+template <typename T, MemoryCategory category>
+class TrackedAllocator {
+  public:
+    // TrackedAllocator Public Methods
+    typedef T value_type;
+    template <typename U>
+    struct rebind {
+        typedef TrackedAllocator<U, category> other;
+    };
+    TrackedAllocator() = default;
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U, category> &) {}
+    T *allocate(size_t n) {
+        TrackMemory(category, int64_t(n * sizeof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *p, size_t n) {
+        std::allocator<T>().deallocate(p, n);
+        TrackMemory(category, -int64_t(n * sizeof(T)));
+    }
+    template <typename U>
+    bool operator==(const TrackedAllocator<U, category> &) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const TrackedAllocator<U, category> &) const {
+        return false;
+    }
 };
 
 template <typename T, int logBlockSize>
@@ -148,6 +266,7 @@ class BlockedArray {
         : uRes(uRes), vRes(vRes), uBlocks(RoundUp(uRes) >> logBlockSize) {
         int nAlloc = RoundUp(uRes) * RoundUp(vRes);
         data = AllocAligned<T>(nAlloc);
+        NumaFirstTouch(data, nAlloc * sizeof(T));
         for (int i = 0; i < nAlloc; ++i) new (&data[i]) T();
         if (d)
             for (int v = 0; v < vRes; ++v)
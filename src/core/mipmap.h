@@ -44,6 +44,7 @@
 #include "texture.h"
 #include "stats.h"
 #include "parallel.h"
+#include "memory.h"
 
 namespace pbrt {
 
@@ -108,6 +109,7 @@ class MIPMap {
     const ImageWrap wrapMode;
     Point2i resolution;
     std::vector<std::unique_ptr<BlockedArray<T>>> pyramid;
+    TrackedMemory trackedMemory{MemoryCategory::Textures};
     static PBRT_CONSTEXPR int WeightLUTSize = 128;
     static Float weightLut[WeightLUTSize];
 };
@@ -161,6 +163,7 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
         for (int i = 0; i < nThreads; ++i)
             resampleBufs.push_back(new T[resPow2[1]]);
         ParallelFor([&](int s) {
+            CHECK_GE(ThreadIndex, 0);
             T *workData = resampleBufs[ThreadIndex];
             for (int t = 0; t < resPow2[1]; ++t) {
                 workData[t] = 0.f;
@@ -186,6 +189,7 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
     pyramid.resize(nLevels);
 
     // Initialize most detailed level of MIPMap
+    trackedMemory.Add(int64_t(resolution[0]) * resolution[1] * sizeof(T));
     pyramid[0].reset(
         new BlockedArray<T>(resolution[0], resolution[1],
                             resampledImage ? resampledImage.get() : img));
@@ -193,6 +197,7 @@ MIPMap<T>::MIPMap(const Point2i &res, const T *img, bool doTrilinear,
         // Initialize $i$th MIPMap level from $i-1$st level
         int sRes = std::max(1, pyramid[i - 1]->uSize() / 2);
         int tRes = std::max(1, pyramid[i - 1]->vSize() / 2);
+        trackedMemory.Add(int64_t(sRes) * tRes * sizeof(T));
         pyramid[i].reset(new BlockedArray<T>(sRes, tRes));
 
         // Filter four texels from finer level of pyramid
@@ -35,22 +35,152 @@
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
 #include <thread>
 #include <condition_variable>
+#include <fstream>
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace pbrt {
 
+STAT_COUNTER("Parallel/Tasks run", nTasksRun);
+STAT_COUNTER("Parallel/Tasks stolen", nTasksStolen);
+
+// Parallel Local Declarations
+class Task {
+  public:
+    // Task Public Methods
+    virtual ~Task() {}
+    virtual void Run() = 0;
+
+    // Task Public Data
+    const uint64_t profilerState = CurrentProfilerState();
+};
+
+// Lock-free work-stealing deque of tasks (Chase and Lev 2005, with the
+// memory orderings from Le et al. 2013). Only the owning thread may call
+// Push() and Pop(), which work at the bottom end; any thread may Steal()
+// from the top.
+class WorkStealingDeque {
+  public:
+    // WorkStealingDeque Public Methods
+    WorkStealingDeque() : buffer(new Buffer(256)) {
+        buffers.emplace_back(buffer.load());
+    }
+    void Push(Task *task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer *buf = buffer.load(std::memory_order_relaxed);
+        if (b - t > buf->capacity - 1) buf = grow(buf, t, b);
+        buf->Put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    Task *Pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer *buf = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // The deque was already empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task *task = buf->Get(b);
+        if (t == b) {
+            // Race against thieves for the last task
+            if (!top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+    Task *Steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        Task *task = buffer.load(std::memory_order_acquire)->Get(t);
+        // Fail if the owner or another thief took the task first
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+    bool Empty() const {
+        return top.load(std::memory_order_relaxed) >=
+               bottom.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // WorkStealingDeque Private Declarations
+    struct Buffer {
+        Buffer(int64_t capacity)
+            : capacity(capacity), tasks(new std::atomic<Task *>[capacity]) {}
+        Task *Get(int64_t i) const {
+            return tasks[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void Put(int64_t i, Task *task) {
+            tasks[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+        }
+        const int64_t capacity;
+        std::unique_ptr<std::atomic<Task *>[]> tasks;
+    };
+
+    // WorkStealingDeque Private Methods
+    Buffer *grow(Buffer *old, int64_t t, int64_t b) {
+        Buffer *buf = new Buffer(2 * old->capacity);
+        for (int64_t i = t; i < b; ++i) buf->Put(i, old->Get(i));
+        // Thieves may still be reading from the old buffer, so it's only
+        // freed along with the deque
+        buffers.emplace_back(buf);
+        buffer.store(buf, std::memory_order_release);
+        return buf;
+    }
+
+    // WorkStealingDeque Private Data
+    std::atomic<int64_t> top{0}, bottom{0};
+    std::atomic<Buffer *> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
 // Parallel Local Definitions
 static std::vector<std::thread> threads;
-static bool shutdownThreads = false;
-class ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
+static std::atomic<bool> shutdownThreads{false};
+// One task deque for each thread that runs tasks, including the main
+// thread; _localDeque_ is the calling thread's, or _nullptr_ for threads
+// that aren't part of the thread pool.
+static std::vector<std::unique_ptr<WorkStealingDeque>> deques;
+static PBRT_THREAD_LOCAL WorkStealingDeque *localDeque = nullptr;
+
+// Idle worker threads sleep on _workerCondition_ until _wakeEpoch_ changes;
+// threads that spawn tasks only take _sleepMutex_ if _nSleeping_ says that
+// some workers may be asleep.
+static std::mutex sleepMutex;
+static std::condition_variable workerCondition;
+static uint64_t wakeEpoch = 0;
+static std::atomic<int> nSleeping{0};
+
+// NUMA mode thread placement: the node and core that each thread is pinned
+// to, indexed by _ThreadIndex_
+static int nNumaNodes = 1;
+static std::vector<int> threadNodes, threadCores;
+static PBRT_THREAD_LOCAL int threadNumaNode = 0;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+// The main thread's affinity before it was pinned, restored by
+// ParallelCleanup()
+static cpu_set_t mainThreadAffinity;
+#endif
 
 // Bookkeeping variables to help with the implementation of
-// MergeWorkerThreadStats().
-static std::atomic<bool> reportWorkerStats{false};
+// MergeWorkerThreadStats(). Each increment of _reportGeneration_ asks the
+// workers to report their stats once.
+static std::atomic<uint64_t> reportGeneration{0};
 // Number of workers that still need to report their stats.
 static std::atomic<int> reporterCount;
 // After kicking the workers to report their stats, the main thread waits
@@ -58,42 +188,6 @@ static std::atomic<int> reporterCount;
 static std::condition_variable reportDoneCondition;
 static std::mutex reportDoneMutex;
 
-class ParallelForLoop {
-  public:
-    // ParallelForLoop Public Methods
-    ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex,
-                    int chunkSize, uint64_t profilerState)
-        : func1D(std::move(func1D)),
-          maxIndex(maxIndex),
-          chunkSize(chunkSize),
-          profilerState(profilerState) {}
-    ParallelForLoop(const std::function<void(Point2i)> &f, const Point2i &count,
-                    uint64_t profilerState)
-        : func2D(f),
-          maxIndex(count.x * count.y),
-          chunkSize(1),
-          profilerState(profilerState) {
-        nX = count.x;
-    }
-
-  public:
-    // ParallelForLoop Private Data
-    std::function<void(int64_t)> func1D;
-    std::function<void(Point2i)> func2D;
-    const int64_t maxIndex;
-    const int chunkSize;
-    uint64_t profilerState;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
-    int nX = -1;
-
-    // ParallelForLoop Private Methods
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
-    }
-};
-
 void Barrier::Wait() {
     std::unique_lock<std::mutex> lock(mutex);
     CHECK_GT(count, 0);
@@ -107,11 +201,124 @@ void Barrier::Wait() {
         cv.wait(lock, [this] { return count == 0; });
 }
 
-static std::condition_variable workListCondition;
+static void WakeWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++wakeEpoch;
+    }
+    workerCondition.notify_all();
+}
+
+static void RunTask(Task *task) {
+    uint64_t oldState = ProfilerState;
+    ProfilerState = task->profilerState;
+    task->Run();
+    ProfilerState = oldState;
+    delete task;
+    ++nTasksRun;
+}
+
+// Queues _task_ on the calling thread's deque, where other threads can
+// steal it; threads outside the thread pool just run it immediately.
+static void Spawn(Task *task) {
+    if (!localDeque) {
+        RunTask(task);
+        return;
+    }
+    localDeque->Push(task);
+    // Pairs with the fence in _workerThreadFunc()_: either a worker going to
+    // sleep sees the new task or it's counted in _nSleeping_ here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nSleeping.load(std::memory_order_relaxed) > 0) WakeWorkers();
+}
+
+static Task *StealTask() {
+    // Try the other threads' deques, starting at a random one
+    static PBRT_THREAD_LOCAL uint32_t rngState = 0;
+    if (rngState == 0) rngState = 2654435761u * (ThreadIndex + 1);
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    int nDeques = deques.size();
+    for (int i = 0; i < nDeques; ++i) {
+        WorkStealingDeque *victim = deques[(rngState + i) % nDeques].get();
+        if (victim == localDeque) continue;
+        if (Task *task = victim->Steal()) {
+            ++nTasksStolen;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+// Runs one of the calling thread's tasks, or one stolen from another
+// thread; returns false if there weren't any to be found.
+static bool RunOneTask() {
+    Task *task = localDeque->Pop();
+    if (!task) task = StealTask();
+    if (!task) return false;
+    RunTask(task);
+    return true;
+}
+
+static bool AnyTasksQueued() {
+    for (const auto &deque : deques)
+        if (!deque->Empty()) return true;
+    return false;
+}
+
+// Returns the cores of each of the system's NUMA nodes, or a single node
+// with all of the cores if that information isn't available.
+static std::vector<std::vector<int>> NumaTopology() {
+    std::vector<std::vector<int>> nodes;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    // Parse Linux's lists of each node's cores, e.g. "0-7,16-23"
+    for (int node = 0;; ++node) {
+        std::ifstream in(StringPrintf("/sys/devices/system/node/node%d/cpulist",
+                                      node));
+        std::string list;
+        if (!in || !std::getline(in, list)) break;
+        std::vector<int> cores;
+        const char *p = list.c_str();
+        while (*p) {
+            char *end;
+            int first = strtol(p, &end, 10), last = first;
+            if (end == p) break;
+            if (*end == '-') last = strtol(end + 1, &end, 10);
+            for (int core = first; core <= last; ++core)
+                cores.push_back(core);
+            p = (*end == ',') ? end + 1 : end;
+        }
+        if (!cores.empty()) nodes.push_back(std::move(cores));
+    }
+#endif
+    if (nodes.empty()) {
+        nodes.resize(1);
+        for (int core = 0; core < NumSystemCores(); ++core)
+            nodes[0].push_back(core);
+    }
+    return nodes;
+}
+
+// Pins the calling thread to the core chosen for it by ParallelInit().
+static void PinThread(int tIndex) {
+    if (threadNodes.empty()) return;
+    threadNumaNode = threadNodes[tIndex];
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(threadCores[tIndex], &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        Warning("Unable to pin thread %d to core %d", tIndex,
+                threadCores[tIndex]);
+#endif
+}
 
 static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Started execution in worker thread " << tIndex;
     ThreadIndex = tIndex;
+    localDeque = deques[tIndex].get();
+    PinThread(tIndex);
 
     // Give the profiler a chance to do per-thread initialization for
     // the worker thread before the profiling system actually stops running.
@@ -126,119 +333,103 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
+    uint64_t reportedGeneration = 0;
+    int idleRounds = 0;
     while (!shutdownThreads) {
-        if (reportWorkerStats) {
+        if (reportGeneration != reportedGeneration) {
+            reportedGeneration = reportGeneration;
             ReportThreadStats();
-            if (--reporterCount == 0)
+            if (--reporterCount == 0) {
                 // Once all worker threads have merged their stats, wake up
                 // the main thread.
+                std::lock_guard<std::mutex> lock(reportDoneMutex);
                 reportDoneCondition.notify_one();
-            // Now sleep again.
-            workListCondition.wait(lock);
-        } else if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd =
-                std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                uint64_t oldState = ProfilerState;
-                ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                ProfilerState = oldState;
             }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) workListCondition.notify_all();
+        } else if (RunOneTask())
+            idleRounds = 0;
+        else if (++idleRounds < 64)
+            // Keep looking for a while before going to sleep, since more
+            // tasks are often spawned soon
+            std::this_thread::yield();
+        else {
+            // Sleep until more tasks are spawned
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            ++nSleeping;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint64_t epoch = wakeEpoch;
+            if (!AnyTasksQueued())
+                workerCondition.wait(lock, [&] {
+                    return wakeEpoch != epoch || shutdownThreads ||
+                           reportGeneration != reportedGeneration;
+                });
+            --nSleeping;
+            idleRounds = 0;
         }
     }
+    localDeque = nullptr;
     LOG(INFO) << "Exiting worker thread " << tIndex;
 }
 
+class ParallelForTask : public Task {
+  public:
+    // ParallelForTask Public Methods
+    ParallelForTask(const std::function<void(int64_t)> &func, int64_t begin,
+                    int64_t end, int chunkSize,
+                    std::atomic<int64_t> *remaining)
+        : func(func),
+          begin(begin),
+          end(end),
+          chunkSize(chunkSize),
+          remaining(remaining) {}
+    void Run() {
+        // Split off the upper half of the range as a new task until only
+        // one chunk is left, so that idle threads can steal large ranges
+        while (end - begin > chunkSize) {
+            int64_t nChunks = (end - begin + chunkSize - 1) / chunkSize;
+            int64_t mid = begin + (nChunks / 2) * chunkSize;
+            Spawn(new ParallelForTask(func, mid, end, chunkSize, remaining));
+            end = mid;
+        }
+        for (int64_t index = begin; index < end; ++index) func(index);
+        // The loop's caller may return as soon as _remaining_ reaches
+        // zero, so it mustn't be accessed after this
+        remaining->fetch_sub(end - begin);
+    }
+
+  private:
+    // ParallelForTask Private Data
+    const std::function<void(int64_t)> &func;
+    int64_t begin, end;
+    const int chunkSize;
+    std::atomic<int64_t> *remaining;
+};
+
 // Parallel Definitions
 void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize) {
     CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
 
     // Run iterations immediately if not using threads or if _count_ is small
-    if (threads.empty() || count < chunkSize) {
+    if (threads.empty() || !localDeque || count < chunkSize) {
         for (int64_t i = 0; i < count; ++i) func(i);
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
-    ParallelForLoop loop(std::move(func), count, chunkSize,
-                         CurrentProfilerState());
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
+    // Run the loop as a task, splitting it up as other threads steal work
+    std::atomic<int64_t> remaining{count};
+    ParallelForTask loop(func, 0, count, std::max(1, chunkSize), &remaining);
+    loop.Run();
 
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    // Help out with other tasks until all of the loop's iterations are done;
+    // they may include other loops' tasks, so nested loops make progress
+    while (remaining.load(std::memory_order_acquire) > 0)
+        if (!RunOneTask()) std::this_thread::yield();
 }
 
-PBRT_THREAD_LOCAL int ThreadIndex;
+// Threads that aren't part of the thread pool don't have an index; static
+// initialization runs on the main thread, which is always thread 0.
+PBRT_THREAD_LOCAL int ThreadIndex = -1;
+static bool mainThreadIndexSet = (ThreadIndex = 0, true);
 
 int MaxThreadIndex() {
     return PbrtOptions.nThreads == 0 ? NumSystemCores() : PbrtOptions.nThreads;
@@ -247,65 +438,64 @@ int MaxThreadIndex() {
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
     CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
 
-    if (threads.empty() || count.x * count.y <= 1) {
+    if (threads.empty() || !localDeque || count.x * count.y <= 1) {
         for (int y = 0; y < count.y; ++y)
             for (int x = 0; x < count.x; ++x) func(Point2i(x, y));
         return;
     }
-
-    ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    ParallelFor([&](int64_t index) {
+        func(Point2i(index % count.x, index / count.x));
+    }, int64_t(count.x) * count.y);
 }
 
 int NumSystemCores() {
     return std::max(1u, std::thread::hardware_concurrency());
 }
 
+int NumaNodeCount() { return nNumaNodes; }
+
+int ThreadNumaNode() { return threadNumaNode; }
+
 void ParallelInit() {
     CHECK_EQ(threads.size(), 0);
     int nThreads = MaxThreadIndex();
     ThreadIndex = 0;
+    if (nThreads > 1) {
+        for (int i = 0; i < nThreads; ++i)
+            deques.push_back(std::unique_ptr<WorkStealingDeque>(
+                new WorkStealingDeque));
+        localDeque = deques[0].get();
+    }
+    if (PbrtOptions.numa) {
+        // Give each NUMA node a contiguous range of thread indices, in
+        // proportion to its number of cores, and pin them to its cores
+        std::vector<std::vector<int>> nodes = NumaTopology();
+        int nCores = 0;
+        for (const auto &cores : nodes) nCores += cores.size();
+        threadNodes.resize(nThreads);
+        threadCores.resize(nThreads);
+        int node = 0, nodeStart = 0, nodeCoresBefore = 0;
+        for (int t = 0; t < nThreads; ++t) {
+            while (node + 1 < (int)nodes.size() &&
+                   int64_t(t) * nCores >=
+                       int64_t(nodeCoresBefore + nodes[node].size()) *
+                           nThreads) {
+                nodeCoresBefore += nodes[node].size();
+                ++node;
+                nodeStart = t;
+            }
+            threadNodes[t] = node;
+            threadCores[t] = nodes[node][(t - nodeStart) % nodes[node].size()];
+        }
+        nNumaNodes = threadNodes.back() + 1;
+        LOG(INFO) << "NUMA mode: " << nThreads << " threads on " << nNumaNodes
+                  << " of " << nodes.size() << " nodes";
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+        pthread_getaffinity_np(pthread_self(), sizeof(mainThreadAffinity),
+                               &mainThreadAffinity);
+#endif
+        PinThread(0);
+    }
 
     // Create a barrier so that we can be sure all worker threads get past
     // their call to ProfilerWorkerThreadInit() before we return from this
@@ -322,34 +512,171 @@ void ParallelInit() {
 }
 
 void ParallelCleanup() {
-    if (threads.empty()) return;
-
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        shutdownThreads = true;
-        workListCondition.notify_all();
+    if (!threadNodes.empty()) {
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+        pthread_setaffinity_np(pthread_self(), sizeof(mainThreadAffinity),
+                               &mainThreadAffinity);
+#endif
+        nNumaNodes = 1;
+        threadNodes.clear();
+        threadCores.clear();
+        threadNumaNode = 0;
     }
+    if (threads.empty()) return;
 
+    // Run any tasks left for group work that _TaskGroup::Wait()_ ran itself;
+    // they've already been claimed, so they just free themselves
+    while (RunOneTask()) continue;
+    shutdownThreads = true;
+    WakeWorkers();
     for (std::thread &thread : threads) thread.join();
     threads.erase(threads.begin(), threads.end());
     shutdownThreads = false;
+    for (const auto &deque : deques) CHECK(deque->Empty());
+    deques.clear();
+    localDeque = nullptr;
 }
 
 void MergeWorkerThreadStats() {
-    std::unique_lock<std::mutex> lock(workListMutex);
+    if (threads.empty()) return;
     std::unique_lock<std::mutex> doneLock(reportDoneMutex);
     // Set up state so that the worker threads will know that we would like
     // them to report their thread-specific stats when they wake up.
-    reportWorkerStats = true;
     reporterCount = threads.size();
+    ++reportGeneration;
 
     // Wake up the worker threads.
-    workListCondition.notify_all();
+    WakeWorkers();
 
     // Wait for all of them to merge their stats.
-    reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
+    reportDoneCondition.wait(doneLock, []() { return reporterCount == 0; });
+}
 
-    reportWorkerStats = false;
+// TaskGroup Method Definitions
+// A function run as one of a group's tasks; it's claimed by whichever
+// thread gets to it first, either through the task queued for it or from
+// the group's list of queued work in _TaskGroup::Wait()_.
+struct GroupWork {
+    GroupWork(std::function<void()> func) : func(std::move(func)) {}
+    std::function<void()> func;
+    std::atomic<bool> claimed{false};
+    const uint64_t profilerState = CurrentProfilerState();
+};
+
+struct TaskGroupState {
+    // Number of the group's tasks that are queued or running
+    std::atomic<int64_t> pending{0};
+    // Continuations waiting for _pending_ to reach zero, and the group's
+    // queued work that threads waiting for the group may run
+    std::mutex mutex;
+    std::vector<std::function<void()>> continuations;
+    std::vector<std::shared_ptr<GroupWork>> queued;
+    size_t pruneSize = 64;
+};
+
+static void SpawnGroupWork(std::function<void()> func,
+                           const std::shared_ptr<TaskGroupState> &state);
+
+// Runs _work_ unless another thread has already claimed it.
+static void RunGroupWork(GroupWork &work,
+                         const std::shared_ptr<TaskGroupState> &state) {
+    if (work.claimed.exchange(true)) return;
+    work.func();
+    // Spawn the group's continuations if this was its last task; the
+    // _TaskGroup_ may be gone by now, but _state_ is kept alive by the
+    // caller's reference to it
+    if (--state->pending > 0) return;
+    std::vector<std::function<void()>> continuations;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->pending > 0) return;
+        // All of the queued work has been claimed
+        state->queued.clear();
+        continuations.swap(state->continuations);
+        state->pending += continuations.size();
+    }
+    for (auto &c : continuations) SpawnGroupWork(std::move(c), state);
+}
+
+class GroupTask : public Task {
+  public:
+    // GroupTask Public Methods
+    GroupTask(std::shared_ptr<GroupWork> work,
+              std::shared_ptr<TaskGroupState> state)
+        : work(std::move(work)), state(std::move(state)) {}
+    void Run() { RunGroupWork(*work, state); }
+
+  private:
+    // GroupTask Private Data
+    std::shared_ptr<GroupWork> work;
+    std::shared_ptr<TaskGroupState> state;
+};
+
+static void SpawnGroupWork(std::function<void()> func,
+                           const std::shared_ptr<TaskGroupState> &state) {
+    std::shared_ptr<GroupWork> work =
+        std::make_shared<GroupWork>(std::move(func));
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        // Drop work that has already run whenever the list doubles in size
+        std::vector<std::shared_ptr<GroupWork>> &queued = state->queued;
+        if (queued.size() >= state->pruneSize) {
+            auto run = [](const std::shared_ptr<GroupWork> &w) {
+                return w->claimed.load();
+            };
+            queued.erase(std::remove_if(queued.begin(), queued.end(), run),
+                         queued.end());
+            state->pruneSize = std::max<size_t>(64, 2 * queued.size());
+        }
+        queued.push_back(work);
+    }
+    Spawn(new GroupTask(std::move(work), state));
+}
+
+TaskGroup::TaskGroup() : state(std::make_shared<TaskGroupState>()) {}
+
+TaskGroup::~TaskGroup() { Wait(); }
+
+void TaskGroup::Run(std::function<void()> func) {
+    ++state->pending;
+    SpawnGroupWork(std::move(func), state);
+}
+
+void TaskGroup::Then(std::function<void()> func) {
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->pending > 0) {
+            state->continuations.push_back(std::move(func));
+            return;
+        }
+        ++state->pending;
+    }
+    SpawnGroupWork(std::move(func), state);
+}
+
+void TaskGroup::Wait() {
+    while (true) {
+        std::shared_ptr<GroupWork> work;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->pending == 0 && state->continuations.empty()) return;
+            // Only help with this group's own work: other tasks might
+            // block on something that the caller is holding
+            std::vector<std::shared_ptr<GroupWork>> &queued = state->queued;
+            while (!queued.empty() && !work) {
+                if (!queued.back()->claimed) work = queued.back();
+                queued.pop_back();
+            }
+        }
+        if (!work) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t oldState = ProfilerState;
+        ProfilerState = work->profilerState;
+        RunGroupWork(*work, state);
+        ProfilerState = oldState;
+    }
 }
 
 }  // namespace pbrt
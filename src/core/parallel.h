@@ -98,12 +98,44 @@ class Barrier {
     int count;
 };
 
+// TaskGroup Declarations
+struct TaskGroupState;
+
+// Runs functions as tasks on the same work-stealing scheduler as
+// ParallelFor(). Tasks may spawn further tasks and may themselves call
+// ParallelFor(); threads waiting for loops to finish run other queued
+// tasks in the meantime, while _Wait()_ only runs the group's own tasks.
+class TaskGroup {
+  public:
+    // TaskGroup Public Methods
+    TaskGroup();
+    ~TaskGroup();
+    void Run(std::function<void()> func);
+    // Adds a continuation: _func_ is run as a task of the group once it has
+    // no other queued or running tasks, without blocking the caller.
+    void Then(std::function<void()> func);
+    // Runs tasks until all of the group's tasks and continuations are done.
+    void Wait();
+
+  private:
+    // TaskGroup Private Data
+    std::shared_ptr<TaskGroupState> state;
+};
+
+// Loop iterations are run in chunks of _chunkSize_ iterations, which are
+// distributed with work stealing; calls may be nested.
 void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize = 1);
+// Index of the calling thread in the thread pool, for indexing per-thread
+// data; it's -1 for threads that aren't part of the pool.
 extern PBRT_THREAD_LOCAL int ThreadIndex;
 void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count);
 int MaxThreadIndex();
 int NumSystemCores();
+// In NUMA mode (_Options::numa_), threads are pinned to cores and spread
+// over the machine's NUMA nodes; otherwise all threads are on node 0.
+int NumaNodeCount();
+int ThreadNumaNode();
 
 void ParallelInit();
 void ParallelCleanup();
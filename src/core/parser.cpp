@@ -33,6 +33,7 @@
 // core/parser.cpp*
 #include "parser.h"
 #include "api.h"
+#include "checkpoint.h"
 #include "fileutil.h"
 #include "memory.h"
 #include "paramset.h"
@@ -212,6 +213,7 @@ Tokenizer::Tokenizer(std::string str,
     pos = contents.data();
     end = pos + contents.size();
     tokenizerMemory += contents.size();
+    AddToCheckpointSceneHash(pos, contents.size());
 }
 
 #if defined(PBRT_HAVE_MMAP) || defined(PBRT_IS_WINDOWS)
@@ -223,6 +225,7 @@ Tokenizer::Tokenizer(void *ptr, size_t len, std::string filename,
       unmapLength(len) {
     pos = (const char *)ptr;
     end = pos + len;
+    AddToCheckpointSceneHash(pos, len);
 }
 #endif
 
@@ -119,6 +119,7 @@ class Shape;
 class Primitive;
 class GeometricPrimitive;
 class TransformedPrimitive;
+struct OccluderCache;
 template <int nSpectrumSamples>
 class CoefficientSpectrum;
 class RGBSpectrum;
@@ -135,6 +136,8 @@ class Sampler;
 class Filter;
 class Film;
 class FilmTile;
+class TileScheduler;
+class Checkpoint;
 class BxDF;
 class BRDF;
 class BTDF;
@@ -154,6 +157,7 @@ class VisibilityTester;
 class AreaLight;
 struct Distribution1D;
 class Distribution2D;
+class LightDistribution;
 #ifdef PBRT_FLOAT_AS_DOUBLE
   typedef double Float;
 #else
@@ -178,6 +182,23 @@ struct Options {
     int nThreads = 0;
     bool quickRender = false;
     bool quiet = false;
+    bool numa = false;
+    // Progressive rendering limits, in seconds and relative error; zero
+    // means no limit
+    Float timeLimit = 0, targetNoise = 0;
+    Float writeInterval = 0;
+    // Distributed rendering: the port to hand out work units on, or the
+    // host:port of the coordinator to render work units for
+    int coordinatorPort = 0;
+    std::string coordinatorAddress;
+    // Checkpointing: the file to save render state to every
+    // _checkpointInterval_ seconds, and whether to resume from it
+    std::string checkpointFile;
+    Float checkpointInterval = 600;
+    bool resume = false;
+    // The most memory, in bytes, that the allocations tracked by
+    // _TrackMemory()_ may use; zero means no limit
+    int64_t memoryBudget = 0;
     bool cat = false, toPly = false;
     std::string imageFile;
     // x0, x1, y0, y1
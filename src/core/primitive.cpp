@@ -43,6 +43,15 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+void Primitive::ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si,
+                                                int n, MemoryArena &arena,
+                                                TransportMode mode,
+                                                bool allowMultipleLobes) const {
+    for (int i = 0; i < n; ++i)
+        si[i]->primitive->ComputeScatteringFunctions(si[i], arena, mode,
+                                                     allowMultipleLobes);
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -95,6 +104,112 @@ bool TransformedPrimitive::IntersectP(const Ray &r) const {
     return primitive->IntersectP(InterpolatedWorldToPrim(r));
 }
 
+// PrimitiveArray Method Definitions
+bool PrimitiveArray::Intersect(const Ray &r, SurfaceInteraction *isect) const {
+    bool hit = false;
+    for (int i = 0; i < NumElements(); ++i)
+        if (Intersect(i, r, isect)) hit = true;
+    return hit;
+}
+
+bool PrimitiveArray::IntersectP(const Ray &r) const {
+    for (int i = 0; i < NumElements(); ++i)
+        if (IntersectP(i, r)) return true;
+    return false;
+}
+
+// InstanceArrayPrimitive Method Definitions
+InstanceArrayPrimitive::InstanceArrayPrimitive() {
+    primitiveMemory += sizeof(*this);
+}
+
+int InstanceArrayPrimitive::AddPrototype(
+    const std::shared_ptr<Primitive> &prototype) {
+    prototypes.push_back(prototype);
+    return prototypes.size() - 1;
+}
+
+void InstanceArrayPrimitive::AddInstance(int prototype,
+                                         const Transform &InstanceToWorld) {
+    CHECK_LT(prototype, (int)prototypes.size());
+    Instance instance;
+    const Matrix4x4 &m = InstanceToWorld.GetMatrix();
+    const Matrix4x4 &mInv = InstanceToWorld.GetInverseMatrix();
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j) {
+            instance.instanceToWorld[i][j] = m.m[i][j];
+            instance.worldToInstance[i][j] = mInv.m[i][j];
+        }
+    instance.prototype = prototype;
+    instances.push_back(instance);
+    primitiveMemory += sizeof(Instance);
+    worldBound = Union(worldBound, ElementBound(instances.size() - 1));
+}
+
+// Returns the full _Transform_ for a 3x4 affine matrix and its inverse.
+static Transform AffineTransform(const Float m[3][4], const Float mInv[3][4]) {
+    return Transform(Matrix4x4(m[0][0], m[0][1], m[0][2], m[0][3], m[1][0],
+                               m[1][1], m[1][2], m[1][3], m[2][0], m[2][1],
+                               m[2][2], m[2][3], 0, 0, 0, 1),
+                     Matrix4x4(mInv[0][0], mInv[0][1], mInv[0][2], mInv[0][3],
+                               mInv[1][0], mInv[1][1], mInv[1][2], mInv[1][3],
+                               mInv[2][0], mInv[2][1], mInv[2][2], mInv[2][3],
+                               0, 0, 0, 1));
+}
+
+// Transforms _r_ by the 3x4 affine matrix _m_; this matches
+// _Transform::operator()(const Ray &)_, including offsetting the origin
+// by its rounding error bounds.
+static Ray TransformRayAffine(const Float m[3][4], const Ray &r) {
+    Point3f o;
+    for (int i = 0; i < 3; ++i)
+        o[i] = (m[i][0] * r.o.x + m[i][1] * r.o.y) +
+               (m[i][2] * r.o.z + m[i][3]);
+    Vector3f oError;
+    for (int i = 0; i < 3; ++i)
+        oError[i] = gamma(3) * (std::abs(m[i][0] * r.o.x) +
+                                std::abs(m[i][1] * r.o.y) +
+                                std::abs(m[i][2] * r.o.z) + std::abs(m[i][3]));
+    Vector3f d(m[0][0] * r.d.x + m[0][1] * r.d.y + m[0][2] * r.d.z,
+               m[1][0] * r.d.x + m[1][1] * r.d.y + m[1][2] * r.d.z,
+               m[2][0] * r.d.x + m[2][1] * r.d.y + m[2][2] * r.d.z);
+    // Offset ray origin to edge of error bounds and compute _tMax_
+    Float lengthSquared = d.LengthSquared();
+    Float tMax = r.tMax;
+    if (lengthSquared > 0) {
+        Float dt = Dot(Abs(d), oError) / lengthSquared;
+        o += d * dt;
+        tMax -= dt;
+    }
+    return Ray(o, d, tMax, r.time, r.medium);
+}
+
+Bounds3f InstanceArrayPrimitive::ElementBound(int index) const {
+    const Instance &instance = instances[index];
+    return AffineTransform(instance.instanceToWorld, instance.worldToInstance)(
+        prototypes[instance.prototype]->WorldBound());
+}
+
+bool InstanceArrayPrimitive::Intersect(int index, const Ray &r,
+                                       SurfaceInteraction *isect) const {
+    // Transform _r_ to the instance's space, where its prototype is stored
+    const Instance &instance = instances[index];
+    Ray ray = TransformRayAffine(instance.worldToInstance, r);
+    if (!prototypes[instance.prototype]->Intersect(ray, isect)) return false;
+    r.tMax = ray.tMax;
+    // Transform instance's intersection data to world space
+    *isect = AffineTransform(instance.instanceToWorld,
+                             instance.worldToInstance)(*isect);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+    return true;
+}
+
+bool InstanceArrayPrimitive::IntersectP(int index, const Ray &r) const {
+    const Instance &instance = instances[index];
+    return prototypes[instance.prototype]->IntersectP(
+        TransformRayAffine(instance.worldToInstance, r));
+}
+
 // GeometricPrimitive Method Definitions
 GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
                                        const std::shared_ptr<Material> &material,
@@ -147,4 +262,15 @@ void GeometricPrimitive::ComputeScatteringFunctions(
     CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
 }
 
+void GeometricPrimitive::ComputeScatteringFunctionsBatch(
+    SurfaceInteraction *const *si, int n, MemoryArena &arena,
+    TransportMode mode, bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctionsBatch(si, n, arena, mode,
+                                                  allowMultipleLobes);
+    for (int i = 0; i < n; ++i)
+        CHECK_GE(Dot(si[i]->n, si[i]->shading.n), 0.);
+}
+
 }  // namespace pbrt
@@ -47,20 +47,45 @@
 
 namespace pbrt {
 
+// OccluderCache Declarations
+struct OccluderCache {
+    // The aggregate that most recently found an occluder for the rays using
+    // this cache, and the aggregate-specific index of that occluder
+    const Primitive *aggregate = nullptr;
+    int index = -1;
+};
+
 // Primitive Declarations
 class Primitive {
   public:
     // Primitive Interface
     virtual ~Primitive();
     virtual Bounds3f WorldBound() const = 0;
+    // Returns bounds of the primitive over the times _time0_ to _time1_;
+    // primitives that don't move just return their world bounds.
+    virtual Bounds3f MotionBounds(Float time0, Float time1) const {
+        return WorldBound();
+    }
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Shadow ray test that may first check the occluder recorded in _cache_
+    // and record the occluder it finds there; aggregates that don't
+    // support occluder caching just call _IntersectP()_.
+    virtual bool IntersectPCached(const Ray &r, OccluderCache *cache) const {
+        return IntersectP(r);
+    }
     virtual const AreaLight *GetAreaLight() const = 0;
     virtual const Material *GetMaterial() const = 0;
     virtual void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                             MemoryArena &arena,
                                             TransportMode mode,
                                             bool allowMultipleLobes) const = 0;
+    // Computes the scattering functions of the _n_ hits in _si_, all of
+    // which are on primitives of this primitive's type with its material;
+    // the default just calls each hit's _ComputeScatteringFunctions()_.
+    virtual void ComputeScatteringFunctionsBatch(
+        SurfaceInteraction *const *si, int n, MemoryArena &arena,
+        TransportMode mode, bool allowMultipleLobes) const;
 };
 
 // GeometricPrimitive Declarations
@@ -79,6 +104,9 @@ class GeometricPrimitive : public Primitive {
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                     MemoryArena &arena, TransportMode mode,
                                     bool allowMultipleLobes) const;
+    void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si, int n,
+                                         MemoryArena &arena, TransportMode mode,
+                                         bool allowMultipleLobes) const;
 
   private:
     // GeometricPrimitive Private Data
@@ -108,6 +136,10 @@ class TransformedPrimitive : public Primitive {
     Bounds3f WorldBound() const {
         return PrimitiveToWorld.MotionBounds(primitive->WorldBound());
     }
+    Bounds3f MotionBounds(Float time0, Float time1) const {
+        return PrimitiveToWorld.MotionBounds(
+            primitive->MotionBounds(time0, time1), time0, time1);
+    }
 
   private:
     // TransformedPrimitive Private Data
@@ -115,6 +147,62 @@ class TransformedPrimitive : public Primitive {
     const AnimatedTransform PrimitiveToWorld;
 };
 
+// PrimitiveArray Declarations
+class PrimitiveArray : public Primitive {
+  public:
+    // PrimitiveArray Interface
+
+    // A _PrimitiveArray_ is made of many elements that an aggregate may
+    // bound and intersect individually, without a _Primitive_ for each.
+    virtual int NumElements() const = 0;
+    virtual Bounds3f ElementBound(int index) const = 0;
+    virtual bool Intersect(int index, const Ray &r,
+                           SurfaceInteraction *isect) const = 0;
+    virtual bool IntersectP(int index, const Ray &r) const = 0;
+
+    // The whole-array methods test every element; aggregates normally use
+    // the per-element variants above instead.
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+};
+
+// InstanceArrayPrimitive Declarations
+class InstanceArrayPrimitive : public PrimitiveArray {
+  public:
+    // InstanceArrayPrimitive Public Methods
+    InstanceArrayPrimitive();
+    int AddPrototype(const std::shared_ptr<Primitive> &prototype);
+    void AddInstance(int prototype, const Transform &InstanceToWorld);
+    int NumElements() const { return instances.size(); }
+    Bounds3f ElementBound(int index) const;
+    bool Intersect(int index, const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(int index, const Ray &r) const;
+    using PrimitiveArray::Intersect;
+    using PrimitiveArray::IntersectP;
+    Bounds3f WorldBound() const { return worldBound; }
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return nullptr; }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const {
+        LOG(FATAL) << "InstanceArrayPrimitive::ComputeScatteringFunctions() "
+                      "shouldn't be called";
+    }
+
+  private:
+    // InstanceArrayPrimitive Private Data
+
+    // Each instance stores its affine transformations as 3x4 matrices
+    // (the last row is always (0, 0, 0, 1)) and the index of its prototype
+    struct Instance {
+        Float instanceToWorld[3][4], worldToInstance[3][4];
+        int prototype;
+    };
+    std::vector<std::shared_ptr<Primitive>> prototypes;
+    std::vector<Instance> instances;
+    Bounds3f worldBound;
+};
+
 // Aggregate Declarations
 class Aggregate : public Primitive {
   public:
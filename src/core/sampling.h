@@ -68,6 +68,9 @@ struct Distribution1D {
         }
     }
     int Count() const { return (int)func.size(); }
+    size_t BytesUsed() const {
+        return sizeof(*this) + (func.capacity() + cdf.capacity()) * sizeof(Float);
+    }
     Float SampleContinuous(Float u, Float *pdf, int *off = nullptr) const {
         // Find surrounding CDF segments and _offset_
         int offset = FindInterval((int)cdf.size(),
@@ -139,6 +142,12 @@ class Distribution2D {
             Clamp(int(p[1] * pMarginal->Count()), 0, pMarginal->Count() - 1);
         return pConditionalV[iv]->func[iu] / pMarginal->funcInt;
     }
+    size_t BytesUsed() const {
+        size_t bytes = sizeof(*this) + pMarginal->BytesUsed() +
+                       pConditionalV.capacity() * sizeof(pConditionalV[0]);
+        for (const auto &d : pConditionalV) bytes += d->BytesUsed();
+        return bytes;
+    }
 
   private:
     // Distribution2D Private Data
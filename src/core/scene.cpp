@@ -54,6 +54,12 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+bool Scene::IntersectP(const Ray &ray, OccluderCache *cache) const {
+    ++nShadowTests;
+    DCHECK_NE(ray.d, Vector3f(0,0,0));
+    return aggregate->IntersectPCached(ray, cache);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
@@ -0,0 +1,260 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/sdtree.cpp*
+#include "sdtree.h"
+#include "sampling.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("Path guiding/Spatial leaves", nSpatialLeaves);
+STAT_INT_DISTRIBUTION("Path guiding/Directional tree nodes", dTreeNodes);
+
+// Spatial leaves are split once they receive more than
+// _SpatialSplitThreshold_ times the square root of the number of samples
+// per pixel of the training pass; the quadrants of directional trees are
+// split if they hold more than _DirectionalSplitThreshold_ of the tree's
+// radiance.
+static PBRT_CONSTEXPR Float SpatialSplitThreshold = 12000;
+static PBRT_CONSTEXPR Float DirectionalSplitThreshold = 0.01;
+static PBRT_CONSTEXPR int MaxDTreeDepth = 20;
+
+// DTree Utility Functions
+static Point2f DirectionToSquare(const Vector3f &w) {
+    Float cosTheta = Clamp(w.z, -1, 1);
+    return Point2f(std::min((cosTheta + 1) / 2, OneMinusEpsilon),
+                   std::min(SphericalPhi(w) * Inv2Pi, OneMinusEpsilon));
+}
+
+static Vector3f SquareToDirection(const Point2f &p) {
+    Float cosTheta = 2 * p.x - 1;
+    Float sinTheta = std::sqrt(std::max((Float)0, 1 - cosTheta * cosTheta));
+    return SphericalDirection(sinTheta, cosTheta, 2 * Pi * p.y);
+}
+
+// Returns the quadrant of the unit square that _p_ is in and remaps _p_
+// to the unit square over that quadrant
+static int ChildQuadrant(Point2f *p) {
+    int qx = p->x >= 0.5f ? 1 : 0, qy = p->y >= 0.5f ? 1 : 0;
+    p->x = std::min(2 * p->x - qx, OneMinusEpsilon);
+    p->y = std::min(2 * p->y - qy, OneMinusEpsilon);
+    return qx + 2 * qy;
+}
+
+// DTree Method Definitions
+DTree::DTree() : nodes(1), sums(new AtomicFloat[4]) {}
+
+DTree::DTree(const DTree &tree)
+    : nodes(tree.nodes), sums(new AtomicFloat[4 * tree.nodes.size()]) {
+    for (size_t i = 0; i < 4 * nodes.size(); ++i) sums[i] = Float(tree.sums[i]);
+}
+
+DTree &DTree::operator=(const DTree &tree) {
+    if (this != &tree) *this = DTree(tree);
+    return *this;
+}
+
+void DTree::Record(const Vector3f &w, Float value) {
+    Point2f p = DirectionToSquare(w);
+    int node = 0;
+    for (;;) {
+        int q = ChildQuadrant(&p);
+        sums[4 * node + q].Add(value);
+        if (!nodes[node].children[q]) return;
+        node = nodes[node].children[q];
+    }
+}
+
+Float DTree::Total() const {
+    return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+Vector3f DTree::Sample(const Point2f &uSample) const {
+    Point2f u = uSample, origin(0, 0);
+    Float size = 1;
+    int node = 0;
+    for (;;) {
+        Float s[4] = {sums[4 * node], sums[4 * node + 1], sums[4 * node + 2],
+                      sums[4 * node + 3]};
+        Float total = s[0] + s[1] + s[2] + s[3];
+        if (total <= 0) {
+            for (int i = 0; i < 4; ++i) s[i] = 1;
+            total = 4;
+        }
+        // Choose the quadrant's column and then its row in proportion to
+        // their radiance
+        int qx = 0, qy = 0;
+        Float pLeft = (s[0] + s[2]) / total;
+        if (u[0] < pLeft)
+            u[0] = std::min(u[0] / pLeft, OneMinusEpsilon);
+        else {
+            qx = 1;
+            u[0] = std::min((u[0] - pLeft) / (1 - pLeft), OneMinusEpsilon);
+        }
+        Float pBottom = s[qx] / (s[qx] + s[qx + 2]);
+        if (u[1] < pBottom)
+            u[1] = std::min(u[1] / pBottom, OneMinusEpsilon);
+        else {
+            qy = 1;
+            u[1] = std::min((u[1] - pBottom) / (1 - pBottom), OneMinusEpsilon);
+        }
+        size /= 2;
+        origin += Vector2f(qx * size, qy * size);
+        int child = nodes[node].children[qx + 2 * qy];
+        if (!child) return SquareToDirection(origin + Vector2f(u) * size);
+        node = child;
+    }
+}
+
+Float DTree::Pdf(const Vector3f &w) const {
+    Point2f p = DirectionToSquare(w);
+    Float pdf = Inv4Pi;
+    int node = 0;
+    for (;;) {
+        Float total = sums[4 * node] + sums[4 * node + 1] +
+                      sums[4 * node + 2] + sums[4 * node + 3];
+        int q = ChildQuadrant(&p);
+        // _Sample()_ chooses the quadrants of nodes without any radiance
+        // uniformly, including the root of a tree that hasn't recorded any
+        if (total > 0) pdf *= 4 * sums[4 * node + q] / total;
+        if (pdf == 0 || !nodes[node].children[q]) return pdf;
+        node = nodes[node].children[q];
+    }
+}
+
+DTree DTree::Refine(Float threshold, int maxDepth) const {
+    // Subdivide the quadrants that hold more than _threshold_ of the
+    // tree's radiance; the radiance of quadrants that aren't subdivided in
+    // this tree is assumed to be spread evenly over their area
+    DTree tree;
+    Float total = Total();
+    if (total <= 0) return tree;
+    struct ToVisit {
+        int node, oldNode;
+        Float radiance;
+        int depth;
+    };
+    std::vector<ToVisit> toVisit;
+    toVisit.push_back({0, 0, total, 1});
+    while (!toVisit.empty()) {
+        ToVisit v = toVisit.back();
+        toVisit.pop_back();
+        for (int q = 0; q < 4; ++q) {
+            Float radiance =
+                v.oldNode >= 0 ? sums[4 * v.oldNode + q] : v.radiance / 4;
+            if (v.depth >= maxDepth || radiance <= threshold * total)
+                continue;
+            int child = tree.nodes.size();
+            tree.nodes.push_back(Node());
+            tree.nodes[v.node].children[q] = child;
+            int oldChild = v.oldNode >= 0 ? nodes[v.oldNode].children[q] : 0;
+            toVisit.push_back(
+                {child, oldChild ? oldChild : -1, radiance, v.depth + 1});
+        }
+    }
+    tree.sums.reset(new AtomicFloat[4 * tree.nodes.size()]);
+    return tree;
+}
+
+// SDTree Method Definitions
+SDTree::SDTree(const Bounds3f &b) : nodes(1) {
+    // Use cube-shaped bounds so that the spatial cells stay close to cubes
+    Float extent = MaxComponent(b.Diagonal());
+    bounds = Bounds3f(b.pMin, b.pMin + Vector3f(extent, extent, extent));
+    leaves.push_back(std::unique_ptr<SDTreeLeaf>(new SDTreeLeaf));
+}
+
+SDTreeLeaf *SDTree::Lookup(const Point3f &p) const {
+    Vector3f o = bounds.Offset(p);
+    int node = 0;
+    while (nodes[node].leaf < 0) {
+        int axis = nodes[node].axis;
+        Float x = Clamp(o[axis], 0, 1);
+        int child = x < 0.5f ? 0 : 1;
+        o[axis] = 2 * x - child;
+        node = nodes[node].children[child];
+    }
+    return leaves[nodes[node].leaf].get();
+}
+
+void SDTree::Refine(int pass) {
+    // Split the spatial leaves that received many samples in half,
+    // repeatedly; both halves start from the radiance recorded in the
+    // original leaf
+    Float threshold = SpatialSplitThreshold * std::pow(2.f, pass / 2.f);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        int leafIndex = nodes[i].leaf;
+        if (leafIndex < 0 || leaves[leafIndex]->nSamples <= threshold)
+            continue;
+        SDTreeLeaf *leaf = leaves[leafIndex].get();
+        leaf->nSamples = leaf->nSamples / 2;
+        SDTreeLeaf *sibling = new SDTreeLeaf;
+        sibling->building = leaf->building;
+        sibling->nSamples = leaf->nSamples.load();
+        leaves.push_back(std::unique_ptr<SDTreeLeaf>(sibling));
+
+        Node child0, child1;
+        child0.axis = child1.axis = (nodes[i].axis + 1) % 3;
+        child0.leaf = leafIndex;
+        child1.leaf = leaves.size() - 1;
+        nodes[i].leaf = -1;
+        nodes[i].children[0] = nodes.size();
+        nodes[i].children[1] = nodes.size() + 1;
+        nodes.push_back(child0);
+        nodes.push_back(child1);
+    }
+
+    // Sample from the radiance recorded in this pass and refine the
+    // directional trees that the next pass records into
+    ParallelFor([&](int64_t i) {
+        SDTreeLeaf &leaf = *leaves[i];
+        leaf.sampling = leaf.building;
+        leaf.building =
+            leaf.sampling.Refine(DirectionalSplitThreshold, MaxDTreeDepth);
+        leaf.nSamples = 0;
+    }, leaves.size(), 16);
+    memory.Set(BytesUsed());
+    nSpatialLeaves = leaves.size();
+    for (const auto &leaf : leaves)
+        ReportValue(dTreeNodes, leaf->building.NumNodes());
+}
+
+size_t SDTree::BytesUsed() const {
+    size_t bytes = nodes.size() * sizeof(Node);
+    for (const auto &leaf : leaves)
+        bytes += sizeof(SDTreeLeaf) + leaf->sampling.BytesUsed() +
+                 leaf->building.BytesUsed();
+    return bytes;
+}
+
+}  // namespace pbrt
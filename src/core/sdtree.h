@@ -0,0 +1,128 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_SDTREE_H
+#define PBRT_CORE_SDTREE_H
+
+// core/sdtree.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include "memory.h"
+#include "parallel.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace pbrt {
+
+// DTree Declarations
+
+// A DTree is a quadtree over the square [0,1]^2, which maps to the sphere
+// of directions via the area-preserving cylindrical mapping, whose nodes
+// store the amount of incident radiance recorded in each of their four
+// quadrants. Recording only adds to the quadrants' sums atomically, so
+// many threads can record into the same tree while its structure stays
+// fixed.
+class DTree {
+  public:
+    // DTree Public Methods
+    DTree();
+    DTree(const DTree &tree);
+    DTree(DTree &&tree) = default;
+    DTree &operator=(const DTree &tree);
+    DTree &operator=(DTree &&tree) = default;
+    void Record(const Vector3f &w, Float value);
+    Vector3f Sample(const Point2f &u) const;
+    Float Pdf(const Vector3f &w) const;
+    Float Total() const;
+    int NumNodes() const { return nodes.size(); }
+    size_t BytesUsed() const {
+        return nodes.size() * (sizeof(Node) + 4 * sizeof(AtomicFloat));
+    }
+    DTree Refine(Float threshold, int maxDepth) const;
+
+  private:
+    // DTree Private Data
+    struct Node {
+        // Index of the node that subdivides each quadrant, or 0 if the
+        // quadrant is a leaf
+        int children[4] = {0, 0, 0, 0};
+    };
+    std::vector<Node> nodes;
+    std::unique_ptr<AtomicFloat[]> sums;
+};
+
+// SDTree Declarations
+
+// Spatial leaf of an _SDTree_: the directional distribution used for
+// sampling, which was learned in the previous training pass, and the one
+// that the current pass records into
+struct SDTreeLeaf {
+    DTree sampling, building;
+    std::atomic<int64_t> nSamples{0};
+};
+
+// An SDTree partitions the (cube-shaped) bounds of the scene with a binary
+// tree whose leaves hold directional distributions of incident radiance;
+// it is learned over a sequence of training passes, following Mueller et
+// al.'s "Practical Path Guiding for Efficient Light-Transport Simulation."
+class SDTree {
+  public:
+    // SDTree Public Methods
+    SDTree(const Bounds3f &bounds);
+    SDTreeLeaf *Lookup(const Point3f &p) const;
+    void Refine(int pass);
+    int NumLeaves() const { return leaves.size(); }
+    size_t BytesUsed() const;
+
+  private:
+    // SDTree Private Data
+    struct Node {
+        int axis = 0;
+        // Index of the leaf for leaf nodes, or -1 if the node is split
+        int leaf = 0;
+        int children[2] = {0, 0};
+    };
+    Bounds3f bounds;
+    std::vector<Node> nodes;
+    std::vector<std::unique_ptr<SDTreeLeaf>> leaves;
+    TrackedMemory memory{MemoryCategory::PathGuiding};
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_SDTREE_H
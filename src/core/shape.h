@@ -81,6 +81,11 @@ class Shape {
     // integration; the nSamples parameter determines how many samples are
     // used in this case.
     virtual Float SolidAngle(const Point3f &p, int nSamples = 512) const;
+    // Returns a cone that bounds the directions of the shape's surface
+    // normals, which area lights use to bound the directions they emit in.
+    virtual DirectionCone NormalBounds() const {
+        return DirectionCone::EntireSphere();
+    }
 
     // Shape Public Data
     const Transform *ObjectToWorld, *WorldToObject;
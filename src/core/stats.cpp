@@ -90,6 +90,18 @@ void PrintStats(FILE *dest) { statsAccumulator.Print(dest); }
 
 void ClearStats() { statsAccumulator.Clear(); }
 
+int64_t GetStatsCounter(const std::string &name) {
+    return statsAccumulator.GetCounter(name);
+}
+
+int64_t GetStatsMemoryCounter(const std::string &name) {
+    return statsAccumulator.GetMemoryCounter(name);
+}
+
+std::pair<int64_t, int64_t> GetStatsRatio(const std::string &name) {
+    return statsAccumulator.GetRatio(name);
+}
+
 static void getCategoryAndTitle(const std::string &str, std::string *category,
                                 std::string *title) {
     const char *s = str.c_str();
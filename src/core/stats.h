@@ -71,6 +71,11 @@ class StatRegisterer {
 void PrintStats(FILE *dest);
 void ClearStats();
 void ReportThreadStats();
+// Accumulated values of individual statistics, by title (e.g.,
+// "BVH/Interior nodes"), for tools that report statistics themselves
+int64_t GetStatsCounter(const std::string &name);
+int64_t GetStatsMemoryCounter(const std::string &name);
+std::pair<int64_t, int64_t> GetStatsRatio(const std::string &name);
 
 class StatsAccumulator {
   public:
@@ -120,6 +125,20 @@ class StatsAccumulator {
         ratios[name].second += denom;
     }
 
+    int64_t GetCounter(const std::string &name) const {
+        auto iter = counters.find(name);
+        return iter == counters.end() ? 0 : iter->second;
+    }
+    int64_t GetMemoryCounter(const std::string &name) const {
+        auto iter = memoryCounters.find(name);
+        return iter == memoryCounters.end() ? 0 : iter->second;
+    }
+    std::pair<int64_t, int64_t> GetRatio(const std::string &name) const {
+        auto iter = ratios.find(name);
+        return iter == ratios.end() ? std::make_pair(int64_t(0), int64_t(0))
+                                    : iter->second;
+    }
+
     void Print(FILE *file);
     void Clear();
 
@@ -181,6 +200,7 @@ enum class Prof {
     MergeFilmTile,
     SplatFilm,
     AddFilmSample,
+    WriteCheckpoint,
     StartPixel,
     GetSample,
     TexFiltTrilerp,
@@ -236,6 +256,7 @@ static const char *ProfNames[] = {
     "Film::MergeTile()",
     "Film::AddSplat()",
     "Film::AddSample()",
+    "Checkpoint writing",
     "Sampler::StartPixelSample()",
     "Sampler::GetSample[12]D()",
     "MIPMap::Lookup() (trilinear)",
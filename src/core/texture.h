@@ -136,6 +136,12 @@ class Texture {
   public:
     // Texture Interface
     virtual T Evaluate(const SurfaceInteraction &) const = 0;
+    // Evaluates the texture at each of the _n_ hits in _si_; textures
+    // that can do better than one virtual call per hit override this
+    virtual void EvaluateBatch(const SurfaceInteraction *const *si, int n,
+                               T *values) const {
+        for (int i = 0; i < n; ++i) values[i] = Evaluate(*si[i]);
+    }
     virtual ~Texture() {}
 };
 
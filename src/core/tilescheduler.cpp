@@ -0,0 +1,329 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/tilescheduler.cpp*
+#include "tilescheduler.h"
+#include "checkpoint.h"
+#include "parallel.h"
+#include "stats.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace pbrt {
+
+STAT_PERCENT("Integrator/Tile work units split", nWorkUnitsSplit,
+             nWorkUnits);
+
+// TileScheduler Local Definitions
+// Work units whose expected cost is more than this many times the average
+// are split into quadrants.
+static const int SplitCostFactor = 4;
+
+static Point2i HilbertPoint(int n, int d) {
+    // Convert distance _d_ along the Hilbert curve over an $n \times n$
+    // grid to a point in the grid
+    Point2i p(0, 0);
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2), ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                p.x = s - 1 - p.x;
+                p.y = s - 1 - p.y;
+            }
+            std::swap(p.x, p.y);
+        }
+        p.x += s * rx;
+        p.y += s * ry;
+        d /= 4;
+    }
+    return p;
+}
+
+// TileScheduler Method Definitions
+TileScheduler::TileScheduler(const Bounds2i &bounds, int tileSize,
+                             int maxTileSize)
+    : bounds(bounds),
+      tileSize(tileSize),
+      maxTileSize(std::max(tileSize, maxTileSize)) {
+    Vector2i extent = bounds.Diagonal();
+    nTiles = Point2i(std::max(0, (extent.x + tileSize - 1) / tileSize),
+                     std::max(0, (extent.y + tileSize - 1) / tileSize));
+    tileCost.reset(new std::atomic<int64_t>[TileCount()]);
+    for (int i = 0; i < TileCount(); ++i) tileCost[i] = 0;
+}
+
+Bounds2i TileScheduler::Tiles(const Bounds2i &workBounds) const {
+    Vector2i dMin = workBounds.pMin - bounds.pMin;
+    Vector2i dMax = workBounds.pMax - bounds.pMin;
+    return Bounds2i(Point2i(dMin.x / tileSize, dMin.y / tileSize),
+                    Point2i((dMax.x + tileSize - 1) / tileSize,
+                            (dMax.y + tileSize - 1) / tileSize));
+}
+
+Bounds2i TileScheduler::TileBounds(const Point2i &tile) const {
+    int x0 = bounds.pMin.x + tile.x * tileSize;
+    int x1 = std::min(x0 + tileSize, bounds.pMax.x);
+    int y0 = bounds.pMin.y + tile.y * tileSize;
+    int y1 = std::min(y0 + tileSize, bounds.pMax.y);
+    return Bounds2i(Point2i(x0, y0), Point2i(x1, y1));
+}
+
+int64_t TileScheduler::WorkCost(const Bounds2i &work) const {
+    // Return the summed cost of _work_'s tiles, or zero if any is unknown
+    int64_t cost = 0;
+    for (Point2i tile : work) {
+        int64_t c = tileCost[TileIndex(tile)].load(std::memory_order_relaxed);
+        if (c == 0) return 0;
+        cost += c;
+    }
+    return cost;
+}
+
+bool TileScheduler::SplitWork(const Bounds2i &work,
+                              std::vector<Bounds2i> *quadrants) const {
+    // Split _work_ at the middle of each axis that is more than one tile wide
+    Vector2i d = work.Diagonal();
+    if (d.x <= 1 && d.y <= 1) return false;
+    Point2i pMid(work.pMin.x + (d.x + 1) / 2, work.pMin.y + (d.y + 1) / 2);
+    int xs[3] = {work.pMin.x, pMid.x, work.pMax.x};
+    int ys[3] = {work.pMin.y, pMid.y, work.pMax.y};
+    quadrants->clear();
+    for (int y = 0; y < 2; ++y)
+        for (int x = 0; x < 2; ++x)
+            if (xs[x] < xs[x + 1] && ys[y] < ys[y + 1])
+                quadrants->push_back(Bounds2i(Point2i(xs[x], ys[y]),
+                                              Point2i(xs[x + 1], ys[y + 1])));
+    return true;
+}
+
+std::vector<Bounds2i> TileScheduler::HilbertWork() const {
+    // Order work units of up to _maxTileSize_ pixels along a Hilbert curve
+    int workTiles = maxTileSize / tileSize;
+    Point2i nWork((nTiles.x + workTiles - 1) / workTiles,
+                  (nTiles.y + workTiles - 1) / workTiles);
+    int n = RoundUpPow2(std::max(nWork.x, nWork.y));
+    std::vector<Bounds2i> work;
+    work.reserve(nWork.x * nWork.y);
+    for (int d = 0; d < n * n; ++d) {
+        Point2i p = HilbertPoint(n, d);
+        if (p.x >= nWork.x || p.y >= nWork.y) continue;
+        Point2i pMin(p.x * workTiles, p.y * workTiles);
+        Point2i pMax(std::min(pMin.x + workTiles, nTiles.x),
+                     std::min(pMin.y + workTiles, nTiles.y));
+        work.push_back(Bounds2i(pMin, pMax));
+    }
+    return work;
+}
+
+std::vector<Bounds2i> TileScheduler::WorkUnits() const {
+    // Return the pixel bounds of the work units, in Hilbert-curve order
+    std::vector<Bounds2i> units;
+    if (TileCount() == 0) return units;
+    for (const Bounds2i &work : HilbertWork())
+        units.push_back(PixelBounds(work));
+    return units;
+}
+
+void TileScheduler::ForEach(std::function<void(const Bounds2i &)> func) {
+    if (TileCount() == 0) return;
+    std::vector<Bounds2i> work = HilbertWork();
+
+    // Give each NUMA node's threads a band of consecutive work units, so
+    // that they mostly share scene data with threads on the same node
+    int nNodes = NumaNodeCount(), nUnits = work.size();
+    std::vector<std::atomic<int>> nextUnit(nNodes);
+    for (int node = 0; node < nNodes; ++node)
+        nextUnit[node] = node * nUnits / nNodes;
+    std::atomic<int> nUnclaimed(nUnits);
+
+    // Initialize shared state for splitting work units
+    std::mutex splitMutex;
+    std::vector<Bounds2i> splitWork;
+    int64_t previousCost = WorkCost(Bounds2i(Point2i(0, 0), nTiles));
+    std::atomic<int64_t> passCost(0), passTiles(0);
+    int nWorkers = MaxThreadIndex();
+
+    auto claim = [&](Bounds2i *unit, int *index) {
+        // Take split work units first, then the next unit in a band,
+        // starting with this thread's NUMA node's band
+        {
+            std::lock_guard<std::mutex> lock(splitMutex);
+            if (!splitWork.empty()) {
+                *unit = splitWork.back();
+                splitWork.pop_back();
+                *index = -1;
+                return true;
+            }
+        }
+        for (int i = 0; i < nNodes; ++i) {
+            int node = (ThreadNumaNode() + i) % nNodes;
+            int u = nextUnit[node]++;
+            if (u < (node + 1) * nUnits / nNodes) {
+                --nUnclaimed;
+                *unit = work[u];
+                *index = u;
+                return true;
+            }
+        }
+        return false;
+    };
+    auto shouldSplit = [&](const Bounds2i &unit, int index) {
+        // Split units near the end of the pass so all threads stay busy
+        if (nWorkers > 1 && nUnclaimed < nWorkers) return true;
+
+        // Split units that are expected to be expensive; costs are from
+        // the previous pass or, failing that, from the unit before it
+        // along the curve, since expensive regions tend to be coherent
+        int64_t unitTiles = unit.Area(), predicted = WorkCost(unit);
+        if (predicted == 0 && index > 0)
+            predicted = WorkCost(work[index - 1]) * unitTiles /
+                        work[index - 1].Area();
+        if (predicted == 0) return false;
+        int64_t doneTiles = passTiles;
+        int64_t meanCost = doneTiles > 0 ? passCost / doneTiles
+                                         : previousCost / TileCount();
+        return predicted > SplitCostFactor * meanCost * unitTiles;
+    };
+
+    // Initialize state for pausing work to write checkpoints
+    std::mutex checkpointMutex;
+    std::condition_variable checkpointCondition;
+    int nActive = 0;
+    bool checkpointing = false;
+    CheckpointTimer timer;
+    auto startUnit = [&]() {
+        // Wait for any checkpoint in progress before claiming a unit
+        if (!checkpoint) return;
+        std::unique_lock<std::mutex> lock(checkpointMutex);
+        checkpointCondition.wait(lock, [&]() { return !checkpointing; });
+        ++nActive;
+    };
+    auto finishUnit = [&](const Bounds2i *unit) {
+        // Record that _unit_'s tiles are done and write a checkpoint once
+        // all other threads have finished their units, if one is due
+        if (!checkpoint) return;
+        std::unique_lock<std::mutex> lock(checkpointMutex);
+        if (unit)
+            for (Point2i tile : *unit) tileDone[TileIndex(tile)] = 1;
+        --nActive;
+        if (!checkpointing && timer.Due()) {
+            checkpointing = true;
+            checkpointCondition.wait(lock, [&]() { return nActive == 0; });
+            checkpoint();
+            timer.Reset();
+            checkpointing = false;
+        }
+        checkpointCondition.notify_all();
+    };
+
+    ParallelFor([&](int64_t) {
+        Bounds2i unit;
+        int index;
+        std::vector<Bounds2i> quadrants;
+        while (true) {
+            startUnit();
+            if (!claim(&unit, &index)) {
+                finishUnit(nullptr);
+                break;
+            }
+
+            // Skip tiles that were done before resuming from a checkpoint,
+            // splitting units that were only partially done
+            if (!tileDone.empty()) {
+                int nDone = 0;
+                for (Point2i tile : unit) nDone += tileDone[TileIndex(tile)];
+                if (nDone > 0 && nDone < unit.Area() &&
+                    SplitWork(unit, &quadrants)) {
+                    std::lock_guard<std::mutex> lock(splitMutex);
+                    splitWork.insert(splitWork.end(), quadrants.begin(),
+                                     quadrants.end());
+                }
+                if (nDone > 0) {
+                    finishUnit(nullptr);
+                    continue;
+                }
+            }
+
+            // Split _unit_ into quadrants, keeping the first one for this
+            // thread, until it is small or cheap enough
+            while (shouldSplit(unit, index) && SplitWork(unit, &quadrants)) {
+                ++nWorkUnitsSplit;
+                {
+                    std::lock_guard<std::mutex> lock(splitMutex);
+                    splitWork.insert(splitWork.end(), quadrants.begin() + 1,
+                                     quadrants.end());
+                }
+                unit = quadrants[0];
+                index = -1;
+            }
+
+            // Process _unit_ and record its cost per tile
+            ++nWorkUnits;
+            auto start = std::chrono::steady_clock::now();
+            func(PixelBounds(unit));
+            int64_t cost = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+            int64_t unitTiles = unit.Area();
+            int64_t costPerTile = std::max<int64_t>(1, cost / unitTiles);
+            for (Point2i tile : unit) tileCost[TileIndex(tile)] = costPerTile;
+            passCost += cost;
+            passTiles += unitTiles;
+            finishUnit(&unit);
+        }
+    }, nWorkers);
+}
+
+void TileScheduler::EnableCheckpoints(std::function<void()> checkpoint) {
+    this->checkpoint = checkpoint;
+    if (tileDone.empty()) tileDone.resize(TileCount(), 0);
+}
+
+int TileScheduler::CompletedTileCount() const {
+    return std::count(tileDone.begin(), tileDone.end(), 1);
+}
+
+void TileScheduler::SaveState(Checkpoint *checkpoint) const {
+    checkpoint->Add("scheduler/tileDone", tileDone);
+}
+
+bool TileScheduler::LoadState(const Checkpoint &checkpoint) {
+    std::vector<uint8_t> done;
+    if (!checkpoint.Get("scheduler/tileDone", &done) ||
+        done.size() != size_t(TileCount()))
+        return false;
+    tileDone = std::move(done);
+    return true;
+}
+
+}  // namespace pbrt
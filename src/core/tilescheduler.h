@@ -0,0 +1,100 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_TILESCHEDULER_H
+#define PBRT_CORE_TILESCHEDULER_H
+
+// core/tilescheduler.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include <atomic>
+#include <functional>
+
+namespace pbrt {
+
+// TileScheduler Declarations
+// Splits an image region into _tileSize_ tiles, each of which is the unit
+// that integrators seed their samplers with, and hands work units of up to
+// _maxTileSize_ pixels on a side to threads in Hilbert-curve order. Work
+// units that are expected to be expensive, or that are claimed near the
+// end of a pass, are split into quadrants so that threads don't wait on a
+// few stragglers. Costs are measured as work units finish and are used to
+// plan later calls to _ForEach()_. When checkpoints are enabled,
+// _ForEach()_ records which tiles are done, skips tiles that were done
+// before a resumed render's checkpoint, and periodically calls the
+// checkpoint function at a point where no work unit is in progress.
+class TileScheduler {
+  public:
+    // TileScheduler Public Methods
+    TileScheduler(const Bounds2i &bounds, int tileSize = 16,
+                  int maxTileSize = 32);
+    int TileCount() const { return nTiles.x * nTiles.y; }
+    int TileIndex(const Point2i &tile) const {
+        return tile.y * nTiles.x + tile.x;
+    }
+    Bounds2i Tiles(const Bounds2i &workBounds) const;
+    Bounds2i TileBounds(const Point2i &tile) const;
+    std::vector<Bounds2i> WorkUnits() const;
+    void ForEach(std::function<void(const Bounds2i &)> func);
+    void EnableCheckpoints(std::function<void()> checkpoint);
+    int CompletedTileCount() const;
+    void SaveState(Checkpoint *checkpoint) const;
+    bool LoadState(const Checkpoint &checkpoint);
+
+  private:
+    // TileScheduler Private Methods
+    std::vector<Bounds2i> HilbertWork() const;
+    Bounds2i PixelBounds(const Bounds2i &tiles) const {
+        return Bounds2i(TileBounds(tiles.pMin).pMin,
+                        TileBounds(tiles.pMax - Vector2i(1, 1)).pMax);
+    }
+    bool SplitWork(const Bounds2i &work, std::vector<Bounds2i> *quadrants)
+        const;
+    int64_t WorkCost(const Bounds2i &work) const;
+
+    // TileScheduler Private Data
+    const Bounds2i bounds;
+    const int tileSize, maxTileSize;
+    Point2i nTiles;
+    std::unique_ptr<std::atomic<int64_t>[]> tileCost;
+    std::vector<uint8_t> tileDone;
+    std::function<void()> checkpoint;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_TILESCHEDULER_H
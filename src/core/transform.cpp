@@ -1246,4 +1246,47 @@ Bounds3f AnimatedTransform::BoundPointMotion(const Point3f &p) const {
     return bounds;
 }
 
+Bounds3f AnimatedTransform::MotionBounds(const Bounds3f &b, Float time0,
+                                         Float time1) const {
+    if (!actuallyAnimated) return (*startTransform)(b);
+    if (hasRotation == false || time0 >= time1) {
+        Transform t0, t1;
+        Interpolate(time0, &t0);
+        Interpolate(time1, &t1);
+        return Union(t0(b), t1(b));
+    }
+    // Return motion bounds over the interval accounting for animated rotation
+    Bounds3f bounds;
+    for (int corner = 0; corner < 8; ++corner)
+        bounds = Union(bounds, BoundPointMotion(b.Corner(corner), time0, time1));
+    return bounds;
+}
+
+Bounds3f AnimatedTransform::BoundPointMotion(const Point3f &p, Float time0,
+                                             Float time1) const {
+    if (!actuallyAnimated) return Bounds3f((*startTransform)(p));
+    Bounds3f bounds((*this)(time0, p), (*this)(time1, p));
+    Float u0 = Clamp((time0 - startTime) / (endTime - startTime), 0, 1);
+    Float u1 = Clamp((time1 - startTime) / (endTime - startTime), 0, 1);
+    if (u0 >= u1) return bounds;
+    Float cosTheta = Dot(R[0], R[1]);
+    Float theta = std::acos(Clamp(cosTheta, -1, 1));
+    for (int c = 0; c < 3; ++c) {
+        // Find motion derivative zeros over the full motion, as in
+        // _BoundPointMotion()_ above, and expand by the ones in $[u_0,u_1]$
+        Float zeros[8];
+        int nZeros = 0;
+        IntervalFindZeros(c1[c].Eval(p), c2[c].Eval(p), c3[c].Eval(p),
+                          c4[c].Eval(p), c5[c].Eval(p), theta, Interval(0., 1.),
+                          zeros, &nZeros);
+        CHECK_LE(nZeros, sizeof(zeros) / sizeof(zeros[0]));
+        for (int i = 0; i < nZeros; ++i) {
+            if (zeros[i] < u0 || zeros[i] > u1) continue;
+            Point3f pz = (*this)(Lerp(zeros[i], startTime, endTime), p);
+            bounds = Union(bounds, pz);
+        }
+    }
+    return bounds;
+}
+
 }  // namespace pbrt
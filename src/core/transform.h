@@ -426,6 +426,10 @@ class AnimatedTransform {
     }
     Bounds3f MotionBounds(const Bounds3f &b) const;
     Bounds3f BoundPointMotion(const Point3f &p) const;
+    // Bounds over the times _time0_ to _time1_ only
+    Bounds3f MotionBounds(const Bounds3f &b, Float time0, Float time1) const;
+    Bounds3f BoundPointMotion(const Point3f &p, Float time0,
+                              Float time1) const;
 
   private:
     // AnimatedTransform Private Data
@@ -32,12 +32,14 @@
 
 // integrators/bdpt.cpp*
 #include "integrators/bdpt.h"
+#include "checkpoint.h"
 #include "film.h"
 #include "filters/box.h"
 #include "integrator.h"
 #include "lightdistrib.h"
 #include "paramset.h"
 #include "progressreporter.h"
+#include "tilescheduler.h"
 #include "sampler.h"
 #include "stats.h"
 
@@ -94,7 +96,7 @@ int GenerateCameraSubpath(const Scene &scene, Sampler &sampler,
 
 int GenerateLightSubpath(
     const Scene &scene, Sampler &sampler, MemoryArena &arena, int maxDepth,
-    Float time, const Distribution1D &lightDistr,
+    Float time, const BDPTLightDistribution &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     Vertex *path) {
     if (maxDepth == 0) return 0;
@@ -102,6 +104,7 @@ int GenerateLightSubpath(
     // Sample initial ray for light subpath
     Float lightPdf;
     int lightNum = lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+    if (lightNum == -1 || lightPdf == 0) return 0;
     const std::shared_ptr<Light> &light = scene.lights[lightNum];
     RayDifferential ray;
     Normal3f nLight;
@@ -227,7 +230,7 @@ Spectrum G(const Scene &scene, Sampler &sampler, const Vertex &v0,
 
 Float MISWeight(const Scene &scene, Vertex *lightVertices,
                 Vertex *cameraVertices, Vertex &sampled, int s, int t,
-                const Distribution1D &lightPdf,
+                const BDPTLightDistribution &lightPdf,
                 const std::unordered_map<const Light *, size_t> &lightToIndex) {
     if (s + t == 2) return 1;
     Float sumRi = 0;
@@ -313,12 +316,12 @@ void BDPTIntegrator::Render(const Scene &scene) {
 
     // Partition the image into tiles
     Film *film = camera->film;
-    const Bounds2i sampleBounds = film->GetSampleBounds();
-    const Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    const int nXTiles = (sampleExtent.x + tileSize - 1) / tileSize;
-    const int nYTiles = (sampleExtent.y + tileSize - 1) / tileSize;
-    ProgressReporter reporter(nXTiles * nYTiles, "Rendering");
+    TileScheduler scheduler(film->GetSampleBounds());
+    InitTileCheckpoints(
+        CheckpointDescription("bdpt", film, sampler->samplesPerPixel), film,
+        &scheduler);
+    ProgressReporter reporter(scheduler.TileCount(), "Rendering");
+    reporter.Update(scheduler.CompletedTileCount());
 
     // Allocate buffers for debug visualization
     const int bufferCount = (1 + maxDepth) * (6 + maxDepth) / 2;
@@ -343,92 +346,94 @@ void BDPTIntegrator::Render(const Scene &scene) {
 
     // Render and write the output image to disk
     if (scene.lights.size() > 0) {
-        ParallelFor2D([&](const Point2i tile) {
-            // Render a single tile using BDPT
-            MemoryArena arena;
-            int seed = tile.y * nXTiles + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
-            LOG(INFO) << "Starting image tile " << tileBounds;
-
+        scheduler.ForEach([&](const Bounds2i &workBounds) {
+            // Render a single work unit using BDPT
+            ThreadArena threadArena;
+            MemoryArena &arena = *threadArena;
+            LOG(INFO) << "Starting image work unit " << workBounds;
             std::unique_ptr<FilmTile> filmTile =
-                camera->film->GetFilmTile(tileBounds);
-            for (Point2i pPixel : tileBounds) {
-                tileSampler->StartPixel(pPixel);
-                if (!InsideExclusive(pPixel, pixelBounds))
-                    continue;
-                do {
-                    // Generate a single sample using BDPT
-                    Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
-
-                    // Trace the camera subpath
-                    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
-                    Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
-                    int nCamera = GenerateCameraSubpath(
-                        scene, *tileSampler, arena, maxDepth + 2, *camera,
-                        pFilm, cameraVertices);
-                    // Get a distribution for sampling the light at the
-                    // start of the light subpath. Because the light path
-                    // follows multiple bounces, basing the sampling
-                    // distribution on any of the vertices of the camera
-                    // path is unlikely to be a good strategy. We use the
-                    // PowerLightDistribution by default here, which
-                    // doesn't use the point passed to it.
-                    const Distribution1D *lightDistr =
-                        lightDistribution->Lookup(cameraVertices[0].p());
-                    // Now trace the light subpath
-                    int nLight = GenerateLightSubpath(
-                        scene, *tileSampler, arena, maxDepth + 1,
-                        cameraVertices[0].time(), *lightDistr, lightToIndex,
-                        lightVertices);
-
-                    // Execute all BDPT connection strategies
-                    Spectrum L(0.f);
-                    for (int t = 1; t <= nCamera; ++t) {
-                        for (int s = 0; s <= nLight; ++s) {
-                            int depth = t + s - 2;
-                            if ((s == 1 && t == 1) || depth < 0 ||
-                                depth > maxDepth)
-                                continue;
-                            // Execute the $(s, t)$ connection strategy and
-                            // update _L_
-                            Point2f pFilmNew = pFilm;
-                            Float misWeight = 0.f;
-                            Spectrum Lpath = ConnectBDPT(
-                                scene, lightVertices, cameraVertices, s, t,
-                                *lightDistr, lightToIndex, *camera, *tileSampler,
-                                &pFilmNew, &misWeight);
-                            VLOG(2) << "Connect bdpt s: " << s <<", t: " << t <<
-                                ", Lpath: " << Lpath << ", misWeight: " << misWeight;
-                            if (visualizeStrategies || visualizeWeights) {
-                                Spectrum value;
-                                if (visualizeStrategies)
-                                    value =
-                                        misWeight == 0 ? 0 : Lpath / misWeight;
-                                if (visualizeWeights) value = Lpath;
-                                weightFilms[BufferIndex(s, t)]->AddSplat(
-                                    pFilmNew, value);
+                camera->film->GetFilmTile(workBounds);
+            for (Point2i tile : scheduler.Tiles(workBounds)) {
+                int seed = scheduler.TileIndex(tile);
+                std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+                Bounds2i tileBounds = scheduler.TileBounds(tile);
+                for (Point2i pPixel : tileBounds) {
+                    tileSampler->StartPixel(pPixel);
+                    if (!InsideExclusive(pPixel, pixelBounds))
+                        continue;
+                    do {
+                        // Generate a single sample using BDPT
+                        Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
+
+                        // Trace the camera subpath
+                        Vertex *cameraVertices =
+                            arena.Alloc<Vertex>(maxDepth + 2);
+                        Vertex *lightVertices =
+                            arena.Alloc<Vertex>(maxDepth + 1);
+                        int nCamera = GenerateCameraSubpath(
+                            scene, *tileSampler, arena, maxDepth + 2, *camera,
+                            pFilm, cameraVertices);
+                        // Get a distribution for sampling the light at the
+                        // start of the light subpath. Because the light path
+                        // follows multiple bounces, basing the sampling
+                        // distribution on any of the vertices of the camera
+                        // path is unlikely to be a good strategy. We use the
+                        // PowerLightDistribution by default here, which
+                        // doesn't use the point passed to it.
+                        BDPTLightDistribution lightDistr(
+                            *lightDistribution, cameraVertices[0].p());
+                        // Now trace the light subpath
+                        int nLight = GenerateLightSubpath(
+                            scene, *tileSampler, arena, maxDepth + 1,
+                            cameraVertices[0].time(), lightDistr, lightToIndex,
+                            lightVertices);
+
+                        // Execute all BDPT connection strategies
+                        Spectrum L(0.f);
+                        for (int t = 1; t <= nCamera; ++t) {
+                            for (int s = 0; s <= nLight; ++s) {
+                                int depth = t + s - 2;
+                                if ((s == 1 && t == 1) || depth < 0 ||
+                                    depth > maxDepth)
+                                    continue;
+                                // Execute the $(s, t)$ connection strategy and
+                                // update _L_
+                                Point2f pFilmNew = pFilm;
+                                Float misWeight = 0.f;
+                                Spectrum Lpath = ConnectBDPT(
+                                    scene, lightVertices, cameraVertices, s, t,
+                                    lightDistr, lightToIndex, *camera,
+                                    *tileSampler, &pFilmNew, &misWeight);
+                                VLOG(2) << "Connect bdpt s: " << s << ", t: "
+                                        << t << ", Lpath: " << Lpath
+                                        << ", misWeight: " << misWeight;
+                                if (visualizeStrategies || visualizeWeights) {
+                                    Spectrum value;
+                                    if (visualizeStrategies)
+                                        value = misWeight == 0
+                                                    ? 0
+                                                    : Lpath / misWeight;
+                                    if (visualizeWeights) value = Lpath;
+                                    weightFilms[BufferIndex(s, t)]->AddSplat(
+                                        pFilmNew, value);
+                                }
+                                if (t != 1)
+                                    L += Lpath;
+                                else
+                                    film->AddSplat(pFilmNew, Lpath);
                             }
-                            if (t != 1)
-                                L += Lpath;
-                            else
-                                film->AddSplat(pFilmNew, Lpath);
                         }
-                    }
-                    VLOG(2) << "Add film sample pFilm: " << pFilm << ", L: " << L <<
-                        ", (y: " << L.y() << ")";
-                    filmTile->AddSample(pFilm, L);
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
+                        VLOG(2) << "Add film sample pFilm: " << pFilm
+                                << ", L: " << L << ", (y: " << L.y() << ")";
+                        filmTile->AddSample(pFilm, L);
+                        arena.Reset();
+                    } while (tileSampler->StartNextSample());
+                }
+                reporter.Update();
             }
             film->MergeFilmTile(std::move(filmTile));
-            reporter.Update();
-            LOG(INFO) << "Finished image tile " << tileBounds;
-        }, Point2i(nXTiles, nYTiles));
+            LOG(INFO) << "Finished image work unit " << workBounds;
+        });
         reporter.Done();
     }
     film->WriteImage(1.0f / sampler->samplesPerPixel);
@@ -443,7 +448,7 @@ void BDPTIntegrator::Render(const Scene &scene) {
 
 Spectrum ConnectBDPT(
     const Scene &scene, Vertex *lightVertices, Vertex *cameraVertices, int s,
-    int t, const Distribution1D &lightDistr,
+    int t, const BDPTLightDistribution &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     const Camera &camera, Sampler &sampler, Point2f *pRaster,
     Float *misWeightPtr) {
@@ -490,9 +495,11 @@ Spectrum ConnectBDPT(
             Float pdf;
             int lightNum =
                 lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+            Point2f uLight = sampler.Get2D();
+            if (lightNum == -1) return Spectrum(0.f);
             const std::shared_ptr<Light> &light = scene.lights[lightNum];
             Spectrum lightWeight = light->Sample_Li(
-                pt.GetInteraction(), sampler.Get2D(), &wi, &pdf, &vis);
+                pt.GetInteraction(), uLight, &wi, &pdf, &vis);
             if (pdf > 0 && !lightWeight.IsBlack()) {
                 EndpointInteraction ei(vis.P1(), light.get());
                 sampled =
@@ -44,6 +44,7 @@
 #include "integrator.h"
 #include "interaction.h"
 #include "light.h"
+#include "lightdistrib.h"
 #include "pbrt.h"
 #include "reflection.h"
 #include "sampling.h"
@@ -111,17 +112,49 @@ class ScopedAssignment {
     Type *target, backup;
 };
 
+// BDPTLightDistribution is the distribution used to choose the light at
+// the start of light subpaths and for $s=1$ connections. It is fixed per
+// sample at the camera vertex _p_ so that all connection strategies agree
+// on the probability of choosing each light. Distributions that provide a
+// _Distribution1D_ are looked up once; others (e.g. the light BVH) are
+// queried through _LightDistribution::Sample()_ and _Pmf()_.
+class BDPTLightDistribution {
+  public:
+    // BDPTLightDistribution Public Methods
+    BDPTLightDistribution(const LightDistribution &lightDistribution,
+                          const Point3f &p)
+        : distrib(lightDistribution.Lookup(p)),
+          lightDistribution(&lightDistribution),
+          p(p) {}
+    explicit BDPTLightDistribution(const Distribution1D &distrib)
+        : distrib(&distrib) {}
+    int SampleDiscrete(Float u, Float *pdf) const {
+        if (distrib) return distrib->SampleDiscrete(u, pdf);
+        return lightDistribution->Sample(p, Normal3f(), u, pdf);
+    }
+    Float DiscretePDF(int index) const {
+        if (distrib) return distrib->DiscretePDF(index);
+        return lightDistribution->Pmf(p, Normal3f(), index);
+    }
+
+  private:
+    // BDPTLightDistribution Private Data
+    const Distribution1D *distrib;
+    const LightDistribution *lightDistribution = nullptr;
+    Point3f p;
+};
+
 inline Float InfiniteLightDensity(
-    const Scene &scene, const Distribution1D &lightDistr,
+    const Scene &scene, const BDPTLightDistribution &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToDistrIndex,
     const Vector3f &w) {
     Float pdf = 0;
     for (const auto &light : scene.infiniteLights) {
         CHECK(lightToDistrIndex.find(light.get()) != lightToDistrIndex.end());
         size_t index = lightToDistrIndex.find(light.get())->second;
-        pdf += light->Pdf_Li(Interaction(), -w) * lightDistr.func[index];
+        pdf += light->Pdf_Li(Interaction(), -w) * lightDistr.DiscretePDF(index);
     }
-    return pdf / (lightDistr.funcInt * lightDistr.Count());
+    return pdf;
 }
 
 // BDPT Declarations
@@ -392,7 +425,7 @@ struct Vertex {
         return pdf;
     }
     Float PdfLightOrigin(const Scene &scene, const Vertex &v,
-                         const Distribution1D &lightDistr,
+                         const BDPTLightDistribution &lightDistr,
                          const std::unordered_map<const Light *, size_t>
                              &lightToDistrIndex) const {
         Vector3f w = v.p() - p();
@@ -431,12 +464,12 @@ extern int GenerateCameraSubpath(const Scene &scene, Sampler &sampler,
 
 extern int GenerateLightSubpath(
     const Scene &scene, Sampler &sampler, MemoryArena &arena, int maxDepth,
-    Float time, const Distribution1D &lightDistr,
+    Float time, const BDPTLightDistribution &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     Vertex *path);
 Spectrum ConnectBDPT(
     const Scene &scene, Vertex *lightVertices, Vertex *cameraVertices, int s,
-    int t, const Distribution1D &lightDistr,
+    int t, const BDPTLightDistribution &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     const Camera &camera, Sampler &sampler, Point2f *pRaster,
     Float *misWeight = nullptr);
@@ -34,6 +34,7 @@
 // integrators/mlt.cpp*
 #include "integrators/mlt.h"
 #include "integrators/bdpt.h"
+#include "checkpoint.h"
 #include "scene.h"
 #include "film.h"
 #include "sampler.h"
@@ -122,6 +123,41 @@ void MLTSampler::StartStream(int index) {
     sampleIndex = 0;
 }
 
+void MLTSampler::SaveState(Checkpoint *checkpoint,
+                           const std::string &name) const {
+    int64_t state[5] = {currentIteration, largeStep, lastLargeStepIteration,
+                        streamIndex, sampleIndex};
+    checkpoint->Add(name + "/state", state, 5);
+    checkpoint->Add(name + "/rng", rng);
+    checkpoint->Add(name + "/X", X);
+}
+
+bool MLTSampler::LoadState(const Checkpoint &checkpoint,
+                           const std::string &name) {
+    int64_t state[5];
+    if (!checkpoint.Get(name + "/state", state, 5) ||
+        !checkpoint.Get(name + "/rng", &rng) ||
+        !checkpoint.Get(name + "/X", &X))
+        return false;
+    currentIteration = state[0];
+    largeStep = state[1];
+    lastLargeStepIteration = state[2];
+    streamIndex = state[3];
+    sampleIndex = state[4];
+    return true;
+}
+
+// MLT Local Declarations
+// The state of a Markov chain other than its sampler, kept from one round
+// of rendering to the next and stored in checkpoints
+struct MLTChain {
+    RNG rng;
+    int depth = 0;
+    Point2f pCurrent;
+    Spectrum LCurrent;
+    int64_t mutationsDone = 0;
+};
+
 // MLT Method Definitions
 Spectrum MLTIntegrator::L(const Scene &scene, MemoryArena &arena,
                           const std::unique_ptr<Distribution1D> &lightDistr,
@@ -152,13 +188,15 @@ Spectrum MLTIntegrator::L(const Scene &scene, MemoryArena &arena,
     sampler.StartStream(lightStreamIndex);
     Vertex *lightVertices = arena.Alloc<Vertex>(s);
     if (GenerateLightSubpath(scene, sampler, arena, s, cameraVertices[0].time(),
-                             *lightDistr, lightToIndex, lightVertices) != s)
+                             BDPTLightDistribution(*lightDistr), lightToIndex,
+                             lightVertices) != s)
         return Spectrum(0.f);
 
     // Execute connection strategy and return the radiance estimate
     sampler.StartStream(connectionStreamIndex);
-    return ConnectBDPT(scene, lightVertices, cameraVertices, s, t, *lightDistr,
-                       lightToIndex, *camera, sampler, pRaster) *
+    return ConnectBDPT(scene, lightVertices, cameraVertices, s, t,
+                       BDPTLightDistribution(*lightDistr), lightToIndex,
+                       *camera, sampler, pRaster) *
            nStrategies;
 }
 
@@ -177,6 +215,8 @@ void MLTIntegrator::Render(const Scene &scene) {
     // Generate bootstrap samples and compute normalization constant $b$
     int nBootstrapSamples = nBootstrap * (maxDepth + 1);
     std::vector<Float> bootstrapWeights(nBootstrapSamples, 0);
+    TrackedMemory bootstrapMemory(MemoryCategory::MLT,
+                                  nBootstrapSamples * sizeof(Float));
     if (scene.lights.size() > 0) {
         ProgressReporter progress(nBootstrap / 256,
                                   "Generating bootstrap paths");
@@ -184,6 +224,7 @@ void MLTIntegrator::Render(const Scene &scene) {
         int chunkSize = Clamp(nBootstrap / 128, 1, 8192);
         ParallelFor([&](int i) {
             // Generate _i_th bootstrap sample
+            CHECK_GE(ThreadIndex, 0);
             MemoryArena &arena = bootstrapThreadArenas[ThreadIndex];
             for (int depth = 0; depth <= maxDepth; ++depth) {
                 int rngIndex = i * (maxDepth + 1) + depth;
@@ -199,6 +240,7 @@ void MLTIntegrator::Render(const Scene &scene) {
         progress.Done();
     }
     Distribution1D bootstrap(&bootstrapWeights[0], nBootstrapSamples);
+    bootstrapMemory.Add(bootstrap.BytesUsed());
     Float b = bootstrap.funcInt * (maxDepth + 1);
 
     // Run _nChains_ Markov chains in parallel
@@ -206,58 +248,139 @@ void MLTIntegrator::Render(const Scene &scene) {
     int64_t nTotalMutations =
         (int64_t)mutationsPerPixel * (int64_t)film.GetSampleBounds().Area();
     if (scene.lights.size() > 0) {
+        // Resume the chains and film saved in a checkpoint, if requested
+        std::vector<MLTChain> chains(nChains);
+        std::vector<std::unique_ptr<MLTSampler>> samplers(nChains);
+        // Each chain's sampler is charged for its primary sample vector
+        // as it was after the chain's first path; it rarely grows later
+        TrackedMemory chainMemory(
+            MemoryCategory::MLT,
+            nChains * (sizeof(MLTChain) + sizeof(samplers[0])));
+        std::vector<size_t> samplerBytes(nChains, 0);
+        std::string description = CheckpointDescription(
+            StringPrintf("mlt %d %d %d", maxDepth, nBootstrap, nChains), &film,
+            mutationsPerPixel);
+        std::unique_ptr<Checkpoint> resumed = ResumeCheckpoint(description);
+        if (resumed) {
+            bool loaded = resumed->Get("mlt/chains", chains.data(), nChains) &&
+                          film.LoadState(*resumed);
+            for (int i = 0; i < nChains && loaded; ++i) {
+                std::string name = StringPrintf("mlt/sampler%d", i);
+                if (!resumed->Has(name + "/state")) continue;
+                samplers[i].reset(new MLTSampler(mutationsPerPixel, 0, sigma,
+                                                 largeStepProbability,
+                                                 nSampleStreams));
+                loaded = samplers[i]->LoadState(*resumed, name);
+            }
+            if (!loaded) {
+                Error("%s: checkpoint is incomplete; starting a new render.",
+                      PbrtOptions.checkpointFile.c_str());
+                film.Clear();
+                chains = std::vector<MLTChain>(nChains);
+                for (auto &sampler : samplers) sampler.reset();
+            }
+        }
+        for (int i = 0; i < nChains; ++i)
+            if (samplers[i]) {
+                samplerBytes[i] = samplers[i]->BytesUsed();
+                chainMemory.Add(samplerBytes[i]);
+            }
+
+        // Run the chains in rounds that end early when a checkpoint is due
         const int progressFrequency = 32768;
         ProgressReporter progress(nTotalMutations / progressFrequency,
                                   "Rendering");
-        ParallelFor([&](int i) {
-            int64_t nChainMutations =
-                std::min((i + 1) * nTotalMutations / nChains, nTotalMutations) -
-                i * nTotalMutations / nChains;
-            // Follow {i}th Markov chain for _nChainMutations_
-            MemoryArena arena;
-
-            // Select initial state from the set of bootstrap samples
-            RNG rng(i);
-            int bootstrapIndex = bootstrap.SampleDiscrete(rng.UniformFloat());
-            int depth = bootstrapIndex % (maxDepth + 1);
-
-            // Initialize local variables for selected state
-            MLTSampler sampler(mutationsPerPixel, bootstrapIndex, sigma,
-                               largeStepProbability, nSampleStreams);
-            Point2f pCurrent;
-            Spectrum LCurrent =
-                L(scene, arena, lightDistr, lightToIndex, sampler, depth, &pCurrent);
-
-            // Run the Markov chain for _nChainMutations_ steps
-            for (int64_t j = 0; j < nChainMutations; ++j) {
-                sampler.StartIteration();
-                Point2f pProposed;
-                Spectrum LProposed =
-                    L(scene, arena, lightDistr, lightToIndex, sampler, depth, &pProposed);
-                // Compute acceptance probability for proposed sample
-                Float accept = std::min((Float)1, LProposed.y() / LCurrent.y());
-
-                // Splat both current and proposed samples to _film_
-                if (accept > 0)
-                    film.AddSplat(pProposed,
-                                  LProposed * accept / LProposed.y());
-                film.AddSplat(pCurrent, LCurrent * (1 - accept) / LCurrent.y());
-
-                // Accept or reject the proposal
-                if (rng.UniformFloat() < accept) {
-                    pCurrent = pProposed;
-                    LCurrent = LProposed;
-                    sampler.Accept();
-                    ++acceptedMutations;
-                } else
-                    sampler.Reject();
-                ++totalMutations;
-                if ((i * nTotalMutations / nChains + j) % progressFrequency ==
-                    0)
-                    progress.Update();
-                arena.Reset();
-            }
-        }, nChains);
+        for (const MLTChain &chain : chains)
+            progress.Update(chain.mutationsDone / progressFrequency);
+        CheckpointTimer checkpointTimer;
+        std::atomic<bool> checkpointDue(false);
+        while (true) {
+            ParallelFor([&](int i) {
+                int64_t nChainMutations =
+                    std::min((i + 1) * nTotalMutations / nChains,
+                             nTotalMutations) -
+                    i * nTotalMutations / nChains;
+                // Follow {i}th Markov chain for _nChainMutations_
+                MLTChain &chain = chains[i];
+                if (chain.mutationsDone == nChainMutations || checkpointDue)
+                    return;
+                ThreadArena threadArena;
+                MemoryArena &arena = *threadArena;
+                if (!samplers[i]) {
+                    // Select initial state from the set of bootstrap samples
+                    chain.rng.SetSequence(i);
+                    int bootstrapIndex =
+                        bootstrap.SampleDiscrete(chain.rng.UniformFloat());
+                    chain.depth = bootstrapIndex % (maxDepth + 1);
+
+                    // Initialize local variables for selected state
+                    samplers[i].reset(new MLTSampler(
+                        mutationsPerPixel, bootstrapIndex, sigma,
+                        largeStepProbability, nSampleStreams));
+                    chain.LCurrent =
+                        L(scene, arena, lightDistr, lightToIndex, *samplers[i],
+                          chain.depth, &chain.pCurrent);
+                    samplerBytes[i] = samplers[i]->BytesUsed();
+                    chainMemory.Add(samplerBytes[i]);
+                }
+                MLTSampler &sampler = *samplers[i];
+
+                // Run the Markov chain for _nChainMutations_ steps
+                for (; chain.mutationsDone < nChainMutations;
+                     ++chain.mutationsDone) {
+                    int64_t j = chain.mutationsDone;
+                    if (j % 1024 == 0 && checkpointTimer.Due())
+                        checkpointDue = true;
+                    if (checkpointDue) return;
+                    sampler.StartIteration();
+                    Point2f pProposed;
+                    Spectrum LProposed = L(scene, arena, lightDistr,
+                                           lightToIndex, sampler, chain.depth,
+                                           &pProposed);
+                    // Compute acceptance probability for proposed sample
+                    Float accept =
+                        std::min((Float)1, LProposed.y() / chain.LCurrent.y());
+
+                    // Splat both current and proposed samples to _film_
+                    if (accept > 0)
+                        film.AddSplat(pProposed,
+                                      LProposed * accept / LProposed.y());
+                    film.AddSplat(chain.pCurrent, chain.LCurrent *
+                                                      (1 - accept) /
+                                                      chain.LCurrent.y());
+
+                    // Accept or reject the proposal
+                    if (chain.rng.UniformFloat() < accept) {
+                        chain.pCurrent = pProposed;
+                        chain.LCurrent = LProposed;
+                        sampler.Accept();
+                        ++acceptedMutations;
+                    } else
+                        sampler.Reject();
+                    ++totalMutations;
+                    if ((i * nTotalMutations / nChains + j) %
+                            progressFrequency ==
+                        0)
+                        progress.Update();
+                    arena.Reset();
+                }
+                chainMemory.Add(-int64_t(samplerBytes[i]));
+                samplers[i].reset();
+            }, nChains);
+            if (!checkpointDue) break;
+
+            // Save the chains, their samplers, and the film
+            Checkpoint checkpoint(description);
+            checkpoint.Add("mlt/chains", chains);
+            for (int i = 0; i < nChains; ++i)
+                if (samplers[i])
+                    samplers[i]->SaveState(&checkpoint,
+                                           StringPrintf("mlt/sampler%d", i));
+            film.SaveState(&checkpoint);
+            SaveCheckpoint(checkpoint);
+            checkpointTimer.Reset();
+            checkpointDue = false;
+        }
         progress.Done();
     }
 
@@ -68,6 +68,11 @@ class MLTSampler : public Sampler {
     void Reject();
     void StartStream(int index);
     int GetNextIndex() { return streamIndex + streamCount * sampleIndex++; }
+    void SaveState(Checkpoint *checkpoint, const std::string &name) const;
+    bool LoadState(const Checkpoint &checkpoint, const std::string &name);
+    size_t BytesUsed() const {
+        return sizeof(*this) + X.capacity() * sizeof(PrimarySample);
+    }
 
   protected:
     // MLTSampler Private Declarations
@@ -37,154 +37,311 @@
 #include "film.h"
 #include "interaction.h"
 #include "paramset.h"
+#include "progressreporter.h"
+#include "samplers/random.h"
 #include "scene.h"
 #include "stats.h"
+#include "tilescheduler.h"
 
 namespace pbrt {
 
 STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_PERCENT("Integrator/Path guide sampled bounces", nGuidedBounces,
+             nGuidableBounces);
+
+// Maximum number of vertices of a training path whose incident radiance is
+// recorded in the path guide, and the probability of sampling the guide
+// rather than the BSDF at vertices where it's been trained
+static PBRT_CONSTEXPR int MaxGuideVertices = 64;
+static PBRT_CONSTEXPR Float GuideSamplingFraction = 0.5;
+
+// Path Guiding Utility Functions
+static void AddGuideRadiance(PathState &path, const Spectrum &L) {
+    for (int i = 0; i < path.nGuideVertices; ++i)
+        path.guideVertices[i].radiance += L;
+}
+
+static void RecordGuideVertices(const PathState &path) {
+    for (int i = 0; i < path.nGuideVertices; ++i) {
+        const PathGuideVertex &v = path.guideVertices[i];
+        // Estimate the radiance arriving at the vertex from _v.wi_ and
+        // record it divided by the direction's density
+        Float Li = 0;
+        for (int c = 0; c < Spectrum::nSamples; ++c)
+            if (v.throughput[c] > 0) Li += v.radiance[c] / v.throughput[c];
+        Li /= Spectrum::nSamples;
+        if (std::isnan(Li) || std::isinf(Li)) continue;
+        if (Li > 0) v.leaf->building.Record(v.wi, Li / v.pdf);
+        ++v.leaf->nSamples;
+    }
+}
+
+// Samples a direction from the one-sample MIS combination of _bsdf_ and
+// _dTree_ that chooses _dTree_ with probability _fraction_
+static Spectrum SampleGuided(const BSDF &bsdf, const Normal3f &ng,
+                             const DTree &dTree, Float fraction,
+                             const Vector3f &wo, Point2f u, Vector3f *wi,
+                             Float *pdf, BxDFType *sampledType) {
+    Spectrum f;
+    Float bsdfPdf;
+    if (u[0] < fraction) {
+        u[0] = std::min(u[0] / fraction, OneMinusEpsilon);
+        *wi = dTree.Sample(u);
+        f = bsdf.f(wo, *wi);
+        bsdfPdf = bsdf.Pdf(wo, *wi);
+        *sampledType = Dot(wo, ng) * Dot(*wi, ng) > 0
+                           ? BSDF_REFLECTION
+                           : BSDF_TRANSMISSION;
+        ++nGuidedBounces;
+    } else {
+        u[0] = std::min((u[0] - fraction) / (1 - fraction), OneMinusEpsilon);
+        f = bsdf.Sample_f(wo, wi, u, &bsdfPdf, BSDF_ALL, sampledType);
+        if (bsdfPdf == 0) {
+            *pdf = 0;
+            return Spectrum(0.f);
+        }
+    }
+    *pdf = fraction * dTree.Pdf(*wi) + (1 - fraction) * bsdfPdf;
+    return f;
+}
 
 // PathIntegrator Method Definitions
 PathIntegrator::PathIntegrator(int maxDepth,
                                std::shared_ptr<const Camera> camera,
                                std::shared_ptr<Sampler> sampler,
                                const Bounds2i &pixelBounds, Float rrThreshold,
-                               const std::string &lightSampleStrategy)
+                               const std::string &lightSampleStrategy,
+                               bool guiding, int guidingSamples)
     : SamplerIntegrator(camera, sampler, pixelBounds),
       maxDepth(maxDepth),
       rrThreshold(rrThreshold),
-      lightSampleStrategy(lightSampleStrategy) {}
+      lightSampleStrategy(lightSampleStrategy),
+      guiding(guiding),
+      guidingSamples(guidingSamples) {}
 
 void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
     lightDistribution =
         CreateLightSampleDistribution(lightSampleStrategy, scene);
+    if (guiding) TrainGuide(scene);
+}
+
+void PathIntegrator::TrainGuide(const Scene &scene) {
+    // Learn the path guide in passes over the image whose numbers of
+    // samples per pixel double until _guidingSamples_ have been taken; the
+    // last pass, which the final image is guided by, also takes the
+    // samples that are left over. The passes hand out tiles with a
+    // _TileScheduler_ like the final render does, so its cost estimates
+    // carry over from pass to pass. The images that they render are
+    // discarded.
+    sdTree.reset(new SDTree(scene.WorldBound()));
+    TileScheduler scheduler(pixelBounds);
+    ProgressReporter reporter(guidingSamples, "Training path guide");
+    int passSamples = 1;
+    for (int pass = 0, trained = 0; trained < guidingSamples; ++pass) {
+        if (guidingSamples - trained < 3 * passSamples)
+            passSamples = guidingSamples - trained;
+        scheduler.ForEach([&](const Bounds2i &workBounds) {
+            ThreadArena arena;
+            for (Point2i tile : scheduler.Tiles(workBounds)) {
+                // Training passes use their own random samples, so that the
+                // guide is independent of the samples of the final image
+                RandomSampler tileSampler(
+                    passSamples,
+                    pass * scheduler.TileCount() + scheduler.TileIndex(tile));
+                for (Point2i pixel : scheduler.TileBounds(tile)) {
+                    tileSampler.StartPixel(pixel);
+                    do {
+                        CameraSample cameraSample =
+                            tileSampler.GetCameraSample(pixel);
+                        RayDifferential ray;
+                        if (camera->GenerateRayDifferential(cameraSample,
+                                                            &ray) > 0) {
+                            ray.ScaleDifferentials(
+                                1 / std::sqrt((Float)passSamples));
+                            PathState path(ray);
+                            path.guideVertices = arena->Alloc<PathGuideVertex>(
+                                std::max(1,
+                                         std::min(maxDepth, MaxGuideVertices)));
+                            TracePath(path, scene, tileSampler, *arena);
+                            RecordGuideVertices(path);
+                        }
+                        arena->Reset();
+                    } while (tileSampler.StartNextSample());
+                }
+            }
+        });
+        sdTree->Refine(pass);
+        trained += passSamples;
+        reporter.Update(passSamples);
+        passSamples *= 2;
+    }
+    reporter.Done();
+    LOG(INFO) << "Path guide has " << sdTree->NumLeaves()
+              << " spatial leaves using " << sdTree->BytesUsed() << " bytes";
 }
 
 Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                             Sampler &sampler, MemoryArena &arena,
                             int depth) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
-    Spectrum L(0.f), beta(1.f);
-    RayDifferential ray(r);
-    bool specularBounce = false;
-    int bounces;
-    // Added after book publication: etaScale tracks the accumulated effect
-    // of radiance scaling due to rays passing through refractive
-    // boundaries (see the derivation on p. 527 of the third edition). We
-    // track this value in order to remove it from beta when we apply
-    // Russian roulette; this is worthwhile, since it lets us sometimes
-    // avoid terminating refracted rays that are about to be refracted back
-    // out of a medium and thus have their beta value increased.
-    Float etaScale = 1;
-
-    for (bounces = 0;; ++bounces) {
+    PathState path(r);
+    TracePath(path, scene, sampler, arena);
+    return path.L;
+}
+
+void PathIntegrator::TracePath(PathState &path, const Scene &scene,
+                               Sampler &sampler, MemoryArena &arena) const {
+    for (;;) {
         // Find next path vertex and accumulate contribution
-        VLOG(2) << "Path tracer bounce " << bounces << ", current L = " << L
-                << ", beta = " << beta;
+        VLOG(2) << "Path tracer bounce " << path.bounces << ", current L = "
+                << path.L << ", beta = " << path.beta;
 
         // Intersect _ray_ with scene and store intersection in _isect_
         SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
-
-        // Possibly add emitted light at intersection
-        if (bounces == 0 || specularBounce) {
-            // Add emitted light at path vertex or from the environment
-            if (foundIntersection) {
-                L += beta * isect.Le(-ray.d);
-                VLOG(2) << "Added Le -> L = " << L;
-            } else {
-                for (const auto &light : scene.infiniteLights)
-                    L += beta * light->Le(ray);
-                VLOG(2) << "Added infinite area lights -> L = " << L;
+        bool foundIntersection = scene.Intersect(path.ray, &isect);
+        if (!Bounce(path, foundIntersection, isect, scene, sampler, arena))
+            break;
+    }
+    ReportValue(pathLength, path.bounces);
+}
+
+bool PathIntegrator::Bounce(PathState &path, bool foundIntersection,
+                            SurfaceInteraction &isect, const Scene &scene,
+                            Sampler &sampler, MemoryArena &arena) const {
+    RayDifferential &ray = path.ray;
+    Spectrum &L = path.L, &beta = path.beta;
+    // Possibly add emitted light at intersection
+    if (path.bounces == 0 || path.specularBounce) {
+        // Add emitted light at path vertex or from the environment
+        if (foundIntersection) {
+            Spectrum Le = beta * isect.Le(-ray.d);
+            L += Le;
+            AddGuideRadiance(path, Le);
+            VLOG(2) << "Added Le -> L = " << L;
+        } else {
+            for (const auto &light : scene.infiniteLights) {
+                Spectrum Le = beta * light->Le(ray);
+                L += Le;
+                AddGuideRadiance(path, Le);
             }
+            VLOG(2) << "Added infinite area lights -> L = " << L;
         }
+    } else if (path.nGuideVertices > 0 &&
+               path.guideVertices[path.nGuideVertices - 1].bounce ==
+                   path.bounces - 1) {
+        // Direct lighting at the previous vertex accounted for the emitted
+        // light, but the guide also needs to learn where it comes from
+        Spectrum Le(0.f);
+        if (foundIntersection)
+            Le = isect.Le(-ray.d);
+        else
+            for (const auto &light : scene.infiniteLights) Le += light->Le(ray);
+        path.guideVertices[path.nGuideVertices - 1].radiance += beta * Le;
+    }
 
-        // Terminate path if ray escaped or _maxDepth_ was reached
-        if (!foundIntersection || bounces >= maxDepth) break;
+    // Terminate path if ray escaped or _maxDepth_ was reached
+    if (!foundIntersection || path.bounces >= maxDepth) return false;
 
-        // Compute scattering functions and skip over medium boundaries
-        isect.ComputeScatteringFunctions(ray, arena, true);
-        if (!isect.bsdf) {
-            VLOG(2) << "Skipping intersection due to null bsdf";
-            ray = isect.SpawnRay(ray.d);
-            bounces--;
-            continue;
-        }
+    // Compute scattering functions and skip over medium boundaries
+    isect.ComputeScatteringFunctions(ray, arena, true);
+    if (!isect.bsdf) {
+        VLOG(2) << "Skipping intersection due to null bsdf";
+        ray = isect.SpawnRay(ray.d);
+        return true;
+    }
 
-        const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
-
-        // Sample illumination from lights to find path contribution.
-        // (But skip this for perfectly specular BSDFs.)
-        if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
-            0) {
-            ++totalPaths;
-            Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
-                                                       sampler, false, distrib);
-            VLOG(2) << "Sampled direct lighting Ld = " << Ld;
-            if (Ld.IsBlack()) ++zeroRadiancePaths;
-            CHECK_GE(Ld.y(), 0.f);
-            L += Ld;
-        }
+    // Sample illumination from lights to find path contribution.
+    // (But skip this for perfectly specular BSDFs.)
+    if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0) {
+        ++totalPaths;
+        Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
+                                                   sampler, false,
+                                                   lightDistribution.get());
+        VLOG(2) << "Sampled direct lighting Ld = " << Ld;
+        if (Ld.IsBlack()) ++zeroRadiancePaths;
+        CHECK_GE(Ld.y(), 0.f);
+        L += Ld;
+        AddGuideRadiance(path, Ld);
+    }
+
+    // Sample BSDF to get new path direction, mixing in the path guide
+    // where it has been trained for non-specular BSDFs
+    Vector3f wo = -ray.d, wi;
+    Float pdf;
+    BxDFType flags;
+    SDTreeLeaf *guideLeaf = nullptr;
+    if (sdTree && isect.bsdf->NumComponents(BSDF_SPECULAR) == 0)
+        guideLeaf = sdTree->Lookup(isect.p);
+    Spectrum f;
+    if (guideLeaf && guideLeaf->sampling.Total() > 0) {
+        ++nGuidableBounces;
+        f = SampleGuided(*isect.bsdf, isect.n, guideLeaf->sampling,
+                         GuideSamplingFraction, wo, sampler.Get2D(), &wi,
+                         &pdf, &flags);
+    } else
+        f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf, BSDF_ALL,
+                                 &flags);
+    VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
+    if (f.IsBlack() || pdf == 0.f) return false;
+    beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+    VLOG(2) << "Updated beta = " << beta;
+    CHECK_GE(beta.y(), 0.f);
+    DCHECK(!std::isinf(beta.y()));
+    if (path.guideVertices && guideLeaf &&
+        path.nGuideVertices < MaxGuideVertices &&
+        !(isect.bssrdf && (flags & BSDF_TRANSMISSION)))
+        path.guideVertices[path.nGuideVertices++] = {
+            guideLeaf, wi, pdf, beta, Spectrum(0.f), path.bounces};
+    path.specularBounce = (flags & BSDF_SPECULAR) != 0;
+    if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+        Float eta = isect.bsdf->eta;
+        // Update the term that tracks radiance scaling for refraction
+        // depending on whether the ray is entering or leaving the
+        // medium.
+        path.etaScale *=
+            (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+    }
+    ray = isect.SpawnRay(wi);
 
-        // Sample BSDF to get new path direction
-        Vector3f wo = -ray.d, wi;
-        Float pdf;
-        BxDFType flags;
-        Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
-                                          BSDF_ALL, &flags);
-        VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
-        if (f.IsBlack() || pdf == 0.f) break;
-        beta *= f * AbsDot(wi, isect.shading.n) / pdf;
-        VLOG(2) << "Updated beta = " << beta;
-        CHECK_GE(beta.y(), 0.f);
+    // Account for subsurface scattering, if applicable
+    if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) {
+        // Importance sample the BSSRDF
+        SurfaceInteraction pi;
+        Spectrum S = isect.bssrdf->Sample_S(
+            scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
         DCHECK(!std::isinf(beta.y()));
-        specularBounce = (flags & BSDF_SPECULAR) != 0;
-        if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
-            Float eta = isect.bsdf->eta;
-            // Update the term that tracks radiance scaling for refraction
-            // depending on whether the ray is entering or leaving the
-            // medium.
-            etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
-        }
-        ray = isect.SpawnRay(wi);
-
-        // Account for subsurface scattering, if applicable
-        if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) {
-            // Importance sample the BSSRDF
-            SurfaceInteraction pi;
-            Spectrum S = isect.bssrdf->Sample_S(
-                scene, sampler.Get1D(), sampler.Get2D(), arena, &pi, &pdf);
-            DCHECK(!std::isinf(beta.y()));
-            if (S.IsBlack() || pdf == 0) break;
-            beta *= S / pdf;
-
-            // Account for the direct subsurface scattering component
-            L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
-                                              lightDistribution->Lookup(pi.p));
-
-            // Account for the indirect subsurface scattering component
-            Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
-                                           BSDF_ALL, &flags);
-            if (f.IsBlack() || pdf == 0) break;
-            beta *= f * AbsDot(wi, pi.shading.n) / pdf;
-            DCHECK(!std::isinf(beta.y()));
-            specularBounce = (flags & BSDF_SPECULAR) != 0;
-            ray = pi.SpawnRay(wi);
-        }
+        if (S.IsBlack() || pdf == 0) return false;
+        beta *= S / pdf;
 
-        // Possibly terminate the path with Russian roulette.
-        // Factor out radiance scaling due to refraction in rrBeta.
-        Spectrum rrBeta = beta * etaScale;
-        if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) {
-            Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
-            if (sampler.Get1D() < q) break;
-            beta /= 1 - q;
-            DCHECK(!std::isinf(beta.y()));
-        }
+        // Account for the direct subsurface scattering component
+        Spectrum Ld = beta * UniformSampleOneLight(pi, scene, arena, sampler,
+                                                   false,
+                                                   lightDistribution.get());
+        L += Ld;
+        AddGuideRadiance(path, Ld);
+
+        // Account for the indirect subsurface scattering component
+        Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
+                                       BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0) return false;
+        beta *= f * AbsDot(wi, pi.shading.n) / pdf;
+        DCHECK(!std::isinf(beta.y()));
+        path.specularBounce = (flags & BSDF_SPECULAR) != 0;
+        ray = pi.SpawnRay(wi);
+    }
+
+    // Possibly terminate the path with Russian roulette.
+    // Factor out radiance scaling due to refraction in rrBeta.
+    Spectrum rrBeta = beta * path.etaScale;
+    if (rrBeta.MaxComponentValue() < rrThreshold && path.bounces > 3) {
+        Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+        if (sampler.Get1D() < q) return false;
+        beta /= 1 - q;
+        DCHECK(!std::isinf(beta.y()));
     }
-    ReportValue(pathLength, bounces);
-    return L;
+    ++path.bounces;
+    return true;
 }
 
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
@@ -208,8 +365,12 @@ PathIntegrator *CreatePathIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
+    bool guiding = params.FindOneBool("guiding", false);
+    int guidingSamples = params.FindOneInt(
+        "guidingsamples", std::max(1, int(sampler->samplesPerPixel / 4)));
     return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                              rrThreshold, lightStrategy);
+                              rrThreshold, lightStrategy, guiding,
+                              guidingSamples);
 }
 
 }  // namespace pbrt
@@ -42,9 +42,45 @@
 #include "pbrt.h"
 #include "integrator.h"
 #include "lightdistrib.h"
+#include "sdtree.h"
 
 namespace pbrt {
 
+// PathGuideVertex Declarations
+struct PathGuideVertex {
+    // The spatial leaf of the vertex's _SDTree_, the sampled direction and
+    // its probability density, the path throughput after the vertex, and
+    // the radiance that the path found after it
+    SDTreeLeaf *leaf;
+    Vector3f wi;
+    Float pdf;
+    Spectrum throughput, radiance;
+    int bounce;
+};
+
+// PathState Declarations
+struct PathState {
+    PathState(const RayDifferential &ray) : ray(ray) {}
+    // The ray to trace next, the radiance gathered so far, and the path
+    // throughput
+    RayDifferential ray;
+    Spectrum L = Spectrum(0.f), beta = Spectrum(1.f);
+    bool specularBounce = false;
+    int bounces = 0;
+    // Added after book publication: etaScale tracks the accumulated effect
+    // of radiance scaling due to rays passing through refractive
+    // boundaries (see the derivation on p. 527 of the third edition). We
+    // track this value in order to remove it from beta when we apply
+    // Russian roulette; this is worthwhile, since it lets us sometimes
+    // avoid terminating refracted rays that are about to be refracted back
+    // out of a medium and thus have their beta value increased.
+    Float etaScale = 1;
+    // When training the path guide, the vertices whose incident radiance is
+    // recorded; null otherwise
+    PathGuideVertex *guideVertices = nullptr;
+    int nGuideVertices = 0;
+};
+
 // PathIntegrator Declarations
 class PathIntegrator : public SamplerIntegrator {
   public:
@@ -52,18 +88,37 @@ class PathIntegrator : public SamplerIntegrator {
     PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                    std::shared_ptr<Sampler> sampler,
                    const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                   const std::string &lightSampleStrategy = "spatial");
+                   const std::string &lightSampleStrategy = "spatial",
+                   bool guiding = false, int guidingSamples = 0);
 
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
 
+    // Processes the result of tracing _path.ray_, adding emitted and
+    // direct lighting and sampling the next ray; returns false if the path
+    // is terminated.
+    bool Bounce(PathState &path, bool foundIntersection,
+                SurfaceInteraction &isect, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena) const;
+
   private:
+    // PathIntegrator Private Methods
+    void TracePath(PathState &path, const Scene &scene, Sampler &sampler,
+                   MemoryArena &arena) const;
+    void TrainGuide(const Scene &scene);
+
     // PathIntegrator Private Data
     const int maxDepth;
     const Float rrThreshold;
     const std::string lightSampleStrategy;
     std::unique_ptr<LightDistribution> lightDistribution;
+    // With _guiding_, bounce directions are sampled from a mix of the BSDF
+    // and an _SDTree_ of the incident radiance that is learned in training
+    // passes taking _guidingSamples_ samples per pixel in total
+    const bool guiding;
+    const int guidingSamples;
+    std::unique_ptr<SDTree> sdTree;
 };
 
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
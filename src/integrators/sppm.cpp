@@ -33,6 +33,7 @@
 
 // integrators/sppm.cpp*
 #include "integrators/sppm.h"
+#include "checkpoint.h"
 #include "parallel.h"
 #include "scene.h"
 #include "imageio.h"
@@ -40,6 +41,7 @@
 #include "rng.h"
 #include "paramset.h"
 #include "progressreporter.h"
+#include "tilescheduler.h"
 #include "interaction.h"
 #include "sampling.h"
 #include "samplers/halton.h"
@@ -84,6 +86,13 @@ struct SPPMPixel {
     Spectrum tau;
 };
 
+// The per-pixel state that carries over from one SPPM iteration to the
+// next, which is what checkpoints store
+struct SPPMPixelState {
+    Float radius, N;
+    Spectrum Ld, tau;
+};
+
 struct SPPMPixelListNode {
     SPPMPixel *pixel;
     SPPMPixelListNode *next;
@@ -117,6 +126,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
     for (int i = 0; i < nPixels; ++i) pixels[i].radius = initialSearchRadius;
     const Float invSqrtSPP = 1.f / std::sqrt(nIterations);
     pixelMemoryBytes = nPixels * sizeof(SPPMPixel);
+    TrackedMemory pixelMemory(MemoryCategory::SPPM, nPixels * sizeof(SPPMPixel));
     // Compute _lightDistr_ for sampling lights proportional to power
     std::unique_ptr<Distribution1D> lightDistr =
         ComputeLightPowerDistribution(scene);
@@ -124,29 +134,49 @@ void SPPMIntegrator::Render(const Scene &scene) {
     // Perform _nIterations_ of SPPM integration
     HaltonSampler sampler(nIterations, pixelBounds);
 
-    // Compute number of tiles to use for SPPM camera pass
-    Vector2i pixelExtent = pixelBounds.Diagonal();
-    const int tileSize = 16;
-    Point2i nTiles((pixelExtent.x + tileSize - 1) / tileSize,
-                   (pixelExtent.y + tileSize - 1) / tileSize);
+    // Create _TileScheduler_ for SPPM camera pass; its cost estimates
+    // carry over from one iteration to the next
+    TileScheduler scheduler(pixelBounds);
+
+    // Resume from the iteration saved in a checkpoint, if requested
+    std::string description = CheckpointDescription(
+        StringPrintf("sppm %d", photonsPerIteration), camera->film,
+        nIterations);
+    std::unique_ptr<Checkpoint> resumed = ResumeCheckpoint(description);
+    int firstIteration = 0;
+    std::vector<SPPMPixelState> pixelStates;
+    if (resumed) {
+        if (resumed->Get("sppm/iterations", &firstIteration) &&
+            resumed->Get("sppm/pixels", &pixelStates) &&
+            pixelStates.size() == size_t(nPixels)) {
+            for (int i = 0; i < nPixels; ++i) {
+                pixels[i].radius = pixelStates[i].radius;
+                pixels[i].N = pixelStates[i].N;
+                pixels[i].Ld = pixelStates[i].Ld;
+                pixels[i].tau = pixelStates[i].tau;
+            }
+        } else {
+            Error("%s: checkpoint is incomplete; starting a new render.",
+                  PbrtOptions.checkpointFile.c_str());
+            firstIteration = 0;
+        }
+    }
+    CheckpointTimer checkpointTimer;
     ProgressReporter progress(2 * nIterations, "Rendering");
+    progress.Update(2 * firstIteration);
     std::vector<MemoryArena> perThreadArenas(MaxThreadIndex());
-    for (int iter = 0; iter < nIterations; ++iter) {
+    TrackedMemory arenaMemory(MemoryCategory::SPPM);
+    for (int iter = firstIteration; iter < nIterations; ++iter) {
         // Generate SPPM visible points
         {
             ProfilePhase _(Prof::SPPMCameraPass);
-            ParallelFor2D([&](Point2i tile) {
+            scheduler.ForEach([&](const Bounds2i &tileBounds) {
+                CHECK_GE(ThreadIndex, 0);
                 MemoryArena &arena = perThreadArenas[ThreadIndex];
-                // Follow camera paths for _tile_ in image for SPPM
-                int tileIndex = tile.y * nTiles.x + tile.x;
+                // Follow camera paths for _tileBounds_ in image for SPPM
+                int tileIndex =
+                    scheduler.TileIndex(scheduler.Tiles(tileBounds).pMin);
                 std::unique_ptr<Sampler> tileSampler = sampler.Clone(tileIndex);
-
-                // Compute _tileBounds_ for SPPM tile
-                int x0 = pixelBounds.pMin.x + tile.x * tileSize;
-                int x1 = std::min(x0 + tileSize, pixelBounds.pMax.x);
-                int y0 = pixelBounds.pMin.y + tile.y * tileSize;
-                int y1 = std::min(y0 + tileSize, pixelBounds.pMax.y);
-                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
                 for (Point2i pPixel : tileBounds) {
                     // Prepare _tileSampler_ for _pPixel_
                     tileSampler->StartPixel(pPixel);
@@ -234,7 +264,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
                         }
                     }
                 }
-            }, nTiles);
+            });
         }
         progress.Update();
 
@@ -244,6 +274,8 @@ void SPPMIntegrator::Render(const Scene &scene) {
         // Allocate grid for SPPM visible points
         const int hashSize = nPixels;
         std::vector<std::atomic<SPPMPixelListNode *>> grid(hashSize);
+        TrackedMemory gridMemory(MemoryCategory::SPPM,
+                                 hashSize * sizeof(grid[0]));
         {
             ProfilePhase _(Prof::SPPMGridConstruction);
 
@@ -267,6 +299,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
 
             // Add visible points to SPPM grid
             ParallelFor([&](int pixelIndex) {
+                CHECK_GE(ThreadIndex, 0);
                 MemoryArena &arena = perThreadArenas[ThreadIndex];
                 SPPMPixel &pixel = pixels[pixelIndex];
                 if (!pixel.vp.beta.IsBlack()) {
@@ -298,6 +331,14 @@ void SPPMIntegrator::Render(const Scene &scene) {
                                     (1 + pMax.z - pMin.z));
                 }
             }, nPixels, 4096);
+
+            // Account for the arenas' BSDFs and grid nodes
+            size_t arenaBytes = 0;
+            for (const MemoryArena &arena : perThreadArenas)
+                arenaBytes += arena.TotalAllocated();
+            arenaMemory.Set(arenaBytes);
+            ReportValue(memoryArenaMB,
+                        (arenaBytes + gridMemory.Bytes()) / (1024.f * 1024.f));
         }
 
         // Trace photons and accumulate contributions
@@ -305,6 +346,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
             ProfilePhase _(Prof::SPPMPhotonPass);
             std::vector<MemoryArena> photonShootArenas(MaxThreadIndex());
             ParallelFor([&](int photonIndex) {
+                CHECK_GE(ThreadIndex, 0);
                 MemoryArena &arena = photonShootArenas[ThreadIndex];
                 // Follow photon path for _photonIndex_
                 uint64_t haltonIndex =
@@ -442,6 +484,20 @@ void SPPMIntegrator::Render(const Scene &scene) {
             }, nPixels, 4096);
         }
 
+        // Save a checkpoint of the pixel state after this iteration, if
+        // one is due
+        if (iter + 1 < nIterations && checkpointTimer.Due()) {
+            pixelStates.resize(nPixels);
+            for (int i = 0; i < nPixels; ++i)
+                pixelStates[i] = {pixels[i].radius, pixels[i].N, pixels[i].Ld,
+                                  pixels[i].tau};
+            Checkpoint checkpoint(description);
+            checkpoint.Add("sppm/iterations", iter + 1);
+            checkpoint.Add("sppm/pixels", pixelStates);
+            SaveCheckpoint(checkpoint);
+            checkpointTimer.Reset();
+        }
+
         // Periodically store SPPM image in film and write image
         if (iter + 1 == nIterations || ((iter + 1) % writeFrequency) == 0) {
             int x0 = pixelBounds.pMin.x;
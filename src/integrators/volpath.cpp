@@ -86,10 +86,8 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
             ++volumeInteractions;
             // Handle scattering at point in medium for volumetric path tracer
-            const Distribution1D *lightDistrib =
-                lightDistribution->Lookup(mi.p);
             L += beta * UniformSampleOneLight(mi, scene, arena, sampler, true,
-                                              lightDistrib);
+                                              lightDistribution.get());
 
             Vector3f wo = -ray.d, wi;
             mi.phase->Sample_p(wo, &wi, sampler.Get2D());
@@ -122,10 +120,8 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
             // Sample illumination from lights to find attenuated path
             // contribution
-            const Distribution1D *lightDistrib =
-                lightDistribution->Lookup(isect.p);
             L += beta * UniformSampleOneLight(isect, scene, arena, sampler,
-                                              true, lightDistrib);
+                                              true, lightDistribution.get());
 
             // Sample BSDF to get new path direction
             Vector3f wo = -ray.d, wi;
@@ -161,7 +157,7 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                 // component
                 L += beta *
                      UniformSampleOneLight(pi, scene, arena, sampler, true,
-                                           lightDistribution->Lookup(pi.p));
+                                           lightDistribution.get());
 
                 // Account for the indirect subsurface scattering component
                 Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(),
@@ -0,0 +1,544 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// integrators/wavefrontpath.cpp*
+#include "integrators/wavefrontpath.h"
+#include "bssrdf.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "material.h"
+#include "paramset.h"
+#include "rng.h"
+#include "scene.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_COUNTER("Integrator/Wavefront shadow rays traced", nShadowRays);
+STAT_COUNTER("Integrator/Wavefront ray batches sorted", nSortedBatches);
+STAT_INT_DISTRIBUTION("Integrator/Wavefront materials per batch",
+                      materialsPerBatch);
+
+// Number of bounces of each path for which sample values are drawn from
+// the tile's _Sampler_ when its camera ray is generated, and the sample
+// values that each bounce uses; a path that needs more uses its own _RNG_
+static PBRT_CONSTEXPR int MaxBufferedBounces = 8;
+enum { LightChoice1D, RussianRoulette1D, Buffered1DPerBounce };
+enum { Light2D, BSDF2D, Buffered2DPerBounce };
+
+// WavefrontPathQueue Declarations
+
+// WavefrontPathQueue stores a batch of camera paths as a structure of
+// arrays, so that each stage of _TraceQueue()_ only touches the arrays
+// it needs for all of the paths.
+struct WavefrontPathQueue {
+    // WavefrontPathQueue Public Methods
+    int Size() const { return ray.size(); }
+    void Clear() {
+        pixel.clear();
+        sampleNum.clear();
+        pFilm.clear();
+        rayWeight.clear();
+        ray.clear();
+        L.clear();
+        beta.clear();
+        etaScale.clear();
+        bounces.clear();
+        specularBounce.clear();
+        prevIntr.clear();
+        bsdfPdf.clear();
+        samples1D.clear();
+        samples2D.clear();
+        rng.clear();
+    }
+    Float Get1D(int path, int dim) {
+        if (bounces[path] < nBufferedBounces)
+            return samples1D[(path * nBufferedBounces + bounces[path]) *
+                                 Buffered1DPerBounce + dim];
+        return rng[path].UniformFloat();
+    }
+    Point2f Get2D(int path, int dim) {
+        if (bounces[path] < nBufferedBounces)
+            return samples2D[(path * nBufferedBounces + bounces[path]) *
+                                 Buffered2DPerBounce + dim];
+        Float u0 = rng[path].UniformFloat();
+        return Point2f(u0, rng[path].UniformFloat());
+    }
+
+    // WavefrontPathQueue Public Data
+    int nBufferedBounces = 0;
+    // Image sample that each path contributes to
+    std::vector<Point2i> pixel;
+    std::vector<int64_t> sampleNum;
+    std::vector<Point2f> pFilm;
+    std::vector<Float> rayWeight;
+    // Path state: see _PathState_
+    std::vector<RayDifferential> ray;
+    std::vector<Spectrum> L, beta;
+    std::vector<Float> etaScale;
+    std::vector<int> bounces;
+    std::vector<uint8_t> specularBounce;
+    // The vertex that each ray leaves and the density of the BSDF sample
+    // that gave its direction, for weighting emitted light that it finds;
+    // _bsdfPdf_ is zero if that light has already been accounted for
+    std::vector<Interaction> prevIntr;
+    std::vector<Float> bsdfPdf;
+    // Sample values drawn when the path was generated
+    std::vector<Float> samples1D;
+    std::vector<Point2f> samples2D;
+    std::vector<RNG> rng;
+};
+
+// PathRNGSampler returns sample values from a path's _RNG_, for the
+// stages of _TraceQueue()_ that take a _Sampler_ but whose sample values
+// aren't buffered
+class PathRNGSampler : public Sampler {
+  public:
+    // PathRNGSampler Public Methods
+    PathRNGSampler(RNG &rng) : Sampler(1), rng(rng) {}
+    Float Get1D() { return rng.UniformFloat(); }
+    Point2f Get2D() {
+        Float u0 = rng.UniformFloat();
+        return Point2f(u0, rng.UniformFloat());
+    }
+    std::unique_ptr<Sampler> Clone(int seed) {
+        LOG(FATAL) << "PathRNGSampler::Clone() shouldn't be called";
+        return nullptr;
+    }
+
+  private:
+    // PathRNGSampler Private Data
+    RNG &rng;
+};
+
+// Returns a key that orders rays by direction octant and then by the
+// Morton code of their origin within _bounds_.
+static uint64_t RaySortKey(const Ray &ray, const Bounds3f &bounds) {
+    Vector3f o = bounds.Offset(ray.o);
+    for (int i = 0; i < 3; ++i) o[i] = Clamp(o[i], 0, 1) * 1023;
+    int octant = (ray.d.x < 0 ? 1 : 0) | (ray.d.y < 0 ? 2 : 0) |
+                 (ray.d.z < 0 ? 4 : 0);
+    return (uint64_t(octant) << 30) | EncodeMorton3(o);
+}
+
+// WavefrontPathIntegrator Method Definitions
+WavefrontPathIntegrator::WavefrontPathIntegrator(
+    int maxDepth, std::shared_ptr<const Camera> camera,
+    std::shared_ptr<Sampler> sampler, const Bounds2i &pixelBounds,
+    Float rrThreshold, const std::string &lightSampleStrategy, int batchSize)
+    : SamplerIntegrator(camera, sampler, pixelBounds),
+      maxDepth(maxDepth),
+      rrThreshold(rrThreshold),
+      lightSampleStrategy(lightSampleStrategy),
+      batchSize(std::max(1, batchSize)) {}
+
+void WavefrontPathIntegrator::Preprocess(const Scene &scene,
+                                         Sampler &sampler) {
+    lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+}
+
+Spectrum WavefrontPathIntegrator::Li(const RayDifferential &ray,
+                                     const Scene &scene, Sampler &sampler,
+                                     MemoryArena &arena, int depth) const {
+    // Trace a single path to completion, for adaptive and progressive
+    // rendering, which choose the samples to take one at a time. The
+    // thread's queue is reused so that its arrays are only allocated once.
+    static thread_local WavefrontPathQueue queue;
+    queue.Clear();
+    AddPath(queue, ray, sampler);
+    TracePath(scene, queue, 0, arena);
+    return queue.L[0];
+}
+
+void WavefrontPathIntegrator::AddPath(WavefrontPathQueue &queue,
+                                      const RayDifferential &ray,
+                                      Sampler &sampler) const {
+    queue.nBufferedBounces = std::min(maxDepth, MaxBufferedBounces);
+    queue.ray.push_back(ray);
+    queue.L.push_back(Spectrum(0.f));
+    queue.beta.push_back(Spectrum(1.f));
+    queue.etaScale.push_back(1);
+    queue.bounces.push_back(0);
+    queue.specularBounce.push_back(false);
+    queue.prevIntr.push_back(Interaction());
+    queue.bsdfPdf.push_back(0);
+    for (int i = 0; i < queue.nBufferedBounces * Buffered1DPerBounce; ++i)
+        queue.samples1D.push_back(sampler.Get1D());
+    for (int i = 0; i < queue.nBufferedBounces * Buffered2DPerBounce; ++i)
+        queue.samples2D.push_back(sampler.Get2D());
+    // Give each of the image's samples its own random sequence for the
+    // bounces past the buffered ones
+    Point2i pixel = sampler.CurrentPixel();
+    Point2i resolution = camera->film->fullResolution;
+    queue.rng.push_back(RNG());
+    queue.rng.back().SetSequence(
+        (uint64_t(pixel.y) * resolution.x + pixel.x) *
+            uint64_t(sampler.samplesPerPixel) +
+        sampler.CurrentSampleNumber());
+}
+
+void WavefrontPathIntegrator::RenderTile(const Scene &scene,
+                                         const Bounds2i &tileBounds,
+                                         Sampler &tileSampler,
+                                         MemoryArena &arena,
+                                         FilmTile *filmTile) {
+    // Adaptive sampling picks each pixel's sample count as it goes, so it
+    // takes samples one at a time with _Li()_
+    if (adaptiveMaxError > 0) {
+        SamplerIntegrator::RenderTile(scene, tileBounds, tileSampler, arena,
+                                      filmTile);
+        return;
+    }
+    WavefrontPathQueue queue;
+    auto traceBatch = [&]() {
+        TraceQueue(scene, queue, arena);
+        // Add paths' contributions to image
+        for (int i = 0; i < queue.Size(); ++i) {
+            Spectrum L = CheckRadiance(queue.L[i], queue.pixel[i],
+                                       queue.sampleNum[i]);
+            filmTile->AddSample(queue.pFilm[i], L, queue.rayWeight[i]);
+        }
+        queue.Clear();
+    };
+    Float cameraSampleScale = 1 / std::sqrt((Float)tileSampler.samplesPerPixel);
+    for (Point2i pixel : tileBounds) {
+        {
+            ProfilePhase pp(Prof::StartPixel);
+            tileSampler.StartPixel(pixel);
+        }
+        if (!InsideExclusive(pixel, pixelBounds)) continue;
+        do {
+            // Generate camera ray and draw sample values for path
+            CameraSample cameraSample = tileSampler.GetCameraSample(pixel);
+            RayDifferential ray;
+            Float rayWeight =
+                camera->GenerateRayDifferential(cameraSample, &ray);
+            ray.ScaleDifferentials(cameraSampleScale);
+            ++nCameraRays;
+            AddPath(queue, ray, tileSampler);
+            int64_t sampleNum = tileSampler.CurrentSampleNumber();
+            queue.pixel.push_back(pixel);
+            queue.sampleNum.push_back(sampleNum);
+            queue.pFilm.push_back(cameraSample.pFilm);
+            queue.rayWeight.push_back(rayWeight);
+            if (queue.Size() == batchSize) traceBatch();
+        } while (tileSampler.StartNextSample());
+    }
+    if (queue.Size() > 0) traceBatch();
+}
+
+void WavefrontPathIntegrator::TraceQueue(const Scene &scene,
+                                         WavefrontPathQueue &queue,
+                                         MemoryArena &arena) const {
+    ProfilePhase p(Prof::SamplerIntegratorLi);
+    int n = queue.Size();
+    std::vector<std::pair<uint64_t, int>> active;
+    for (int i = 0; i < n; ++i)
+        if (queue.rayWeight[i] > 0) active.push_back({0, i});
+    Bounds3f sceneBounds = scene.WorldBound();
+    std::vector<SurfaceInteraction> isects(n);
+    std::vector<std::pair<const Material *, int>> byMaterial;
+    ShadingQueue shading;
+    // Shadow rays of the light samples and the radiance that they carry
+    std::vector<int> shadowPath;
+    std::vector<VisibilityTester> shadowRays;
+    std::vector<const Light *> shadowLight;
+    std::vector<Spectrum> shadowLd;
+
+    while (!active.empty()) {
+        // Sort the active paths' rays by direction octant and origin, so
+        // that nearby rays with similar directions are traced
+        // consecutively, and intersect them
+        for (auto &a : active)
+            a.first = RaySortKey(queue.ray[a.second], sceneBounds);
+        std::sort(active.begin(), active.end());
+        ++nSortedBatches;
+        for (const auto &a : active) {
+            int i = a.second;
+            isects[i] = SurfaceInteraction();
+            if (!scene.Intersect(queue.ray[i], &isects[i]))
+                isects[i].primitive = nullptr;
+        }
+
+        // Add emitted light, keeping the paths that continue
+        byMaterial.clear();
+        for (const auto &a : active)
+            if (AddEmitted(scene, queue, a.second, isects[a.second]))
+                byMaterial.push_back(
+                    {isects[a.second].primitive->GetMaterial(), a.second});
+
+        // Sort the hits by material, so that the following stages also
+        // visit them grouped by material, and compute their scattering
+        // functions one material at a time
+        std::sort(byMaterial.begin(), byMaterial.end());
+        int nMaterials = 0;
+        active.clear();
+        for (size_t j = 0; j < byMaterial.size(); ++j) {
+            if (j == 0 || byMaterial[j].first != byMaterial[j - 1].first)
+                ++nMaterials;
+            int i = byMaterial[j].second;
+            shading.Add(&isects[i], queue.ray[i]);
+            active.push_back({0, i});
+        }
+        shading.Shade(arena, TransportMode::Radiance, true);
+        ReportValue(materialsPerBatch, nMaterials);
+
+        // Sample the lights at the hits and trace the shadow rays
+        shadowPath.clear();
+        shadowRays.clear();
+        shadowLight.clear();
+        shadowLd.clear();
+        for (const auto &a : active) {
+            VisibilityTester vis;
+            const Light *light;
+            Spectrum Ld;
+            if (SampleLight(scene, queue, a.second, isects[a.second], &vis,
+                            &light, &Ld)) {
+                shadowPath.push_back(a.second);
+                shadowRays.push_back(vis);
+                shadowLight.push_back(light);
+                shadowLd.push_back(Ld);
+            }
+        }
+        for (size_t s = 0; s < shadowRays.size(); ++s) {
+            ++nShadowRays;
+            if (shadowRays[s].Unoccluded(scene, *shadowLight[s]))
+                queue.L[shadowPath[s]] += shadowLd[s];
+        }
+
+        // Sample the BSDFs for the paths' next rays
+        size_t nActive = 0;
+        for (const auto &a : active)
+            if (SampleNextRay(scene, queue, a.second, isects[a.second], arena))
+                active[nActive++] = a;
+        active.resize(nActive);
+        // The scattering functions of this bounce are no longer needed
+        arena.Reset();
+    }
+}
+
+void WavefrontPathIntegrator::TracePath(const Scene &scene,
+                                        WavefrontPathQueue &queue, int i,
+                                        MemoryArena &arena) const {
+    ProfilePhase p(Prof::SamplerIntegratorLi);
+    // Run path _i_ through the stages of _TraceQueue()_ one bounce at a
+    // time, tracing its shadow rays right away
+    while (true) {
+        SurfaceInteraction isect;
+        if (!scene.Intersect(queue.ray[i], &isect)) isect.primitive = nullptr;
+        if (!AddEmitted(scene, queue, i, isect)) break;
+        isect.ComputeScatteringFunctions(queue.ray[i], arena, true);
+        VisibilityTester vis;
+        const Light *light;
+        Spectrum Ld;
+        if (SampleLight(scene, queue, i, isect, &vis, &light, &Ld)) {
+            ++nShadowRays;
+            if (vis.Unoccluded(scene, *light)) queue.L[i] += Ld;
+        }
+        if (!SampleNextRay(scene, queue, i, isect, arena)) break;
+    }
+}
+
+bool WavefrontPathIntegrator::AddEmitted(const Scene &scene,
+                                         WavefrontPathQueue &queue, int i,
+                                         const SurfaceInteraction &isect) const {
+    // Returns the weight of emitted light that _queue.ray[i]_ finds at an
+    // emitter where sampling _light_ has density _lightPdf_
+    auto emittedWeight = [&](const Light &light) -> Float {
+        if (queue.bounces[i] == 0 || queue.specularBounce[i]) return 1;
+        if (queue.bsdfPdf[i] == 0) return 0;
+        Float lightPdf = light.Pdf_Li(queue.prevIntr[i], queue.ray[i].d);
+        return PowerHeuristic(1, queue.bsdfPdf[i], 1, lightPdf);
+    };
+
+    // Add emitted light and terminate paths that escaped or are long enough
+    if (!isect.primitive) {
+        for (const auto &light : scene.infiniteLights) {
+            Spectrum Le = light->Le(queue.ray[i]);
+            if (!Le.IsBlack())
+                queue.L[i] += queue.beta[i] * Le * emittedWeight(*light);
+        }
+        ReportValue(pathLength, queue.bounces[i]);
+        return false;
+    }
+    const AreaLight *area = isect.primitive->GetAreaLight();
+    if (area) {
+        Spectrum Le = isect.Le(-queue.ray[i].d);
+        if (!Le.IsBlack())
+            queue.L[i] += queue.beta[i] * Le * emittedWeight(*area);
+    }
+    if (queue.bounces[i] >= maxDepth) {
+        ReportValue(pathLength, queue.bounces[i]);
+        return false;
+    }
+    return true;
+}
+
+bool WavefrontPathIntegrator::SampleLight(const Scene &scene,
+                                          WavefrontPathQueue &queue, int i,
+                                          const SurfaceInteraction &isect,
+                                          VisibilityTester *vis,
+                                          const Light **light,
+                                          Spectrum *Ld) const {
+    if (!isect.bsdf ||
+        isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) == 0)
+        return false;
+    // Choose a light and sample it
+    Float lightPmf;
+    int lightNum = lightDistribution->Sample(
+        isect.p, isect.n, queue.Get1D(i, LightChoice1D), &lightPmf);
+    if (lightNum == -1) return false;
+    *light = scene.lights[lightNum].get();
+    Vector3f wi;
+    Float lightPdf;
+    Spectrum Li =
+        (*light)->Sample_Li(isect, queue.Get2D(i, Light2D), &wi, &lightPdf, vis);
+    if (lightPdf == 0 || Li.IsBlack()) return false;
+    Spectrum f = isect.bsdf->f(isect.wo, wi) * AbsDot(wi, isect.shading.n);
+    if (f.IsBlack()) return false;
+    // Weight the sample for MIS with the BSDF sample of the path's next
+    // direction
+    Float weight = 1;
+    if (!IsDeltaLight((*light)->flags))
+        weight = PowerHeuristic(1, lightPdf, 1, isect.bsdf->Pdf(isect.wo, wi));
+    *Ld = queue.beta[i] * f * Li * weight / (lightPdf * lightPmf);
+    return true;
+}
+
+bool WavefrontPathIntegrator::SampleNextRay(const Scene &scene,
+                                            WavefrontPathQueue &queue, int i,
+                                            SurfaceInteraction &isect,
+                                            MemoryArena &arena) const {
+    RayDifferential &ray = queue.ray[i];
+    Spectrum &beta = queue.beta[i];
+    if (!isect.bsdf) {
+        // Skip over medium boundaries
+        ray = isect.SpawnRay(ray.d);
+        return true;
+    }
+    Vector3f wo = -ray.d, wi;
+    Float pdf;
+    BxDFType flags;
+    Spectrum f = isect.bsdf->Sample_f(wo, &wi, queue.Get2D(i, BSDF2D), &pdf,
+                                      BSDF_ALL, &flags);
+    if (f.IsBlack() || pdf == 0.f) {
+        ReportValue(pathLength, queue.bounces[i]);
+        return false;
+    }
+    beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+    DCHECK(!std::isinf(beta.y()));
+    queue.specularBounce[i] = (flags & BSDF_SPECULAR) != 0;
+    queue.bsdfPdf[i] = pdf;
+    queue.prevIntr[i] = isect;
+    if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+        Float eta = isect.bsdf->eta;
+        queue.etaScale[i] *=
+            (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+    }
+    ray = isect.SpawnRay(wi);
+
+    // Account for subsurface scattering, if applicable; it's handled one
+    // path at a time, with sample values from the path's _RNG_
+    if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) {
+        PathRNGSampler sampler(queue.rng[i]);
+        SurfaceInteraction pi;
+        Spectrum S = isect.bssrdf->Sample_S(scene, sampler.Get1D(),
+                                            sampler.Get2D(), arena, &pi, &pdf);
+        if (S.IsBlack() || pdf == 0) {
+            ReportValue(pathLength, queue.bounces[i]);
+            return false;
+        }
+        beta *= S / pdf;
+        queue.L[i] += beta * UniformSampleOneLight(pi, scene, arena, sampler,
+                                                   false,
+                                                   lightDistribution.get());
+        f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf, BSDF_ALL,
+                              &flags);
+        if (f.IsBlack() || pdf == 0) {
+            ReportValue(pathLength, queue.bounces[i]);
+            return false;
+        }
+        beta *= f * AbsDot(wi, pi.shading.n) / pdf;
+        DCHECK(!std::isinf(beta.y()));
+        queue.specularBounce[i] = (flags & BSDF_SPECULAR) != 0;
+        // Direct lighting at _pi_ accounted for emitted light that the next
+        // ray finds
+        queue.bsdfPdf[i] = 0;
+        ray = pi.SpawnRay(wi);
+    }
+
+    // Possibly terminate the path with Russian roulette
+    Spectrum rrBeta = beta * queue.etaScale[i];
+    if (rrBeta.MaxComponentValue() < rrThreshold && queue.bounces[i] > 3) {
+        Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+        if (queue.Get1D(i, RussianRoulette1D) < q) {
+            ReportValue(pathLength, queue.bounces[i]);
+            return false;
+        }
+        beta /= 1 - q;
+        DCHECK(!std::isinf(beta.y()));
+    }
+    ++queue.bounces[i];
+    return true;
+}
+
+WavefrontPathIntegrator *CreateWavefrontPathIntegrator(
+    const ParamSet &params, std::shared_ptr<Sampler> sampler,
+    std::shared_ptr<const Camera> camera) {
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+    Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "spatial");
+    int batchSize = params.FindOneInt("batchsize", 4096);
+    return new WavefrontPathIntegrator(maxDepth, camera, sampler, pixelBounds,
+                                       rrThreshold, lightStrategy, batchSize);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,111 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_INTEGRATORS_WAVEFRONTPATH_H
+#define PBRT_INTEGRATORS_WAVEFRONTPATH_H
+
+// integrators/wavefrontpath.h*
+#include "pbrt.h"
+#include "integrator.h"
+#include "lightdistrib.h"
+
+namespace pbrt {
+struct WavefrontPathQueue;
+
+// WavefrontPathIntegrator Declarations
+
+// WavefrontPathIntegrator computes the same estimate as _PathIntegrator_,
+// but it traces the camera paths of a tile in batches, one stage at a time:
+// all of the batch's rays are sorted by direction and origin and
+// intersected, the hits are sorted by material and their BSDFs evaluated,
+// light samples are taken and their shadow rays traced together, and then
+// the next rays are sampled. Adaptive and progressive rendering, which take
+// samples one at a time, run each path through the same stages on its own.
+class WavefrontPathIntegrator : public SamplerIntegrator {
+  public:
+    // WavefrontPathIntegrator Public Methods
+    WavefrontPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+                            std::shared_ptr<Sampler> sampler,
+                            const Bounds2i &pixelBounds, Float rrThreshold = 1,
+                            const std::string &lightSampleStrategy = "spatial",
+                            int batchSize = 4096);
+    void Preprocess(const Scene &scene, Sampler &sampler);
+    Spectrum Li(const RayDifferential &ray, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena, int depth) const;
+
+  protected:
+    // WavefrontPathIntegrator Protected Methods
+    void RenderTile(const Scene &scene, const Bounds2i &tileBounds,
+                    Sampler &tileSampler, MemoryArena &arena,
+                    FilmTile *filmTile);
+
+  private:
+    // WavefrontPathIntegrator Private Methods
+    void AddPath(WavefrontPathQueue &queue, const RayDifferential &ray,
+                 Sampler &sampler) const;
+    void TraceQueue(const Scene &scene, WavefrontPathQueue &queue,
+                    MemoryArena &arena) const;
+    void TracePath(const Scene &scene, WavefrontPathQueue &queue, int i,
+                   MemoryArena &arena) const;
+
+    // Stages of tracing path _i_ of _queue_, which _TraceQueue()_ runs
+    // for a batch of paths and _TracePath()_ for one. _AddEmitted()_ and
+    // _SampleNextRay()_ return false if the path is terminated;
+    // _SampleLight()_ returns false if there's no light sample to trace.
+    bool AddEmitted(const Scene &scene, WavefrontPathQueue &queue, int i,
+                    const SurfaceInteraction &isect) const;
+    bool SampleLight(const Scene &scene, WavefrontPathQueue &queue, int i,
+                     const SurfaceInteraction &isect, VisibilityTester *vis,
+                     const Light **light, Spectrum *Ld) const;
+    bool SampleNextRay(const Scene &scene, WavefrontPathQueue &queue, int i,
+                       SurfaceInteraction &isect, MemoryArena &arena) const;
+
+    // WavefrontPathIntegrator Private Data
+    const int maxDepth;
+    const Float rrThreshold;
+    const std::string lightSampleStrategy;
+    const int batchSize;
+    std::unique_ptr<LightDistribution> lightDistribution;
+};
+
+WavefrontPathIntegrator *CreateWavefrontPathIntegrator(
+    const ParamSet &params, std::shared_ptr<Sampler> sampler,
+    std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_INTEGRATORS_WAVEFRONTPATH_H
@@ -65,6 +65,14 @@ Spectrum DiffuseAreaLight::Power() const {
     return (twoSided ? 2 : 1) * Lemit * area * Pi;
 }
 
+bool DiffuseAreaLight::Bounds(LightBounds *bounds) const {
+    // Emission falls off with the cosine to the surface normal, out to 90
+    // degrees from the normals' bounds
+    *bounds = LightBounds(shape->WorldBound(), Power().y(),
+                          shape->NormalBounds(), 0, twoSided);
+    return true;
+}
+
 Spectrum DiffuseAreaLight::Sample_Li(const Interaction &ref, const Point2f &u,
                                      Vector3f *wi, Float *pdf,
                                      VisibilityTester *vis) const {
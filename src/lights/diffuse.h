@@ -57,6 +57,7 @@ class DiffuseAreaLight : public AreaLight {
         return (twoSided || Dot(intr.n, w) > 0) ? Lemit : Spectrum(0.f);
     }
     Spectrum Power() const;
+    bool Bounds(LightBounds *bounds) const;
     Spectrum Sample_Li(const Interaction &ref, const Point2f &u, Vector3f *wo,
                        Float *pdf, VisibilityTester *vis) const;
     Float Pdf_Li(const Interaction &, const Vector3f &) const;
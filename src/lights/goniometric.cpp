@@ -58,6 +58,12 @@ Spectrum GonioPhotometricLight::Power() const {
                                  SpectrumType::Illuminant);
 }
 
+bool GonioPhotometricLight::Bounds(LightBounds *bounds) const {
+    *bounds = LightBounds(Bounds3f(pLight, pLight), Power().y(),
+                          DirectionCone::EntireSphere(), 0, false);
+    return true;
+}
+
 Float GonioPhotometricLight::Pdf_Li(const Interaction &,
                                     const Vector3f &) const {
     return 0.f;
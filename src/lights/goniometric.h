@@ -76,6 +76,7 @@ class GonioPhotometricLight : public Light {
                        : Spectrum(mipmap->Lookup(st), SpectrumType::Illuminant);
     }
     Spectrum Power() const;
+    bool Bounds(LightBounds *bounds) const;
     Float Pdf_Li(const Interaction &, const Vector3f &) const;
     Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
                        Ray *ray, Normal3f *nLight, Float *pdfPos,
@@ -81,6 +81,7 @@ InfiniteAreaLight::InfiniteAreaLight(const Transform &LightToWorld,
 
     // Compute sampling distributions for rows and columns of image
     distribution.reset(new Distribution2D(img.get(), width, height));
+    trackedMemory.Add(distribution->BytesUsed());
 }
 
 Spectrum InfiniteAreaLight::Power() const {
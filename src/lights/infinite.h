@@ -74,6 +74,7 @@ class InfiniteAreaLight : public Light {
     Point3f worldCenter;
     Float worldRadius;
     std::unique_ptr<Distribution2D> distribution;
+    TrackedMemory trackedMemory{MemoryCategory::Lights};
 };
 
 std::shared_ptr<InfiniteAreaLight> CreateInfiniteLight(
@@ -58,6 +58,12 @@ Float PointLight::Pdf_Li(const Interaction &, const Vector3f &) const {
     return 0;
 }
 
+bool PointLight::Bounds(LightBounds *bounds) const {
+    *bounds = LightBounds(Bounds3f(pLight, pLight), Power().y(),
+                          DirectionCone::EntireSphere(), 0, false);
+    return true;
+}
+
 Spectrum PointLight::Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
                                Ray *ray, Normal3f *nLight, Float *pdfPos,
                                Float *pdfDir) const {
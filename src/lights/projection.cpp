@@ -105,6 +105,13 @@ Spectrum ProjectionLight::Power() const {
            I * 2 * Pi * (1.f - cosTotalWidth);
 }
 
+bool ProjectionLight::Bounds(LightBounds *bounds) const {
+    Vector3f w = LightToWorld(Vector3f(0, 0, 1));
+    *bounds = LightBounds(Bounds3f(pLight, pLight), Power().y(),
+                          DirectionCone(w, cosTotalWidth), 1, false);
+    return true;
+}
+
 Float ProjectionLight::Pdf_Li(const Interaction &, const Vector3f &) const {
     return 0.f;
 }
@@ -76,6 +76,17 @@ Spectrum SpotLight::Power() const {
     return I * 2 * Pi * (1 - .5f * (cosFalloffStart + cosTotalWidth));
 }
 
+bool SpotLight::Bounds(LightBounds *bounds) const {
+    // Light is emitted at full strength within _falloffStart_ of the axis
+    // and falls off to zero at _totalWidth_
+    Vector3f w = LightToWorld(Vector3f(0, 0, 1));
+    Float cosThetaE =
+        std::cos(std::acos(cosTotalWidth) - std::acos(cosFalloffStart));
+    *bounds = LightBounds(Bounds3f(pLight, pLight), Power().y(),
+                          DirectionCone(w, cosFalloffStart), cosThetaE, false);
+    return true;
+}
+
 Float SpotLight::Pdf_Li(const Interaction &, const Vector3f &) const {
     return 0.f;
 }
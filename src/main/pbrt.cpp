@@ -46,13 +46,31 @@ static void usage(const char *msg = nullptr) {
 
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
+  --checkpoint <file>  Periodically save the state of the render to <file>.
+  --checkpointinterval <sec> Save a checkpoint every <sec> seconds.
+                       Default: 600.
+  --coordinator <port> Hand out parts of the image to pbrt processes started
+                       with --worker, render the rest, and write the image.
   --cropwindow <x0,x1,y0,y1> Specify an image crop window.
   --help               Print this help text.
+  --memorybudget <size> Exit with an error, rather than running the machine
+                       out of memory, if pbrt's large data structures need
+                       more than <size> bytes (e.g. 512M or 60G).
   --nthreads <num>     Use specified number of threads for rendering.
+  --numa               Pin threads to cores and spread large data structures
+                       and image tiles over the machine's NUMA nodes.
   --outfile <filename> Write the final image to the given filename.
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --resume             Continue the render saved in the --checkpoint file.
+  --targetnoise <err>  Render progressively, stopping once the average
+                       relative error of the pixels falls below <err>.
+  --timelimit <sec>    Render progressively, stopping after <sec> seconds.
+  --worker <host:port> Render parts of the image for a pbrt process started
+                       with --coordinator on the same scene files.
+  --writeinterval <sec> When rendering progressively, write the image so
+                       far every <sec> seconds.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -72,6 +90,29 @@ Reformatting options:
     exit(msg ? 1 : 0);
 }
 
+// Parses a size in bytes with an optional k, M, or G suffix; returns -1 if
+// _str_ isn't one.
+static int64_t parseMemorySize(const char *str) {
+    char *end;
+    double size = strtod(str, &end);
+    switch (*end) {
+    case 'k': case 'K':
+        size *= 1024.;
+        ++end;
+        break;
+    case 'm': case 'M':
+        size *= 1024. * 1024.;
+        ++end;
+        break;
+    case 'g': case 'G':
+        size *= 1024. * 1024. * 1024.;
+        ++end;
+        break;
+    }
+    if (end == str || *end != '\0' || size <= 0) return -1;
+    return int64_t(size);
+}
+
 // main program
 int main(int argc, char *argv[]) {
     google::InitGoogleLogging(argv[0]);
@@ -87,6 +128,51 @@ int main(int argc, char *argv[]) {
             options.nThreads = atoi(argv[++i]);
         } else if (!strncmp(argv[i], "--nthreads=", 11)) {
             options.nThreads = atoi(&argv[i][11]);
+        } else if (!strcmp(argv[i], "--numa") || !strcmp(argv[i], "-numa")) {
+            options.numa = true;
+        } else if (!strcmp(argv[i], "--timelimit") ||
+                   !strcmp(argv[i], "--time-limit")) {
+            if (i + 1 == argc)
+                usage("missing value after --timelimit argument");
+            options.timeLimit = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--targetnoise") ||
+                   !strcmp(argv[i], "--target-noise")) {
+            if (i + 1 == argc)
+                usage("missing value after --targetnoise argument");
+            options.targetNoise = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--writeinterval") ||
+                   !strcmp(argv[i], "--write-interval")) {
+            if (i + 1 == argc)
+                usage("missing value after --writeinterval argument");
+            options.writeInterval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--checkpoint")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpoint argument");
+            options.checkpointFile = argv[++i];
+        } else if (!strcmp(argv[i], "--checkpointinterval") ||
+                   !strcmp(argv[i], "--checkpoint-interval")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpointinterval argument");
+            options.checkpointInterval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--resume")) {
+            options.resume = true;
+        } else if (!strcmp(argv[i], "--memorybudget") ||
+                   !strcmp(argv[i], "--memory-budget")) {
+            if (i + 1 == argc)
+                usage("missing value after --memorybudget argument");
+            options.memoryBudget = parseMemorySize(argv[++i]);
+            if (options.memoryBudget < 0)
+                usage("invalid size after --memorybudget argument");
+        } else if (!strcmp(argv[i], "--coordinator")) {
+            if (i + 1 == argc)
+                usage("missing value after --coordinator argument");
+            options.coordinatorPort = atoi(argv[++i]);
+            if (options.coordinatorPort <= 0 || options.coordinatorPort > 65535)
+                usage("invalid port after --coordinator argument");
+        } else if (!strcmp(argv[i], "--worker")) {
+            if (i + 1 == argc)
+                usage("missing value after --worker argument");
+            options.coordinatorAddress = argv[++i];
         } else if (!strcmp(argv[i], "--outfile") || !strcmp(argv[i], "-outfile")) {
             if (i + 1 == argc)
                 usage("missing value after --outfile argument");
@@ -137,6 +223,8 @@ int main(int argc, char *argv[]) {
         } else
             filenames.push_back(argv[i]);
     }
+    if (options.resume && options.checkpointFile.empty())
+        usage("--resume requires a --checkpoint file");
 
     // Print welcome banner
     if (!options.quiet && !options.cat && !options.toPly) {
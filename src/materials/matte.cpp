@@ -61,6 +61,33 @@ void MatteMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
     }
 }
 
+void MatteMaterial::ComputeScatteringFunctionsBatch(
+    SurfaceInteraction *const *si, int n, MemoryArena &arena,
+    TransportMode mode, bool allowMultipleLobes) const {
+    // Perform bump mapping with _bumpMap_, if present
+    if (bumpMap)
+        for (int i = 0; i < n; ++i) Bump(bumpMap, si[i]);
+
+    // Evaluate textures for all of the hits
+    Spectrum *r = arena.Alloc<Spectrum>(n, false);
+    Float *sig = arena.Alloc<Float>(n, false);
+    Kd->EvaluateBatch(si, n, r);
+    sigma->EvaluateBatch(si, n, sig);
+
+    // Allocate BRDFs for _MatteMaterial_ hits
+    for (int i = 0; i < n; ++i) {
+        si[i]->bsdf = ARENA_ALLOC(arena, BSDF)(*si[i]);
+        Spectrum ri = r[i].Clamp();
+        Float sigi = Clamp(sig[i], 0, 90);
+        if (!ri.IsBlack()) {
+            if (sigi == 0)
+                si[i]->bsdf->Add(ARENA_ALLOC(arena, LambertianReflection)(ri));
+            else
+                si[i]->bsdf->Add(ARENA_ALLOC(arena, OrenNayar)(ri, sigi));
+        }
+    }
+}
+
 MatteMaterial *CreateMatteMaterial(const TextureParams &mp) {
     std::shared_ptr<Texture<Spectrum>> Kd =
         mp.GetSpectrumTexture("Kd", Spectrum(0.5f));
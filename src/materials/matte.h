@@ -55,6 +55,10 @@ class MatteMaterial : public Material {
     void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
                                     TransportMode mode,
                                     bool allowMultipleLobes) const;
+    void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si, int n,
+                                         MemoryArena &arena,
+                                         TransportMode mode,
+                                         bool allowMultipleLobes) const;
 
   private:
     // MatteMaterial Private Data
@@ -69,6 +69,46 @@ void PlasticMaterial::ComputeScatteringFunctions(
     }
 }
 
+void PlasticMaterial::ComputeScatteringFunctionsBatch(
+    SurfaceInteraction *const *si, int n, MemoryArena &arena,
+    TransportMode mode, bool allowMultipleLobes) const {
+    // Perform bump mapping with _bumpMap_, if present
+    if (bumpMap)
+        for (int i = 0; i < n; ++i) Bump(bumpMap, si[i]);
+
+    // Evaluate textures for all of the hits
+    Spectrum *kd = arena.Alloc<Spectrum>(n, false);
+    Spectrum *ks = arena.Alloc<Spectrum>(n, false);
+    Float *rough = arena.Alloc<Float>(n, false);
+    Kd->EvaluateBatch(si, n, kd);
+    Ks->EvaluateBatch(si, n, ks);
+    roughness->EvaluateBatch(si, n, rough);
+
+    for (int i = 0; i < n; ++i) {
+        si[i]->bsdf = ARENA_ALLOC(arena, BSDF)(*si[i]);
+        // Initialize diffuse component of plastic material
+        Spectrum kdi = kd[i].Clamp();
+        if (!kdi.IsBlack())
+            si[i]->bsdf->Add(ARENA_ALLOC(arena, LambertianReflection)(kdi));
+
+        // Initialize specular component of plastic material
+        Spectrum ksi = ks[i].Clamp();
+        if (!ksi.IsBlack()) {
+            Fresnel *fresnel =
+                ARENA_ALLOC(arena, FresnelDielectric)(1.5f, 1.f);
+            // Create microfacet distribution _distrib_ for plastic material
+            Float r = rough[i];
+            if (remapRoughness)
+                r = TrowbridgeReitzDistribution::RoughnessToAlpha(r);
+            MicrofacetDistribution *distrib =
+                ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(r, r);
+            BxDF *spec =
+                ARENA_ALLOC(arena, MicrofacetReflection)(ksi, distrib, fresnel);
+            si[i]->bsdf->Add(spec);
+        }
+    }
+}
+
 PlasticMaterial *CreatePlasticMaterial(const TextureParams &mp) {
     std::shared_ptr<Texture<Spectrum>> Kd =
         mp.GetSpectrumTexture("Kd", Spectrum(0.25f));
@@ -61,6 +61,10 @@ class PlasticMaterial : public Material {
     void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
                                     TransportMode mode,
                                     bool allowMultipleLobes) const;
+    void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si, int n,
+                                         MemoryArena &arena,
+                                         TransportMode mode,
+                                         bool allowMultipleLobes) const;
 
   private:
     // PlasticMaterial Private Data
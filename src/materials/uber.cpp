@@ -100,6 +100,80 @@ void UberMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
             ARENA_ALLOC(arena, SpecularTransmission)(kt, 1.f, e, mode));
 }
 
+void UberMaterial::ComputeScatteringFunctionsBatch(
+    SurfaceInteraction *const *si, int n, MemoryArena &arena,
+    TransportMode mode, bool allowMultipleLobes) const {
+    // Perform bump mapping with _bumpMap_, if present
+    if (bumpMap)
+        for (int i = 0; i < n; ++i) Bump(bumpMap, si[i]);
+
+    // Evaluate textures for all of the hits
+    Float *e = arena.Alloc<Float>(n, false);
+    Float *roughu = arena.Alloc<Float>(n, false);
+    Float *roughv = arena.Alloc<Float>(n, false);
+    Spectrum *op = arena.Alloc<Spectrum>(n, false);
+    Spectrum *kd = arena.Alloc<Spectrum>(n, false);
+    Spectrum *ks = arena.Alloc<Spectrum>(n, false);
+    Spectrum *kr = arena.Alloc<Spectrum>(n, false);
+    Spectrum *kt = arena.Alloc<Spectrum>(n, false);
+    eta->EvaluateBatch(si, n, e);
+    opacity->EvaluateBatch(si, n, op);
+    Kd->EvaluateBatch(si, n, kd);
+    Ks->EvaluateBatch(si, n, ks);
+    Kr->EvaluateBatch(si, n, kr);
+    Kt->EvaluateBatch(si, n, kt);
+    (roughnessu ? roughnessu : roughness)->EvaluateBatch(si, n, roughu);
+    if (roughnessv)
+        roughnessv->EvaluateBatch(si, n, roughv);
+    else
+        std::copy(roughu, roughu + n, roughv);
+
+    for (int i = 0; i < n; ++i) {
+        Spectrum opi = op[i].Clamp();
+        Spectrum t = (-opi + Spectrum(1.f)).Clamp();
+        if (!t.IsBlack()) {
+            si[i]->bsdf = ARENA_ALLOC(arena, BSDF)(*si[i], 1.f);
+            BxDF *tr =
+                ARENA_ALLOC(arena, SpecularTransmission)(t, 1.f, 1.f, mode);
+            si[i]->bsdf->Add(tr);
+        } else
+            si[i]->bsdf = ARENA_ALLOC(arena, BSDF)(*si[i], e[i]);
+
+        Spectrum kdi = opi * kd[i].Clamp();
+        if (!kdi.IsBlack()) {
+            BxDF *diff = ARENA_ALLOC(arena, LambertianReflection)(kdi);
+            si[i]->bsdf->Add(diff);
+        }
+
+        Spectrum ksi = opi * ks[i].Clamp();
+        if (!ksi.IsBlack()) {
+            Fresnel *fresnel = ARENA_ALLOC(arena, FresnelDielectric)(1.f, e[i]);
+            Float ru = roughu[i], rv = roughv[i];
+            if (remapRoughness) {
+                ru = TrowbridgeReitzDistribution::RoughnessToAlpha(ru);
+                rv = TrowbridgeReitzDistribution::RoughnessToAlpha(rv);
+            }
+            MicrofacetDistribution *distrib =
+                ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(ru, rv);
+            BxDF *spec =
+                ARENA_ALLOC(arena, MicrofacetReflection)(ksi, distrib, fresnel);
+            si[i]->bsdf->Add(spec);
+        }
+
+        Spectrum kri = opi * kr[i].Clamp();
+        if (!kri.IsBlack()) {
+            Fresnel *fresnel = ARENA_ALLOC(arena, FresnelDielectric)(1.f, e[i]);
+            si[i]->bsdf->Add(
+                ARENA_ALLOC(arena, SpecularReflection)(kri, fresnel));
+        }
+
+        Spectrum kti = opi * kt[i].Clamp();
+        if (!kti.IsBlack())
+            si[i]->bsdf->Add(
+                ARENA_ALLOC(arena, SpecularTransmission)(kti, 1.f, e[i], mode));
+    }
+}
+
 UberMaterial *CreateUberMaterial(const TextureParams &mp) {
     std::shared_ptr<Texture<Spectrum>> Kd =
         mp.GetSpectrumTexture("Kd", Spectrum(0.25f));
@@ -73,6 +73,10 @@ class UberMaterial : public Material {
     void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
                                     TransportMode mode,
                                     bool allowMultipleLobes) const;
+    void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si, int n,
+                                         MemoryArena &arena,
+                                         TransportMode mode,
+                                         bool allowMultipleLobes) const;
 
   private:
     // UberMaterial Private Data
@@ -43,6 +43,8 @@ STAT_PERCENT("Intersections/Ray-curve intersection tests", nHits, nTests);
 STAT_INT_DISTRIBUTION("Intersections/Curve refinement level", refinementLevel);
 STAT_COUNTER("Scene/Curves", nCurves);
 STAT_COUNTER("Scene/Split curves", nSplitCurves);
+STAT_PERCENT("Intersections/Curves culled by oriented bounds", nObbCulls,
+             nObbTests);
 
 // Curve Utility Functions
 static Point3f BlossomBezier(const Point3f p[4], Float u0, Float u1, Float u2) {
@@ -86,7 +88,7 @@ static Point3f EvalBezier(const Point3f cp[4], Float u,
 // Curve Method Definitions
 CurveCommon::CurveCommon(const Point3f c[4], Float width0, Float width1,
                          CurveType type, const Normal3f *norm)
-    : type(type) {
+    : type(type), trackedMemory(MemoryCategory::Meshes) {
     width[0] = width0;
     width[1] = width1;
     for (int i = 0; i < 4; ++i)
@@ -117,21 +119,112 @@ std::vector<std::shared_ptr<Shape>> CreateCurve(
         ++nSplitCurves;
     }
     curveBytes += sizeof(CurveCommon) + nSegments * sizeof(Curve);
+    common->trackedMemory.Add(sizeof(CurveCommon) + nSegments * sizeof(Curve));
     return segments;
 }
 
-Bounds3f Curve::ObjectBound() const {
+Curve::Curve(const Transform *ObjectToWorld, const Transform *WorldToObject,
+             bool reverseOrientation,
+             const std::shared_ptr<CurveCommon> &common, Float uMin,
+             Float uMax)
+    : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      common(common),
+      uMin(uMin),
+      uMax(uMax) {
     // Compute object-space control points for curve segment, _cpObj_
-    Point3f cpObj[4];
     cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
     cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
     cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
     cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
+    maxWidth = std::max(Lerp(uMin, common->width[0], common->width[1]),
+                        Lerp(uMax, common->width[0], common->width[1]));
+
+    // Compute oriented bounding box frame for curve segment
+    Vector3f chord = cpObj[3] - cpObj[0];
+    if (chord.LengthSquared() == 0) chord = cpObj[2] - cpObj[1];
+    if (chord.LengthSquared() == 0) {
+        obbAxis[0] = Vector3f(1, 0, 0);
+        obbAxis[1] = Vector3f(0, 1, 0);
+        obbAxis[2] = Vector3f(0, 0, 1);
+    } else {
+        // Align the second axis with the interior control point farthest
+        // from the chord, so that planar segments have no extent along the
+        // third axis
+        obbAxis[0] = Normalize(chord);
+        Vector3f perp;
+        for (int i = 1; i < 3; ++i) {
+            Vector3f v = cpObj[i] - cpObj[0];
+            v -= Dot(v, obbAxis[0]) * obbAxis[0];
+            if (v.LengthSquared() > perp.LengthSquared()) perp = v;
+        }
+        if (perp.LengthSquared() > 0) {
+            obbAxis[1] = Normalize(perp);
+            obbAxis[2] = Cross(obbAxis[0], obbAxis[1]);
+        } else
+            CoordinateSystem(obbAxis[0], &obbAxis[1], &obbAxis[2]);
+    }
+
+    // Bound the control points along each axis; the segment lies in their
+    // convex hull, and its surface is within half its width of it
+    for (int axis = 0; axis < 3; ++axis) {
+        obbMin[axis] = Infinity;
+        obbMax[axis] = -Infinity;
+        for (int i = 0; i < 4; ++i) {
+            Float d = Dot(Vector3f(cpObj[i]), obbAxis[axis]);
+            obbMin[axis] = std::min(obbMin[axis], d);
+            obbMax[axis] = std::max(obbMax[axis], d);
+        }
+        // Pad the extent slightly to cover round-off in the projections
+        Float pad = 0.5f * maxWidth +
+                    gamma(4) * std::max(std::abs(obbMin[axis]),
+                                        std::abs(obbMax[axis]));
+        obbMin[axis] -= pad;
+        obbMax[axis] += pad;
+    }
+}
+
+Bounds3f Curve::ObjectBound() const {
     Bounds3f b =
         Union(Bounds3f(cpObj[0], cpObj[1]), Bounds3f(cpObj[2], cpObj[3]));
-    Float width[2] = {Lerp(uMin, common->width[0], common->width[1]),
-                      Lerp(uMax, common->width[0], common->width[1])};
-    return Expand(b, std::max(width[0], width[1]) * 0.5f);
+    return Expand(b, maxWidth * 0.5f);
+}
+
+Bounds3f Curve::WorldBound() const {
+    // Both the transformed object-space bounds and the world-space bounds
+    // of the oriented bounding box's corners contain the segment, so it's
+    // bounded by their intersection. This is much tighter than either for
+    // long, thin segments that are diagonal to the axes.
+    Bounds3f obbBounds;
+    for (int corner = 0; corner < 8; ++corner) {
+        Point3f p(0, 0, 0);
+        for (int axis = 0; axis < 3; ++axis)
+            p += ((corner & (1 << axis)) ? obbMax[axis] : obbMin[axis]) *
+                 obbAxis[axis];
+        obbBounds = Union(obbBounds, (*ObjectToWorld)(p));
+    }
+    return pbrt::Intersect(Shape::WorldBound(), obbBounds);
+}
+
+bool Curve::orientedBoundsIntersectP(const Ray &ray) const {
+    ++nObbTests;
+    // Clip the object-space ray against the slabs of the oriented bounding
+    // box, as in _Bounds3::IntersectP()_
+    Float t0 = 0, t1 = ray.tMax;
+    for (int axis = 0; axis < 3; ++axis) {
+        Float o = Dot(Vector3f(ray.o), obbAxis[axis]);
+        Float invD = 1 / Dot(ray.d, obbAxis[axis]);
+        Float tNear = (obbMin[axis] - o) * invD;
+        Float tFar = (obbMax[axis] - o) * invD;
+        if (tNear > tFar) std::swap(tNear, tFar);
+        tFar *= 1 + 2 * gamma(3);
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if (t0 > t1) {
+            ++nObbCulls;
+            return false;
+        }
+    }
+    return true;
 }
 
 bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
@@ -142,12 +235,9 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     Vector3f oErr, dErr;
     Ray ray = (*WorldToObject)(r, &oErr, &dErr);
 
-    // Compute object-space control points for curve segment, _cpObj_
-    Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
+    // Cull rays that miss the segment's oriented bounding box before doing
+    // the more expensive tests below
+    if (!orientedBoundsIntersectP(ray)) return false;
 
     // Project curve control points to plane perpendicular to ray
 
@@ -177,8 +267,6 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     // the curve's bounding box. We start with the y dimension, since the y
     // extent is generally the smallest (and is often tiny) due to our
     // careful orientation of the ray coordinate ysstem above.
-    Float maxWidth = std::max(Lerp(uMin, common->width[0], common->width[1]),
-                              Lerp(uMax, common->width[0], common->width[1]));
     if (std::max(std::max(cp[0].y, cp[1].y), std::max(cp[2].y, cp[3].y)) +
             0.5f * maxWidth < 0 ||
         std::min(std::min(cp[0].y, cp[1].y), std::min(cp[2].y, cp[3].y)) -
@@ -374,12 +462,6 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
 }
 
 Float Curve::Area() const {
-    // Compute object-space control points for curve segment, _cpObj_
-    Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
     Float width0 = Lerp(uMin, common->width[0], common->width[1]);
     Float width1 = Lerp(uMax, common->width[0], common->width[1]);
     Float avgWidth = (width0 + width1) * 0.5f;
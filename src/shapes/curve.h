@@ -56,6 +56,8 @@ struct CurveCommon {
     Float width[2];
     Normal3f n[2];
     Float normalAngle, invSinNormalAngle;
+    // Accounts for this and the _Curve_ segments that share it
+    TrackedMemory trackedMemory;
 };
 
 // Curve Declarations
@@ -64,12 +66,9 @@ class Curve : public Shape {
     // Curve Public Methods
     Curve(const Transform *ObjectToWorld, const Transform *WorldToObject,
           bool reverseOrientation, const std::shared_ptr<CurveCommon> &common,
-          Float uMin, Float uMax)
-        : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
-          common(common),
-          uMin(uMin),
-          uMax(uMax) {}
+          Float uMin, Float uMax);
     Bounds3f ObjectBound() const;
+    Bounds3f WorldBound() const;
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture) const;
     Float Area() const;
@@ -81,10 +80,19 @@ class Curve : public Shape {
                             SurfaceInteraction *isect, const Point3f cp[4],
                             const Transform &rayToObject, Float u0, Float u1,
                             int depth) const;
+    bool orientedBoundsIntersectP(const Ray &ray) const;
 
     // Curve Private Data
     const std::shared_ptr<CurveCommon> common;
     const Float uMin, uMax;
+    // Object-space control points and maximum width of this segment
+    Point3f cpObj[4];
+    Float maxWidth;
+    // Oriented bounding box of the segment: an orthonormal frame whose
+    // first axis follows the segment's chord, and the extent of the
+    // segment along each axis
+    Vector3f obbAxis[3];
+    Float obbMin[3], obbMax[3];
 };
 
 std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
@@ -136,6 +136,12 @@ Interaction Disk::Sample(const Point2f &u, Float *pdf) const {
     return it;
 }
 
+DirectionCone Disk::NormalBounds() const {
+    Normal3f n = (*ObjectToWorld)(Normal3f(0, 0, 1));
+    if (reverseOrientation) n *= -1;
+    return DirectionCone(Vector3f(n));
+}
+
 std::shared_ptr<Disk> CreateDiskShape(const Transform *o2w,
                                       const Transform *w2o,
                                       bool reverseOrientation,
@@ -60,6 +60,7 @@ class Disk : public Shape {
                    bool testAlphaTexture) const;
     bool IntersectP(const Ray &ray, bool testAlphaTexture) const;
     Float Area() const;
+    DirectionCone NormalBounds() const;
     Interaction Sample(const Point2f &u, Float *pdf) const;
 
   private:
@@ -32,6 +32,7 @@
 
 // shapes/triangle.cpp*
 #include "shapes/triangle.h"
+#include "material.h"
 #include "texture.h"
 #include "textures/constant.h"
 #include "paramset.h"
@@ -61,13 +62,16 @@ TriangleMesh::TriangleMesh(
       nVertices(nVertices),
       vertexIndices(vertexIndices, vertexIndices + 3 * nTriangles),
       alphaMask(alphaMask),
-      shadowAlphaMask(shadowAlphaMask) {
+      shadowAlphaMask(shadowAlphaMask),
+      trackedMemory(MemoryCategory::Meshes) {
     ++nMeshes;
     nTris += nTriangles;
-    triMeshBytes += sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
-                    nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
-                                 (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
-                                 (fIndices ? sizeof(*fIndices) : 0));
+    size_t bytes = sizeof(*this) + this->vertexIndices.size() * sizeof(int) +
+                   nVertices * (sizeof(*P) + (N ? sizeof(*N) : 0) +
+                                (S ? sizeof(*S) : 0) + (UV ? sizeof(*UV) : 0) +
+                                (fIndices ? sizeof(*fIndices) : 0));
+    triMeshBytes += bytes;
+    trackedMemory.Add(bytes);
 
     // Transform mesh vertices to world space
     p.reset(new Point3f[nVertices]);
@@ -185,14 +189,33 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
-bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
-                         bool testAlphaTexture) const {
+// Triangle Utility Functions
+static void GetTriangleUVs(const TriangleMesh &mesh, const int *v,
+                           Point2f uv[3]) {
+    if (mesh.uv) {
+        uv[0] = mesh.uv[v[0]];
+        uv[1] = mesh.uv[v[1]];
+        uv[2] = mesh.uv[v[2]];
+    } else {
+        uv[0] = Point2f(0, 0);
+        uv[1] = Point2f(1, 0);
+        uv[2] = Point2f(1, 1);
+    }
+}
+
+bool IntersectTriangle(const TriangleMesh &mesh, int triNumber,
+                       const Shape *shape, bool reverseOrientation,
+                       bool transformSwapsHandedness, const Ray &ray,
+                       Float *tHit, SurfaceInteraction *isect,
+                       bool testAlphaTexture) {
     ProfilePhase p(Prof::TriIntersect);
     ++nTests;
+    const int *v = &mesh.vertexIndices[3 * triNumber];
+    int faceIndex = mesh.faceIndices.size() ? mesh.faceIndices[triNumber] : 0;
     // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
 
     // Perform ray--triangle intersection test
 
@@ -293,7 +316,7 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     // Compute triangle partial derivatives
     Vector3f dpdu, dpdv;
     Point2f uv[3];
-    GetUVs(uv);
+    GetTriangleUVs(mesh, v, uv);
 
     // Compute deltas for triangle partial derivatives
     Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -330,30 +353,30 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
 
     // Test intersection against alpha texture, if present
-    if (testAlphaTexture && mesh->alphaMask) {
+    if (testAlphaTexture && mesh.alphaMask) {
         SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
                                       dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+                                      Normal3f(0, 0, 0), ray.time, shape);
+        if (mesh.alphaMask->Evaluate(isectLocal) == 0) return false;
     }
 
     // Fill in _SurfaceInteraction_ from triangle hit
     *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
                                 Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
-                                this, faceIndex);
+                                shape, faceIndex);
 
     // Override surface normal in _isect_ for triangle
     isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
     if (reverseOrientation ^ transformSwapsHandedness)
         isect->n = isect->shading.n = -isect->n;
 
-    if (mesh->n || mesh->s) {
+    if (mesh.n || mesh.s) {
         // Initialize _Triangle_ shading geometry
 
         // Compute shading normal _ns_ for triangle
         Normal3f ns;
-        if (mesh->n) {
-            ns = (b0 * mesh->n[v[0]] + b1 * mesh->n[v[1]] + b2 * mesh->n[v[2]]);
+        if (mesh.n) {
+            ns = (b0 * mesh.n[v[0]] + b1 * mesh.n[v[1]] + b2 * mesh.n[v[2]]);
             if (ns.LengthSquared() > 0)
                 ns = Normalize(ns);
             else
@@ -363,8 +386,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute shading tangent _ss_ for triangle
         Vector3f ss;
-        if (mesh->s) {
-            ss = (b0 * mesh->s[v[0]] + b1 * mesh->s[v[1]] + b2 * mesh->s[v[2]]);
+        if (mesh.s) {
+            ss = (b0 * mesh.s[v[0]] + b1 * mesh.s[v[1]] + b2 * mesh.s[v[2]]);
             if (ss.LengthSquared() > 0)
                 ss = Normalize(ss);
             else
@@ -382,12 +405,12 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute $\dndu$ and $\dndv$ for triangle shading geometry
         Normal3f dndu, dndv;
-        if (mesh->n) {
+        if (mesh.n) {
             // Compute deltas for triangle partial derivatives of normal
             Vector2f duv02 = uv[0] - uv[2];
             Vector2f duv12 = uv[1] - uv[2];
-            Normal3f dn1 = mesh->n[v[0]] - mesh->n[v[2]];
-            Normal3f dn2 = mesh->n[v[1]] - mesh->n[v[2]];
+            Normal3f dn1 = mesh.n[v[0]] - mesh.n[v[2]];
+            Normal3f dn2 = mesh.n[v[1]] - mesh.n[v[2]];
             Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
             bool degenerateUV = std::abs(determinant) < 1e-8;
             if (degenerateUV) {
@@ -397,8 +420,8 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                 // (rather than giving up) so that ray differentials for
                 // rays reflected from triangles with degenerate
                 // parameterizations are still reasonable.
-                Vector3f dn = Cross(Vector3f(mesh->n[v[2]] - mesh->n[v[0]]),
-                                    Vector3f(mesh->n[v[1]] - mesh->n[v[0]]));
+                Vector3f dn = Cross(Vector3f(mesh.n[v[2]] - mesh.n[v[0]]),
+                                    Vector3f(mesh.n[v[1]] - mesh.n[v[0]]));
                 if (dn.LengthSquared() == 0)
                     dndu = dndv = Normal3f(0, 0, 0);
                 else {
@@ -423,13 +446,16 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     return true;
 }
 
-bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+bool IntersectPTriangle(const TriangleMesh &mesh, int triNumber,
+                        const Shape *shape, const Ray &ray,
+                        bool testAlphaTexture) {
     ProfilePhase p(Prof::TriIntersectP);
     ++nTests;
+    const int *v = &mesh.vertexIndices[3 * triNumber];
     // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
 
     // Perform ray--triangle intersection test
 
@@ -528,11 +554,11 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
     if (t <= deltaT) return false;
 
     // Test shadow ray intersection against alpha texture, if present
-    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
+    if (testAlphaTexture && (mesh.alphaMask || mesh.shadowAlphaMask)) {
         // Compute triangle partial derivatives
         Vector3f dpdu, dpdv;
         Point2f uv[3];
-        GetUVs(uv);
+        GetTriangleUVs(mesh, v, uv);
 
         // Compute deltas for triangle partial derivatives
         Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -560,17 +586,29 @@ bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
         Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
         SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
                                       dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
+                                      Normal3f(0, 0, 0), ray.time, shape);
+        if (mesh.alphaMask && mesh.alphaMask->Evaluate(isectLocal) == 0)
             return false;
-        if (mesh->shadowAlphaMask &&
-            mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
+        if (mesh.shadowAlphaMask &&
+            mesh.shadowAlphaMask->Evaluate(isectLocal) == 0)
             return false;
     }
     ++nHits;
     return true;
 }
 
+bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    return IntersectTriangle(*mesh, TriangleNumber(), this, reverseOrientation,
+                             transformSwapsHandedness, ray, tHit, isect,
+                             testAlphaTexture);
+}
+
+bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    return IntersectPTriangle(*mesh, TriangleNumber(), this, ray,
+                              testAlphaTexture);
+}
+
 Float Triangle::Area() const {
     // Get triangle vertices in _p0_, _p1_, and _p2_
     const Point3f &p0 = mesh->p[v[0]];
@@ -579,6 +617,21 @@ Float Triangle::Area() const {
     return 0.5 * Cross(p1 - p0, p2 - p0).Length();
 }
 
+DirectionCone Triangle::NormalBounds() const {
+    // Orient the geometric normal as _Sample()_ does
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+    Vector3f n = Cross(p1 - p0, p2 - p0);
+    if (n.LengthSquared() == 0) return DirectionCone::EntireSphere();
+    if (mesh->n) {
+        Normal3f ns = mesh->n[v[0]] + mesh->n[v[1]] + mesh->n[v[2]];
+        n = Faceforward(n, ns);
+    } else if (reverseOrientation ^ transformSwapsHandedness)
+        n *= -1;
+    return DirectionCone(n);
+}
+
 Interaction Triangle::Sample(const Point2f &u, Float *pdf) const {
     Point2f b = UniformSampleTriangle(u);
     // Get triangle vertices in _p0_, _p1_, and _p2_
@@ -644,6 +697,70 @@ Float Triangle::SolidAngle(const Point3f &p, int nSamples) const {
         std::acos(Clamp(Dot(cross20, -cross01), -1, 1)) - Pi);
 }
 
+// TriangleMeshPrimitive Method Definitions
+TriangleMeshPrimitive::TriangleMeshPrimitive(
+    const std::shared_ptr<TriangleMesh> &mesh, bool reverseOrientation,
+    bool transformSwapsHandedness, const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface)
+    : mesh(mesh),
+      reverseOrientation(reverseOrientation),
+      transformSwapsHandedness(transformSwapsHandedness),
+      material(material),
+      mediumInterface(mediumInterface),
+      trackedMemory(MemoryCategory::Meshes, sizeof(*this)) {
+    for (int i = 0; i < mesh->nTriangles; ++i)
+        worldBound = Union(worldBound, ElementBound(i));
+    triMeshBytes += sizeof(*this);
+}
+
+Bounds3f TriangleMeshPrimitive::ElementBound(int triNumber) const {
+    const int *v = &mesh->vertexIndices[3 * triNumber];
+    return Union(Bounds3f(mesh->p[v[0]], mesh->p[v[1]]), mesh->p[v[2]]);
+}
+
+bool TriangleMeshPrimitive::Intersect(int triNumber, const Ray &r,
+                                      SurfaceInteraction *isect) const {
+    Float tHit;
+    if (!IntersectTriangle(*mesh, triNumber, nullptr, reverseOrientation,
+                           transformSwapsHandedness, r, &tHit, isect))
+        return false;
+    r.tMax = tHit;
+    isect->primitive = this;
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+    // Initialize _SurfaceInteraction::mediumInterface_ after triangle
+    // intersection
+    if (mediumInterface.IsMediumTransition())
+        isect->mediumInterface = mediumInterface;
+    else
+        isect->mediumInterface = MediumInterface(r.medium);
+    return true;
+}
+
+bool TriangleMeshPrimitive::IntersectP(int triNumber, const Ray &r) const {
+    return IntersectPTriangle(*mesh, triNumber, nullptr, r);
+}
+
+void TriangleMeshPrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+}
+
+void TriangleMeshPrimitive::ComputeScatteringFunctionsBatch(
+    SurfaceInteraction *const *si, int n, MemoryArena &arena,
+    TransportMode mode, bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctionsBatch(si, n, arena, mode,
+                                                  allowMultipleLobes);
+    for (int i = 0; i < n; ++i)
+        CHECK_GE(Dot(si[i]->n, si[i]->shading.n), 0.);
+}
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
@@ -40,6 +40,7 @@
 
 // shapes/triangle.h*
 #include "shape.h"
+#include "primitive.h"
 #include "stats.h"
 #include <map>
 
@@ -66,6 +67,7 @@ struct TriangleMesh {
     std::unique_ptr<Point2f[]> uv;
     std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
     std::vector<int> faceIndices;
+    TrackedMemory trackedMemory;
 };
 
 class Triangle : public Shape {
@@ -77,14 +79,17 @@ class Triangle : public Shape {
         : Shape(ObjectToWorld, WorldToObject, reverseOrientation), mesh(mesh) {
         v = &mesh->vertexIndices[3 * triNumber];
         triMeshBytes += sizeof(*this);
+        TrackMemory(MemoryCategory::Meshes, sizeof(*this));
         faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[triNumber] : 0;
     }
+    ~Triangle() { TrackMemory(MemoryCategory::Meshes, -int64_t(sizeof(*this))); }
     Bounds3f ObjectBound() const;
     Bounds3f WorldBound() const;
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture = true) const;
     bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
     Float Area() const;
+    DirectionCone NormalBounds() const;
 
     using Shape::Sample;  // Bring in the other Sample() overload.
     Interaction Sample(const Point2f &u, Float *pdf) const;
@@ -93,26 +98,64 @@ class Triangle : public Shape {
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
 
-  private:
-    // Triangle Private Methods
-    void GetUVs(Point2f uv[3]) const {
-        if (mesh->uv) {
-            uv[0] = mesh->uv[v[0]];
-            uv[1] = mesh->uv[v[1]];
-            uv[2] = mesh->uv[v[2]];
-        } else {
-            uv[0] = Point2f(0, 0);
-            uv[1] = Point2f(1, 0);
-            uv[2] = Point2f(1, 1);
-        }
-    }
+    const std::shared_ptr<TriangleMesh> &GetMesh() const { return mesh; }
+    int TriangleNumber() const { return (v - &mesh->vertexIndices[0]) / 3; }
 
+  private:
     // Triangle Private Data
     std::shared_ptr<TriangleMesh> mesh;
     const int *v;
     int faceIndex;
 };
 
+// TriangleMeshPrimitive Declarations
+class TriangleMeshPrimitive : public PrimitiveArray {
+  public:
+    // TriangleMeshPrimitive Public Methods
+    TriangleMeshPrimitive(const std::shared_ptr<TriangleMesh> &mesh,
+                          bool reverseOrientation,
+                          bool transformSwapsHandedness,
+                          const std::shared_ptr<Material> &material,
+                          const MediumInterface &mediumInterface);
+    Bounds3f WorldBound() const { return worldBound; }
+    int NumElements() const { return mesh->nTriangles; }
+    Bounds3f ElementBound(int triNumber) const;
+    bool Intersect(int triNumber, const Ray &r,
+                   SurfaceInteraction *isect) const;
+    bool IntersectP(int triNumber, const Ray &r) const;
+    using PrimitiveArray::Intersect;
+    using PrimitiveArray::IntersectP;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+    void ComputeScatteringFunctionsBatch(SurfaceInteraction *const *si, int n,
+                                         MemoryArena &arena, TransportMode mode,
+                                         bool allowMultipleLobes) const;
+
+  private:
+    // TriangleMeshPrimitive Private Data
+    std::shared_ptr<TriangleMesh> mesh;
+    const bool reverseOrientation, transformSwapsHandedness;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+    Bounds3f worldBound;
+    TrackedMemory trackedMemory;
+};
+
+// Intersect the _triNumber_th triangle of _mesh_ with a ray; _Triangle_ and
+// _TriangleMeshPrimitive_ share these so that a mesh doesn't need a _Shape_
+// per triangle in order to be ray traced.
+bool IntersectTriangle(const TriangleMesh &mesh, int triNumber,
+                       const Shape *shape, bool reverseOrientation,
+                       bool transformSwapsHandedness, const Ray &ray,
+                       Float *tHit, SurfaceInteraction *isect,
+                       bool testAlphaTexture = true);
+bool IntersectPTriangle(const TriangleMesh &mesh, int triNumber,
+                        const Shape *shape, const Ray &ray,
+                        bool testAlphaTexture = true);
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
@@ -0,0 +1,333 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "interaction.h"
+#include "primitive.h"
+#include "accelerators/bvh.h"
+#include "accelerators/kdtreeaccel.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+#include "stats.h"
+#ifndef PBRT_IS_WINDOWS
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace pbrt;
+
+// Creates a mesh of _nTriangles_ randomly placed small triangles.
+static std::shared_ptr<TriangleMesh> RandomTriangleMesh(RNG &rng,
+                                                        int nTriangles) {
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < nTriangles; ++i) {
+        Point3f center(20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10);
+        for (int j = 0; j < 3; ++j) {
+            indices.push_back(p.size());
+            p.push_back(center + Vector3f(rng.UniformFloat() - .5f,
+                                          rng.UniformFloat() - .5f,
+                                          rng.UniformFloat() - .5f));
+        }
+    }
+    return std::make_shared<TriangleMesh>(
+        Transform(), nTriangles, &indices[0], p.size(), &p[0], nullptr,
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+}
+
+// Checks that _a_ and _b_ give the same results for random rays through
+// the region where _RandomTriangleMesh()_ places triangles.
+static void ExpectSameIntersections(const Primitive &a, const Primitive &b,
+                                    RNG &rng) {
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o(30 * rng.UniformFloat() - 15, 30 * rng.UniformFloat() - 15,
+                  30 * rng.UniformFloat() - 15);
+        Point3f target(20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10);
+        Ray ra(o, target - o), rb(o, target - o);
+        SurfaceInteraction ia, ib;
+        bool hitA = a.Intersect(ra, &ia);
+        bool hitB = b.Intersect(rb, &ib);
+        ASSERT_EQ(hitA, hitB);
+        EXPECT_EQ(a.IntersectP(Ray(o, target - o)),
+                  b.IntersectP(Ray(o, target - o)));
+        if (hitA) {
+            EXPECT_EQ(ra.tMax, rb.tMax);
+            EXPECT_EQ(ia.p, ib.p);
+            EXPECT_EQ(ia.n, ib.n);
+        }
+    }
+}
+
+static std::vector<std::shared_ptr<Primitive>> TrianglePrimitives(
+    const std::shared_ptr<TriangleMesh> &mesh) {
+    static Transform identity;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (int i = 0; i < mesh->nTriangles; ++i)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            std::make_shared<Triangle>(&identity, &identity, false, mesh, i),
+            nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+TEST(BVH, CompactMatchesFull) {
+    RNG rng;
+    std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 2000);
+
+    // Build a regular BVH over one _GeometricPrimitive_ per triangle and a
+    // compact one over a single _TriangleMeshPrimitive_ for the same mesh
+    std::vector<std::shared_ptr<Primitive>> meshPrims;
+    meshPrims.push_back(std::make_shared<TriangleMeshPrimitive>(
+        mesh, false, false, nullptr, MediumInterface()));
+    BVHAccel full(TrianglePrimitives(mesh), 4);
+    BVHAccel compact(meshPrims, 4, BVHAccel::SplitMethod::SAH, true);
+
+    Bounds3f fb = full.WorldBound(), cb = compact.WorldBound();
+    for (int c = 0; c < 3; ++c) {
+        EXPECT_EQ(fb.pMin[c], cb.pMin[c]);
+        EXPECT_EQ(fb.pMax[c], cb.pMax[c]);
+    }
+    ExpectSameIntersections(full, compact, rng);
+}
+
+#ifndef PBRT_IS_WINDOWS
+TEST(BVH, CorruptCacheIsRebuilt) {
+    RNG rng;
+    std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 500);
+    std::vector<std::shared_ptr<Primitive>> prims = TrianglePrimitives(mesh);
+    std::vector<std::shared_ptr<Primitive>> meshPrims;
+    meshPrims.push_back(std::make_shared<TriangleMeshPrimitive>(
+        mesh, false, false, nullptr, MediumInterface()));
+    BVHAccel reference(prims, 4);
+
+    for (bool compact : {false, true}) {
+        // Write a cache file for the BVH into an empty directory
+        std::string dir = "test_bvhcache";
+        ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+        const auto &p = compact ? meshPrims : prims;
+        {
+            BVHAccel cached(p, 4, BVHAccel::SplitMethod::SAH, compact, dir);
+        }
+        std::string filename;
+        DIR *d = opendir(dir.c_str());
+        ASSERT_TRUE(d != nullptr);
+        while (dirent *entry = readdir(d))
+            if (entry->d_name[0] != '.') filename = dir + "/" + entry->d_name;
+        closedir(d);
+        ASSERT_FALSE(filename.empty());
+
+        // Overwrite the last node with offsets far out of range; the file
+        // still has the right size and hash, so only checking the nodes
+        // catches it
+        FILE *f = fopen(filename.c_str(), "r+b");
+        ASSERT_TRUE(f != nullptr);
+        std::vector<char> garbage(32, 0x7f);
+        size_t nodeSize = compact ? 16 : 32;
+        ASSERT_EQ(0, fseek(f, -long(nodeSize), SEEK_END));
+        ASSERT_EQ(nodeSize, fwrite(garbage.data(), 1, nodeSize, f));
+        fclose(f);
+
+        BVHAccel rebuilt(p, 4, BVHAccel::SplitMethod::SAH, compact, dir);
+        ExpectSameIntersections(reference, rebuilt, rng);
+
+        EXPECT_EQ(0, remove(filename.c_str()));
+        EXPECT_EQ(0, rmdir(dir.c_str()));
+    }
+}
+#endif  // !PBRT_IS_WINDOWS
+
+TEST(BVH, Refit) {
+    RNG rng;
+    std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 2000);
+    std::vector<std::shared_ptr<Primitive>> meshPrims;
+    meshPrims.push_back(std::make_shared<TriangleMeshPrimitive>(
+        mesh, false, false, nullptr, MediumInterface()));
+    BVHAccel full(TrianglePrimitives(mesh), 4);
+    BVHAccel fullNoRotate(TrianglePrimitives(mesh), 4);
+    BVHAccel compact(meshPrims, 4, BVHAccel::SplitMethod::SAH, true);
+
+    // Move each triangle by a random offset and refit
+    for (int i = 0; i < mesh->nTriangles; ++i) {
+        Vector3f offset(4 * rng.UniformFloat() - 2, 4 * rng.UniformFloat() - 2,
+                        4 * rng.UniformFloat() - 2);
+        for (int j = 0; j < 3; ++j)
+            mesh->p[mesh->vertexIndices[3 * i + j]] += offset;
+    }
+    full.Refit();
+    fullNoRotate.Refit(false);
+    compact.Refit();
+
+    // Compare against a BVH built from scratch for the moved triangles
+    BVHAccel rebuilt(TrianglePrimitives(mesh), 4);
+    ExpectSameIntersections(rebuilt, full, rng);
+    ExpectSameIntersections(rebuilt, fullNoRotate, rng);
+    ExpectSameIntersections(rebuilt, compact, rng);
+}
+
+TEST(BVH, MotionBlur) {
+    RNG rng;
+    // Create spheres with random rotating and translating motion
+    static Transform identity;
+    std::vector<std::unique_ptr<Transform>> transforms;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (int i = 0; i < 500; ++i) {
+        Vector3f t0(20 * rng.UniformFloat() - 10, 20 * rng.UniformFloat() - 10,
+                    20 * rng.UniformFloat() - 10);
+        Vector3f t1 = t0 + Vector3f(rng.UniformFloat() - .5f,
+                                    rng.UniformFloat() - .5f,
+                                    rng.UniformFloat() - .5f);
+        Vector3f axis(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                      rng.UniformFloat() + .1f);
+        transforms.push_back(std::unique_ptr<Transform>(new Transform(
+            Translate(t0) * Translate(Vector3f(1, 0, 0)))));
+        transforms.push_back(std::unique_ptr<Transform>(
+            new Transform(Translate(t1) * Rotate(180 * rng.UniformFloat(),
+                                                 Normalize(axis)) *
+                          Translate(Vector3f(1, 0, 0)))));
+        AnimatedTransform motion(transforms[transforms.size() - 2].get(), 0,
+                                 transforms.back().get(), 1);
+        std::shared_ptr<Primitive> sphere =
+            std::make_shared<GeometricPrimitive>(
+                std::make_shared<Sphere>(&identity, &identity, false, .3f,
+                                         -.3f, .3f, 360.f),
+                nullptr, nullptr, MediumInterface());
+        prims.push_back(std::make_shared<TransformedPrimitive>(sphere, motion));
+    }
+
+    BVHAccel bvh(prims, 4);
+    BVHAccel motionBVH(prims, 4, BVHAccel::SplitMethod::SAH, false, "", 4);
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o(30 * rng.UniformFloat() - 15, 30 * rng.UniformFloat() - 15,
+                  30 * rng.UniformFloat() - 15);
+        Point3f target(20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10);
+        Float time = rng.UniformFloat();
+        Ray ra(o, target - o, Infinity, time), rb(o, target - o, Infinity, time);
+        SurfaceInteraction ia, ib;
+        bool hitA = bvh.Intersect(ra, &ia), hitB = motionBVH.Intersect(rb, &ib);
+        ASSERT_EQ(hitA, hitB);
+        EXPECT_EQ(bvh.IntersectP(Ray(o, target - o, Infinity, time)),
+                  motionBVH.IntersectP(Ray(o, target - o, Infinity, time)));
+        if (hitA) EXPECT_EQ(ra.tMax, rb.tMax);
+    }
+}
+
+TEST(BVH, InstanceArray) {
+    RNG rng;
+    // Create two prototypes, each a BVH over a small random mesh
+    std::vector<std::shared_ptr<Primitive>> prototypes;
+    for (int i = 0; i < 2; ++i) {
+        std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 100);
+        prototypes.push_back(
+            std::make_shared<BVHAccel>(TrianglePrimitives(mesh), 4));
+    }
+
+    // Instance them with random rigid transformations, both through an
+    // _InstanceArrayPrimitive_ and with individual _TransformedPrimitive_s
+    std::vector<std::unique_ptr<Transform>> transforms;
+    std::vector<std::shared_ptr<Primitive>> transformedPrims, arrayPrims;
+    std::shared_ptr<InstanceArrayPrimitive> instances =
+        std::make_shared<InstanceArrayPrimitive>();
+    int prototypeIndex[2] = {instances->AddPrototype(prototypes[0]),
+                             instances->AddPrototype(prototypes[1])};
+    for (int i = 0; i < 50; ++i) {
+        Vector3f axis(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                      rng.UniformFloat() + .1f);
+        transforms.push_back(std::unique_ptr<Transform>(new Transform(
+            Translate(Vector3f(10 * rng.UniformFloat() - 5,
+                               10 * rng.UniformFloat() - 5,
+                               10 * rng.UniformFloat() - 5)) *
+            Rotate(360 * rng.UniformFloat(), Normalize(axis)) *
+            Scale(.5f, .5f, .5f))));
+        int p = i & 1;
+        transformedPrims.push_back(std::make_shared<TransformedPrimitive>(
+            prototypes[p], AnimatedTransform(transforms.back().get(), 0,
+                                             transforms.back().get(), 1)));
+        instances->AddInstance(prototypeIndex[p], *transforms.back());
+    }
+    arrayPrims.push_back(instances);
+
+    BVHAccel transformed(transformedPrims, 4);
+    BVHAccel array(arrayPrims, 4);
+    EXPECT_EQ(instances->NumElements(), 50);
+    ExpectSameIntersections(transformed, array, rng);
+}
+
+TEST(BVH, ShadowRays) {
+    RNG rng;
+    std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 2000);
+    std::vector<std::shared_ptr<Primitive>> meshPrims;
+    meshPrims.push_back(std::make_shared<TriangleMeshPrimitive>(
+        mesh, false, false, nullptr, MediumInterface()));
+    BVHAccel full(TrianglePrimitives(mesh), 4);
+    BVHAccel optimized(TrianglePrimitives(mesh), 4, BVHAccel::SplitMethod::SAH,
+                       false, "", 0, 0, 1, true);
+    BVHAccel compact(meshPrims, 4, BVHAccel::SplitMethod::SAH, true, "", 0,
+                     0, 1, true);
+    ExpectSameIntersections(full, optimized, rng);
+    ExpectSameIntersections(full, compact, rng);
+
+    // Trace shadow rays from random points to a fixed light position
+    // through an occluder cache
+    OccluderCache cache, compactCache;
+    Point3f pLight(0, 0, 15);
+    for (int i = 0; i < 10000; ++i) {
+        Point3f p(20 * rng.UniformFloat() - 10, 20 * rng.UniformFloat() - 10,
+                  20 * rng.UniformFloat() - 10);
+        Ray ray(p, pLight - p, 1);
+        bool occluded = full.IntersectP(ray);
+        EXPECT_EQ(occluded, optimized.IntersectPCached(ray, &cache));
+        EXPECT_EQ(occluded, compact.IntersectPCached(ray, &compactCache));
+    }
+    EXPECT_EQ(&optimized, cache.aggregate);
+    EXPECT_EQ(&compact, compactCache.aggregate);
+
+    // In compact mode, the shadow ray order should only change the
+    // traversal of shadow rays
+    BVHAccel compactPlain(meshPrims, 4, BVHAccel::SplitMethod::SAH, true, "",
+                          0, 0, 1, false);
+    std::vector<Ray> rays, shadowRays;
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o(30 * rng.UniformFloat() - 15, 30 * rng.UniformFloat() - 15,
+                  30 * rng.UniformFloat() - 15);
+        Point3f target(20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10,
+                       20 * rng.UniformFloat() - 10);
+        rays.push_back(Ray(o, target - o));
+        Point3f p(20 * rng.UniformFloat() - 10, 20 * rng.UniformFloat() - 10,
+                  20 * rng.UniformFloat() - 10);
+        shadowRays.push_back(Ray(p, pLight - p, 1));
+    }
+    auto nodesVisited = [&](const BVHAccel &bvh, bool shadow) {
+        ReportThreadStats();
+        ClearStats();
+        for (const Ray &r : shadow ? shadowRays : rays) {
+            Ray ray = r;
+            SurfaceInteraction isect;
+            if (shadow)
+                bvh.IntersectP(ray);
+            else
+                bvh.Intersect(ray, &isect);
+        }
+        ReportThreadStats();
+        return GetStatsRatio("Accelerator/Nodes visited per ray").first;
+    };
+    EXPECT_EQ(nodesVisited(compactPlain, false), nodesVisited(compact, false));
+    EXPECT_LT(nodesVisited(compact, true), nodesVisited(compactPlain, true));
+}
+
+TEST(KdTree, MatchesBVH) {
+    RNG rng;
+    // Use enough triangles that the upper levels are built in parallel
+    std::shared_ptr<TriangleMesh> mesh = RandomTriangleMesh(rng, 10000);
+    BVHAccel bvh(TrianglePrimitives(mesh), 4);
+    KdTreeAccel kdtree(TrianglePrimitives(mesh));
+    KdTreeAccel kdtreeMultiple(TrianglePrimitives(mesh), 80, 1, 0.5f, 8);
+    ExpectSameIntersections(bvh, kdtree, rng);
+    ExpectSameIntersections(bvh, kdtreeMultiple, rng);
+}
@@ -15,6 +15,7 @@
 #include "integrators/mlt.h"
 #include "integrators/path.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefrontpath.h"
 #include "lights/diffuse.h"
 #include "lights/point.h"
 #include "materials/matte.h"
@@ -29,6 +30,7 @@
 #include "shapes/sphere.h"
 #include "spectrum.h"
 #include "textures/constant.h"
+#include <set>
 
 using namespace pbrt;
 
@@ -313,6 +315,71 @@ std::vector<TestIntegrator> GetIntegrators() {
                                    scene});
         }
 
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., inTestDir("test.exr"), 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator =
+                new PathIntegrator(8, camera, sampler.first,
+                                   film->croppedPixelBounds, 1, "spatial",
+                                   true, 16);
+            integrators.push_back({integrator, film,
+                                   "Path guided, depth 8, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., inTestDir("test.exr"), 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator = new WavefrontPathIntegrator(
+                8, camera, sampler.first, film->croppedPixelBounds, 1,
+                "spatial", 100);
+            integrators.push_back({integrator, film,
+                                   "Wavefront path, depth 8, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., inTestDir("test.exr"), 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            // Adaptive sampling traces the paths one at a time; a depth
+            // past the buffered bounces checks their random sample values
+            WavefrontPathIntegrator *integrator = new WavefrontPathIntegrator(
+                12, camera, sampler.first, film->croppedPixelBounds, 1,
+                "spatial", 100);
+            integrator->SetAdaptiveSampling(.01, 16);
+            integrators.push_back({integrator, film,
+                                   "Wavefront path adaptive, depth 12, "
+                                   "Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
         // Volume path tracing integrators
         for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
             std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
@@ -438,3 +505,171 @@ TEST_P(RenderTest, RadianceMatches) {
 
 INSTANTIATE_TEST_CASE_P(AnalyticTestScenes, RenderTest,
                         testing::ValuesIn(GetIntegrators()));
+
+// Records a 2D sample value for each camera ray that it's asked to trace
+class SampleRecordingIntegrator : public SamplerIntegrator {
+  public:
+    SampleRecordingIntegrator(std::shared_ptr<const Camera> camera,
+                              std::shared_ptr<Sampler> sampler)
+        : SamplerIntegrator(camera, sampler,
+                            camera->film->croppedPixelBounds) {}
+    Spectrum Li(const RayDifferential &ray, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena, int depth) const {
+        Point2f u = sampler.Get2D();
+        samples.push_back(u);
+        // Return a noisy value so that the pixel never converges
+        return Spectrum(u.x + u.y);
+    }
+    mutable std::vector<Point2f> samples;
+};
+
+TEST(AdaptiveSampling, KeepsPixelStratification) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    pbrtInit(options);
+
+    // Render a single pixel with a 4x4 stratified pattern, without jitter,
+    // in adaptive rounds of 2, 2, 4 and 8 samples; together the rounds
+    // must use each stratum once
+    Point2i resolution(1, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., inTestDir("adaptive.exr"),
+                          1.);
+    Transform cameraTransform;
+    AnimatedTransform identity(&cameraTransform, 0, &cameraTransform, 1);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    std::shared_ptr<Sampler> sampler =
+        std::make_shared<StratifiedSampler>(4, 4, false, 4);
+    SampleRecordingIntegrator integrator(camera, sampler);
+    integrator.SetAdaptiveSampling(1e-6f, 2);
+    Scene scene(std::make_shared<BVHAccel>(
+                    std::vector<std::shared_ptr<Primitive>>()),
+                std::vector<std::shared_ptr<Light>>());
+    integrator.Render(scene);
+
+    ASSERT_EQ(16, integrator.samples.size());
+    std::set<int> strata;
+    for (const Point2f &u : integrator.samples)
+        strata.insert(int(u.x * 4) + 4 * int(u.y * 4));
+    EXPECT_EQ(16, strata.size());
+
+    pbrtCleanup();
+    EXPECT_EQ(0, remove(inTestDir("adaptive.exr").c_str()));
+}
+
+TEST(AdaptiveSampling, WavefrontMatchesTiledRendering) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    // Paths inside a closed diffuse sphere that is lit by a point light
+    // bounce past the sample values that are buffered for each path
+    Transform identity;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &identity, &identity, true, 3, -3, 3, 360);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.9));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, nullptr, MediumInterface()));
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(std::make_shared<PointLight>(
+        Translate(Vector3f(1, 1, 1)), MediumInterface(), Spectrum(10)));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    // Render the scene tile by tile and adaptively; with a minimum sample
+    // count equal to the sampler's, adaptive sampling takes the same
+    // samples one at a time, so the images must match
+    Point2i resolution(8, 8);
+    auto render = [&](bool adaptive) {
+        std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+        Film *film =
+            new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                     std::move(filter), 1., inTestDir("wavefront.exr"), 1.);
+        Transform cameraTransform;
+        AnimatedTransform cameraToWorld(&cameraTransform, 0,
+                                        &cameraTransform, 1);
+        std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+            cameraToWorld, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+            0., 10., 45, film, nullptr);
+        WavefrontPathIntegrator integrator(
+            12, camera, std::make_shared<RandomSampler>(16),
+            film->croppedPixelBounds, 1, "spatial", 100);
+        if (adaptive) integrator.SetAdaptiveSampling(1e-6f, 16);
+        integrator.Render(scene);
+        Point2i res;
+        std::unique_ptr<RGBSpectrum[]> image =
+            ReadImage(inTestDir("wavefront.exr"), &res);
+        EXPECT_EQ(0, remove(inTestDir("wavefront.exr").c_str()));
+        return image;
+    };
+    std::unique_ptr<RGBSpectrum[]> tiled = render(false);
+    std::unique_ptr<RGBSpectrum[]> adaptive = render(true);
+    ASSERT_TRUE(tiled && adaptive);
+    for (int i = 0; i < resolution.x * resolution.y; ++i)
+        for (int c = 0; c < 3; ++c)
+            EXPECT_NEAR(tiled[i][c], adaptive[i][c], 1e-4 * tiled[i][c])
+                << "pixel " << i;
+
+    pbrtCleanup();
+}
+
+// Returns the sample values that a _SampleRecordingIntegrator_ takes when
+// it renders a single pixel with a _RandomSampler_, either in one go or
+// progressively
+static std::vector<Point2f> RecordPixelSamples(bool progressive) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    // An unreachable noise target makes the render progressive and take
+    // all of the sampler's samples
+    if (progressive) options.targetNoise = 1e-6f;
+    pbrtInit(options);
+
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film =
+        new Film(Point2i(1, 1), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                 std::move(filter), 1., inTestDir("progressive.exr"), 1.);
+    Transform cameraTransform;
+    AnimatedTransform identity(&cameraTransform, 0, &cameraTransform, 1);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    SampleRecordingIntegrator integrator(camera,
+                                         std::make_shared<RandomSampler>(64));
+    Scene scene(std::make_shared<BVHAccel>(
+                    std::vector<std::shared_ptr<Primitive>>()),
+                std::vector<std::shared_ptr<Light>>());
+    integrator.Render(scene);
+
+    pbrtCleanup();
+    EXPECT_EQ(0, remove(inTestDir("progressive.exr").c_str()));
+    return integrator.samples;
+}
+
+TEST(ProgressiveRendering, TakesNewRandomSamplesInEachPass) {
+    // Rendering progressively in passes of 1, 2, 4, ... samples must take
+    // as many distinct sample values as rendering in one go; the first
+    // pass takes the same values as the one-shot render's first sample
+    std::vector<Point2f> oneShot = RecordPixelSamples(false);
+    std::vector<Point2f> progressive = RecordPixelSamples(true);
+    ASSERT_EQ(64, oneShot.size());
+    ASSERT_EQ(64, progressive.size());
+    EXPECT_EQ(oneShot[0], progressive[0]);
+    std::set<std::pair<Float, Float>> oneShotValues, progressiveValues;
+    for (int i = 0; i < 64; ++i) {
+        oneShotValues.insert(std::make_pair(oneShot[i].x, oneShot[i].y));
+        progressiveValues.insert(
+            std::make_pair(progressive[i].x, progressive[i].y));
+    }
+    EXPECT_EQ(64, oneShotValues.size());
+    EXPECT_EQ(64, progressiveValues.size());
+}
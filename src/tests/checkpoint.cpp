@@ -0,0 +1,129 @@
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include "pbrt.h"
+#include "checkpoint.h"
+#include "film.h"
+#include "filters/box.h"
+#include "parallel.h"
+#include "tilescheduler.h"
+#include <atomic>
+#include <mutex>
+
+using namespace pbrt;
+
+TEST(Checkpoint, WriteRead) {
+    std::string filename = "test_checkpoint.ckpt";
+    Checkpoint checkpoint("test 1 2 3");
+    std::vector<Float> values = {1.f, -2.5f, 1e20f};
+    checkpoint.Add("values", values);
+    checkpoint.Add("count", int64_t(42));
+    checkpoint.Add("empty", std::vector<int>());
+    ASSERT_TRUE(checkpoint.Write(filename));
+
+    std::unique_ptr<Checkpoint> read = Checkpoint::Read(filename);
+    ASSERT_TRUE(read.get() != nullptr);
+    EXPECT_EQ("test 1 2 3", read->Description());
+    std::vector<Float> readValues;
+    EXPECT_TRUE(read->Get("values", &readValues));
+    EXPECT_EQ(values, readValues);
+    int64_t count = 0;
+    EXPECT_TRUE(read->Get("count", &count));
+    EXPECT_EQ(42, count);
+    std::vector<int> empty = {1};
+    EXPECT_TRUE(read->Get("empty", &empty));
+    EXPECT_TRUE(empty.empty());
+
+    // Sections of the wrong size or that are missing aren't returned
+    int32_t wrongSize;
+    EXPECT_FALSE(read->Get("count", &wrongSize));
+    EXPECT_FALSE(read->Has("missing"));
+    EXPECT_FALSE(read->Get("missing", &count));
+
+    EXPECT_EQ(0, remove(filename.c_str()));
+    EXPECT_TRUE(Checkpoint::Read(filename).get() == nullptr);
+}
+
+TEST(Checkpoint, TileSchedulerResume) {
+    TestThreadPool threads;
+
+    // Checkpoint after every work unit of a render that stops early,
+    // making sure that no work unit is in progress at each checkpoint
+    Options options = PbrtOptions;
+    PbrtOptions.checkpointFile = "unused.ckpt";
+    PbrtOptions.checkpointInterval = 0;
+    Bounds2i bounds(Point2i(0, 0), Point2i(200, 150));
+    std::unique_ptr<Checkpoint> saved;
+    std::atomic<int> nActive(0), nUnits(0);
+    {
+        TileScheduler scheduler(bounds);
+        scheduler.EnableCheckpoints([&]() {
+            EXPECT_EQ(0, nActive);
+            if (scheduler.CompletedTileCount() <= scheduler.TileCount() / 2) {
+                saved.reset(new Checkpoint("test"));
+                scheduler.SaveState(saved.get());
+            }
+        });
+        scheduler.ForEach([&](const Bounds2i &) {
+            ++nActive;
+            ++nUnits;
+            --nActive;
+        });
+        EXPECT_EQ(scheduler.TileCount(), scheduler.CompletedTileCount());
+        EXPECT_GT(nUnits, 1);
+    }
+    PbrtOptions = options;
+
+    // A resumed scheduler should visit exactly the pixels that weren't done
+    ASSERT_TRUE(saved.get() != nullptr);
+    TileScheduler resumed(bounds);
+    ASSERT_TRUE(resumed.LoadState(*saved));
+    int nDone = resumed.CompletedTileCount();
+    EXPECT_GT(nDone, 0);
+    EXPECT_LT(nDone, resumed.TileCount());
+    std::mutex mutex;
+    std::vector<int> count(bounds.Area(), 0);
+    std::atomic<int> nTiles(0);
+    resumed.ForEach([&](const Bounds2i &workBounds) {
+        nTiles += resumed.Tiles(workBounds).Area();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Point2i p : workBounds) ++count[p.y * bounds.pMax.x + p.x];
+    });
+    EXPECT_EQ(resumed.TileCount() - nDone, nTiles);
+    int nPixelsDone = 0;
+    for (int c : count) {
+        EXPECT_LE(c, 1);
+        nPixelsDone += c;
+    }
+    EXPECT_GT(nPixelsDone, 0);
+    EXPECT_LT(nPixelsDone, bounds.Area());
+}
+
+TEST(Checkpoint, ResumeRequiresSameScene) {
+    Options options = PbrtOptions;
+    PbrtOptions.checkpointFile = "test_scene.ckpt";
+    PbrtOptions.resume = true;
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film film(Point2i(16, 16), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 1., "unused.exr", 1.);
+
+    // Checkpoint a render of one scene
+    const char scene[] = "Shape \"sphere\" \"float radius\" 1";
+    ResetCheckpointSceneHash();
+    AddToCheckpointSceneHash(scene, sizeof(scene));
+    std::string description = CheckpointDescription("test", &film, 16);
+    ASSERT_TRUE(Checkpoint(description).Write(PbrtOptions.checkpointFile));
+    EXPECT_TRUE(ResumeCheckpoint(description).get() != nullptr);
+
+    // The same resolution and sample count with a different scene or
+    // sampler mustn't resume it
+    const char edited[] = "Shape \"sphere\" \"float radius\" 2";
+    ResetCheckpointSceneHash();
+    AddToCheckpointSceneHash(edited, sizeof(edited));
+    std::string editedDescription = CheckpointDescription("test", &film, 16);
+    EXPECT_NE(description, editedDescription);
+    EXPECT_TRUE(ResumeCheckpoint(editedDescription).get() == nullptr);
+
+    EXPECT_EQ(0, remove(PbrtOptions.checkpointFile.c_str()));
+    ResetCheckpointSceneHash();
+    PbrtOptions = options;
+}
@@ -0,0 +1,135 @@
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include "pbrt.h"
+#include "distributed.h"
+#include "film.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "paramset.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+using namespace pbrt;
+
+#ifndef PBRT_IS_WINDOWS
+static const Point2i res(64, 48);
+
+static std::unique_ptr<Film> MakeFilm(const std::string &filename) {
+    return std::unique_ptr<Film>(
+        new Film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                 std::unique_ptr<Filter>(CreateBoxFilter(ParamSet())), 35.f,
+                 filename, 1.f));
+}
+
+static std::vector<Bounds2i> MakeWorkUnits() {
+    std::vector<Bounds2i> workUnits;
+    for (int y = 0; y < res.y; y += 8)
+        for (int x = 0; x < res.x; x += 8)
+            workUnits.push_back(
+                Bounds2i(Point2i(x, y), Point2i(x + 8, y + 8)));
+    return workUnits;
+}
+
+// Gives each pixel a single sample with a value that identifies it
+static std::unique_ptr<FilmTile> RenderUnit(Film *film,
+                                            const Bounds2i &bounds) {
+    std::unique_ptr<FilmTile> tile = film->GetFilmTile(bounds);
+    for (Point2i p : bounds)
+        tile->AddSample(Point2f(p.x + .5f, p.y + .5f),
+                        Spectrum(1 + p.x + 100 * p.y));
+    return tile;
+}
+
+// Checks that every pixel of the image has exactly its own value
+static void CheckImage(const std::string &filename) {
+    Point2i readRes;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, &readRes);
+    ASSERT_TRUE(image.get() != nullptr);
+    EXPECT_EQ(res, readRes);
+    for (int y = 0; y < res.y; ++y)
+        for (int x = 0; x < res.x; ++x) {
+            Float rgb[3];
+            image[y * res.x + x].ToRGB(rgb);
+            for (int c = 0; c < 3; ++c)
+                EXPECT_NEAR(1 + x + 100 * y, rgb[c], 1e-3f * (1 + x + 100 * y));
+        }
+    EXPECT_EQ(0, remove(filename.c_str()));
+}
+
+TEST(Distributed, CoordinatorAndWorker) {
+    TestThreadPool threads;
+
+    std::string filename = "test_distributed.pfm";
+    std::unique_ptr<Film> film = MakeFilm(filename),
+                          workerFilm = MakeFilm(filename);
+    std::vector<Bounds2i> workUnits = MakeWorkUnits();
+
+    // The coordinator renders slowly so that the worker gets work units
+    std::atomic<int> nWorkerUnits(0);
+    std::promise<int> port;
+    std::thread worker([&]() {
+        int p = port.get_future().get();
+        RenderWorker("localhost:" + std::to_string(p), workerFilm.get(), 1,
+                     [&](const Bounds2i &bounds) {
+                         ++nWorkerUnits;
+                         return RenderUnit(workerFilm.get(), bounds);
+                     });
+    });
+    RenderCoordinator(0, workUnits, film.get(), 1,
+                      [&](const Bounds2i &bounds) {
+                          std::this_thread::sleep_for(
+                              std::chrono::milliseconds(100));
+                          return RenderUnit(film.get(), bounds);
+                      },
+                      [&](int p) { port.set_value(p); });
+    worker.join();
+    EXPECT_GT(nWorkerUnits, 0);
+    film->WriteImage();
+    CheckImage(filename);
+}
+
+TEST(Distributed, MultithreadedWorker) {
+    TestThreadPool threads;
+
+    std::string filename = "test_distributed_mt.pfm";
+    std::unique_ptr<Film> film = MakeFilm(filename),
+                          workerFilm = MakeFilm(filename);
+    std::vector<Bounds2i> workUnits = MakeWorkUnits();
+
+    // Run the coordinator on its own thread, where it renders one unit at
+    // a time, and the worker on this one, so that the worker renders units
+    // on all of the pool's threads and several are still rendering when
+    // the coordinator runs out of work
+    std::atomic<int> nCoordinatorUnits(0), nWorkerUnits(0);
+    std::promise<int> port;
+    std::thread coordinator([&]() {
+        RenderCoordinator(0, workUnits, film.get(), 1,
+                          [&](const Bounds2i &bounds) {
+                              ++nCoordinatorUnits;
+                              std::this_thread::sleep_for(
+                                  std::chrono::milliseconds(100));
+                              return RenderUnit(film.get(), bounds);
+                          },
+                          [&](int p) { port.set_value(p); });
+    });
+    int p = port.get_future().get();
+    RenderWorker("localhost:" + std::to_string(p), workerFilm.get(), 1,
+                 [&](const Bounds2i &bounds) {
+                     ++nWorkerUnits;
+                     std::this_thread::sleep_for(
+                         std::chrono::milliseconds(20));
+                     return RenderUnit(workerFilm.get(), bounds);
+                 });
+    coordinator.join();
+
+    // Every unit the worker rendered must have been used, so that the
+    // coordinator didn't have to render any unit a second time
+    EXPECT_GT(nWorkerUnits, 1);
+    EXPECT_EQ(int(workUnits.size()), nCoordinatorUnits + nWorkerUnits);
+    film->WriteImage();
+    CheckImage(filename);
+}
+#endif  // !PBRT_IS_WINDOWS
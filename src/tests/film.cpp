@@ -0,0 +1,84 @@
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include "pbrt.h"
+#include "film.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "paramset.h"
+
+using namespace pbrt;
+
+TEST(Film, ParallelMergeAndSplat) {
+    TestThreadPool threads;
+
+    Point2i res(40, 30);
+    std::string filename = "test_film.pfm";
+    Film film(res, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::unique_ptr<Filter>(CreateBoxFilter(ParamSet())), 35.f,
+              filename, 1.f);
+
+    // Merge overlapping tiles of samples with values 1 through 4 from many
+    // threads; each pixel should end up with their average
+    const int tileSize = 8, nPasses = 4;
+    Point2i nTiles((res.x + tileSize - 1) / tileSize,
+                   (res.y + tileSize - 1) / tileSize);
+    ParallelFor([&](int64_t i) {
+        int pass = i / (nTiles.x * nTiles.y), tile = i % (nTiles.x * nTiles.y);
+        Point2i p0(tile % nTiles.x * tileSize, tile / nTiles.x * tileSize);
+        Bounds2i tileBounds(p0, Min(p0 + Vector2i(tileSize, tileSize), res));
+        std::unique_ptr<FilmTile> filmTile = film.GetFilmTile(tileBounds);
+        for (Point2i p : tileBounds)
+            filmTile->AddSample(Point2f(p.x + .5f, p.y + .5f),
+                                Spectrum(pass + 1));
+        film.MergeFilmTile(std::move(filmTile));
+    }, nPasses * nTiles.x * nTiles.y);
+
+    // Splat to every pixel many times from many threads
+    const int nSplats = 500;
+    ParallelFor([&](int64_t) {
+        for (int y = 0; y < res.y; ++y)
+            for (int x = 0; x < res.x; ++x)
+                film.AddSplat(Point2f(x + .5f, y + .5f), Spectrum(.01f));
+    }, nSplats);
+    film.WriteImage();
+
+    Point2i readRes;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, &readRes);
+    ASSERT_TRUE(image.get() != nullptr);
+    EXPECT_EQ(res, readRes);
+    for (int i = 0; i < res.x * res.y; ++i) {
+        Float rgb[3];
+        image[i].ToRGB(rgb);
+        for (int c = 0; c < 3; ++c) EXPECT_NEAR(2.5f + 5.f, rgb[c], 1e-2f);
+    }
+    EXPECT_EQ(0, remove(filename.c_str()));
+}
+
+TEST(Film, VarianceEstimator) {
+    VarianceEstimator v;
+    EXPECT_EQ(0, v.Count());
+    EXPECT_EQ(0, v.Variance());
+
+    // Compare with the two-pass mean and sample variance
+    Float values[] = {1.f, 4.f, 2.5f, 100.f, -3.f, 7.f};
+    Float sum = 0, sumSq = 0;
+    for (Float x : values) {
+        v.Add(x);
+        sum += x;
+    }
+    int n = sizeof(values) / sizeof(values[0]);
+    Float mean = sum / n;
+    for (Float x : values) sumSq += (x - mean) * (x - mean);
+    EXPECT_EQ(n, v.Count());
+    EXPECT_NEAR(mean, v.Mean(), 1e-4f);
+    EXPECT_NEAR(sumSq / (n - 1), v.Variance(), 1e-2f);
+
+    // Merging statistics of two halves should match the whole series
+    VarianceEstimator a, b;
+    for (int i = 0; i < n; ++i) (i < 2 ? a : b).Add(values[i]);
+    a.Merge(b);
+    EXPECT_EQ(n, a.Count());
+    EXPECT_NEAR(v.Mean(), a.Mean(), 1e-4f);
+    EXPECT_NEAR(v.Variance(), a.Variance(), 1e-2f);
+}
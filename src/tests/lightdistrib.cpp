@@ -0,0 +1,166 @@
+
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include <cmath>
+#include <thread>
+#include "pbrt.h"
+#include "rng.h"
+#include "scene.h"
+#include "lightdistrib.h"
+#include "memory.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "sampling.h"
+#include "accelerators/bvh.h"
+#include "lights/infinite.h"
+#include "lights/point.h"
+#include "lights/spot.h"
+#include "shapes/sphere.h"
+
+using namespace pbrt;
+
+TEST(LightBVH, SampleMatchesPmf) {
+    RNG rng;
+    std::vector<std::shared_ptr<Light>> lights;
+    for (int i = 0; i < 100; ++i) {
+        Vector3f p(-10 + 20 * rng.UniformFloat(), -10 + 20 * rng.UniformFloat(),
+                   -10 + 20 * rng.UniformFloat());
+        Spectrum I(0.1f + rng.UniformFloat());
+        if (i % 2 == 0)
+            lights.push_back(std::make_shared<PointLight>(
+                Translate(p), MediumInterface(), I));
+        else {
+            Vector3f dir = UniformSampleSphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            Transform dirToZ = LookAt(Point3f(0, 0, 0), Point3f(dir.x, dir.y, dir.z),
+                                      Vector3f(dir.y, dir.z, dir.x));
+            lights.push_back(std::make_shared<SpotLight>(
+                Translate(p) * Inverse(dirToZ), MediumInterface(), I,
+                30 + 30 * rng.UniformFloat(), 20));
+        }
+    }
+    lights.push_back(
+        std::make_shared<InfiniteAreaLight>(Transform(), Spectrum(1), 1, ""));
+    std::vector<std::shared_ptr<Primitive>> prims;
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+    LightBVHLightDistribution distrib(scene);
+
+    for (int i = 0; i < 100; ++i) {
+        Point3f p(-15 + 30 * rng.UniformFloat(), -15 + 30 * rng.UniformFloat(),
+                  -15 + 30 * rng.UniformFloat());
+        Normal3f n(0, 0, 0);
+        if (i % 2 == 0)
+            n = Normal3f(UniformSampleSphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat())));
+
+        // The probabilities of all lights can't sum to more than one; they
+        // may sum to less when descending the tree reaches nodes that
+        // can't illuminate _p_.
+        Float sum = 0;
+        for (size_t j = 0; j < lights.size(); ++j)
+            sum += distrib.Pmf(p, n, j);
+        EXPECT_LT(sum, 1 + 1e-4) << p << " " << n;
+
+        // Sampled lights must report the same probability as Pmf()
+        for (int j = 0; j < 16; ++j) {
+            Float pmf;
+            int index = distrib.Sample(p, n, rng.UniformFloat(), &pmf);
+            if (index == -1) {
+                EXPECT_EQ(0, pmf);
+                continue;
+            }
+            EXPECT_GT(pmf, 0);
+            EXPECT_LT(std::abs(pmf - distrib.Pmf(p, n, index)), 1e-5 * pmf)
+                << p << " " << n << " light " << index;
+        }
+    }
+}
+
+TEST(LightBVH, PointLightsSumToOne) {
+    // Point lights emit in all directions, so every light has a nonzero
+    // probability everywhere
+    RNG rng;
+    std::vector<std::shared_ptr<Light>> lights;
+    for (int i = 0; i < 37; ++i) {
+        Vector3f p(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        lights.push_back(std::make_shared<PointLight>(
+            Translate(p), MediumInterface(), Spectrum(1 + i)));
+    }
+    std::vector<std::shared_ptr<Primitive>> prims;
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+    LightBVHLightDistribution distrib(scene);
+
+    for (int i = 0; i < 100; ++i) {
+        Point3f p(-1 + 3 * rng.UniformFloat(), -1 + 3 * rng.UniformFloat(),
+                  -1 + 3 * rng.UniformFloat());
+        Float sum = 0;
+        for (size_t j = 0; j < lights.size(); ++j) {
+            Float pmf = distrib.Pmf(p, Normal3f(0, 0, 0), j);
+            EXPECT_GT(pmf, 0);
+            sum += pmf;
+        }
+        EXPECT_LT(std::abs(sum - 1), 1e-4) << p;
+    }
+}
+
+TEST(SpatialLightDistribution, ConcurrentLookupsWithEviction) {
+    TestThreadPool threads;
+
+    RNG rng;
+    std::vector<std::shared_ptr<Light>> lights;
+    for (int i = 0; i < 16; ++i) {
+        Vector3f p(-1 + 2 * rng.UniformFloat(), -1 + 2 * rng.UniformFloat(),
+                   -1 + 2 * rng.UniformFloat());
+        lights.push_back(std::make_shared<PointLight>(
+            Translate(p), MediumInterface(), Spectrum(1 + i)));
+    }
+    Transform identity;
+    std::shared_ptr<Shape> sphere =
+        std::make_shared<Sphere>(&identity, &identity, false, 1, -1, 1, 360);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, nullptr, nullptr, MediumInterface()));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    // Allow only a few hundred distributions so that voxels are evicted
+    // while other threads may be using them
+    const size_t maxBytes = 64 * 1024;
+    int64_t baseMemory = TrackedMemoryInUse(MemoryCategory::Lights);
+    {
+        SpatialLightDistribution distrib(scene, 64, maxBytes);
+        std::atomic<int> nBad{0};
+        auto lookup = [&](uint64_t seed, int nLookups) {
+            RNG rng(seed);
+            for (int i = 0; i < nLookups; ++i) {
+                Point3f p(-1 + 2 * rng.UniformFloat(), -1 + 2 * rng.UniformFloat(),
+                          -1 + 2 * rng.UniformFloat());
+                const Distribution1D *d = distrib.Lookup(p);
+                Float sum = 0;
+                for (int j = 0; j < d->Count(); ++j) sum += d->DiscretePDF(j);
+                if (d->Count() != int(lights.size()) || std::abs(sum - 1) > 1e-3)
+                    ++nBad;
+            }
+        };
+
+        // Also look up from threads outside the thread pool, one of which
+        // stops after its first lookup and so keeps evicted voxels from
+        // being freed until it exits
+        std::atomic<bool> done{false};
+        std::vector<std::thread> others;
+        others.push_back(std::thread([&]() {
+            lookup(1000, 1);
+            while (!done) std::this_thread::yield();
+        }));
+        for (int t = 0; t < 2; ++t)
+            others.push_back(
+                std::thread([&, t]() { lookup(1001 + t, 100000); }));
+        ParallelFor([&](int64_t chunk) { lookup(chunk, 1000); }, 400);
+        done = true;
+        for (std::thread &t : others) t.join();
+
+        EXPECT_EQ(0, nBad);
+        EXPECT_LT(TrackedMemoryInUse(MemoryCategory::Lights) - baseMemory,
+                  2 * maxBytes);
+    }
+    EXPECT_EQ(baseMemory, TrackedMemoryInUse(MemoryCategory::Lights));
+}
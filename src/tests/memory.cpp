@@ -0,0 +1,77 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "memory.h"
+
+using namespace pbrt;
+
+TEST(MemoryArena, ReuseBlocks) {
+    MemoryArena arena(1024);
+    EXPECT_EQ(0, arena.BytesUsed());
+    for (int pass = 0; pass < 3; ++pass) {
+        // Allocations that need several blocks, including a large one
+        for (int i = 0; i < 10; ++i) {
+            uint8_t *p = arena.Alloc<uint8_t>(200);
+            p[0] = p[199] = i;
+        }
+        arena.Alloc<uint8_t>(5000);
+        EXPECT_GE(arena.BytesUsed(), 2000 + 5000);
+        size_t allocated = arena.TotalAllocated();
+        arena.Reset();
+        EXPECT_EQ(0, arena.BytesUsed());
+        EXPECT_GE(arena.MaxBytesUsed(), 2000 + 5000);
+
+        // Later passes should reuse the first pass's blocks
+        if (pass == 0)
+            EXPECT_GT(allocated, 0);
+        else
+            EXPECT_EQ(allocated, arena.TotalAllocated());
+    }
+}
+
+TEST(ThreadArena, Nesting) {
+    MemoryArena *outerArena;
+    {
+        ThreadArena outer;
+        outerArena = &*outer;
+        int *a = outer->Alloc<int>(4);
+        {
+            // A nested ThreadArena must not be the one that's in use
+            ThreadArena inner;
+            EXPECT_NE(outerArena, &*inner);
+            inner->Alloc<int>(100);
+        }
+        EXPECT_EQ(4 * sizeof(int), outer->BytesUsed());
+        a[3] = 1;
+    }
+    // Arenas are reset and reused once they are returned
+    ThreadArena again;
+    EXPECT_EQ(outerArena, &*again);
+    EXPECT_EQ(0, again->BytesUsed());
+}
+
+TEST(TrackedMemory, LiveAndPeak) {
+    // Other tests may have left memory charged to a category, so compare
+    // against the usage at the start
+    ClearMemoryUsage();
+    int64_t meshes = TrackedMemoryInUse(MemoryCategory::Meshes);
+    int64_t textures = TrackedMemoryInUse(MemoryCategory::Textures);
+    {
+        TrackedMemory tm(MemoryCategory::Meshes, 1000);
+        tm.Add(500);
+        EXPECT_EQ(1500, tm.Bytes());
+        EXPECT_EQ(meshes + 1500, TrackedMemoryInUse(MemoryCategory::Meshes));
+        tm.Set(100);
+        EXPECT_EQ(meshes + 100, TrackedMemoryInUse(MemoryCategory::Meshes));
+        EXPECT_EQ(meshes + 1500, TrackedMemoryPeak(MemoryCategory::Meshes));
+
+        // Containers with a TrackedAllocator charge their storage
+        std::vector<int, TrackedAllocator<int, MemoryCategory::Textures>> v(
+            256);
+        EXPECT_GE(TrackedMemoryInUse(MemoryCategory::Textures),
+                  textures + 256 * int64_t(sizeof(int)));
+    }
+    EXPECT_EQ(meshes, TrackedMemoryInUse(MemoryCategory::Meshes));
+    EXPECT_EQ(textures, TrackedMemoryInUse(MemoryCategory::Textures));
+    EXPECT_EQ(meshes + 1500, TrackedMemoryPeak(MemoryCategory::Meshes));
+    EXPECT_GE(TrackedMemoryPeak(), TrackedMemoryInUse() + 1500);
+}
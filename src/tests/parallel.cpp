@@ -1,8 +1,11 @@
 
 #include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
 #include "pbrt.h"
 #include "parallel.h"
 #include <atomic>
+#include <chrono>
+#include <thread>
 
 using namespace pbrt;
 
@@ -37,3 +40,104 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    TestThreadPool threads;
+
+    std::atomic<int> counter{0};
+    ParallelFor([&](int64_t) {
+        ParallelFor([&](int64_t) { ++counter; }, 100, 7);
+    }, 50);
+    EXPECT_EQ(50 * 100, counter);
+
+    counter = 0;
+    ParallelFor2D([&](Point2i) {
+        ParallelFor2D([&](Point2i) { ++counter; }, Point2i(3, 5));
+    }, Point2i(8, 9));
+    EXPECT_EQ(8 * 9 * 3 * 5, counter);
+}
+
+TEST(Parallel, TaskGroup) {
+    TestThreadPool threads;
+
+    // Recursively spawn a binary tree of tasks
+    std::atomic<int> counter{0};
+    std::function<void(TaskGroup &, int)> spawn = [&](TaskGroup &group,
+                                                      int depth) {
+        ++counter;
+        if (depth > 0)
+            for (int i = 0; i < 2; ++i)
+                group.Run([&, depth]() { spawn(group, depth - 1); });
+    };
+    {
+        TaskGroup group;
+        group.Run([&]() { spawn(group, 10); });
+        group.Wait();
+        EXPECT_EQ((1 << 11) - 1, counter);
+    }
+
+    // Continuations run after the group's tasks, including ones added by
+    // other continuations
+    counter = 0;
+    std::atomic<int> seenByContinuation{-1}, seenBySecond{-1};
+    {
+        TaskGroup group;
+        for (int i = 0; i < 100; ++i)
+            group.Run([&]() {
+                ParallelFor([&](int64_t) { ++counter; }, 10);
+            });
+        group.Then([&]() {
+            seenByContinuation = counter.load();
+            group.Run([&]() { ++counter; });
+            group.Then([&]() { seenBySecond = counter.load(); });
+        });
+        group.Wait();
+    }
+    EXPECT_EQ(1000, seenByContinuation);
+    EXPECT_EQ(1001, seenBySecond);
+    EXPECT_EQ(1001, counter);
+}
+
+TEST(Parallel, TaskGroupWaitOnlyRunsItsOwnTasks) {
+    TestThreadPool threads;
+
+    // While this thread waits for _slow_, it mustn't pick up _other_'s
+    // tasks, which might need something that it's holding
+    static thread_local bool waiting = false;
+    std::atomic<bool> ranWhileWaiting{false};
+    std::atomic<int> nOther{0};
+    TaskGroup slow, other;
+    slow.Run([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    for (int i = 0; i < 200; ++i)
+        other.Run([&]() {
+            if (waiting) ranWhileWaiting = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ++nOther;
+        });
+    waiting = true;
+    slow.Wait();
+    waiting = false;
+    other.Wait();
+    EXPECT_FALSE(ranWhileWaiting);
+    EXPECT_EQ(200, nOther);
+}
+
+TEST(Parallel, ThreadIndex) {
+    TestThreadPool threads;
+
+    std::atomic<bool> inRange{true};
+    ParallelFor([&](int64_t) {
+        if (ThreadIndex < 0 || ThreadIndex >= MaxThreadIndex())
+            inRange = false;
+    }, 1000);
+    EXPECT_TRUE(inRange);
+    EXPECT_EQ(0, ThreadIndex);
+
+    // Threads outside of the thread pool don't have an index
+    int otherIndex = 0;
+    std::thread other([&]() { otherIndex = ThreadIndex; });
+    other.join();
+    EXPECT_EQ(-1, otherIndex);
+}
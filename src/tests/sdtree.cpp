@@ -0,0 +1,119 @@
+
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include <cmath>
+#include "pbrt.h"
+#include "rng.h"
+#include "sampling.h"
+#include "parallel.h"
+#include "sdtree.h"
+
+using namespace pbrt;
+
+// Records radiance from a narrow cone around +z and a uniform background
+// and returns the refined tree for sampling.
+static DTree TrainedDTree() {
+    RNG rng;
+    DTree tree;
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = 0; i < 20000; ++i) {
+            Point2f u(rng.UniformFloat(), rng.UniformFloat());
+            if (i % 2 == 0)
+                tree.Record(UniformSampleCone(u, 0.95f),
+                            100 / UniformConePdf(0.95f));
+            else
+                tree.Record(UniformSampleSphere(u), 1 / UniformSpherePdf());
+        }
+        tree = tree.Refine(0.01, 20);
+        if (pass < 2) continue;
+        // Record once more into the refined structure
+        for (int i = 0; i < 20000; ++i) {
+            Point2f u(rng.UniformFloat(), rng.UniformFloat());
+            tree.Record(i % 2 == 0 ? UniformSampleCone(u, 0.95f)
+                                   : UniformSampleSphere(u),
+                        i % 2 == 0 ? 100 / UniformConePdf(0.95f)
+                                   : 1 / UniformSpherePdf());
+        }
+    }
+    return tree;
+}
+
+TEST(DTree, PdfMatchesSamples) {
+    DTree tree = TrainedDTree();
+    EXPECT_GT(tree.NumNodes(), 1);
+
+    // The density integrates to one over the sphere
+    RNG rng;
+    const int n = 200000;
+    double integral = 0;
+    for (int i = 0; i < n; ++i) {
+        Point2f u(rng.UniformFloat(), rng.UniformFloat());
+        integral += tree.Pdf(UniformSampleSphere(u)) / UniformSpherePdf();
+    }
+    EXPECT_NEAR(1, integral / n, 0.02);
+
+    // Sampled directions have nonzero density, are concentrated in the
+    // cone, and their densities' reciprocals estimate the sphere's area
+    double area = 0;
+    int inCone = 0;
+    for (int i = 0; i < n; ++i) {
+        Vector3f w = tree.Sample(Point2f(rng.UniformFloat(),
+                                         rng.UniformFloat()));
+        EXPECT_NEAR(1, w.Length(), 1e-4);
+        Float pdf = tree.Pdf(w);
+        ASSERT_GT(pdf, 0);
+        area += 1 / pdf;
+        if (w.z > 0.95f) ++inCone;
+    }
+    EXPECT_NEAR(4 * Pi, area / n, 0.05 * 4 * Pi);
+    EXPECT_GT(inCone, n / 2);
+}
+
+TEST(DTree, EmptyTreeIsUniform) {
+    // A tree without any radiance samples directions uniformly, so its
+    // density must be uniform too
+    DTree tree;
+    EXPECT_EQ(0, tree.Total());
+    RNG rng;
+    for (int i = 0; i < 100; ++i) {
+        Vector3f w = tree.Sample(Point2f(rng.UniformFloat(),
+                                         rng.UniformFloat()));
+        EXPECT_FLOAT_EQ(UniformSpherePdf(), tree.Pdf(w));
+    }
+}
+
+TEST(DTree, ConcurrentRecording) {
+    DTree tree = TrainedDTree().Refine(0.01, 20);
+    Float before = tree.Total();
+    TestThreadPool threads;
+    ParallelFor([&](int64_t i) {
+        RNG rng(i);
+        for (int j = 0; j < 1000; ++j)
+            tree.Record(UniformSampleSphere(Point2f(rng.UniformFloat(),
+                                                    rng.UniformFloat())),
+                        1);
+    }, 64);
+    EXPECT_EQ(0, before);
+    EXPECT_EQ(64000, tree.Total());
+}
+
+TEST(SDTree, RefineSplitsBusyLeaves) {
+    SDTree tree(Bounds3f(Point3f(0, 0, 0), Point3f(1, 2, 1)));
+    RNG rng;
+    // Train the half of the scene with x < 0.5 heavily
+    for (int i = 0; i < 100000; ++i) {
+        Point3f p(rng.UniformFloat() / 2, 2 * rng.UniformFloat(),
+                  rng.UniformFloat());
+        SDTreeLeaf *leaf = tree.Lookup(p);
+        leaf->building.Record(Vector3f(0, 0, 1), 1);
+        ++leaf->nSamples;
+    }
+    tree.Refine(0);
+    EXPECT_GT(tree.NumLeaves(), 1);
+    // Points on both sides of the first split find different leaves, and
+    // all leaves sample from the recorded radiance
+    EXPECT_NE(tree.Lookup(Point3f(0.1, 0.1, 0.1)),
+              tree.Lookup(Point3f(1.9, 0.1, 0.1)));
+    EXPECT_GT(tree.Lookup(Point3f(0.1, 0.1, 0.1))->sampling.Total(), 0);
+    EXPECT_EQ(0, tree.Lookup(Point3f(0.1, 0.1, 0.1))->nSamples);
+}
@@ -0,0 +1,104 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "interaction.h"
+#include "material.h"
+#include "medium.h"
+#include "memory.h"
+#include "primitive.h"
+#include "reflection.h"
+#include "rng.h"
+#include "sampling.h"
+#include "materials/matte.h"
+#include "materials/plastic.h"
+#include "materials/uber.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+#include "textures/uv.h"
+
+using namespace pbrt;
+
+static std::shared_ptr<Texture<Spectrum>> ConstSpectrum(Float v) {
+    return std::make_shared<ConstantTexture<Spectrum>>(Spectrum(v));
+}
+
+static std::shared_ptr<Texture<Float>> ConstFloat(Float v) {
+    return std::make_shared<ConstantTexture<Float>>(v);
+}
+
+static std::shared_ptr<Texture<Spectrum>> UVSpectrum() {
+    return std::make_shared<UVTexture>(
+        std::unique_ptr<TextureMapping2D>(new UVMapping2D(4, 4)));
+}
+
+TEST(ShadingQueue, MatchesPerHitShading) {
+    Transform identity;
+    std::shared_ptr<Shape> sphere =
+        std::make_shared<Sphere>(&identity, &identity, false, 1.f, -1.f, 1.f,
+                                 360.f);
+    std::vector<std::shared_ptr<Material>> materials = {
+        std::make_shared<MatteMaterial>(UVSpectrum(), ConstFloat(0), nullptr),
+        std::make_shared<MatteMaterial>(ConstSpectrum(.5), ConstFloat(20),
+                                        nullptr),
+        std::make_shared<PlasticMaterial>(UVSpectrum(), ConstSpectrum(.25),
+                                          ConstFloat(.1), nullptr, true),
+        std::make_shared<UberMaterial>(
+            UVSpectrum(), ConstSpectrum(.25), ConstSpectrum(.1),
+            ConstSpectrum(0), ConstFloat(.1), nullptr, ConstFloat(.3),
+            ConstSpectrum(.75), ConstFloat(1.5), nullptr, false),
+        nullptr};
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &m : materials)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            sphere, m, nullptr, MediumInterface()));
+
+    // Intersect the sphere with random rays, alternating between the
+    // primitives so that the queue sees the materials interleaved
+    const int nHits = 100;
+    RNG rng;
+    std::vector<RayDifferential> rays;
+    std::vector<SurfaceInteraction> single(nHits), queued(nHits);
+    for (int i = 0; i < nHits; ++i) {
+        Point3f o = Point3f(0, 0, 0) +
+                    3 * UniformSampleSphere({rng.UniformFloat(),
+                                             rng.UniformFloat()});
+        Point3f target(.5f * rng.UniformFloat() - .25f,
+                       .5f * rng.UniformFloat() - .25f,
+                       .5f * rng.UniformFloat() - .25f);
+        rays.push_back(RayDifferential(o, target - o));
+        const Primitive &prim = *prims[i % prims.size()];
+        RayDifferential r0 = rays[i], r1 = rays[i];
+        ASSERT_TRUE(prim.Intersect(r0, &single[i]));
+        ASSERT_TRUE(prim.Intersect(r1, &queued[i]));
+    }
+
+    // Shade the hits one at a time and through a _ShadingQueue_; both
+    // must give the same BSDFs
+    MemoryArena arena;
+    ShadingQueue queue;
+    for (int i = 0; i < nHits; ++i) {
+        single[i].ComputeScatteringFunctions(rays[i], arena, true);
+        queue.Add(&queued[i], rays[i]);
+    }
+    EXPECT_EQ(nHits, queue.Size());
+    queue.Shade(arena, TransportMode::Radiance, true);
+    EXPECT_EQ(0, queue.Size());
+
+    for (int i = 0; i < nHits; ++i) {
+        if (!single[i].bsdf) {
+            EXPECT_TRUE(queued[i].bsdf == nullptr);
+            continue;
+        }
+        ASSERT_TRUE(queued[i].bsdf != nullptr);
+        EXPECT_EQ(single[i].bsdf->NumComponents(),
+                  queued[i].bsdf->NumComponents());
+        for (int j = 0; j < 8; ++j) {
+            Vector3f wi = UniformSampleSphere(
+                {rng.UniformFloat(), rng.UniformFloat()});
+            EXPECT_EQ(single[i].bsdf->f(single[i].wo, wi),
+                      queued[i].bsdf->f(queued[i].wo, wi));
+            EXPECT_EQ(single[i].bsdf->Pdf(single[i].wo, wi),
+                      queued[i].bsdf->Pdf(queued[i].wo, wi));
+        }
+    }
+}
@@ -7,7 +7,9 @@
 #include "shape.h"
 #include "lowdiscrepancy.h"
 #include "sampling.h"
+#include "paramset.h"
 #include "shapes/cone.h"
+#include "shapes/curve.h"
 #include "shapes/cylinder.h"
 #include "shapes/disk.h"
 #include "shapes/paraboloid.h"
@@ -557,3 +559,49 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+TEST(Curve, OrientedBounds) {
+    RNG rng(7);
+    Transform identity;
+    int nHits = 0, nRays = 0;
+    for (int i = 0; i < 50; ++i) {
+        // Create a random flat curve, split into 8 segments
+        std::unique_ptr<Point3f[]> cp(new Point3f[4]);
+        for (int j = 0; j < 4; ++j)
+            cp[j] = Point3f(pUnif(rng), pUnif(rng), pUnif(rng));
+        std::unique_ptr<Float[]> width(new Float[1]);
+        width[0] = .2f;
+        ParamSet params;
+        params.AddPoint3f("P", std::move(cp), 4);
+        params.AddFloat("width", std::move(width), 1);
+        std::vector<std::shared_ptr<Shape>> segments =
+            CreateCurveShape(&identity, &identity, false, params);
+        ASSERT_EQ(8, segments.size());
+        int nPoints;
+        const Point3f *p = params.FindPoint3f("P", &nPoints);
+
+        for (int j = 0; j < 100; ++j) {
+            // Find a random point on the curve
+            Float u = rng.UniformFloat();
+            Point3f a[3] = {Lerp(u, p[0], p[1]), Lerp(u, p[1], p[2]),
+                            Lerp(u, p[2], p[3])};
+            Point3f b[2] = {Lerp(u, a[0], a[1]), Lerp(u, a[1], a[2])};
+            Point3f pc = Lerp(u, b[0], b[1]);
+
+            // The segment containing it must bound it
+            const Shape &segment = *segments[std::min(int(u * 8), 7)];
+            EXPECT_TRUE(Inside(pc, Expand(segment.WorldBound(), 1e-4f)));
+
+            // A ray through the point should almost always hit the curve
+            Point3f o(pExp(rng, 2), pExp(rng, 2), pExp(rng, 2));
+            Ray ray(o, pc - o);
+            ++nRays;
+            for (const auto &s : segments)
+                if (s->IntersectP(ray, false)) {
+                    ++nHits;
+                    break;
+                }
+        }
+    }
+    EXPECT_GE(nHits, int(.99f * nRays));
+}
@@ -0,0 +1,31 @@
+
+#ifndef PBRT_TESTS_TESTTHREADS_H
+#define PBRT_TESTS_TESTTHREADS_H
+
+#include "pbrt.h"
+#include "parallel.h"
+
+namespace pbrt {
+
+// Starts the thread pool with several threads for the lifetime of the
+// object, even on machines with few cores, so that tests of concurrent
+// code actually run concurrently, and restores the thread count after.
+class TestThreadPool {
+  public:
+    explicit TestThreadPool(int nThreads = 8)
+        : savedThreads(PbrtOptions.nThreads) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+    }
+    ~TestThreadPool() {
+        ParallelCleanup();
+        PbrtOptions.nThreads = savedThreads;
+    }
+
+  private:
+    int savedThreads;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_TESTS_TESTTHREADS_H
@@ -0,0 +1,54 @@
+#include "tests/gtest/gtest.h"
+#include "tests/testthreads.h"
+#include "pbrt.h"
+#include "parallel.h"
+#include "tilescheduler.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace pbrt;
+
+TEST(TileScheduler, Coverage) {
+    TestThreadPool threads;
+
+    Bounds2i bounds(Point2i(-3, 5), Point2i(117, 90));
+    TileScheduler scheduler(bounds, 16, 32);
+    EXPECT_EQ(8 * 6, scheduler.TileCount());
+    std::unique_ptr<std::atomic<int>[]> count(
+        new std::atomic<int>[bounds.Area()]);
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = 0; i < bounds.Area(); ++i) count[i] = 0;
+        std::atomic<int> nTiles{0};
+        scheduler.ForEach([&](const Bounds2i &workBounds) {
+            // Work units must be made of whole tiles
+            Vector2i d = workBounds.Diagonal();
+            EXPECT_LE(d.x, 32);
+            EXPECT_LE(d.y, 32);
+            Bounds2i tiles = scheduler.Tiles(workBounds);
+            EXPECT_EQ(workBounds.pMin, scheduler.TileBounds(tiles.pMin).pMin);
+            EXPECT_EQ(workBounds.pMax,
+                      scheduler.TileBounds(tiles.pMax - Vector2i(1, 1)).pMax);
+            nTiles += tiles.Area();
+
+            for (Point2i p : workBounds) {
+                EXPECT_TRUE(InsideExclusive(p, bounds));
+                Vector2i o = p - bounds.pMin;
+                ++count[o.y * (bounds.pMax.x - bounds.pMin.x) + o.x];
+            }
+            // Make a corner of the image expensive so that work is split
+            if (workBounds.pMax.x > 90 && workBounds.pMax.y > 70)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        });
+        EXPECT_EQ(scheduler.TileCount(), nTiles);
+        for (int i = 0; i < bounds.Area(); ++i) EXPECT_EQ(1, count[i]);
+    }
+}
+
+TEST(TileScheduler, Empty) {
+    TileScheduler scheduler(Bounds2i(Point2i(4, 4), Point2i(4, 10)));
+    EXPECT_EQ(0, scheduler.TileCount());
+    int count = 0;
+    scheduler.ForEach([&](const Bounds2i &) { ++count; });
+    EXPECT_EQ(0, count);
+}
@@ -52,6 +52,10 @@ class ConstantTexture : public Texture<T> {
     // ConstantTexture Public Methods
     ConstantTexture(const T &value) : value(value) {}
     T Evaluate(const SurfaceInteraction &) const { return value; }
+    void EvaluateBatch(const SurfaceInteraction *const *si, int n,
+                       T *values) const {
+        std::fill(values, values + n, value);
+    }
 
   private:
     T value;
@@ -39,6 +39,7 @@
 #include "stats.h"
 
 #include <Ptexture.h>
+#include <mutex>
 
 namespace pbrt {
 
@@ -54,6 +55,19 @@ STAT_COUNTER("Texture/Ptex files accessed", nFilesAccessed);
 STAT_COUNTER("Texture/Ptex block reads", nBlockReads);
 STAT_MEMORY_COUNTER("Memory/Ptex peak memory used", peakMemoryUsed);
 
+// The cache's memory use, which is charged to _MemoryCategory::Ptex_ as
+// lookups load texture data
+std::mutex ptexMemoryMutex;
+TrackedMemory ptexMemory(MemoryCategory::Ptex);
+PBRT_THREAD_LOCAL int nLookupsSinceMemoryUpdate;
+
+void updatePtexMemory() {
+    Ptex::PtexCache::Stats stats;
+    cache->getStats(stats);
+    std::lock_guard<std::mutex> lock(ptexMemoryMutex);
+    ptexMemory.Set(stats.memUsed);
+}
+
 struct : public PtexErrorHandler {
     void reportError(const char *error) override { Error("%s", error); }
 } errorHandler;
@@ -68,6 +82,10 @@ PtexTexture<T>::PtexTexture(const std::string &filename, Float gamma)
         CHECK_EQ(nActiveTextures, 0);
         int maxFiles = 100;
         size_t maxMem = 1ull << 32;  // 4GB
+        // Leave most of a --memorybudget to the rest of the scene; the
+        // cache evicts data to stay under its limit
+        if (PbrtOptions.memoryBudget > 0)
+            maxMem = std::min<size_t>(maxMem, PbrtOptions.memoryBudget / 4);
         bool premultiply = true;
 
         cache = Ptex::PtexCache::create(maxFiles, maxMem, premultiply, nullptr,
@@ -90,6 +108,7 @@ PtexTexture<T>::PtexTexture(const std::string &filename, Float gamma)
         else {
             valid = true;
             LOG(INFO) << filename << ": added ptex texture";
+            updatePtexMemory();
         }
         texture->release();
     }
@@ -104,6 +123,10 @@ PtexTexture<T>::~PtexTexture() {
         nFilesAccessed += stats.filesAccessed;
         nBlockReads += stats.blockReads;
         peakMemoryUsed = stats.peakMemUsed;
+        {
+            std::lock_guard<std::mutex> lock(ptexMemoryMutex);
+            ptexMemory.Set(0);
+        }
 
         cache->release();
         cache = nullptr;
@@ -154,6 +177,10 @@ T PtexTexture<T>::Evaluate(const SurfaceInteraction &si) const {
                  si.uv[1], si.dudx, si.dvdx, si.dudy, si.dvdy);
     filter->release();
     texture->release();
+    if (++nLookupsSinceMemoryUpdate == 1024) {
+        updatePtexMemory();
+        nLookupsSinceMemoryUpdate = 0;
+    }
 
     if (gamma != 1)
         for (int i = 0; i < nc; ++i)
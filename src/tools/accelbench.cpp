@@ -0,0 +1,375 @@
+//
+// accelbench.cpp
+//
+// Measures acceleration structure construction and traversal performance
+// for the geometry of a pbrt scene, using fixed sets of rays.
+//
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "pbrt.h"
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "parser.h"
+#include "primitive.h"
+#include "rng.h"
+#include "sampling.h"
+#include "stats.h"
+#include "accelerators/bvh.h"
+#include "accelerators/kdtreeaccel.h"
+#include <glog/logging.h>
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr, ...) {
+    if (msg) {
+        va_list args;
+        va_start(args, msg);
+        fprintf(stderr, "pbrt_accelbench: ");
+        vfprintf(stderr, msg, args);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, R"(usage: pbrt_accelbench [<options>] <filename.pbrt...>
+
+Builds acceleration structures for the scene's geometry and reports their
+construction time, memory use, and traversal performance for primary,
+ambient occlusion, and diffuse bounce rays.
+
+options:
+  --config <accel>[:<splitmethod>]
+                       Accelerator ("bvh" or "kdtree") and BVH split method
+                       to benchmark; may be given multiple times.
+                       Default: bvh:sah, bvh:hlbvh, bvh:middle, bvh:equal,
+                       and kdtree.
+  --compact            Use compact nodes for BVH configurations.
+  --help               Print this help text.
+  --nthreads <num>     Use specified number of threads.
+  --rays <num>         Number of primary rays. Default: 1000000
+  --readrays <file>    Use the ray sets stored in the given file rather than
+                       generating them.
+  --seed <num>         Seed for generating rays. Default: 0
+  --shadowrays         Optimize BVH configurations for shadow rays.
+  --writerays <file>   Write the generated ray sets to the given file.
+)");
+    exit(msg ? 1 : 0);
+}
+
+struct RaySet {
+    std::string name;
+    std::vector<Ray> rays;
+};
+
+struct BenchOptions {
+    std::vector<std::string> configs;
+    bool compact = false, shadowRays = false;
+    int nRays = 1000000;
+    int seed = 0;
+    std::string readRays, writeRays;
+};
+
+static std::vector<RaySet> GenerateRaySets(const Primitive &accel,
+                                           const Camera &camera,
+                                           const BenchOptions &opts) {
+    std::vector<RaySet> sets(3);
+    sets[0].name = "primary";
+    sets[1].name = "ao";
+    sets[2].name = "diffuse";
+    RNG rng(opts.seed);
+    Bounds2i sampleBounds = camera.film->GetSampleBounds();
+    Bounds3f worldBound = accel.WorldBound();
+    Float aoRadius = 0.05f * Distance(worldBound.pMin, worldBound.pMax);
+
+    // Generate primary rays at random film positions
+    for (int i = 0; i < opts.nRays; ++i) {
+        CameraSample cs;
+        cs.pFilm = Point2f(Lerp(rng.UniformFloat(), sampleBounds.pMin.x,
+                                sampleBounds.pMax.x),
+                           Lerp(rng.UniformFloat(), sampleBounds.pMin.y,
+                                sampleBounds.pMax.y));
+        cs.pLens = Point2f(rng.UniformFloat(), rng.UniformFloat());
+        cs.time = rng.UniformFloat();
+        Ray ray;
+        if (camera.GenerateRay(cs, &ray) > 0) sets[0].rays.push_back(ray);
+    }
+
+    // Generate ambient occlusion and diffuse rays from the primary hits
+    for (const Ray &r : sets[0].rays) {
+        Ray ray = r;
+        SurfaceInteraction isect;
+        if (!accel.Intersect(ray, &isect)) continue;
+        Normal3f n = Faceforward(isect.n, -ray.d);
+        Vector3f s, t;
+        CoordinateSystem(Vector3f(n), &s, &t);
+        for (int set = 1; set < 3; ++set) {
+            Vector3f w = CosineSampleHemisphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+            Ray spawned =
+                isect.SpawnRay(w.x * s + w.y * t + w.z * Vector3f(n));
+            if (set == 1) spawned.tMax = aoRadius / spawned.d.Length();
+            sets[set].rays.push_back(spawned);
+        }
+    }
+    return sets;
+}
+
+// Ray sets are stored as a count for each set followed by its rays' origins,
+// directions, _tMax_ values and times as 32-bit floats.
+static bool WriteRaySets(const std::string &filename,
+                         const std::vector<RaySet> &sets) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+    bool ok = true;
+    for (const RaySet &set : sets) {
+        int64_t count = set.rays.size();
+        ok &= fwrite(&count, sizeof(count), 1, f) == 1;
+        for (const Ray &r : set.rays) {
+            float v[8] = {float(r.o.x), float(r.o.y), float(r.o.z),
+                          float(r.d.x), float(r.d.y), float(r.d.z),
+                          float(r.tMax), float(r.time)};
+            ok &= fwrite(v, sizeof(float), 8, f) == 8;
+        }
+    }
+    return (fclose(f) == 0) && ok;
+}
+
+static bool ReadRaySets(const std::string &filename,
+                        std::vector<RaySet> *sets) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    for (RaySet &set : *sets) {
+        int64_t count;
+        if (fread(&count, sizeof(count), 1, f) != 1 || count < 0) {
+            fclose(f);
+            return false;
+        }
+        set.rays.resize(count);
+        for (Ray &r : set.rays) {
+            float v[8];
+            if (fread(v, sizeof(float), 8, f) != 8) {
+                fclose(f);
+                return false;
+            }
+            r = Ray(Point3f(v[0], v[1], v[2]), Vector3f(v[3], v[4], v[5]),
+                    v[6], v[7]);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static std::shared_ptr<Primitive> BuildAccelerator(
+    const std::string &config, const BenchOptions &opts,
+    std::vector<std::shared_ptr<Primitive>> prims) {
+    std::string accelName = config, splitMethod;
+    size_t colon = config.find(':');
+    if (colon != std::string::npos) {
+        accelName = config.substr(0, colon);
+        splitMethod = config.substr(colon + 1);
+    }
+    ParamSet ps;
+    if (!splitMethod.empty()) {
+        std::unique_ptr<std::string[]> s(new std::string[1]);
+        s[0] = splitMethod;
+        ps.AddString("splitmethod", std::move(s), 1);
+    }
+    if (accelName == "bvh") {
+        if (opts.compact) {
+            std::unique_ptr<bool[]> b(new bool[1]);
+            b[0] = true;
+            ps.AddBool("compact", std::move(b), 1);
+        }
+        if (opts.shadowRays) {
+            std::unique_ptr<bool[]> b(new bool[1]);
+            b[0] = true;
+            ps.AddBool("shadowrays", std::move(b), 1);
+        }
+        return CreateBVHAccelerator(std::move(prims), ps);
+    } else if (accelName == "kdtree")
+        return CreateKdTreeAccelerator(std::move(prims), ps);
+    Error("Accelerator \"%s\" unknown.", accelName.c_str());
+    return nullptr;
+}
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+// Merges all threads' statistics, for reading them with GetStats*().
+static void GatherStats() {
+    MergeWorkerThreadStats();
+    ReportThreadStats();
+}
+
+static void Benchmark(std::vector<std::shared_ptr<Primitive>> &primitives,
+                      std::shared_ptr<const Camera> camera,
+                      const BenchOptions &opts) {
+    if (!camera) {
+        Error("Unable to create camera");
+        return;
+    }
+    // Find ray sets using a reference BVH
+    std::vector<RaySet> sets(3);
+    sets[0].name = "primary";
+    sets[1].name = "ao";
+    sets[2].name = "diffuse";
+    if (!opts.readRays.empty()) {
+        if (!ReadRaySets(opts.readRays, &sets)) {
+            Error("%s: unable to read ray sets", opts.readRays.c_str());
+            return;
+        }
+    } else {
+        BVHAccel reference(primitives);
+        sets = GenerateRaySets(reference, *camera, opts);
+    }
+    if (!opts.writeRays.empty() && !WriteRaySets(opts.writeRays, sets))
+        Error("%s: unable to write ray sets", opts.writeRays.c_str());
+    printf("%zu primitives; %zu primary, %zu ao, %zu diffuse rays\n\n",
+           primitives.size(), sets[0].rays.size(), sets[1].rays.size(),
+           sets[2].rays.size());
+
+    std::vector<int64_t> referenceHits(2 * sets.size(), -1);
+    for (const std::string &config : opts.configs) {
+        // Build accelerator and measure its memory use
+        GatherStats();
+        ClearStats();
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<Primitive> accel =
+            BuildAccelerator(config, opts, primitives);
+        if (!accel) continue;
+        double buildTime = Seconds(start);
+        GatherStats();
+        int64_t memory = GetStatsMemoryCounter("Memory/BVH tree") +
+                         GetStatsMemoryCounter("Memory/Kd-tree");
+        printf("%s%s: build %.3f s, %.2f kB\n", config.c_str(),
+               (opts.compact && config.compare(0, 3, "bvh") == 0)
+                   ? " (compact)"
+                   : "",
+               buildTime, memory / 1024.);
+
+        // Trace each ray set with _Intersect()_ and _IntersectP()_
+        for (size_t s = 0; s < sets.size(); ++s) {
+            const std::vector<Ray> &rays = sets[s].rays;
+            if (rays.empty()) continue;
+            for (int occlusion = 0; occlusion < 2; ++occlusion) {
+                ClearStats();
+                std::atomic<int64_t> nHits{0};
+                const int64_t chunkSize = 1024;
+                int64_t nChunks = (rays.size() + chunkSize - 1) / chunkSize;
+                start = std::chrono::steady_clock::now();
+                ParallelFor([&](int64_t chunk) {
+                    int64_t hits = 0;
+                    size_t end =
+                        std::min(rays.size(), size_t((chunk + 1) * chunkSize));
+                    for (size_t i = chunk * chunkSize; i < end; ++i) {
+                        if (occlusion)
+                            hits += accel->IntersectP(rays[i]);
+                        else {
+                            Ray ray = rays[i];
+                            SurfaceInteraction isect;
+                            hits += accel->Intersect(ray, &isect);
+                        }
+                    }
+                    nHits += hits;
+                }, nChunks);
+                double time = Seconds(start);
+                GatherStats();
+                std::pair<int64_t, int64_t> nodes =
+                    GetStatsRatio("Accelerator/Nodes visited per ray");
+                std::pair<int64_t, int64_t> prims =
+                    GetStatsRatio("Accelerator/Primitive tests per ray");
+                printf("    %-8s %-10s %8.3f Mrays/s %8.2f nodes/ray "
+                       "%8.2f prims/ray\n",
+                       sets[s].name.c_str(),
+                       occlusion ? "IntersectP" : "Intersect",
+                       rays.size() / time * 1e-6,
+                       double(nodes.first) / rays.size(),
+                       double(prims.first) / rays.size());
+
+                // Check that all accelerators find the same number of hits
+                int64_t &ref = referenceHits[2 * s + occlusion];
+                if (ref == -1)
+                    ref = nHits;
+                else if (ref != nHits)
+                    Warning("%s: %s rays found %" PRId64 " hits with %s; "
+                            "expected %" PRId64, config.c_str(),
+                            sets[s].name.c_str(), int64_t(nHits),
+                            occlusion ? "IntersectP()" : "Intersect()", ref);
+            }
+        }
+        printf("\n");
+    }
+    ClearStats();
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1; // Warning and above.
+
+    Options options;
+    options.quiet = true;
+    BenchOptions opts;
+    std::vector<std::string> filenames;
+    // Process command-line arguments
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--config") || !strcmp(argv[i], "-config")) {
+            if (i + 1 == argc) usage("missing value after --config argument");
+            opts.configs.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "--compact") ||
+                   !strcmp(argv[i], "-compact")) {
+            opts.compact = true;
+        } else if (!strcmp(argv[i], "--nthreads") ||
+                   !strcmp(argv[i], "-nthreads")) {
+            if (i + 1 == argc)
+                usage("missing value after --nthreads argument");
+            options.nThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rays") || !strcmp(argv[i], "-rays")) {
+            if (i + 1 == argc) usage("missing value after --rays argument");
+            opts.nRays = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--readrays") ||
+                   !strcmp(argv[i], "-readrays")) {
+            if (i + 1 == argc)
+                usage("missing value after --readrays argument");
+            opts.readRays = argv[++i];
+        } else if (!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-seed")) {
+            if (i + 1 == argc) usage("missing value after --seed argument");
+            opts.seed = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--shadowrays") ||
+                   !strcmp(argv[i], "-shadowrays")) {
+            opts.shadowRays = true;
+        } else if (!strcmp(argv[i], "--writerays") ||
+                   !strcmp(argv[i], "-writerays")) {
+            if (i + 1 == argc)
+                usage("missing value after --writerays argument");
+            opts.writeRays = argv[++i];
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-help") ||
+                   !strcmp(argv[i], "-h")) {
+            usage();
+        } else if (argv[i][0] == '-')
+            usage("unknown option \"%s\"", argv[i]);
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty()) usage("no scene files specified");
+    if (opts.configs.empty())
+        opts.configs = {"bvh:sah", "bvh:hlbvh", "bvh:middle", "bvh:equal",
+                        "kdtree"};
+
+    pbrtInit(options);
+    pbrtSetWorldEndCallback(
+        [&](std::vector<std::shared_ptr<Primitive>> &primitives,
+            std::shared_ptr<const Camera> camera) {
+            Benchmark(primitives, camera, opts);
+        });
+    for (const std::string &f : filenames) pbrtParseFile(f);
+    pbrtCleanup();
+    return 0;
+}